@@ -0,0 +1,430 @@
+#include "artstore.hh"
+#include "batch.hh"
+#include "fileio.hh"
+#include "id3.hh"
+#include "iostat.hh"
+#include "libaudiotag.hh"
+#include "sha256.hh"
+#include "tagedit.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <unordered_map>
+
+/**********************************************
+ *  apic_info_t:
+ *    the layout of an APIC body: encoding,
+ *  MIME type, picture type, description and
+ *  then the image to the end of the frame.
+ **********************************************/
+typedef struct apic_info_t {
+    uint32_t desc;          // offset of the description
+    uint32_t data;          // offset of the image
+    char ext[5];            // file extension for the MIME type
+} apic_info_t;
+
+/**********************************************
+ *  art_image_t:
+ *    a distinct image seen by the scan.
+ **********************************************/
+typedef struct art_image_t {
+    uint64_t size;
+    size_t count;           // pictures holding it
+    uint8_t preexisting;    // was in the store before this run
+    uint8_t stored;         // the store holds it, so links to it are safe
+    char ext[5];
+} art_image_t;
+
+/**********************************************
+ *  art_picture_t:
+ *    an APIC frame of a scanned file, in tag
+ *  order, so the dedupe pass can find it.
+ **********************************************/
+typedef struct art_picture_t {
+    char hash[SHA256_HEX_SIZE + 1];
+    uint32_t frame_size;
+} art_picture_t;
+
+/**********************************************
+ *  art_file_t:
+ *    the identity of a scanned file, so the
+ *  dedupe pass can tell whether it changed.
+ **********************************************/
+typedef struct art_file_t {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+} art_file_t;
+
+/**********************************************
+ *  art_ctx_t:
+ *    state shared by the art workers. Each
+ *  worker only touches pictures[idx] and
+ *  files[idx] of its own file; the rest is
+ *  under lock.
+ **********************************************/
+typedef struct art_ctx_t {
+    std::string dir;
+    audiotag_opts_t opts;
+    std::mutex lock;
+    std::unordered_map<std::string, art_image_t> images;
+    std::vector<std::vector<art_picture_t>> pictures;
+    std::vector<art_file_t> files;
+    art_stats_t stats;
+} art_ctx_t;
+
+/**********************************************
+ *  apic_parse:
+ *    fills info for the APIC body of size
+ *  bytes. Returns 0 on success and -1 if the
+ *  body is malformed or already a link.
+ **********************************************/
+static int apic_parse(const uint8_t* body, uint32_t size, apic_info_t* info) {
+    if (size < 4) {
+        return -1;
+    }
+    const uint8_t* mime_end = (const uint8_t*) memchr(body + 1, 0, size - 1);
+    if (mime_end == nullptr || mime_end + 2 > body + size) {
+        return -1;
+    }
+    const char* mime = (const char*) body + 1;
+    if (strcmp(mime, ART_LINK_MIME) == 0) {
+        return -1;
+    }
+    info->desc = mime_end + 2 - body;
+
+    // The description ends with a terminator in the frame's encoding
+    uint32_t end = info->desc;
+    if (body[0] == 1 || body[0] == 2) {
+        while (end + 1 < size && (body[end] || body[end + 1])) {
+            end += 2;
+        }
+        end += 2;
+    } else {
+        while (end < size && body[end]) {
+            ++end;
+        }
+        end += 1;
+    }
+    if (end > size) {
+        return -1;
+    }
+    info->data = end;
+
+    if (strcasecmp(mime, "image/jpeg") == 0 || strcasecmp(mime, "image/jpg") == 0) {
+        strcpy(info->ext, "jpg");
+    } else if (strcasecmp(mime, "image/png") == 0) {
+        strcpy(info->ext, "png");
+    } else if (strcasecmp(mime, "image/gif") == 0) {
+        strcpy(info->ext, "gif");
+    } else if (strcasecmp(mime, "image/webp") == 0) {
+        strcpy(info->ext, "webp");
+    } else {
+        strcpy(info->ext, "bin");
+    }
+    return 0;
+}
+
+/**********************************************
+ *  image_path:
+ *    returns where the store at dir keeps the
+ *  image hash with extension ext.
+ **********************************************/
+static std::string image_path(const std::string& dir, const char* hash, const char* ext) {
+    return dir + "/" + std::string(hash, 2) + "/" + hash + "." + ext;
+}
+
+/**********************************************
+ *  hash_chunk:
+ *    id3_stream_fn_t that feeds the sha256_t
+ *  in ctx.
+ **********************************************/
+static int hash_chunk(const uint8_t* buf, size_t n, void* ctx) {
+    sha256_update((sha256_t*) ctx, buf, n);
+    return 0;
+}
+
+/**********************************************
+ *  store_image:
+ *    copies the image at range of fd into the
+ *  store unless it is there already. Returns
+ *  a batch_err_t.
+ **********************************************/
+static int store_image(art_ctx_t* art, int fd, const id3_2_frame_range_t* range, const char* hash, const char* ext) {
+    std::string path = image_path(art->dir, hash, ext);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        std::lock_guard<std::mutex> guard(art->lock);
+        art->images[hash].preexisting = 1;
+        art->images[hash].stored = 1;
+        return BATCH_OK;
+    }
+    std::string sub = art->dir + "/" + std::string(hash, 2);
+    if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST) {
+        return BATCH_ERR_WRITE;
+    }
+    if (copy_to_file(fd, range->offset, range->size, (char*) path.c_str(), art->opts.sync) != 0) {
+        return BATCH_ERR_WRITE;
+    }
+    std::lock_guard<std::mutex> guard(art->lock);
+    art->images[hash].stored = 1;
+    art->stats.stored++;
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  file_identity:
+ *    fills file with the identity of st.
+ **********************************************/
+static void file_identity(const struct stat* st, art_file_t* file) {
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    file->size = st->st_size;
+}
+
+/**********************************************
+ *  scan_file:
+ *    batch_fn_t that hashes the image of every
+ *  APIC frame of path and stores new images.
+ *  Images of mapped tags are streamed from the
+ *  file rather than paged in through the map.
+ **********************************************/
+static int scan_file(const char* path, size_t idx, unsigned worker, void* ctx) {
+    art_ctx_t* art = (art_ctx_t*) ctx;
+    int fd = iostat_open(path, O_RDONLY);
+    if (fd < 0) {
+        return BATCH_ERR_OPEN;
+    }
+    struct stat st;
+    id3_tag_t tag;
+    if (fstat(fd, &st) != 0 || id3_read_tag(fd, &tag) != 0) {
+        close(fd);
+        return BATCH_ERR_READ;
+    }
+    file_identity(&st, &art->files[idx]);
+
+    int ret = BATCH_OK;
+    id3_2_frame_iter_t it;
+    id3_2_frame_view_t view;
+    id3_2_frame_iter_tag(&it, &tag);
+    while (ret == BATCH_OK && id3_2_frame_next(&it, &view)) {
+        apic_info_t info;
+        if (memcmp(view.id, "APIC", 4) != 0 || apic_parse(view.body, view.size, &info) != 0) {
+            continue;
+        }
+        id3_2_frame_range_t range;
+        id3_2_frame_range(&tag, &view, &range);
+        range.offset += info.data;
+        range.size -= info.data;
+
+        sha256_t hash;
+        sha256_init(&hash);
+        if (!tag.map_sz) {
+            sha256_update(&hash, view.body + info.data, range.size);
+        } else if (id3_2_frame_stream(fd, &range, hash_chunk, &hash) != 0) {
+            ret = BATCH_ERR_READ;
+            break;
+        }
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        art_picture_t pic;
+        sha256_final(&hash, digest);
+        sha256_hex(digest, pic.hash);
+        pic.frame_size = view.size;
+        art->pictures[idx].push_back(pic);
+
+        int is_new;
+        {
+            std::lock_guard<std::mutex> guard(art->lock);
+            auto found = art->images.find(pic.hash);
+            is_new = found == art->images.end();
+            if (is_new) {
+                art_image_t image = {range.size, 1, 0, 0, {0}};
+                memcpy(image.ext, info.ext, sizeof(image.ext));
+                art->images[pic.hash] = image;
+                art->stats.images++;
+                art->stats.unique_bytes += range.size;
+            } else {
+                found->second.count++;
+            }
+            art->stats.pictures++;
+            art->stats.bytes += range.size;
+        }
+        if (is_new) {
+            ret = store_image(art, fd, &range, pic.hash, info.ext);
+        }
+    }
+    id3_free_tag(&tag);
+    close(fd);
+    return ret;
+}
+
+/**********************************************
+ *  is_duplicate:
+ *    returns whether image is worth a link:
+ *  held by several pictures or already stored
+ *  before the run. Images the store does not
+ *  hold, because copying them failed, are
+ *  never linked.
+ **********************************************/
+static int is_duplicate(const art_image_t* image) {
+    return image->stored && (image->count > 1 || image->preexisting);
+}
+
+/**********************************************
+ *  link_file:
+ *    batch_fn_t that replaces the pictures of
+ *  path whose image is a duplicate with links
+ *  to the store, in one commit. A file that
+ *  changed since the scan (inode, mtime or
+ *  size) is left alone, so a picture is never
+ *  replaced by a link to another image.
+ **********************************************/
+static int link_file(const char* path, size_t idx, unsigned worker, void* ctx) {
+    art_ctx_t* art = (art_ctx_t*) ctx;
+    const std::vector<art_picture_t>& pics = art->pictures[idx];
+    size_t wanted = 0;
+    for (size_t i = 0; i < pics.size(); ++i) {
+        wanted += is_duplicate(&art->images.at(pics[i].hash));
+    }
+    if (wanted == 0) {
+        return BATCH_OK;
+    }
+
+    audiotag_t at;
+    int ret = audiotag_open(&at, path, 1, &art->opts);
+    if (ret != BATCH_OK) {
+        return ret;
+    }
+    struct stat before;
+    if (fstat(at.fd, &before) != 0) {
+        audiotag_close(&at);
+        return BATCH_ERR_READ;
+    }
+    art_file_t now;
+    file_identity(&before, &now);
+    const art_file_t* scanned = &art->files[idx];
+    if (now.dev != scanned->dev || now.ino != scanned->ino || now.mtime_ns != scanned->mtime_ns || now.size != scanned->size) {
+        audiotag_close(&at);
+        return BATCH_OK;
+    }
+    id3_2_edit_t* tx = audiotag_edit(&at);
+    if (tx == nullptr) {
+        ret = at.refused ? BATCH_ERR_FORMAT : BATCH_ERR_READ;
+        audiotag_close(&at);
+        return ret;
+    }
+
+    size_t k = 0;
+    size_t linked = 0;
+    for (size_t i = 0; i < tx->frames.size() && k < pics.size(); ++i) {
+        id3_2_edit_frame_t* f = &tx->frames[i];
+        apic_info_t info;
+        if (memcmp(f->id, "APIC", 4) != 0 || apic_parse(f->body, f->size, &info) != 0) {
+            continue;
+        }
+        const art_picture_t* pic = &pics[k++];
+        if (pic->frame_size != f->size) {
+            linked = 0;
+            break;
+        }
+        const art_image_t* image = &art->images.at(pic->hash);
+        if (!is_duplicate(image)) {
+            continue;
+        }
+
+        // Same encoding, picture type and description; a URL for the image
+        std::string url = "file://" + image_path(art->dir, pic->hash, image->ext);
+        uint32_t head = 1 + sizeof(ART_LINK_MIME);
+        uint32_t desc = info.data - info.desc;
+        uint32_t sz = head + 1 + desc + url.size();
+        uint8_t* body = (uint8_t*) malloc(sz);
+        if (body == nullptr) {
+            ret = BATCH_ERR_WRITE;
+            break;
+        }
+        body[0] = f->body[0];
+        memcpy(body + 1, ART_LINK_MIME, sizeof(ART_LINK_MIME));
+        body[head] = f->body[info.desc - 1];
+        memcpy(body + head + 1, f->body + info.desc, desc);
+        memcpy(body + head + 1 + desc, url.data(), url.size());
+        id3_2_edit_set_body(tx, i, body, sz);
+        ++linked;
+    }
+
+    if (ret == BATCH_OK && linked) {
+        ret = audiotag_commit(&at);
+    }
+
+    struct stat after;
+    if (ret == BATCH_OK && linked && fstat(at.fd, &after) == 0) {
+        std::lock_guard<std::mutex> guard(art->lock);
+        art->stats.linked += linked;
+        if (after.st_size < before.st_size) {
+            art->stats.reclaimed += before.st_size - after.st_size;
+        }
+    }
+    audiotag_close(&at);
+    return ret;
+}
+
+/**********************************************
+ *  art_run:
+ *    scans files into the store at dir and,
+ *  with dedupe, links duplicate pictures.
+ **********************************************/
+long art_run(const std::vector<std::string>& files, unsigned num_workers, const char* dir, int dedupe, const audiotag_opts_t* opts, art_stats_t* stats) {
+    art_ctx_t art;
+    memset(&art.stats, 0, sizeof(art.stats));
+    if (opts != nullptr) {
+        art.opts = *opts;
+    } else {
+        audiotag_opts_init(&art.opts);
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    char* abs = realpath(dir, nullptr);
+    if (abs == nullptr) {
+        return -1;
+    }
+    art.dir = abs;
+    free(abs);
+    art.pictures.resize(files.size());
+    art.files.resize(files.size());
+
+    size_t failed = batch_run(files, num_workers, scan_file, &art);
+    for (auto& image : art.images) {
+        if (is_duplicate(&image.second)) {
+            size_t copies = image.second.preexisting ? image.second.count : image.second.count - 1;
+            art.stats.reclaimable += copies * image.second.size;
+        }
+    }
+    if (dedupe) {
+        failed += batch_run(files, num_workers, link_file, &art);
+    }
+    *stats = art.stats;
+    return failed;
+}
+
+/**********************************************
+ *  art_report:
+ *    prints stats to out.
+ **********************************************/
+void art_report(const art_stats_t* stats, int dedupe, FILE* out) {
+    fprintf(out, "%zu pictures, %zu distinct images, %zu added to the store\n",
+            stats->pictures, stats->images, stats->stored);
+    fprintf(out, "%llu bytes of artwork, %llu distinct, %llu reclaimable\n",
+            (unsigned long long) stats->bytes, (unsigned long long) stats->unique_bytes,
+            (unsigned long long) stats->reclaimable);
+    if (dedupe) {
+        fprintf(out, "%zu pictures replaced by references, %llu bytes reclaimed\n",
+                stats->linked, (unsigned long long) stats->reclaimed);
+    }
+}
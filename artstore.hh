@@ -0,0 +1,60 @@
+#ifndef ARTSTORE_H
+#define ARTSTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "libaudiotag.hh"
+
+// APIC MIME type marking picture data that is a URL (ID3v2.3 4.15)
+#define ART_LINK_MIME "-->"
+
+/**********************************************
+ *  The store holds each distinct image once,
+ *  named by the SHA-256 of the image bytes:
+ *  DIR/ab/abcdef....jpg, where ab are the
+ *  first two hex digits. Files are written
+ *  whole through a rename and never change.
+ **********************************************/
+
+/**********************************************
+ *  art_stats_t:
+ *    what an art_run found and did.
+ **********************************************/
+typedef struct art_stats_t {
+    size_t pictures;        // APIC frames holding an image
+    size_t images;          // distinct images among them
+    size_t stored;          // images this run added to the store
+    uint64_t bytes;         // image bytes across all pictures
+    uint64_t unique_bytes;  // image bytes of the distinct images
+    uint64_t reclaimable;   // image bytes links would take out of files
+    size_t linked;          // pictures replaced by references
+    uint64_t reclaimed;     // bytes the files shrank by
+} art_stats_t;
+
+/**********************************************
+ *  art_run:
+ *    hashes the image of every APIC frame of
+ *  files across num_workers threads (0 for one
+ *  per core) and adds each image missing from
+ *  the store at dir. With dedupe, pictures
+ *  whose image is in more than one frame or
+ *  was already stored are then replaced by
+ *  ART_LINK_MIME frames holding a file:// URL
+ *  to the stored copy. Stored images and
+ *  edited tags are written as opts asks (null
+ *  for the defaults). Fills stats and returns
+ *  the number of files that failed, or -1 if
+ *  the store could not be opened.
+ **********************************************/
+long art_run(const std::vector<std::string>& files, unsigned num_workers, const char* dir, int dedupe, const audiotag_opts_t* opts, art_stats_t* stats);
+
+/**********************************************
+ *  art_report:
+ *    prints stats to out.
+ **********************************************/
+void art_report(const art_stats_t* stats, int dedupe, FILE* out);
+
+#endif
@@ -1,23 +1,29 @@
 #include <iostream>
+#include <vector>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include "fileio.hh"
+#include "iostat.hh"
+#include "id3.hh"
+#include "id3frames.hh"
+#include "tagedit.hh"
+#include "batch.hh"
+#include "dump.hh"
+#include "catalog.hh"
+#include "artstore.hh"
+#include "manifest.hh"
+#include "migrate.hh"
+#include "libaudiotag.hh"
+#include "watch.hh"
+#include "table.hh"
+#include <chrono>
 
 #define ID3_2_MAX_FRAME_SIZE 60
 #define ID3_1_FRAME_SIZE 30
 
-// Flips endianess of 32-bit integer
-uint32_t flip_endianness(uint32_t x) {
-    uint32_t ret = 0;
-    ret |= (x & 0xFF) << 24;
-    ret |= (x & 0xFF00) << 8;
-    ret |= (x & 0xFF000000) >> 24;
-    ret |= (x & 0xFF0000) >> 8;
-    return ret;
-}
-
 /**********************************************
  *  Required fields:
  *  These defines cause the program to prompt
@@ -59,69 +65,6 @@ typedef enum {
     NUM_TRAITS,
 } trait_index_t;
 
-static uint8_t traits[NUM_TRAITS];
-
-
-/**********************************************
- *  id3v1 is the following format: 
- *  "TAG" - 3 bytes
- *  TITLE - 30 bytes
- *  ARTIST - 30 bytes
- *  ALBUM - 30 bytes
- *  YEAR - 4 bytes
- *  COMMENT/TRACK - 30 bytes 
- *  GENRE - 1 byte
- * https://id3.org/ID3v1
- **********************************************/
-typedef struct id3_1_t {
-    char title[30];
-    char artist[30];
-    char album[30];
-    char year[4];
-    char comment[30];
-    char genre[1];
-} id3_1_t;
-
-/**********************************************
- *  id3v2 frames have the following format: 
- *  ID - 4 bytes
- *  SIZE - 4 bytes (big-endian)
- *  FLAGS - 2 bytes
- *  https://id3.org/id3v2.3.0
- **********************************************/
-typedef struct id3_2_frame_header_t {
-    char id[4];
-    uint32_t size;
-    uint32_t flags;
-} id3_2_frame_t;
-
-
-/**********************************************
- *  string_from_id: 
- *  given an ID3v2 frame ID puts a plaintext
- *  string of the frame content in s.
- *  Assumes that s is at least 8 bytes.
- *  If the ID is not recognized, the ID is
- *  placed in s.
- **********************************************/
-void string_from_id(char* id, char* s) {
-    if (strncmp(id, "TALB", 4) == 0) {
-        memcpy(s, "Album", 5);
-    } else if (strncmp(id, "TIT2", 4) == 0) {
-        memcpy(s, "Title", 5);
-    } else if (strncmp(id, "TORY", 4) == 0 || strncmp(id, "TYER", 4) == 0) {
-        memcpy(s, "Year", 4);
-    } else if (strncmp(id, "TPE1", 4) == 0) {
-        memcpy(s, "Artist", 6);
-    } else if (strncmp(id, "TRCK", 4) == 0) {
-        memcpy(s, "Track", 5);
-    } else if (strncmp(id, "TCOM", 4) == 0) {
-        memcpy(s, "Composer", 8);
-    } else {
-        // Default to original id
-        memcpy(s, id, 4);
-    }
-}
 
 /**********************************************
  *  set_trait_from_tag_id: 
@@ -129,50 +72,58 @@ void string_from_id(char* id, char* s) {
  *  value, marks that ID as value in the trait
  * array. Does nothing if not a required ID.
  **********************************************/
-void set_trait_from_tag_id(char* id, int val) {
-#ifdef ALBUM_REQUIRED
-    if (strncmp(id, "TALB", 4) == 0) {
-        traits[album_idx] = val;
+void set_trait_from_tag_id(uint8_t* traits, char* id, int val) {
+    const id3_frame_info_t* info = id3_frame_info(id3_fourcc(id));
+    if (info == nullptr) {
+        return;
     }
+    switch (info->trait) {
+#ifdef ALBUM_REQUIRED
+        case ID3_TRAIT_ALBUM:
+            traits[album_idx] = val;
+            break;
 #endif
 
 #ifdef TITLE_REQUIRED
-    if (strncmp(id, "TIT2", 4) == 0) {
-        traits[title_idx] = val;
-    }
+        case ID3_TRAIT_TITLE:
+            traits[title_idx] = val;
+            break;
 #endif
 
 #ifdef YEAR_REQUIRED
-    if (strncmp(id, "TORY", 4) == 0 || strncmp(id, "TYER", 4) == 0) {
-        traits[year_idx] = val;
-    }
-#endif 
+        case ID3_TRAIT_YEAR:
+            traits[year_idx] = val;
+            break;
+#endif
 
 #ifdef ARTIST_REQUIRED
-    if (strncmp(id, "TPE1", 4) == 0) {
-        traits[artist_idx] = val;
-    }
+        case ID3_TRAIT_ARTIST:
+            traits[artist_idx] = val;
+            break;
 #endif
 
 #ifdef TRACK_REQUIRED
-    if (strncmp(id, "TRCK", 4) == 0) {
-        traits[track_idx] = val;
-    }
-#endif 
+        case ID3_TRAIT_TRACK:
+            traits[track_idx] = val;
+            break;
+#endif
 
 #ifdef COMPOSER_REQUIRED
-    if (strncmp(id, "TCOM", 4) == 0) {
-        traits[composer_idx] = val;
-    }
+        case ID3_TRAIT_COMPOSER:
+            traits[composer_idx] = val;
+            break;
 #endif
+        default:
+            break;
+    }
 }
 
-void remove_trait(char* id) {
-    set_trait_from_tag_id(id, 0);
+void remove_trait(uint8_t* traits, char* id) {
+    set_trait_from_tag_id(traits, id, 0);
 }
 
-void add_trait(char* id) {
-    set_trait_from_tag_id(id, 1);
+void add_trait(uint8_t* traits, char* id) {
+    set_trait_from_tag_id(traits, id, 1);
 }
 
 
@@ -200,83 +151,29 @@ int prompt_input(char* prompt_text, char* current_text, char* prompt_input, size
     return in == 'y';
 }
 
-/**********************************************
- *  get_id3_2_header:
- *    reads 10 bytes and places them in a
- *  frame_header struct.
- **********************************************/
-id3_2_frame_header_t get_id3_2_header(int fd) {
-    id3_2_frame_header_t frame; 
-
-    // Read the frame
-    int ret = read(fd, &frame, 10);
-    frame.size = flip_endianness(frame.size);
-
-    return frame;
-}
-
-/**********************************************
- *  add_id3_2_frame:
- *    adds an ID3 frame id with field text as 
- *  text.
- **********************************************/
-void add_id3_2_frame(int fd, char* id, char* text, char* path) {
-
-    long unsigned n = strlen(text);
-    char* frame = (char*) malloc(n + 11); // 10 for header, n for text, 1 for encoding byte
-    memcpy(frame, id, 4);
-    uint32_t sz = flip_endianness(n + 1);
-    memcpy(frame + 4, &sz, 4);
-    memset(frame + 8, 0, 3);
-    memcpy(frame + 11, text, n);
-
-    add_bytes(fd, n + 11, (uint8_t*) frame, path);
-    free(frame);
-
-    return;
-}
-
 /**********************************************
  *  interpret_frame_text:
- *    Given a buffer from an ID3 frame, 
- *  interpret the string
+ *    Given a buffer from an ID3 frame and the
+ *  decoder for its frame type, prints the text
+ *  as UTF-8, followed by its encoding if the
+ *  frame starts with an encoding byte. Frames
+ *  without a decoder print their size.
  **********************************************/
-void interpret_frame_text(char* buf, size_t sz) {
-    char encoding_byte = buf[0];
+void interpret_frame_text(const uint8_t* buf, size_t sz, id3_frame_decoder_t decode, int has_encoding) {
+    static const char* encodings[] = {"ISO-8859-1", "UTF-16", "UTF-16 (BE)", "UTF-8"};
     if (sz <= 1) {
         printf("VOID\n");
         return;
     }
-    switch(encoding_byte) {
-        case 0:
-            // Ascii terminated with 0 byte
-            for (int i = 1; i < sz; ++i) {
-                printf("%c", buf[i]);
-            }
-            printf("\n");
-            printf("Text Encoding: ASCII\n");
-            break;
-        case 1:
-            // UTF-16 terminated with aligned double 0 byte
-            assert((uint8_t) buf[1] == 0xff);
-            assert((uint8_t) buf[2] == 0xfe);
-            for (int i = 3; i < sz; i+=2) {
-                printf("%c", buf[i]);
-            }
-            printf("\n");
-            printf("Text Encoding: UTF-16 (LE)\n");
-            break;
-        case 2:
-            assert((uint8_t) buf[1] == 0xfe);
-            assert((uint8_t) buf[2] == 0xff);
-            // UTF-16 (BE) terminated with aligned double 0 byte
-            printf("Text Encoding: UTF-16 (BE)\n");
-            break;
-        case 3:
-            // UTF-8 terminated with 0 byte
-            printf("Text Encoding: UTF-8\n");
-            break;
-
+    if (decode == nullptr) {
+        printf("<%zu bytes of binary data>\n", sz);
+        return;
+    }
+    std::string text;
+    decode(buf, sz, text);
+    printf("%s\n", text.c_str());
+    if (has_encoding) {
+        printf("Text Encoding: %s\n", buf[0] < 4 ? encodings[buf[0]] : "unknown");
     }
 }
 
@@ -284,42 +181,40 @@ void interpret_frame_text(char* buf, size_t sz) {
 /**********************************************
  *  handle_id3v2:
  *    parses for ID3v2 frames and prompts
- *  user for frame modifications.
- *  assumes that fd points to the first frame
+ *  user for frame modifications. The edits
+ *  are collected in the transaction of at and
+ *  written to the file once at the end.
+ *  Creates the tag if the file does not have
+ *  one.
  **********************************************/
-void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
+void handle_id3v2(audiotag_t* at) {
+    uint8_t traits[NUM_TRAITS];
     memset(traits, 0, sizeof(traits));
-    // Get the first frame header
-    id3_2_frame_header_t frame_header = get_id3_2_header(fd);
 
-    int32_t added_bytes = 0;
-    uint32_t bytes_read = 10;
-    
-    char field_text[ID3_2_MAX_FRAME_SIZE + 1];
-    char field_plain_text[10];
-    char zeroes[4] = {0,0,0,0};
-
-    // While we haven't reached the end of the tag or hit padding
-    while (bytes_read <= tag_sz + added_bytes && memcmp(frame_header.id, zeroes, 4) != 0) {
+    id3_2_edit_t* tx = audiotag_edit(at);
+    if (tx == nullptr) {
+        std::cerr << (at->refused ? "Cannot edit this ID3v2 tag\n" : "Could not read ID3v2 tag\n");
+        return;
+    }
 
-        memset(field_plain_text, 0, sizeof(field_plain_text));
+    char field_text[ID3_2_MAX_FRAME_SIZE + 1];
 
-        // Print the frame tag
-        string_from_id(frame_header.id, (char*) field_plain_text);
-        printf("%s (%d): ", field_plain_text, frame_header.size);
+    size_t i = 0;
+    while (i < tx->frames.size()) {
+        id3_2_edit_frame_t* frame = &tx->frames[i];
+        uint8_t removed = 0;
 
-        // Alloc for the frame text
-        char* frame_text = (char*) malloc(frame_header.size);
-        if (frame_text == nullptr) {
-            break;
+        // Print the frame name and interpret the text
+        const id3_frame_info_t* info = id3_frame_info(id3_fourcc(frame->id));
+        if (info != nullptr) {
+            printf("%s (%d): ", info->name, frame->size);
+        } else {
+            printf("%.4s (%d): ", frame->id, frame->size);
         }
+        id3_frame_decoder_t decode = info != nullptr ? info->decode : frame->id[0] == 'T' ? id3_2_text_utf8 : nullptr;
+        interpret_frame_text(frame->body, frame->size, decode, info == nullptr || info->kind != ID3_FRAME_URL);
 
-        // Read and interpret the text
-        read(fd, frame_text, frame_header.size);
-        bytes_read += frame_header.size;
-        interpret_frame_text(frame_text, frame_header.size);
-
-        add_trait(frame_header.id);
+        add_trait(traits, frame->id);
 
         char in = 0;
         while (in != 'y' && in != 'n') {
@@ -331,10 +226,9 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
             std::cout << "Remove field? (y/n): ";
             std::cin >> in;
             if (in == 'y') {
-                off_t curr = lseek(fd, lseek(fd, 0, SEEK_CUR) - frame_header.size - 10, SEEK_SET);
-                remove_bytes(fd, 10 + frame_header.size, path);
-                remove_trait(frame_header.id);
-                added_bytes -= frame_header.size;
+                remove_trait(traits, frame->id);
+                id3_2_edit_remove(tx, i);
+                removed = 1;
                 in = 'n';
             }
             else if (in == 'n') {
@@ -349,29 +243,15 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
             std::cout << "New Text (max 60 chars): ";
             std::cin.getline(field_text, sizeof(field_text));
 
-            off_t curr = lseek(fd, lseek(fd, 0, SEEK_CUR) - frame_header.size - 10, SEEK_SET);
-            assert(curr != -1);
-
-            unsigned long n = strlen(field_text);
-            added_bytes += n - frame_header.size;
-
-            remove_bytes(fd, 10 + frame_header.size, path);
-            add_id3_2_frame(fd, frame_header.id, field_text, path);
-
-            add_trait(frame_header.id);
+            id3_2_edit_replace(tx, i, field_text);
+            add_trait(traits, frame->id);
         }
         std::cout << "\n";
 
-        // Free the text buffer and get the next frame
-        free(frame_text);
-        in = 0;
-
-        frame_header = get_id3_2_header(fd);
-        bytes_read += 10;
+        if (!removed) {
+            ++i;
+        }
     }
-    // last frame was not an actual frame header, so backup
-    lseek(fd, lseek(fd,0,SEEK_CUR) - 10, SEEK_SET);
-
 
     // Prompt for required traits
     for (int i = 0; i < NUM_TRAITS; ++i) {
@@ -381,7 +261,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef ALBUM_REQUIRED
                 case album_idx:
                     if (prompt_input((char*) "Album", (char*) "", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TALB", field_text, path);
+                        add_id3_2_frame(tx, "TALB", field_text);
                     }
                     break;
                 #endif
@@ -389,7 +269,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef COMPOSER_REQUIRED
                 case composer_idx:
                     if (prompt_input((char*) "Composer",(char*) "", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TCOM", field_text, path);
+                        add_id3_2_frame(tx, "TCOM", field_text);
                     }
                     break;
                 #endif
@@ -397,7 +277,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef YEAR_REQUIRED
                 case year_idx:
                     if (prompt_input((char*) "Year", (char*)"", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TORY", field_text, path);
+                        add_id3_2_frame(tx, "TORY", field_text);
                     }
                     break;
                 #endif
@@ -405,7 +285,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef ARTIST_REQUIRED
                 case artist_idx:
                     if (prompt_input((char*) "Artist",(char*) "", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TPE1", field_text, path);
+                        add_id3_2_frame(tx, "TPE1", field_text);
                     }
                     break;
                 #endif
@@ -413,7 +293,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef TRACK_REQUIRED
                 case track_idx:
                     if (prompt_input((char*) "Track", (char*)"", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TRCK", field_text, path);
+                        add_id3_2_frame(tx, "TRCK", field_text);
                     }
                     break;
                 #endif
@@ -421,7 +301,7 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
                 #ifdef TITLE_REQUIRED
                 case title_idx:
                     if (prompt_input((char*) "Title", (char*)"", field_text, ID3_2_MAX_FRAME_SIZE)) {
-                        add_id3_2_frame(fd, (char*) "TIT2", field_text, path);
+                        add_id3_2_frame(tx, "TIT2", field_text);
                     }
                     break;
                 #endif
@@ -430,60 +310,55 @@ void handle_id3v2(int fd, char* path, uint32_t tag_sz) {
             }
         }
     }
+
+    // Write every change at once
+    if (audiotag_commit(at) != BATCH_OK) {
+        std::cerr << "Could not write ID3v2 tag\n";
+    }
 }
 
 /**********************************************
  *  handle_id3v1:
- *    parses an ID3v1 tag and prompts
- *  user for modifications.
- *  assumes that fd points to the title
+ *    prompts user for modifications to the
+ *  ID3v1 tag audio_tag, whose title starts at
+ *  frame_start in fd. Changed fields are
+ *  written back with pwrite.
  **********************************************/
-void handle_id3v1(int fd) {
-    off_t frame_start = lseek(fd, 0, SEEK_CUR);
-    id3_1_t audio_tag;
+void handle_id3v1(int fd, off_t frame_start, id3_1_t* audio_tag) {
     char new_text[ID3_1_FRAME_SIZE + 1];      // 30 bytes for content + 1 for newline
     memset(new_text, 0, sizeof(new_text));
 
     // Update Title
-    read(fd, audio_tag.title, 30);
-    if (prompt_input((char*) "Title", audio_tag.title, new_text, ID3_1_FRAME_SIZE)) {
-        lseek(fd, frame_start, SEEK_SET);
-        write(fd, new_text, 30);
+    if (prompt_input((char*) "Title", audio_tag->title, new_text, ID3_1_FRAME_SIZE)) {
+        pwrite(fd, new_text, 30, frame_start);
         memset(new_text,0, sizeof(new_text));
     }
 
     // Update Artist
-    read(fd, audio_tag.artist, 30);
-    if (prompt_input((char*) "Artist", audio_tag.artist, new_text, ID3_1_FRAME_SIZE)) {
-        lseek(fd, frame_start + 30, SEEK_SET);
-        write(fd, new_text, 30);
+    if (prompt_input((char*) "Artist", audio_tag->artist, new_text, ID3_1_FRAME_SIZE)) {
+        pwrite(fd, new_text, 30, frame_start + 30);
         memset(new_text,0, sizeof(new_text));
     }
 
     // Update Album
-    read(fd, audio_tag.album, 30);
-    if (prompt_input((char*) "Album", audio_tag.album, new_text, ID3_1_FRAME_SIZE)) {
-        lseek(fd, frame_start + 60, SEEK_SET);
-        write(fd, new_text, 30);
+    if (prompt_input((char*) "Album", audio_tag->album, new_text, ID3_1_FRAME_SIZE)) {
+        pwrite(fd, new_text, 30, frame_start + 60);
         memset(new_text,0, sizeof(new_text));
     }
 
     // Update Year
-    read(fd, audio_tag.year, 4);
-    if (prompt_input((char*) "Year", audio_tag.year, new_text, 4)) {
-        lseek(fd, frame_start + 90, SEEK_SET);
-        write(fd, new_text, 4);
+    if (prompt_input((char*) "Year", audio_tag->year, new_text, 4)) {
+        pwrite(fd, new_text, 4, frame_start + 90);
         memset(new_text,0, sizeof(new_text));
     }
 
     // Update Comment
-    read(fd, audio_tag.comment, 30);
-    if (audio_tag.comment[28] == 0) {
+    if (audio_tag->comment[28] == 0) {
         
         // Temp buffer for track number
         char track_arr[3];
-        uint8_t comment_modified = prompt_input((char*) "Comment", audio_tag.comment, new_text, 28);
-        sprintf(track_arr, "%d", audio_tag.comment[29]);
+        uint8_t comment_modified = prompt_input((char*) "Comment", audio_tag->comment, new_text, 28);
+        sprintf(track_arr, "%d", audio_tag->comment[29]);
         uint8_t track_modified = prompt_input((char*) "Track", track_arr, track_arr, 3);
 
         uint8_t track_num = atoi(track_arr);
@@ -491,129 +366,554 @@ void handle_id3v1(int fd) {
 
         // If the comment is new
         if (comment_modified) {
-            lseek(fd, frame_start + 94, SEEK_SET);
             // If the track is also new
             if (track_modified) {
                 // Zero-byte
                 new_text[28] = 0; 
                 new_text[29] = track_num;
-                write(fd, new_text, 30);
+                pwrite(fd, new_text, 30, frame_start + 94);
             } else {
-                write(fd, new_text, 28);
-                lseek(fd, 2, SEEK_CUR);
+                pwrite(fd, new_text, 28, frame_start + 94);
             }
         } else if (track_modified) {
-            lseek(fd, frame_start + 94 + 29, SEEK_SET);
-            write(fd, (char*) &track_num, 1);
+            pwrite(fd, (char*) &track_num, 1, frame_start + 94 + 29);
         }
     }
     else {
-        if (prompt_input((char*) "Comment", audio_tag.comment, new_text, ID3_1_FRAME_SIZE)) {
-            lseek(fd, frame_start + 94, SEEK_SET);
-            write(fd, new_text, 30);
+        if (prompt_input((char*) "Comment", audio_tag->comment, new_text, ID3_1_FRAME_SIZE)) {
+            pwrite(fd, new_text, 30, frame_start + 94);
         }
     }
 
-    read(fd, audio_tag.genre, 1);
-    sprintf(new_text, "%d", audio_tag.genre[0]);
+    sprintf(new_text, "%d", audio_tag->genre[0]);
     if (prompt_input((char*) "Genre ID", new_text, new_text, 3)) {
         uint8_t genre_num = atoi(new_text);
-        lseek(fd, frame_start + 124, SEEK_SET);
-        write(fd, (char*) &genre_num,1);
+        pwrite(fd, (char*) &genre_num, 1, frame_start + 124);
     }
 }
 
 
+/**********************************************
+ *  parse_padding:
+ *    reads a padding policy given as comma
+ *  separated min=, headroom=, max= and align=
+ *  settings (bytes, or percent of the frames
+ *  for headroom) over the defaults in policy.
+ *  Returns 0 on success and -1 if spec is not
+ *  valid.
+ **********************************************/
+static int parse_padding(const char* spec, id3_2_padding_t* policy) {
+    static const char* keys[] = {"min", "headroom", "max", "align"};
+    uint32_t* fields[] = {&policy->min, &policy->headroom_pct, &policy->max, &policy->align};
+    while (*spec) {
+        const char* eq = strchr(spec, '=');
+        if (eq == nullptr) {
+            return -1;
+        }
+        size_t k = 0;
+        while (k < 4 && (strlen(keys[k]) != (size_t) (eq - spec) || memcmp(keys[k], spec, eq - spec) != 0)) {
+            ++k;
+        }
+        char* end;
+        unsigned long v = strtoul(eq + 1, &end, 10);
+        if (k == 4 || end == eq + 1 || (*end != ',' && *end != '\0') || v > UINT32_MAX / 2) {
+            return -1;
+        }
+        *fields[k] = v;
+        spec = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**********************************************
+ *  usage:
+ *    prints the command line usage and
+ *  returns the exit code for bad arguments.
+ **********************************************/
+int usage() {
+    std::cerr << "Usage: ./audiotag [--fsync none|file|batch] [--padding spec] [file.mp3]\n"
+              << "       ./audiotag [--stats[=text|json]] [--fsync none|file|batch] [--padding spec] -s ID=text|-r ID ... file.mp3\n"
+              << "       ./audiotag -b [--stats[=text|json]] [-j workers] [--fsync none|file|batch] [--padding spec] [-m rules] [-l list] [-s ID=text] [-r ID] [path ...]\n"
+              << "       ./audiotag --dump [--stats[=text|json]] [--format json|csv] [--uring] [-j workers] [-l list] [path ...]\n"
+              << "       ./audiotag --index catalog [--stats[=text|json]] [--hash] [-j workers] [-l list] [path ...]\n"
+              << "       ./audiotag --dump --index catalog [--format json|csv] [path ...]\n"
+              << "       ./audiotag --dupes --index catalog [--format json|csv]\n"
+              << "       ./audiotag --art-store dir [--stats[=text|json]] [--art-dedupe] [-j workers] [--fsync none|file|batch] [-l list] [path ...]\n"
+              << "       ./audiotag --manifest file.csv|file.jsonl [--journal file] [--stats[=text|json]] [-j workers] [--fsync none|file|batch] [--padding spec]\n"
+              << "       ./audiotag --migrate [--drop-v1] [--stats[=text|json]] [-j workers] [--fsync none|file|batch] [--padding spec] [-l list] [path ...]\n"
+              << "       ./audiotag --watch socket [-j workers] dir ...\n"
+              << "       ./audiotag --query query --index catalog [--format json|csv]\n"
+              << "  --padding min=bytes,headroom=percent,max=bytes,align=bytes (any of them; align=0 for the block size)\n"
+              << "  --stats prints I/O calls, bytes, phase times and per-file latency to stderr\n";
+    return 1;
+}
+
 int main(int argc, char* argv[]) {
 
+    // Scripted edits: -s ID=text sets a frame, -r ID removes it
+    std::vector<id3_2_rule_t> rules;
+    std::vector<std::string> files;
+    uint8_t batch = 0;
+    uint8_t dump = 0;
+    uint8_t uring = 0;
+    dump_format_t format = DUMP_JSON;
+    char* index = nullptr;
+    char* art_store = nullptr;
+    uint8_t art_dedupe = 0;
+    uint8_t hash = 0;
+    uint8_t dupes = 0;
+    char* watch = nullptr;
+    char* query = nullptr;
+    char* manifest = nullptr;
+    char* journal = nullptr;
+    uint8_t migrate = 0;
+    uint8_t drop_v1 = 0;
+    int io_stats = -1;          // -1 for none, 0 for text, 1 for JSON
+    unsigned num_workers = 0;
+
+    // How edits write and make themselves durable, for every mode
+    fileio_syncer_t syncer;
+    fileio_syncer_init(&syncer, FILEIO_SYNC_NONE);
+    audiotag_opts_t opts;
+    audiotag_opts_init(&opts);
+    opts.sync = &syncer;
+
+    static struct option long_opts[] = {
+        {"dump", no_argument, nullptr, 'd'},
+        {"format", required_argument, nullptr, 'f'},
+        {"index", required_argument, nullptr, 'i'},
+        {"uring", no_argument, nullptr, 'u'},
+        {"fsync", required_argument, nullptr, 'y'},
+        {"art-store", required_argument, nullptr, 'A'},
+        {"art-dedupe", no_argument, nullptr, 'D'},
+        {"hash", no_argument, nullptr, 'H'},
+        {"dupes", no_argument, nullptr, 'U'},
+        {"padding", required_argument, nullptr, 'P'},
+        {"watch", required_argument, nullptr, 'W'},
+        {"query", required_argument, nullptr, 'Q'},
+        {"stats", optional_argument, nullptr, 'S'},
+        {"manifest", required_argument, nullptr, 'M'},
+        {"journal", required_argument, nullptr, 'J'},
+        {"migrate", no_argument, nullptr, 'G'},
+        {"drop-v1", no_argument, nullptr, 'V'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:r:bj:m:l:df:i:uy:A:DHUP:W:Q:S::M:J:GV", long_opts, nullptr)) != -1) {
+        id3_2_rule_t rule;
+        switch (opt) {
+            case 's':
+                if (strlen(optarg) < 5 || optarg[4] != '=') {
+                    return usage();
+                }
+                memcpy(rule.id, optarg, 4);
+                rule.text = optarg + 5;
+                rules.push_back(rule);
+                break;
+            case 'r':
+                if (strlen(optarg) != 4) {
+                    return usage();
+                }
+                memcpy(rule.id, optarg, 4);
+                rule.text = nullptr;
+                rules.push_back(rule);
+                break;
+            case 'b':
+                batch = 1;
+                break;
+            case 'd':
+                dump = 1;
+                break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    format = DUMP_JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = DUMP_CSV;
+                } else {
+                    return usage();
+                }
+                break;
+            case 'i':
+                index = optarg;
+                break;
+            case 'u':
+                uring = 1;
+                break;
+            case 'A':
+                art_store = optarg;
+                break;
+            case 'D':
+                art_dedupe = 1;
+                break;
+            case 'H':
+                hash = 1;
+                break;
+            case 'U':
+                dupes = 1;
+                break;
+            case 'Q':
+                query = optarg;
+                break;
+            case 'W':
+                watch = optarg;
+                break;
+            case 'M':
+                manifest = optarg;
+                break;
+            case 'J':
+                journal = optarg;
+                break;
+            case 'G':
+                migrate = 1;
+                break;
+            case 'V':
+                drop_v1 = 1;
+                break;
+            case 'S':
+                if (optarg == nullptr || strcmp(optarg, "text") == 0) {
+                    io_stats = 0;
+                } else if (strcmp(optarg, "json") == 0) {
+                    io_stats = 1;
+                } else {
+                    return usage();
+                }
+                break;
+            case 'P':
+                if (parse_padding(optarg, &opts.padding) != 0) {
+                    return usage();
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "none") == 0) {
+                    syncer.mode = FILEIO_SYNC_NONE;
+                } else if (strcmp(optarg, "file") == 0) {
+                    syncer.mode = FILEIO_SYNC_FILE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    syncer.mode = FILEIO_SYNC_BATCH;
+                } else {
+                    return usage();
+                }
+                break;
+            case 'j':
+                num_workers = atoi(optarg);
+                break;
+            case 'm':
+                if (batch_load_rules(optarg, rules) != 0) {
+                    std::cerr << "Could not read rules from " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'l':
+                if (batch_collect_list(optarg, files) != 0) {
+                    std::cerr << "Could not read file list " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            default:
+                return usage();
+        }
+    }
+
+    // The watch daemon keeps the tags of whole trees in memory
+    if (watch) {
+        if (batch || dump || index || art_store || art_dedupe || hash || dupes || query || manifest || migrate || io_stats >= 0 ||
+            !rules.empty() || !files.empty() || optind == argc) {
+            return usage();
+        }
+        for (int i = optind; i < argc; ++i) {
+            files.push_back(argv[i]);
+        }
+        return watch_run(files, watch, num_workers) == 0 ? 0 : 2;
+    }
+
+    // With --stats, this thread and the workers it starts count their I/O
+    iostat_sink_t sink;
+    iostat_sink_init(&sink);
+    if (io_stats >= 0) {
+        iostat_attach(&sink);
+    }
+    auto report = [&](int ret) {
+        if (io_stats >= 0) {
+            iostat_flush(nullptr, 0);
+            iostat_report(&sink, io_stats, stderr);
+        }
+        return ret;
+    };
+
+    // The io_uring engine only serves read-only scans
+    if (uring && (!dump || index)) {
+        return usage();
+    }
+
+    // Artwork goes to the store, and with --art-dedupe out of the files
+    if (art_store || art_dedupe) {
+        if (!art_store || batch || dump || index || query || manifest || journal || migrate || drop_v1 || !rules.empty()) {
+            return usage();
+        }
+        for (int i = optind; i < argc; ++i) {
+            if (batch_collect(argv[i], files) != 0) {
+                std::cerr << "Could not open " << argv[i] << "\n";
+            }
+        }
+        art_stats_t stats;
+        long failed = art_run(files, num_workers, art_store, art_dedupe, &opts, &stats);
+        if (failed < 0) {
+            std::cerr << "Could not open artwork store " << art_store << "\n";
+            return 2;
+        }
+        if (fileio_sync_flush(&syncer) != 0) {
+            std::cerr << "Could not sync written files\n";
+            return 4;
+        }
+        art_report(&stats, art_dedupe, stdout);
+        return report(failed ? 6 : 0);
+    }
+
+    // Manifests name their own files, and the journal lets a rerun resume
+    if (manifest || journal) {
+        if (!manifest || batch || dump || index || uring || art_store || art_dedupe || hash || dupes || query || migrate || drop_v1 ||
+            !rules.empty() || !files.empty() || optind != argc || (!journal && strcmp(manifest, "-") == 0)) {
+            return usage();
+        }
+        std::vector<manifest_entry_t> entries;
+        size_t line;
+        if (manifest_load(manifest, entries, &line) != 0) {
+            if (line) {
+                std::cerr << manifest << ":" << line << ": bad manifest entry\n";
+            } else {
+                std::cerr << "Could not read manifest " << manifest << "\n";
+            }
+            return 1;
+        }
+        std::string journal_path = journal ? journal : std::string(manifest) + ".journal";
+        manifest_stats_t stats;
+        long failed = manifest_run(entries, journal_path.c_str(), num_workers, &opts, &stats);
+        if (failed < 0) {
+            std::cerr << "Could not read or write journal " << journal_path << "\n";
+            return 4;
+        }
+        if (fileio_sync_flush(&syncer) != 0) {
+            std::cerr << "Could not sync edited files\n";
+            return 4;
+        }
+        manifest_report(&stats, stdout);
+        return report(failed ? 6 : 0);
+    }
+
+    // ID3v1-only files get their ID3v2 tag in a single write each
+    if (migrate || drop_v1) {
+        if (!migrate || batch || dump || index || uring || hash || dupes || query || !rules.empty()) {
+            return usage();
+        }
+        for (int i = optind; i < argc; ++i) {
+            if (batch_collect(argv[i], files) != 0) {
+                std::cerr << "Could not open " << argv[i] << "\n";
+            }
+        }
+        migrate_stats_t stats;
+        size_t failed = migrate_run(files, num_workers, drop_v1, &opts, &stats);
+        if (fileio_sync_flush(&syncer) != 0) {
+            std::cerr << "Could not sync migrated files\n";
+            return 4;
+        }
+        migrate_report(&stats, stdout);
+        return report(failed ? 6 : 0);
+    }
+
+    // Queries run over a column table built from the catalog alone
+    if (query) {
+        table_query_t q;
+        if (!index || dump || batch || hash || dupes || io_stats >= 0 || !rules.empty() || optind != argc ||
+            table_parse_query(query, &q) != 0) {
+            return usage();
+        }
+        catalog_t cat;
+        if (catalog_open(index, &cat) != 0) {
+            std::cerr << "Could not open catalog " << index << "\n";
+            return 2;
+        }
+        auto start = std::chrono::steady_clock::now();
+        table_t table;
+        table_build(&cat, &table);
+        auto built = std::chrono::steady_clock::now();
+        size_t matched = table_run(&table, &q, format, STDOUT_FILENO);
+        auto done = std::chrono::steady_clock::now();
+        fprintf(stderr, "%zu rows, %zu columns, %zu matched, built in %.1fms, queried in %.1fms\n",
+                table.num_rows, table.columns.size(), matched,
+                std::chrono::duration<double, std::milli>(built - start).count(),
+                std::chrono::duration<double, std::milli>(done - built).count());
+        catalog_close(&cat);
+        return 0;
+    }
+
+    // Payload hashes are kept in the catalog and grouped from there
+    if ((hash || dupes) && (!index || dump || batch || !rules.empty() || (hash && dupes))) {
+        return usage();
+    }
+    if ((dupes || (dump && index)) && io_stats >= 0) {
+        return usage();
+    }
+    if (dupes) {
+        catalog_t cat;
+        if (catalog_open(index, &cat) != 0) {
+            std::cerr << "Could not open catalog " << index << "\n";
+            return 2;
+        }
+        size_t unhashed = dump_dupes(&cat, format, STDOUT_FILENO);
+        catalog_close(&cat);
+        if (unhashed) {
+            std::cerr << unhashed << " entries have no payload hash; refresh with --hash\n";
+        }
+        return 0;
+    }
+
+    // Dumping from the catalog reads no audio files
+    if (dump && index) {
+        catalog_t cat;
+        if (catalog_open(index, &cat) != 0) {
+            std::cerr << "Could not open catalog " << index << "\n";
+            return 2;
+        }
+        for (int i = optind; i < argc; ++i) {
+            files.push_back(argv[i]);
+        }
+        size_t missing = dump_catalog(&cat, files, format, STDOUT_FILENO);
+        catalog_close(&cat);
+        return missing ? 6 : 0;
+    }
+
+    // Catalog refreshes re-parse only files that changed
+    if (index) {
+        if (batch || !rules.empty()) {
+            return usage();
+        }
+        for (int i = optind; i < argc; ++i) {
+            if (batch_collect(argv[i], files) != 0) {
+                std::cerr << "Could not open " << argv[i] << "\n";
+            }
+        }
+        long failed = catalog_refresh(index, files, num_workers, hash);
+        if (failed < 0) {
+            std::cerr << "Could not write catalog " << index << "\n";
+            return 4;
+        }
+        return report(failed ? 6 : 0);
+    }
+
+    // Batch and dump modes take any number of files and directories
+    if (batch || dump) {
+        if (batch == dump || (batch && rules.empty()) || (dump && !rules.empty())) {
+            return usage();
+        }
+        for (int i = optind; i < argc; ++i) {
+            if (batch_collect(argv[i], files) != 0) {
+                std::cerr << "Could not open " << argv[i] << "\n";
+            }
+        }
+        if (dump && uring) {
+            return report(dump_run_uring(files, num_workers, format, STDOUT_FILENO) ? 6 : 0);
+        }
+        if (dump) {
+            return report(dump_run(files, num_workers, format, STDOUT_FILENO) ? 6 : 0);
+        }
+        batch_tag_ctx_t bc;
+        batch_tag_init(&bc, rules.data(), rules.size(), &opts);
+        size_t failed = batch_run(files, num_workers, batch_tag_worker, &bc);
+        if (fileio_sync_flush(&syncer) != 0) {
+            std::cerr << "Could not sync edited files\n";
+            return 4;
+        }
+        fprintf(stderr, "%zu edited in place, %zu grown by inserting blocks, %zu rewritten, %zu shrunk\n",
+                bc.in_place.load(), bc.grown.load(), bc.rewritten.load(), bc.shrunk.load());
+        return report(failed ? 6 : 0);
+    }
+
     // Check arguments
-    if (argc != 2) {
-        std::cerr << "Usage: ./audiotag [file.mp3]\n";
-        return 1;
+    if (optind != argc - 1 || !files.empty()) {
+        return usage();
     }
+    char* path = argv[optind];
 
     // Check file is an mp3 file
-    int n = strlen(argv[argc - 1]);
-    if (memcmp(&argv[argc - 1][n - 4], ".mp3", 3) != 0) {
-        std::cerr << "Usage: ./audiotag [file.mp3]\n";
-        return 1;
+    int n = strlen(path);
+    if (n < 4 || memcmp(&path[n - 4], ".mp3", 3) != 0) {
+        return usage();
     }
 
+    if (!rules.empty()) {
+        batch_tag_ctx_t bc;
+        batch_tag_init(&bc, rules.data(), rules.size(), &opts);
+        int64_t began = iostat_now();
+        int err = batch_tag_file(path, &bc);
+        if (err == BATCH_OK && fileio_sync_flush(&syncer) != 0) {
+            err = BATCH_ERR_WRITE;
+        }
+        uint64_t took = iostat_now() - began;
+        iostat_flush(&took, 1);
+        if (err != BATCH_OK) {
+            std::cerr << path << ": " << audiotag_strerror(err) << "\n";
+            return report(1 + err);
+        }
+        return report(0);
+    }
+
+    // Interactive edits wait on the user, so there is nothing to time
+    if (io_stats >= 0) {
+        return usage();
+    }
     // Open the file
-    int fd = open(argv[argc - 1], O_RDWR, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        std::cerr << "Could not open " << argv[argc - 1] << "\n";
+    audiotag_t at;
+    if (audiotag_open(&at, path, 1, &opts) != BATCH_OK) {
+        std::cerr << "Could not open " << path << "\n";
         return 2;
     }
 
-    // Read the first ten bytes
-    char tag_bytes[10];
-    memset(tag_bytes, 0, 10);
-    read(fd, tag_bytes, 10);
+    // Load the tag in one or two reads
+    const id3_tag_t* tag;
+    if (audiotag_read(&at, &tag) != BATCH_OK) {
+        std::cerr << "Could not read " << path << "\n";
+        audiotag_close(&at);
+        return 5;
+    }
 
     // Check if we found an ID3.2 tag
-    if (!memcmp("ID3", tag_bytes, 3)) {
+    id3_1_t v1 = tag->v1;
+    if (tag->version == ID3_V2) {
         printf("ID3v2\n");
-        uint32_t sz = (tag_bytes[6] << 21) | (tag_bytes[7] << 14) | (tag_bytes[8] << 7) | tag_bytes[9];
-
-        handle_id3v2(fd, argv[argc - 1], sz);
-    } else {
+        handle_id3v2(&at);
+    } else if (tag->version == ID3_V1) {
         // Otherwise check for an ID3v1 tag
-        off_t end = lseek(fd, 0, SEEK_END);
-
-        // ID3v1 tags start at end - 128
-        off_t tag_start = end - 128;
-        lseek(fd, tag_start, SEEK_SET);
+        printf("ID3v1\n");
+        handle_id3v1(at.fd, tag->v1_offset + 3, &v1);
+    } else {
 
-        int res = read(fd, tag_bytes, 3);
-        if (res != 3) {
-            std::cerr << "Did not read 3 bytes\n";
-            close(fd);
-            return 5;
+        // Should we add tags?
+        char in = 0;
+        while (in != 'n' && in != 'y') {
+            printf("Add ID3v2 Tags? (y/n): ");
+            std::cin >> in;
         }
-
-        if (memcmp("TAG", tag_bytes, 3) == 0) {
-            printf("ID3v1\n");
-            handle_id3v1(fd);
+        if (in == 'y') {
+            // The tag and its padding are created by the commit
+            handle_id3v2(&at);
         } else {
-
-            // Should we add tags?
-            char in = 0;
+            in = 0;
             while (in != 'n' && in != 'y') {
-                printf("Add ID3v2 Tags? (y/n): ");
+                printf("Add ID3v1 Tags? (y/n): ");
                 std::cin >> in;
             }
             if (in == 'y') {
-                uint8_t id3v2_header[10] = {'I','D','3',3,0,0, 0, 0, 0x1f, 0x76};
-                add_bytes_at(fd, 10, id3v2_header, 0, argv[argc - 1]);
-                handle_id3v2(fd, argv[argc - 1], 0);
-                off_t curr = lseek(fd, 0, SEEK_CUR);
-
-                // ID3v2 recommends adding padding to prevent having to rewrite large mp3s
-                uint32_t bytes_to_write = 4096 - curr;
-
-                uint8_t* zeroes = (uint8_t*) malloc(bytes_to_write);
-                memset(zeroes, 0, bytes_to_write);
-
-                // Add padding
-                add_bytes(fd, bytes_to_write, zeroes, argv[argc - 1]);
-            } else {
-                in = 0;
-                while (in != 'n' && in != 'y') {
-                    printf("Add ID3v1 Tags? (y/n): ");
-                    std::cin >> in;
-                }
-                if (in == 'y') {
-                    char id3_frame[128] = {'T', 'A', 'G'};
-                    add_bytes_at(fd, 128, (uint8_t*) id3_frame, end ,argv[argc - 1]);
-                    lseek(fd, end + 3, SEEK_SET);
-                    handle_id3v1(fd);
-                }
+                off_t end = lseek(at.fd, 0, SEEK_END);
+                char id3_frame[128] = {'T', 'A', 'G'};
+                add_bytes_at(at.fd, 128, (uint8_t*) id3_frame, end, at.path, &syncer);
+                memset(&v1, 0, sizeof(v1));
+                handle_id3v1(at.fd, end + 3, &v1);
             }
         }
     }
 
     // Close the file and return
-    close(fd);
-    return 0;
-}
\ No newline at end of file
+    int ret = fileio_sync(&syncer, at.fd) == 0 && fileio_sync_flush(&syncer) == 0 ? 0 : 4;
+    audiotag_close(&at);
+    return ret;
+}
@@ -0,0 +1,281 @@
+#include "batch.hh"
+#include "iostat.hh"
+#include "libaudiotag.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+/**********************************************
+ *  batch_is_mp3:
+ *    returns whether name ends in .mp3.
+ **********************************************/
+int batch_is_mp3(const char* name) {
+    size_t n = strlen(name);
+    return n >= 4 && strcasecmp(name + n - 4, ".mp3") == 0;
+}
+
+/**********************************************
+ *  batch_collect:
+ *    appends path to files if it is an mp3
+ *  file, or every mp3 file below it if it is a
+ *  directory. Returns -1 if path could not be
+ *  read.
+ **********************************************/
+int batch_collect(const char* path, std::vector<std::string>& files) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return 0;
+    }
+
+    // Walk the tree with an explicit stack of directories
+    std::vector<std::string> dirs(1, path);
+    while (!dirs.empty()) {
+        std::string dir = dirs.back();
+        dirs.pop_back();
+
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr) {
+            fprintf(stderr, "%s: could not open directory\n", dir.c_str());
+            continue;
+        }
+        struct dirent* ent;
+        while ((ent = readdir(d)) != nullptr) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            std::string child = dir + "/" + ent->d_name;
+            unsigned char type = ent->d_type;
+
+            // Not every filesystem fills in d_type
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                type = DT_UNKNOWN;
+                if (stat(child.c_str(), &st) == 0) {
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+            if (type == DT_DIR && ent->d_type != DT_LNK) {
+                dirs.push_back(child);
+            } else if (type == DT_REG && batch_is_mp3(ent->d_name)) {
+                files.push_back(child);
+            }
+        }
+        closedir(d);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  batch_collect_list:
+ *    runs batch_collect on each line of the
+ *  file list at list ("-" reads stdin).
+ *  Returns -1 if the list could not be read.
+ **********************************************/
+int batch_collect_list(const char* list, std::vector<std::string>& files) {
+    FILE* f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (f == nullptr) {
+        return -1;
+    }
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = 0;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (batch_collect(line, files) != 0) {
+            fprintf(stderr, "%s: could not open file\n", line);
+        }
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  batch_load_rules:
+ *    appends the rules in the rules file at
+ *  path. Each line is ID=text to set a frame or
+ *  a bare ID to remove it; # starts a comment.
+ *  Returns -1 on a read or syntax error.
+ **********************************************/
+int batch_load_rules(const char* path, std::vector<id3_2_rule_t>& rules) {
+    FILE* f = fopen(path, "r");
+    if (f == nullptr) {
+        return -1;
+    }
+    int ret = 0;
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = 0;
+        }
+        if (n == 0 || line[0] == '#') {
+            continue;
+        }
+
+        id3_2_rule_t rule;
+        if (n == 4) {
+            rule.text = nullptr;
+        } else if (n >= 5 && line[4] == '=') {
+            // Rules live for the whole run
+            rule.text = strdup(line + 5);
+        } else {
+            ret = -1;
+            break;
+        }
+        memcpy(rule.id, line, 4);
+        rules.push_back(rule);
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+/**********************************************
+ *  batch_tag_init:
+ *    sets up bc to apply num_rules rules with
+ *  opts and no commits counted.
+ **********************************************/
+void batch_tag_init(batch_tag_ctx_t* bc, const id3_2_rule_t* rules, size_t num_rules, const audiotag_opts_t* opts) {
+    bc->rules = rules;
+    bc->num_rules = num_rules;
+    bc->opts = opts;
+    bc->in_place = 0;
+    bc->grown = 0;
+    bc->rewritten = 0;
+    bc->shrunk = 0;
+}
+
+/**********************************************
+ *  batch_tag_file:
+ *    applies the rules of bc to the ID3v2 tag
+ *  of path with a single commit and counts how
+ *  it was served. Returns a batch_err_t.
+ **********************************************/
+int batch_tag_file(const char* path, batch_tag_ctx_t* bc) {
+    audiotag_t at;
+    int ret = audiotag_open(&at, path, 1, bc->opts);
+    if (ret != BATCH_OK) {
+        return ret;
+    }
+    ret = audiotag_apply(&at, bc->rules, bc->num_rules);
+    if (ret == BATCH_OK) {
+        ret = audiotag_commit(&at);
+    }
+    if (ret == BATCH_OK) {
+        switch (at.tx.outcome) {
+            case ID3_2_EDIT_IN_PLACE:
+                bc->in_place.fetch_add(1);
+                break;
+            case ID3_2_EDIT_GROWN:
+                bc->grown.fetch_add(1);
+                break;
+            case ID3_2_EDIT_REWRITTEN:
+                bc->rewritten.fetch_add(1);
+                break;
+            default:
+                break;
+        }
+        bc->shrunk.fetch_add(at.tx.shrunk);
+    }
+    audiotag_close(&at);
+    return ret;
+}
+
+/**********************************************
+ *  batch_tag_worker:
+ *    batch_fn_t that runs batch_tag_file with
+ *  the batch_tag_ctx_t in ctx.
+ **********************************************/
+int batch_tag_worker(const char* path, size_t idx, unsigned worker, void* ctx) {
+    return batch_tag_file(path, (batch_tag_ctx_t*) ctx);
+}
+
+/**********************************************
+ *  batch_workers:
+ *    returns num_workers, or the number of
+ *  cores if num_workers is 0.
+ **********************************************/
+unsigned batch_workers(unsigned num_workers) {
+    if (num_workers == 0) {
+        num_workers = std::thread::hardware_concurrency();
+    }
+    return num_workers ? num_workers : 1;
+}
+
+/**********************************************
+ *  batch_run:
+ *    calls fn on every file across a pool of
+ *  num_workers threads (0 for one per core).
+ *  Failures are reported on stderr and do not
+ *  stop the run. If the calling thread is
+ *  attached to an iostat sink, every worker
+ *  reports its I/O counters and the time each
+ *  file took to it. Returns the number of
+ *  files that failed.
+ **********************************************/
+size_t batch_run(const std::vector<std::string>& files, unsigned num_workers, batch_fn_t fn, void* ctx) {
+    num_workers = batch_workers(num_workers);
+    if (num_workers > files.size()) {
+        num_workers = files.size() ? files.size() : 1;
+    }
+
+    // Workers pull the next file from a shared counter
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    auto start = std::chrono::steady_clock::now();
+
+    // Workers report their counters and per-file latency to the
+    // sink of the calling thread, if it has one
+    iostat_sink_t* sink = iostat_attached();
+
+    auto work = [&](unsigned worker) {
+        std::vector<uint64_t> latency;
+        iostat_attach(sink);
+        size_t i;
+        while ((i = next.fetch_add(1)) < files.size()) {
+            int64_t began = sink ? iostat_now() : 0;
+            int err = fn(files[i].c_str(), i, worker, ctx);
+            if (sink) {
+                latency.push_back(iostat_now() - began);
+            }
+            if (err != BATCH_OK) {
+                fprintf(stderr, "%s: %s\n", files[i].c_str(), audiotag_strerror(err));
+                failed.fetch_add(1);
+            }
+        }
+        iostat_flush(latency.data(), latency.size());
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned w = 1; w < num_workers; ++w) {
+        pool.emplace_back(work, w);
+    }
+    work(0);
+    for (size_t w = 0; w < pool.size(); ++w) {
+        pool[w].join();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%zu files, %zu failed, %u workers, %.2fs (%.1f files/s)\n",
+            files.size(), failed.load(), num_workers, secs, secs > 0 ? files.size() / secs : 0.0);
+    return failed.load();
+}
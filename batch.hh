@@ -0,0 +1,113 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "tagedit.hh"
+#include "libaudiotag.hh"
+
+
+/**********************************************
+ *  batch_tag_ctx_t:
+ *    a scripted edit of many files: the rules,
+ *  how commits write, and how they were served
+ *  across all workers.
+ **********************************************/
+typedef struct batch_tag_ctx_t {
+    const id3_2_rule_t* rules;
+    size_t num_rules;
+    const audiotag_opts_t* opts;
+    std::atomic<size_t> in_place;   // frames fit in the existing tag
+    std::atomic<size_t> grown;      // blocks were inserted in front of the audio
+    std::atomic<size_t> rewritten;  // the whole file was rewritten
+    std::atomic<size_t> shrunk;     // excess padding was given back
+} batch_tag_ctx_t;
+
+/**********************************************
+ *  batch_fn_t:
+ *    work done for each file in a batch. idx
+ *  is the position of path in the file list,
+ *  worker is the index of the calling worker
+ *  thread and ctx is passed through from
+ *  batch_run. Returns a batch_err_t.
+ **********************************************/
+typedef int (*batch_fn_t)(const char* path, size_t idx, unsigned worker, void* ctx);
+
+/**********************************************
+ *  batch_is_mp3:
+ *    returns whether name ends in .mp3.
+ **********************************************/
+int batch_is_mp3(const char* name);
+
+/**********************************************
+ *  batch_collect:
+ *    appends path to files if it is an mp3
+ *  file, or every mp3 file below it if it is a
+ *  directory. Returns -1 if path could not be
+ *  read.
+ **********************************************/
+int batch_collect(const char* path, std::vector<std::string>& files);
+
+/**********************************************
+ *  batch_collect_list:
+ *    runs batch_collect on each line of the
+ *  file list at list ("-" reads stdin).
+ *  Returns -1 if the list could not be read.
+ **********************************************/
+int batch_collect_list(const char* list, std::vector<std::string>& files);
+
+/**********************************************
+ *  batch_load_rules:
+ *    appends the rules in the rules file at
+ *  path. Each line is ID=text to set a frame or
+ *  a bare ID to remove it; # starts a comment.
+ *  Returns -1 on a read or syntax error.
+ **********************************************/
+int batch_load_rules(const char* path, std::vector<id3_2_rule_t>& rules);
+
+/**********************************************
+ *  batch_tag_init:
+ *    sets up bc to apply num_rules rules with
+ *  opts (null for the defaults) and no commits
+ *  counted.
+ **********************************************/
+void batch_tag_init(batch_tag_ctx_t* bc, const id3_2_rule_t* rules, size_t num_rules, const audiotag_opts_t* opts);
+
+/**********************************************
+ *  batch_tag_file:
+ *    applies the rules of bc to the ID3v2 tag
+ *  of path with a single commit and counts how
+ *  it was served. Returns a batch_err_t.
+ **********************************************/
+int batch_tag_file(const char* path, batch_tag_ctx_t* bc);
+
+/**********************************************
+ *  batch_tag_worker:
+ *    batch_fn_t that runs batch_tag_file with
+ *  the batch_tag_ctx_t in ctx.
+ **********************************************/
+int batch_tag_worker(const char* path, size_t idx, unsigned worker, void* ctx);
+
+/**********************************************
+ *  batch_workers:
+ *    returns num_workers, or the number of
+ *  cores if num_workers is 0.
+ **********************************************/
+unsigned batch_workers(unsigned num_workers);
+
+/**********************************************
+ *  batch_run:
+ *    calls fn on every file across a pool of
+ *  num_workers threads (0 for one per core).
+ *  Failures are reported on stderr and do not
+ *  stop the run. If the calling thread is
+ *  attached to an iostat sink, every worker
+ *  reports its I/O counters and the time each
+ *  file took to it. Returns the number of
+ *  files that failed.
+ **********************************************/
+size_t batch_run(const std::vector<std::string>& files, unsigned num_workers, batch_fn_t fn, void* ctx);
+
+#endif
@@ -0,0 +1,360 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+#include "fileio.hh"
+#include "id3.hh"
+#include "tagedit.hh"
+#include "batch.hh"
+#include "dump.hh"
+#include "libaudiotag.hh"
+
+/**********************************************
+ *  bench_opts_t:
+ *    shape of the synthetic corpus.
+ **********************************************/
+typedef struct bench_opts_t {
+    const char* dir;
+    size_t num_files;
+    size_t audio_sz;        // bytes of MPEG frames per file
+    size_t num_frames;      // text frames per tag
+    size_t apic_sz;         // bytes of cover art, 0 for none
+    size_t padding;         // bytes of tag padding
+    int version;            // 1 or 2
+    unsigned num_workers;
+} bench_opts_t;
+
+/**********************************************
+ *  io_counters_t:
+ *    the process I/O counters from
+ *  /proc/self/io.
+ **********************************************/
+typedef struct io_counters_t {
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long syscr;
+    unsigned long long syscw;
+} io_counters_t;
+
+// Text frames cycled through by the generator
+static const char* text_ids[] = {"TIT2", "TPE1", "TALB", "TYER", "TRCK", "TCOM", "TCON", "TPE2"};
+#define NUM_TEXT_IDS (sizeof(text_ids) / sizeof(text_ids[0]))
+
+/**********************************************
+ *  read_io:
+ *    fills c from /proc/self/io, or zeros it
+ *  if the counters are unavailable.
+ **********************************************/
+static void read_io(io_counters_t* c) {
+    memset(c, 0, sizeof(*c));
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f == nullptr) {
+        return;
+    }
+    char name[32];
+    unsigned long long val;
+    while (fscanf(f, "%31[^:]: %llu\n", name, &val) == 2) {
+        if (strcmp(name, "rchar") == 0) {
+            c->rchar = val;
+        } else if (strcmp(name, "wchar") == 0) {
+            c->wchar = val;
+        } else if (strcmp(name, "syscr") == 0) {
+            c->syscr = val;
+        } else if (strcmp(name, "syscw") == 0) {
+            c->syscw = val;
+        }
+    }
+    fclose(f);
+}
+
+/**********************************************
+ *  put_frame:
+ *    appends an ID3v2 frame id with body of
+ *  sz bytes to out.
+ **********************************************/
+static void put_frame(std::string& out, const char* id, const std::string& body) {
+    uint32_t sz = flip_endianness(body.size());
+    out.append(id, 4);
+    out.append((const char*) &sz, 4);
+    out.append(2, '\0');
+    out += body;
+}
+
+/**********************************************
+ *  generate_file:
+ *    writes one synthetic mp3 file of the
+ *  shape in opts to path. Returns 0 on success.
+ **********************************************/
+static int generate_file(const char* path, size_t n, const bench_opts_t* opts) {
+    std::string data;
+
+    if (opts->version == 2) {
+        std::string frames;
+        for (size_t i = 0; i < opts->num_frames; ++i) {
+            std::string body(1, '\0');
+            body += "Value " + std::to_string(n) + "." + std::to_string(i);
+            put_frame(frames, text_ids[i % NUM_TEXT_IDS], body);
+        }
+        if (opts->apic_sz) {
+            std::string body("\0image/jpeg\0\3\0", 14);
+            body.append(opts->apic_sz, '\xa5');
+            put_frame(frames, "APIC", body);
+        }
+        frames.append(opts->padding, '\0');
+
+        uint8_t header[10] = {'I', 'D', '3', 3, 0, 0};
+        put_id3_2_tag_size(header, frames.size());
+        data.append((const char*) header, 10);
+        data += frames;
+    }
+
+    // MPEG-1 Layer III, 128 kbps, 44.1 kHz frames
+    static const uint8_t sync[4] = {0xff, 0xfb, 0x90, 0x64};
+    size_t start = data.size();
+    while (data.size() - start < opts->audio_sz) {
+        size_t left = opts->audio_sz - (data.size() - start);
+        size_t frame = left < 417 ? left : 417;
+        data.append((const char*) sync, frame < 4 ? frame : 4);
+        if (frame > 4) {
+            data.append(frame - 4, (char) (n + frame));
+        }
+    }
+
+    if (opts->version == 1) {
+        char v1[128];
+        memset(v1, 0, sizeof(v1));
+        memcpy(v1, "TAG", 3);
+        snprintf(v1 + 3, 30, "Title %zu", n);
+        snprintf(v1 + 33, 30, "Artist %zu", n);
+        snprintf(v1 + 63, 30, "Album %zu", n);
+        memcpy(v1 + 93, "2001", 4);
+        v1[126] = n % 100;
+        data.append(v1, 128);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = write(fd, data.data(), data.size());
+    close(fd);
+    return ret == (ssize_t) data.size() ? 0 : -1;
+}
+
+/**********************************************
+ *  report:
+ *    prints one benchmark result as a JSON
+ *  line: throughput, syscalls and bytes moved
+ *  between before and after.
+ **********************************************/
+static void report(const char* name, const bench_opts_t* opts, size_t files, double secs,
+                   const io_counters_t* before, const io_counters_t* after) {
+    printf("{\"bench\":\"%s\",\"files\":%zu,\"audio_bytes\":%zu,\"frames\":%zu,\"apic_bytes\":%zu,"
+           "\"padding\":%zu,\"version\":%d,\"workers\":%u,\"secs\":%.6f,\"files_per_sec\":%.1f,"
+           "\"read_syscalls\":%llu,\"write_syscalls\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu}\n",
+           name, files, opts->audio_sz, opts->num_frames, opts->apic_sz, opts->padding, opts->version,
+           batch_workers(opts->num_workers), secs, secs > 0 ? files / secs : 0.0,
+           after->syscr - before->syscr, after->syscw - before->syscw,
+           after->rchar - before->rchar, after->wchar - before->wchar);
+    fflush(stdout);
+}
+
+/**********************************************
+ *  bench_parse:
+ *    reads and decodes every tag on one thread.
+ **********************************************/
+static int bench_parse(const std::vector<std::string>& files) {
+    std::vector<id3_frame_text_t> frames;
+    for (size_t i = 0; i < files.size(); ++i) {
+        int fd = open(files[i].c_str(), O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        id3_tag_t tag;
+        if (id3_read_tag(fd, &tag) != 0) {
+            close(fd);
+            return -1;
+        }
+        frames.clear();
+        id3_decode_frames(&tag, frames);
+        id3_free_tag(&tag);
+        close(fd);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  bench_edit:
+ *    sets TIT2 on every file through an edit
+ *  transaction with text of text_sz bytes.
+ **********************************************/
+static int bench_edit(const std::vector<std::string>& files, size_t text_sz) {
+    std::string text(text_sz, 'e');
+    for (size_t i = 0; i < files.size(); ++i) {
+        audiotag_t at;
+        int err = audiotag_open(&at, files[i].c_str(), 1, nullptr);
+        if (err != BATCH_OK) {
+            return -1;
+        }
+        err = audiotag_set(&at, "TIT2", text.c_str());
+        if (err == BATCH_OK) {
+            err = audiotag_commit(&at);
+        }
+        audiotag_close(&at);
+        if (err != BATCH_OK) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************
+ *  bench_rewrite:
+ *    inserts and then removes 10 bytes at the
+ *  start of the audio with add_bytes and
+ *  remove_bytes, i.e. two full rewrites per
+ *  file that leave it unchanged.
+ **********************************************/
+static int bench_rewrite(const std::vector<std::string>& files) {
+    uint8_t buf[10];
+    memset(buf, 0, sizeof(buf));
+    for (size_t i = 0; i < files.size(); ++i) {
+        char* path = (char*) files[i].c_str();
+        int fd = open(path, O_RDWR);
+        if (fd < 0) {
+            return -1;
+        }
+        id3_tag_t tag;
+        if (id3_read_tag(fd, &tag) != 0) {
+            close(fd);
+            return -1;
+        }
+        off_t off = tag.version == ID3_V2 ? 10 + tag.tag_sz : 0;
+        id3_free_tag(&tag);
+
+        add_bytes_at(fd, sizeof(buf), buf, off, path, nullptr);
+        remove_bytes_at(fd, sizeof(buf), off, path, nullptr);
+        close(fd);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  usage:
+ *    prints the command line usage and
+ *  returns the exit code for bad arguments.
+ **********************************************/
+static int usage() {
+    std::cerr << "Usage: ./audiobench [-d dir] [-n files] [-a audio_bytes] [-f frames] [-p apic_bytes]\n"
+              << "                    [-P padding] [-v 1|2] [-j workers]\n";
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    bench_opts_t opts;
+    opts.dir = "bench_corpus";
+    opts.num_files = 200;
+    opts.audio_sz = 4 * 1024 * 1024;
+    opts.num_frames = 8;
+    opts.apic_sz = 0;
+    opts.padding = 2048;
+    opts.version = 2;
+    opts.num_workers = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:a:f:p:P:v:j:")) != -1) {
+        switch (opt) {
+            case 'd': opts.dir = optarg; break;
+            case 'n': opts.num_files = strtoull(optarg, nullptr, 10); break;
+            case 'a': opts.audio_sz = strtoull(optarg, nullptr, 10); break;
+            case 'f': opts.num_frames = strtoull(optarg, nullptr, 10); break;
+            case 'p': opts.apic_sz = strtoull(optarg, nullptr, 10); break;
+            case 'P': opts.padding = strtoull(optarg, nullptr, 10); break;
+            case 'v': opts.version = atoi(optarg); break;
+            case 'j': opts.num_workers = atoi(optarg); break;
+            default: return usage();
+        }
+    }
+    if (optind != argc || (opts.version != 1 && opts.version != 2)) {
+        return usage();
+    }
+
+    mkdir(opts.dir, S_IRWXU);
+    std::vector<std::string> files;
+    for (size_t i = 0; i < opts.num_files; ++i) {
+        files.push_back(std::string(opts.dir) + "/track" + std::to_string(i) + ".mp3");
+    }
+
+    io_counters_t before, after;
+    auto start = std::chrono::steady_clock::now();
+    auto lap = [&](const char* name) {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        read_io(&after);
+        report(name, &opts, files.size(), secs, &before, &after);
+        read_io(&before);
+        start = std::chrono::steady_clock::now();
+    };
+
+    read_io(&before);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (generate_file(files[i].c_str(), i, &opts) != 0) {
+            std::cerr << "Could not write " << files[i] << "\n";
+            return 2;
+        }
+    }
+    lap("generate");
+
+    if (bench_parse(files) != 0) {
+        std::cerr << "parse failed\n";
+        return 3;
+    }
+    lap("parse");
+
+    // Scans run through the dump path with its output discarded
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (dump_run(files, opts.num_workers, DUMP_JSON, null_fd) != 0) {
+        std::cerr << "scan failed\n";
+        return 3;
+    }
+    lap("scan");
+
+    if (dump_run_uring(files, opts.num_workers, DUMP_JSON, null_fd) != 0) {
+        std::cerr << "io_uring scan failed\n";
+        return 3;
+    }
+    close(null_fd);
+    lap("scan_uring");
+
+    if (opts.version == 2) {
+        if (bench_edit(files, 4) != 0) {
+            std::cerr << "in-place edit failed\n";
+            return 3;
+        }
+        lap("edit_in_place");
+    }
+
+    if (bench_rewrite(files) != 0) {
+        std::cerr << "rewrite failed\n";
+        return 3;
+    }
+    lap("edit_full_rewrite");
+
+    // Outgrow the padding so the tag has to grow
+    if (bench_edit(files, opts.padding + 4096) != 0) {
+        std::cerr << "growing edit failed\n";
+        return 3;
+    }
+    lap("edit_grow");
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        unlink(files[i].c_str());
+    }
+    rmdir(opts.dir);
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include "catalog.hh"
+#include "batch.hh"
+#include "iostat.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+
+/**********************************************
+ *  catalog_rec_t:
+ *    the result of refreshing one file.
+ **********************************************/
+typedef struct catalog_rec_t {
+    struct stat st;
+    uint8_t ok;
+    uint8_t version;
+    uint8_t minor;
+    uint8_t hashed;
+    mpeg_info_t audio;
+    uint64_t payload_hash;
+    uint64_t payload_bytes;
+    std::string blob;
+} catalog_rec_t;
+
+/**********************************************
+ *  catalog_ctx_t:
+ *    state shared by the refresh workers.
+ **********************************************/
+typedef struct catalog_ctx_t {
+    const catalog_t* old;
+    int hash;               // hash the audio payload of every file
+    std::vector<catalog_rec_t> recs;
+    std::atomic<size_t> reused;
+} catalog_ctx_t;
+
+/**********************************************
+ *  catalog_open:
+ *    maps the catalog at path into cat.
+ *  Returns 0 on success and -1 if the file is
+ *  missing or not a catalog, or an entry
+ *  points outside its strings.
+ **********************************************/
+int catalog_open(const char* path, catalog_t* cat) {
+    memset(cat, 0, sizeof(*cat));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(catalog_header_t)) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    cat->map = (uint8_t*) map;
+    cat->map_sz = st.st_size;
+    cat->header = (const catalog_header_t*) map;
+    cat->entries = (const catalog_entry_t*) (cat->map + sizeof(catalog_header_t));
+    cat->strings = (const char*) (cat->entries + cat->header->num_entries);
+
+    // Check the layout before trusting any offsets
+    size_t entries_sz = cat->header->num_entries * sizeof(catalog_entry_t);
+    if (memcmp(cat->header->magic, CATALOG_MAGIC, 8) != 0 ||
+        cat->header->num_entries > (cat->map_sz - sizeof(catalog_header_t)) / sizeof(catalog_entry_t) ||
+        cat->header->strings_sz != cat->map_sz - sizeof(catalog_header_t) - entries_sz) {
+        catalog_close(cat);
+        return -1;
+    }
+    uint64_t strings_sz = cat->header->strings_sz;
+    for (uint64_t i = 0; i < cat->header->num_entries; ++i) {
+        const catalog_entry_t* e = &cat->entries[i];
+        if (e->path_off > strings_sz || e->path_len > strings_sz - e->path_off ||
+            e->frames_off > strings_sz || e->frames_len > strings_sz - e->frames_off) {
+            catalog_close(cat);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************
+ *  catalog_close:
+ *    unmaps cat.
+ **********************************************/
+void catalog_close(catalog_t* cat) {
+    if (cat->map) {
+        munmap(cat->map, cat->map_sz);
+    }
+    memset(cat, 0, sizeof(*cat));
+}
+
+/**********************************************
+ *  compare_path:
+ *    orders the path of entry e against the n
+ *  bytes of path like std::string does.
+ **********************************************/
+static int compare_path(const catalog_t* cat, const catalog_entry_t* e, const char* path, size_t n) {
+    size_t len = e->path_len < n ? e->path_len : n;
+    int c = memcmp(cat->strings + e->path_off, path, len);
+    if (c != 0) {
+        return c;
+    }
+    return e->path_len < n ? -1 : e->path_len > n ? 1 : 0;
+}
+
+/**********************************************
+ *  catalog_find:
+ *    returns the entry for path by binary
+ *  search, or nullptr if it is not indexed.
+ **********************************************/
+const catalog_entry_t* catalog_find(const catalog_t* cat, const char* path) {
+    if (cat->map == nullptr) {
+        return nullptr;
+    }
+    size_t n = strlen(path);
+    size_t lo = 0;
+    size_t hi = cat->header->num_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = compare_path(cat, &cat->entries[mid], path, n);
+        if (c == 0) {
+            return &cat->entries[mid];
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return nullptr;
+}
+
+/**********************************************
+ *  catalog_frame:
+ *    returns the text of frame id of entry e
+ *  and stores its length in len, or returns
+ *  nullptr if the entry has no such frame.
+ **********************************************/
+const char* catalog_frame(const catalog_t* cat, const catalog_entry_t* e, const char* id, uint32_t* len) {
+    const char* p = cat->strings + e->frames_off;
+    const char* end = p + e->frames_len;
+    while (end - p >= 8) {
+        uint32_t n;
+        memcpy(&n, p + 4, 4);
+        if (n > (size_t) (end - p - 8)) {
+            break;
+        }
+        if (memcmp(p, id, 4) == 0) {
+            *len = n;
+            return p + 8;
+        }
+        p += 8 + n;
+    }
+    return nullptr;
+}
+
+/**********************************************
+ *  catalog_frames:
+ *    appends every frame of entry e to frames.
+ **********************************************/
+void catalog_frames(const catalog_t* cat, const catalog_entry_t* e, std::vector<id3_frame_text_t>& frames) {
+    const char* p = cat->strings + e->frames_off;
+    const char* end = p + e->frames_len;
+    while (end - p >= 8) {
+        uint32_t n;
+        memcpy(&n, p + 4, 4);
+        if (n > (size_t) (end - p - 8)) {
+            break;
+        }
+        frames.push_back(std::make_pair(std::string(p, 4), std::string(p + 8, n)));
+        p += 8 + n;
+    }
+}
+
+/**********************************************
+ *  mtime_ns:
+ *    returns the mtime of st in nanoseconds.
+ **********************************************/
+static int64_t mtime_ns(const struct stat* st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/**********************************************
+ *  refresh_worker:
+ *    batch_fn_t that stats one file and either
+ *  reuses its old entry or parses its tag,
+ *  scans its audio and, if asked, hashes it.
+ **********************************************/
+static int refresh_worker(const char* path, size_t idx, unsigned worker, void* ctx) {
+    catalog_ctx_t* cc = (catalog_ctx_t*) ctx;
+    catalog_rec_t* rec = &cc->recs[idx];
+
+    if (stat(path, &rec->st) != 0) {
+        return BATCH_ERR_OPEN;
+    }
+
+    // Unchanged since the last run: copy the old entry
+    const catalog_entry_t* old = catalog_find(cc->old, path);
+    if (old && old->dev == (uint64_t) rec->st.st_dev && old->ino == (uint64_t) rec->st.st_ino &&
+        old->mtime_ns == mtime_ns(&rec->st) && old->size == (uint64_t) rec->st.st_size &&
+        (old->hashed || !cc->hash)) {
+        rec->version = old->version;
+        rec->minor = old->minor;
+        rec->audio = old->audio;
+        rec->hashed = old->hashed;
+        rec->payload_hash = old->payload_hash;
+        rec->payload_bytes = old->payload_bytes;
+        rec->blob.assign(cc->old->strings + old->frames_off, old->frames_len);
+        rec->ok = 1;
+        cc->reused.fetch_add(1);
+        return BATCH_OK;
+    }
+
+    int fd = iostat_open(path, O_RDONLY);
+    if (fd < 0) {
+        return BATCH_ERR_OPEN;
+    }
+    id3_tag_t tag;
+    int ret = id3_read_tag(fd, &tag);
+    if (ret != 0) {
+        close(fd);
+        return BATCH_ERR_READ;
+    }
+    mpeg_scan(fd, &tag, &rec->audio);
+    rec->hashed = 0;
+    if (cc->hash) {
+        if (mpeg_hash_payload(fd, &tag, &rec->payload_hash, &rec->payload_bytes) != 0) {
+            close(fd);
+            id3_free_tag(&tag);
+            return BATCH_ERR_READ;
+        }
+        rec->hashed = 1;
+    }
+    close(fd);
+
+    std::vector<id3_frame_text_t> frames;
+    if (id3_decode_frames(&tag, frames) != 0) {
+        id3_free_tag(&tag);
+        return BATCH_ERR_FORMAT;
+    }
+    rec->version = tag.version;
+    rec->minor = tag.data ? tag.data[3] : 0;
+    id3_free_tag(&tag);
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        uint32_t n = frames[i].second.size();
+        rec->blob.append(frames[i].first.data(), 4);
+        rec->blob.append((const char*) &n, 4);
+        rec->blob.append(frames[i].second);
+    }
+    rec->ok = 1;
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  catalog_refresh:
+ *    rebuilds the catalog at index for files,
+ *  re-parsing only files whose inode, mtime or
+ *  size changed since the last run, across
+ *  num_workers threads (0 for one per core),
+ *  hashing audio payloads if hash is set.
+ *  The new catalog replaces the old one
+ *  atomically. Returns the number of files
+ *  that failed, or -1 if the catalog could
+ *  not be written.
+ **********************************************/
+long catalog_refresh(const char* index, const std::vector<std::string>& files, unsigned num_workers, int hash) {
+    catalog_t old;
+    catalog_open(index, &old);
+
+    catalog_ctx_t ctx;
+    ctx.old = &old;
+    ctx.hash = hash;
+    ctx.recs.resize(files.size());
+    ctx.reused = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        ctx.recs[i].ok = 0;
+    }
+    size_t failed = batch_run(files, num_workers, refresh_worker, &ctx);
+    catalog_close(&old);
+
+    // Entries are sorted by path for lookups
+    std::vector<size_t> order;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (ctx.recs[i].ok) {
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return files[a] < files[b]; });
+    order.erase(std::unique(order.begin(), order.end(), [&](size_t a, size_t b) { return files[a] == files[b]; }), order.end());
+
+    std::vector<catalog_entry_t> entries(order.size());
+    std::string strings;
+    for (size_t i = 0; i < order.size(); ++i) {
+        const catalog_rec_t* rec = &ctx.recs[order[i]];
+        const std::string& path = files[order[i]];
+        catalog_entry_t* e = &entries[i];
+        memset(e, 0, sizeof(*e));
+        e->dev = rec->st.st_dev;
+        e->ino = rec->st.st_ino;
+        e->mtime_ns = mtime_ns(&rec->st);
+        e->size = rec->st.st_size;
+        e->version = rec->version;
+        e->minor = rec->minor;
+        e->audio = rec->audio;
+        e->hashed = rec->hashed;
+        e->payload_hash = rec->payload_hash;
+        e->payload_bytes = rec->payload_bytes;
+        e->path_off = strings.size();
+        e->path_len = path.size();
+        strings += path;
+        e->frames_off = strings.size();
+        e->frames_len = rec->blob.size();
+        strings += rec->blob;
+    }
+
+    catalog_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CATALOG_MAGIC, 8);
+    header.num_entries = entries.size();
+    header.strings_sz = strings.size();
+
+    // Write to a unique name next to the old catalog and swap it in
+    std::string tmp = std::string(index) + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        return -1;
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    FILE* f = fdopen(fd, "wb");
+    if (f == nullptr) {
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             (entries.empty() || fwrite(entries.data(), sizeof(catalog_entry_t), entries.size(), f) == entries.size()) &&
+             (strings.empty() || fwrite(strings.data(), strings.size(), 1, f) == 1);
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), index) != 0) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    fprintf(stderr, "%zu entries, %zu unchanged, %zu parsed\n",
+            entries.size(), ctx.reused.load(), entries.size() - ctx.reused.load());
+    return failed;
+}
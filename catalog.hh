@@ -0,0 +1,115 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "id3.hh"
+#include "mpeg.hh"
+
+#define CATALOG_MAGIC "ATCAT03"
+
+/**********************************************
+ *  The catalog file has the following format: 
+ *  HEADER - catalog_header_t
+ *  ENTRIES - num_entries catalog_entry_t,
+ *            sorted by path
+ *  STRINGS - strings_sz bytes of paths and
+ *            frame blobs referenced by the
+ *            entries
+ *  A frame blob is a run of frames, each an
+ *  ID (4 bytes), a length (4 bytes, native)
+ *  and that many bytes of UTF-8 text.
+ *  Everything is used straight from the
+ *  mapping without deserializing.
+ **********************************************/
+typedef struct catalog_header_t {
+    char magic[8];
+    uint64_t num_entries;
+    uint64_t strings_sz;
+} catalog_header_t;
+
+typedef struct catalog_entry_t {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+    uint64_t path_off;
+    uint64_t frames_off;
+    uint32_t path_len;
+    uint32_t frames_len;
+    uint8_t version;        // an id3_version_t
+    uint8_t minor;          // ID3v2 major version byte
+    uint8_t hashed;         // payload_hash and payload_bytes are set
+    uint8_t reserved[5];
+    mpeg_info_t audio;      // duration, bitrate and the like of the audio
+    uint64_t payload_hash;  // XXH64 of the audio between the tags
+    uint64_t payload_bytes;
+} catalog_entry_t;
+
+/**********************************************
+ *  catalog_t:
+ *    a catalog file mapped read-only.
+ **********************************************/
+typedef struct catalog_t {
+    uint8_t* map;
+    size_t map_sz;
+    const catalog_header_t* header;
+    const catalog_entry_t* entries;
+    const char* strings;
+} catalog_t;
+
+/**********************************************
+ *  catalog_open:
+ *    maps the catalog at path into cat.
+ *  Returns 0 on success and -1 if the file is
+ *  missing or not a catalog, or an entry
+ *  points outside its strings.
+ **********************************************/
+int catalog_open(const char* path, catalog_t* cat);
+
+/**********************************************
+ *  catalog_close:
+ *    unmaps cat.
+ **********************************************/
+void catalog_close(catalog_t* cat);
+
+/**********************************************
+ *  catalog_find:
+ *    returns the entry for path by binary
+ *  search, or nullptr if it is not indexed.
+ **********************************************/
+const catalog_entry_t* catalog_find(const catalog_t* cat, const char* path);
+
+/**********************************************
+ *  catalog_frame:
+ *    returns the text of frame id of entry e
+ *  and stores its length in len, or returns
+ *  nullptr if the entry has no such frame.
+ **********************************************/
+const char* catalog_frame(const catalog_t* cat, const catalog_entry_t* e, const char* id, uint32_t* len);
+
+/**********************************************
+ *  catalog_frames:
+ *    appends every frame of entry e to frames.
+ **********************************************/
+void catalog_frames(const catalog_t* cat, const catalog_entry_t* e, std::vector<id3_frame_text_t>& frames);
+
+/**********************************************
+ *  catalog_refresh:
+ *    rebuilds the catalog at index for files,
+ *  re-parsing only files whose inode, mtime or
+ *  size changed since the last run, across
+ *  num_workers threads (0 for one per core).
+ *  With hash, every entry also gets the hash
+ *  of its audio payload (mpeg_hash_payload),
+ *  which means reading each new file whole.
+ *  The new catalog replaces the old one
+ *  atomically. Returns the number of files
+ *  that failed, or -1 if the catalog could
+ *  not be written.
+ **********************************************/
+long catalog_refresh(const char* index, const std::vector<std::string>& files, unsigned num_workers, int hash);
+
+#endif
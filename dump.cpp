@@ -0,0 +1,458 @@
+#include "dump.hh"
+#include "batch.hh"
+#include "id3.hh"
+#include "iostat.hh"
+#include "uring.hh"
+#include "mpeg.hh"
+#include "xxh64.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+// Frames given their own CSV column, in order
+static const char* csv_ids[] = {"TIT2", "TPE1", "TALB", "TYER", "TRCK", "TCOM", "TCON"};
+#define NUM_CSV_IDS (sizeof(csv_ids) / sizeof(csv_ids[0]))
+
+// Audio columns after the frames
+#define CSV_AUDIO_COLUMNS "duration_ms,bitrate,sample_rate,channels"
+
+/**********************************************
+ *  dump_ctx_t:
+ *    state shared by the dump workers. Each
+ *  worker formats into its own scratch string.
+ **********************************************/
+typedef struct dump_ctx_t {
+    dump_format_t format;
+    dump_writer_t writer;
+    std::vector<std::string> scratch;
+} dump_ctx_t;
+
+/**********************************************
+ *  dump_writer_init:
+ *    sets up w to write to file descriptor fd.
+ **********************************************/
+void dump_writer_init(dump_writer_t* w, int fd) {
+    w->fd = fd;
+    w->buf.clear();
+    w->buf.reserve(DUMP_FLUSH_SIZE * 2);
+}
+
+/**********************************************
+ *  write_all:
+ *    writes all n bytes of buf to fd.
+ **********************************************/
+static void write_all(int fd, const char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t ret = write(fd, buf, n);
+        if (ret <= 0) {
+            return;
+        }
+        buf += ret;
+        n -= ret;
+    }
+}
+
+/**********************************************
+ *  dump_writer_append:
+ *    appends the n bytes of s to w, flushing
+ *  when the buffer is full.
+ **********************************************/
+void dump_writer_append(dump_writer_t* w, const char* s, size_t n) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    w->buf.append(s, n);
+    if (w->buf.size() >= DUMP_FLUSH_SIZE) {
+        write_all(w->fd, w->buf.data(), w->buf.size());
+        w->buf.clear();
+    }
+}
+
+/**********************************************
+ *  dump_writer_flush:
+ *    writes out everything buffered in w.
+ **********************************************/
+void dump_writer_flush(dump_writer_t* w) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    write_all(w->fd, w->buf.data(), w->buf.size());
+    w->buf.clear();
+}
+
+/**********************************************
+ *  dump_json_string:
+ *    appends the n bytes of s to out as a
+ *  quoted JSON string.
+ **********************************************/
+void dump_json_string(const char* s, size_t n, std::string& out) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+/**********************************************
+ *  dump_csv_field:
+ *    appends the n bytes of s to out as a CSV
+ *  field, quoting it when needed.
+ **********************************************/
+void dump_csv_field(const char* s, size_t n, std::string& out) {
+    // s need not be NUL-terminated, as catalog paths are not
+    size_t i = 0;
+    while (i < n && s[i] != ',' && s[i] != '"' && s[i] != '\r' && s[i] != '\n') {
+        ++i;
+    }
+    if (i == n) {
+        out.append(s, n);
+        return;
+    }
+    out += '"';
+    for (i = 0; i < n; ++i) {
+        if (s[i] == '"') {
+            out += '"';
+        }
+        out += s[i];
+    }
+    out += '"';
+}
+
+/**********************************************
+ *  dump_file:
+ *    opens path read-only, parses its tag
+ *  and scans its audio without prompting and
+ *  appends one JSON object or CSV row for it
+ *  to out. Returns a batch_err_t.
+ **********************************************/
+int dump_file(const char* path, dump_format_t format, std::string& out) {
+    int fd = iostat_open(path, O_RDONLY);
+    if (fd < 0) {
+        return BATCH_ERR_OPEN;
+    }
+
+    id3_tag_t tag;
+    int ret = id3_read_tag(fd, &tag);
+    if (ret != 0) {
+        close(fd);
+        return BATCH_ERR_READ;
+    }
+    mpeg_info_t audio;
+    mpeg_scan(fd, &tag, &audio);
+    close(fd);
+
+    ret = dump_tag(path, &tag, &audio, format, out);
+    id3_free_tag(&tag);
+    return ret;
+}
+
+/**********************************************
+ *  dump_tag:
+ *    appends one JSON object or CSV row for
+ *  the loaded tag and the audio of path to
+ *  out. Returns a batch_err_t,
+ *  BATCH_ERR_FORMAT for tags whose frames
+ *  cannot be read.
+ **********************************************/
+int dump_tag(const char* path, const id3_tag_t* tag, const mpeg_info_t* audio, dump_format_t format, std::string& out) {
+    std::vector<id3_frame_text_t> frames;
+    if (id3_decode_frames(tag, frames) != 0) {
+        return BATCH_ERR_FORMAT;
+    }
+    const char* version = id3_version_name(tag->version, tag->data ? tag->data[3] : 0);
+    dump_record(path, version, frames, audio, format, out);
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  put_json_audio:
+ *    appends audio to out as a JSON object, or
+ *  null if no MPEG audio was found.
+ **********************************************/
+static void put_json_audio(const mpeg_info_t* audio, std::string& out) {
+    if (audio == nullptr || audio->source == MPEG_NONE) {
+        out += "null";
+        return;
+    }
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"mpeg\":\"%s\",\"layer\":%u,\"duration_ms\":%u,\"bitrate\":%u,\"sample_rate\":%u,"
+             "\"channels\":%u,\"vbr\":%s,\"frames\":%u,\"delay\":%u,\"padding\":%u,\"source\":\"%s\"}",
+             mpeg_version_name(audio->version), audio->layer, audio->duration_ms, audio->bitrate,
+             audio->sample_rate, audio->channels, audio->vbr ? "true" : "false", audio->frames,
+             audio->delay, audio->padding, mpeg_source_name(audio->source));
+    out += buf;
+}
+
+/**********************************************
+ *  dump_record:
+ *    appends one JSON object or CSV row for
+ *  the decoded frames and the audio of path
+ *  to out.
+ **********************************************/
+void dump_record(const char* path, const char* version, const std::vector<id3_frame_text_t>& frames, const mpeg_info_t* audio, dump_format_t format, std::string& out) {
+    if (format == DUMP_JSON) {
+        out += "{\"path\":";
+        dump_json_string(path, strlen(path), out);
+        out += ",\"version\":";
+        if (version) {
+            dump_json_string(version, strlen(version), out);
+        } else {
+            out += "null";
+        }
+        out += ",\"frames\":{";
+        for (size_t i = 0; i < frames.size(); ++i) {
+            if (i) {
+                out += ',';
+            }
+            dump_json_string(frames[i].first.data(), 4, out);
+            out += ':';
+            dump_json_string(frames[i].second.data(), frames[i].second.size(), out);
+        }
+        out += "},\"audio\":";
+        put_json_audio(audio, out);
+        out += "}\n";
+    } else {
+        dump_csv_field(path, strlen(path), out);
+        out += ',';
+        if (version) {
+            out += version;
+        }
+        for (size_t c = 0; c < NUM_CSV_IDS; ++c) {
+            out += ',';
+            for (size_t i = 0; i < frames.size(); ++i) {
+                if (frames[i].first == csv_ids[c]) {
+                    dump_csv_field(frames[i].second.data(), frames[i].second.size(), out);
+                    break;
+                }
+            }
+        }
+        if (audio && audio->source != MPEG_NONE) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), ",%u,%u,%u,%u", audio->duration_ms, audio->bitrate,
+                     audio->sample_rate, audio->channels);
+            out += buf;
+        } else {
+            out += ",,,,";
+        }
+        out += '\n';
+    }
+}
+
+/**********************************************
+ *  dump_worker:
+ *    batch_fn_t that dumps one file through
+ *  the dump_ctx_t in ctx.
+ **********************************************/
+static int dump_worker(const char* path, size_t idx, unsigned worker, void* ctx) {
+    dump_ctx_t* dump = (dump_ctx_t*) ctx;
+    std::string& out = dump->scratch[worker];
+    out.clear();
+    int err = dump_file(path, dump->format, out);
+    if (err == BATCH_OK) {
+        dump_writer_append(&dump->writer, out.data(), out.size());
+    }
+    return err;
+}
+
+/**********************************************
+ *  dump_header:
+ *    writes the CSV header row to w.
+ **********************************************/
+static void dump_header(dump_writer_t* w, dump_format_t format) {
+    if (format == DUMP_CSV) {
+        std::string header = "path,version";
+        for (size_t c = 0; c < NUM_CSV_IDS; ++c) {
+            header += ',';
+            header += csv_ids[c];
+        }
+        header += "," CSV_AUDIO_COLUMNS "\n";
+        dump_writer_append(w, header.data(), header.size());
+    }
+}
+
+/**********************************************
+ *  dump_run:
+ *    dumps every file to fd in format across
+ *  num_workers threads (0 for one per core).
+ *  Returns the number of files that failed.
+ **********************************************/
+size_t dump_run(const std::vector<std::string>& files, unsigned num_workers, dump_format_t format, int fd) {
+    dump_ctx_t ctx;
+    ctx.format = format;
+    dump_writer_init(&ctx.writer, fd);
+    ctx.scratch.resize(batch_workers(num_workers));
+
+    dump_header(&ctx.writer, format);
+    size_t failed = batch_run(files, num_workers, dump_worker, &ctx);
+    dump_writer_flush(&ctx.writer);
+    return failed;
+}
+
+/**********************************************
+ *  dump_uring_tag:
+ *    uring_tag_fn_t that dumps one loaded tag
+ *  through the dump_ctx_t in ctx.
+ **********************************************/
+static int dump_uring_tag(const char* path, size_t idx, int err, const id3_tag_t* tag, const mpeg_info_t* audio, void* ctx) {
+    dump_ctx_t* dump = (dump_ctx_t*) ctx;
+    if (err != BATCH_OK) {
+        return err;
+    }
+    std::string& out = dump->scratch[0];
+    out.clear();
+    err = dump_tag(path, tag, audio, dump->format, out);
+    if (err != BATCH_OK) {
+        return err;
+    }
+    dump_writer_append(&dump->writer, out.data(), out.size());
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  dump_run_uring:
+ *    dump_run with all file I/O queued on one
+ *  io_uring by a single thread. Falls back to
+ *  dump_run with num_workers threads when
+ *  io_uring is unavailable.
+ **********************************************/
+size_t dump_run_uring(const std::vector<std::string>& files, unsigned num_workers, dump_format_t format, int fd) {
+    dump_ctx_t ctx;
+    ctx.format = format;
+    dump_writer_init(&ctx.writer, fd);
+    ctx.scratch.resize(1);
+
+    dump_header(&ctx.writer, format);
+    long failed = uring_scan(files, dump_uring_tag, &ctx);
+    if (failed < 0) {
+        // Nothing was read; the thread pool starts over with its own header
+        ctx.writer.buf.clear();
+        return dump_run(files, num_workers, format, fd);
+    }
+    dump_writer_flush(&ctx.writer);
+    return failed;
+}
+
+/**********************************************
+ *  dump_catalog:
+ *    dumps entries of cat to fd in format
+ *  without touching the audio files: every
+ *  entry, or only those for paths if it is
+ *  not empty. Returns the number of paths
+ *  missing from the catalog.
+ **********************************************/
+size_t dump_catalog(const catalog_t* cat, const std::vector<std::string>& paths, dump_format_t format, int fd) {
+    dump_writer_t writer;
+    dump_writer_init(&writer, fd);
+    dump_header(&writer, format);
+
+    size_t missing = 0;
+    size_t n = paths.empty() ? cat->header->num_entries : paths.size();
+    std::string out;
+    std::vector<id3_frame_text_t> frames;
+    for (size_t i = 0; i < n; ++i) {
+        const catalog_entry_t* e = &cat->entries[i];
+        if (!paths.empty()) {
+            e = catalog_find(cat, paths[i].c_str());
+            if (e == nullptr) {
+                fprintf(stderr, "%s: not in catalog\n", paths[i].c_str());
+                ++missing;
+                continue;
+            }
+        }
+        std::string path(cat->strings + e->path_off, e->path_len);
+        frames.clear();
+        catalog_frames(cat, e, frames);
+        out.clear();
+        dump_record(path.c_str(), id3_version_name(e->version, e->minor), frames, &e->audio, format, out);
+        dump_writer_append(&writer, out.data(), out.size());
+    }
+    dump_writer_flush(&writer);
+    return missing;
+}
+
+/**********************************************
+ *  dump_dupes:
+ *    sorts the hashed entries of cat by hash
+ *  and writes each run of two or more to fd.
+ *  Returns the number of entries without a
+ *  hash.
+ **********************************************/
+size_t dump_dupes(const catalog_t* cat, dump_format_t format, int fd) {
+    dump_writer_t writer;
+    dump_writer_init(&writer, fd);
+    if (format == DUMP_CSV) {
+        static const char header[] = "hash,bytes,path\n";
+        dump_writer_append(&writer, header, sizeof(header) - 1);
+    }
+
+    size_t unhashed = 0;
+    std::vector<const catalog_entry_t*> order;
+    for (size_t i = 0; i < cat->header->num_entries; ++i) {
+        const catalog_entry_t* e = &cat->entries[i];
+        if (!e->hashed) {
+            ++unhashed;
+        } else if (e->payload_bytes > 0) {
+            order.push_back(e);
+        }
+    }
+    std::sort(order.begin(), order.end(), [](const catalog_entry_t* a, const catalog_entry_t* b) {
+        if (a->payload_hash != b->payload_hash) {
+            return a->payload_hash < b->payload_hash;
+        }
+        return a->payload_bytes < b->payload_bytes;
+    });
+
+    std::string out;
+    for (size_t i = 0; i < order.size();) {
+        size_t j = i + 1;
+        while (j < order.size() && order[j]->payload_hash == order[i]->payload_hash &&
+               order[j]->payload_bytes == order[i]->payload_bytes) {
+            ++j;
+        }
+        if (j - i > 1) {
+            char hex[XXH64_HEX_SIZE + 1];
+            xxh64_hex(order[i]->payload_hash, hex);
+            char bytes[32];
+            snprintf(bytes, sizeof(bytes), "%llu", (unsigned long long) order[i]->payload_bytes);
+            out.clear();
+            if (format == DUMP_JSON) {
+                out += "{\"hash\":\"";
+                out += hex;
+                out += "\",\"bytes\":";
+                out += bytes;
+                out += ",\"paths\":[";
+                for (size_t k = i; k < j; ++k) {
+                    if (k > i) {
+                        out += ',';
+                    }
+                    dump_json_string(cat->strings + order[k]->path_off, order[k]->path_len, out);
+                }
+                out += "]}\n";
+            } else {
+                for (size_t k = i; k < j; ++k) {
+                    out += hex;
+                    out += ',';
+                    out += bytes;
+                    out += ',';
+                    dump_csv_field(cat->strings + order[k]->path_off, order[k]->path_len, out);
+                    out += '\n';
+                }
+            }
+            dump_writer_append(&writer, out.data(), out.size());
+        }
+        i = j;
+    }
+    dump_writer_flush(&writer);
+    return unhashed;
+}
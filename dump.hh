@@ -0,0 +1,131 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "id3.hh"
+#include "catalog.hh"
+#include "mpeg.hh"
+
+// Output is flushed once the writer holds this many bytes
+#define DUMP_FLUSH_SIZE (256 * 1024)
+
+typedef enum {
+    DUMP_JSON,
+    DUMP_CSV,
+} dump_format_t;
+
+/**********************************************
+ *  dump_writer_t:
+ *    a buffered writer shared by the dump
+ *  workers. Records are appended whole under
+ *  the lock and written out in large blocks.
+ **********************************************/
+typedef struct dump_writer_t {
+    int fd;
+    std::mutex lock;
+    std::string buf;
+} dump_writer_t;
+
+/**********************************************
+ *  dump_writer_init:
+ *    sets up w to write to file descriptor fd.
+ **********************************************/
+void dump_writer_init(dump_writer_t* w, int fd);
+
+/**********************************************
+ *  dump_writer_append:
+ *    appends the n bytes of s to w, flushing
+ *  when the buffer is full.
+ **********************************************/
+void dump_writer_append(dump_writer_t* w, const char* s, size_t n);
+
+/**********************************************
+ *  dump_writer_flush:
+ *    writes out everything buffered in w.
+ **********************************************/
+void dump_writer_flush(dump_writer_t* w);
+
+/**********************************************
+ *  dump_json_string:
+ *    appends the n bytes of s to out as a
+ *  quoted JSON string.
+ **********************************************/
+void dump_json_string(const char* s, size_t n, std::string& out);
+
+/**********************************************
+ *  dump_csv_field:
+ *    appends the n bytes of s to out as a CSV
+ *  field, quoting it when needed.
+ **********************************************/
+void dump_csv_field(const char* s, size_t n, std::string& out);
+
+/**********************************************
+ *  dump_file:
+ *    opens path read-only, parses its tag
+ *  without prompting and appends one JSON
+ *  object or CSV row for it to out. Returns
+ *  a batch_err_t.
+ **********************************************/
+int dump_file(const char* path, dump_format_t format, std::string& out);
+
+/**********************************************
+ *  dump_tag:
+ *    appends one JSON object or CSV row for
+ *  the loaded tag and the audio of path to
+ *  out. Returns a batch_err_t,
+ *  BATCH_ERR_FORMAT for tags whose frames
+ *  cannot be read.
+ **********************************************/
+int dump_tag(const char* path, const id3_tag_t* tag, const mpeg_info_t* audio, dump_format_t format, std::string& out);
+
+/**********************************************
+ *  dump_record:
+ *    appends one JSON object or CSV row for
+ *  the decoded frames and the audio of path
+ *  to out.
+ **********************************************/
+void dump_record(const char* path, const char* version, const std::vector<id3_frame_text_t>& frames, const mpeg_info_t* audio, dump_format_t format, std::string& out);
+
+/**********************************************
+ *  dump_run:
+ *    dumps every file to fd in format across
+ *  num_workers threads (0 for one per core).
+ *  Returns the number of files that failed.
+ **********************************************/
+size_t dump_run(const std::vector<std::string>& files, unsigned num_workers, dump_format_t format, int fd);
+
+/**********************************************
+ *  dump_run_uring:
+ *    dump_run with all file I/O queued on one
+ *  io_uring by a single thread, with up to
+ *  URING_QUEUE_DEPTH files in flight. Falls
+ *  back to dump_run with num_workers threads
+ *  when io_uring is unavailable.
+ **********************************************/
+size_t dump_run_uring(const std::vector<std::string>& files, unsigned num_workers, dump_format_t format, int fd);
+
+/**********************************************
+ *  dump_catalog:
+ *    dumps entries of cat to fd in format
+ *  without touching the audio files: every
+ *  entry, or only those for paths if it is
+ *  not empty. Returns the number of paths
+ *  missing from the catalog.
+ **********************************************/
+size_t dump_catalog(const catalog_t* cat, const std::vector<std::string>& paths, dump_format_t format, int fd);
+
+/**********************************************
+ *  dump_dupes:
+ *    writes every group of catalog entries
+ *  whose audio payloads hash the same to fd:
+ *  one JSON object per group, or one CSV row
+ *  per file. Entries without a payload hash
+ *  or without audio are left out. Returns the
+ *  number of entries without a hash.
+ **********************************************/
+size_t dump_dupes(const catalog_t* cat, dump_format_t format, int fd);
+
+#endif
@@ -1,107 +1,423 @@
 #include "fileio.hh"
+#include "iostat.hh"
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
 
-#define BLOCK_SIZE 1024
+// Fallback copies go through an aligned buffer of this size
+#define COPY_BUF_SIZE (1024 * 1024)
+#define COPY_BUF_ALIGN 4096
 
-static uint8_t block_buf[BLOCK_SIZE];
+// Pieces of new bytes gathered into one write by write_pieces_at
+#define PIECE_IOV_MAX 64
+
+// Attempts at a unique name before a rewrite gives up
+#define TEMP_NAME_TRIES 100
+
+// Distinguishes temporary names made by this process
+static std::atomic<unsigned> temp_counter(0);
 
 /****************************************************************
- * print_pointers: 
- *   prints the current and end positions of file with file 
- * descriptor fd. 
+ * copy_range: 
+ *   internal helper for the rewrites. Copies len bytes at in_off 
+ * in fd to out_off in fd2. Whole blocks are reflinked when the
+ * filesystem supports it, the rest is copied in the kernel with
+ * copy_file_range or sendfile and only then through a user
+ * buffer. Returns 0 on success and -1 on error. 
  ****************************************************************/
-void print_pointers(int fd) {
-    off_t curr = lseek(fd, 0, SEEK_CUR);
+static int copy_range(int fd, off_t in_off, int fd2, off_t out_off, off_t len) {
+    if (len <= 0) {
+        return 0;
+    }
+    iostat_local()->bytes_copied += len;
+
+    // Share the unchanged blocks on CoW filesystems (btrfs, XFS)
+    struct stat st;
+    if (fstat(fd2, &st) == 0 && st.st_blksize > 0) {
+        off_t blk = st.st_blksize;
+        off_t clone_len = len / blk * blk;
+        if (in_off % blk == 0 && out_off % blk == 0 && clone_len > 0) {
+            struct file_clone_range range;
+            range.src_fd = fd;
+            range.src_offset = in_off;
+            range.src_length = clone_len;
+            range.dest_offset = out_off;
+            if (ioctl(fd2, FICLONERANGE, &range) == 0) {
+                iostat_count(IOSTAT_COPY, clone_len);
+                in_off += clone_len;
+                out_off += clone_len;
+                len -= clone_len;
+            }
+        }
+    }
+
+    // In-kernel copy
+    while (len > 0) {
+        loff_t in = in_off;
+        loff_t out = out_off;
+        ssize_t n = copy_file_range(fd, &in, fd2, &out, len, 0);
+        if (n <= 0) {
+            break;
+        }
+        iostat_count(IOSTAT_COPY, n);
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+
+    // Older kernels and cross-filesystem copies
+    if (len > 0 && iostat_lseek(fd2, out_off, SEEK_SET) == out_off) {
+        while (len > 0) {
+            off_t in = in_off;
+            ssize_t n = sendfile(fd2, fd, &in, len);
+            if (n <= 0) {
+                break;
+            }
+            iostat_count(IOSTAT_COPY, n);
+            in_off += n;
+            out_off += n;
+            len -= n;
+        }
+    }
 
-    printf("Curr: %lld End: %lld\n", curr, lseek(fd, 0, SEEK_END));
-    lseek(fd, curr, SEEK_SET);
-    return;
+    if (len == 0) {
+        return 0;
+    }
+
+    // Last resort: a large aligned buffer
+    void* buf;
+    if (posix_memalign(&buf, COPY_BUF_ALIGN, COPY_BUF_SIZE) != 0) {
+        return -1;
+    }
+    while (len > 0) {
+        size_t want = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+        ssize_t n = iostat_pread(fd, buf, want, in_off);
+        if (n <= 0 || iostat_pwrite(fd2, buf, n, out_off) != n) {
+            break;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    free(buf);
+    return len == 0 ? 0 : -1;
 }
 
 /****************************************************************
- *  copy_prefix: 
- *   internal helper function for add_bytes/remove_bytes. Copies
- * bytes [0, curr) from the file with file descriptor fd to 
- * the file with file descriptor fd2.
+ * fileio_syncer_init: 
+ *   sets up sync for mode with nothing pending. 
  ****************************************************************/
-void copy_prefix(int fd, int fd2, off_t curr) {
-    uint32_t bytes_read = 0;
-    int offset = 0;
-    int end = curr;
+void fileio_syncer_init(fileio_syncer_t* sync, fileio_sync_t mode) {
+    sync->mode = mode;
+    sync->pending.clear();
+}
 
-    // Write by a block until only less than a block remains
-    while (end - bytes_read > BLOCK_SIZE) {
-        read(fd, block_buf, BLOCK_SIZE);
-        write(fd2, block_buf, BLOCK_SIZE);
-        bytes_read += BLOCK_SIZE;
+/****************************************************************
+ * fileio_sync: 
+ *   makes the data written to fd durable as sync asks: not at 
+ * all, with fdatasync, or for FILEIO_SYNC_BATCH by starting 
+ * writeback now and leaving the wait to fileio_sync_flush. 
+ * Returns 0 on success and -1 on error. 
+ ****************************************************************/
+int fileio_sync(fileio_syncer_t* sync, int fd) {
+    if (sync == nullptr) {
+        return 0;
+    }
+    if (sync->mode == FILEIO_SYNC_FILE) {
+        iostat_scope_t scope(IOSTAT_PHASE_SYNC);
+        iostat_count(IOSTAT_SYNC, 0);
+        return fdatasync(fd);
+    }
+    if (sync->mode == FILEIO_SYNC_BATCH) {
+        iostat_scope_t scope(IOSTAT_PHASE_SYNC);
+        iostat_count(IOSTAT_SYNC, 0);
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> guard(sync->lock);
+        for (size_t i = 0; i < sync->pending.size(); ++i) {
+            if (sync->pending[i].first == st.st_dev) {
+                return 0;
+            }
+        }
+        int dup_fd = dup(fd);
+        if (dup_fd < 0) {
+            return -1;
+        }
+        sync->pending.push_back(std::make_pair(st.st_dev, dup_fd));
     }
-    read(fd, block_buf, end - bytes_read);
-    write(fd2, block_buf, end - bytes_read);
+    return 0;
 }
 
 /****************************************************************
- * remove_bytes: 
- *   removes num_bytes bytes from fd and places the resulting file
- * at location path. 
+ * fileio_sync_flush: 
+ *   for FILEIO_SYNC_BATCH, waits until everything sync saw since 
+ * the last flush is durable with one syncfs per filesystem. 
+ * Returns 0 on success and -1 if any filesystem failed. 
  ****************************************************************/
-void remove_bytes(int fd, size_t num_bytes, char* path) {
-    int fd2 = open("tmp", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd2 == -1) {
-        return;
+int fileio_sync_flush(fileio_syncer_t* sync) {
+    if (sync == nullptr) {
+        return 0;
     }
-    assert(fd != fd2);
+    iostat_scope_t scope(IOSTAT_PHASE_SYNC);
+    std::lock_guard<std::mutex> guard(sync->lock);
+    int ret = 0;
+    for (size_t i = 0; i < sync->pending.size(); ++i) {
+        iostat_count(IOSTAT_SYNC, 0);
+        if (syncfs(sync->pending[i].second) != 0) {
+            ret = -1;
+        }
+        close(sync->pending[i].second);
+    }
+    sync->pending.clear();
+    return ret;
+}
 
-    // Get the current position
-    off_t curr = lseek(fd, 0, SEEK_CUR);
+/****************************************************************
+ * dir_of: 
+ *   returns the directory part of path, "." if it has none. 
+ ****************************************************************/
+static std::string dir_of(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (slash == nullptr) {
+        return ".";
+    }
+    if (slash == path) {
+        return "/";
+    }
+    return std::string(path, slash - path);
+}
 
-    // Copy the prefix
-    lseek(fd, 0, SEEK_SET);
-    copy_prefix(fd, fd2, curr);
+/****************************************************************
+ * temp_name: 
+ *   returns a hidden name next to path for a temporary copy of
+ * it, unique within this process. 
+ ****************************************************************/
+static std::string temp_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    std::string name = slash ? std::string(path, slash + 1 - path) : std::string();
+    name += '.';
+    name += slash ? slash + 1 : path;
+    name += '.' + std::to_string(getpid()) + '.' + std::to_string(temp_counter.fetch_add(1));
+    return name;
+}
 
-    // Get the start of bytes following the deleted range
-    off_t rd_start = lseek(fd, num_bytes, SEEK_CUR);
-    assert(rd_start != -1);
+/****************************************************************
+ * open_temp: 
+ *   opens an anonymous O_TMPFILE in the directory of path, or, 
+ * where the filesystem has none, creates a uniquely named file 
+ * there and stores its name in tmp. Returns the descriptor or -1. 
+ ****************************************************************/
+static int open_temp(const char* path, std::string& tmp) {
+    int fd = iostat_open(dir_of(path).c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        return fd;
+    }
+    for (int i = 0; i < TEMP_NAME_TRIES; ++i) {
+        tmp = temp_name(path);
+        fd = iostat_open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd >= 0 || errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        tmp.clear();
+    }
+    return fd;
+}
 
-    size_t bytes_read;
+/****************************************************************
+ * link_temp: 
+ *   gives the O_TMPFILE fd a unique name next to path and stores
+ * it in tmp. Returns 0 on success and -1 on error. 
+ ****************************************************************/
+static int link_temp(int fd, const char* path, std::string& tmp) {
+    std::string proc = "/proc/self/fd/" + std::to_string(fd);
+    for (int i = 0; i < TEMP_NAME_TRIES; ++i) {
+        tmp = temp_name(path);
+        if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, tmp.c_str(), AT_SYMLINK_FOLLOW) == 0 ||
+            linkat(fd, "", AT_FDCWD, tmp.c_str(), AT_EMPTY_PATH) == 0) {
+            return 0;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    tmp.clear();
+    return -1;
+}
 
-    // Read a block
-    while ((bytes_read = read(fd, &block_buf, BLOCK_SIZE))) {
-        write(fd2, &block_buf, bytes_read);
+/****************************************************************
+ * wait_writeback: 
+ *   for FILEIO_SYNC_BATCH, waits for the writeback fileio_sync 
+ * started on fd, so a rename of fd over the original cannot 
+ * reach the disk ahead of its data. The cache flush and the 
+ * metadata are still left to fileio_sync_flush. Returns 0 on 
+ * success and -1 on error. 
+ ****************************************************************/
+static int wait_writeback(fileio_syncer_t* sync, int fd) {
+    if (sync == nullptr || sync->mode != FILEIO_SYNC_BATCH) {
+        return 0;
     }
+    iostat_scope_t scope(IOSTAT_PHASE_SYNC);
+    return sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+}
 
-    close(fd);
-    close(fd2);
+/****************************************************************
+ * sync_dir: 
+ *   fsyncs the directory holding path so a rename into it is 
+ * durable. 
+ ****************************************************************/
+static int sync_dir(const char* path) {
+    iostat_scope_t scope(IOSTAT_PHASE_SYNC);
+    int dir_fd = iostat_open(dir_of(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    iostat_count(IOSTAT_SYNC, 0);
+    int ret = fsync(dir_fd);
+    close(dir_fd);
+    return ret;
+}
 
-    unlink(path);
-    rename("tmp",  path);
-    fd2 = open(path, O_RDWR, S_IRUSR | S_IWUSR);
+/****************************************************************
+ * rewrite_file: 
+ *   internal helper for add_bytes/remove_bytes. Writes a copy of 
+ * fd, with the old_bytes bytes at offset replaced by num_pieces 
+ * pieces, to a temporary file in the same 
+ * directory with the original's mode and owner, then renames it 
+ * over path and makes fd refer to it, positioned just past the 
+ * new bytes. The last trim bytes of fd are left out of the 
+ * copy. Rewrites of different files never share anything, 
+ * so they may run in parallel. On error the original file is 
+ * left untouched and no temporary file remains. Returns 0 on 
+ * success and -1 on error with errno set. 
+ ****************************************************************/
+static int rewrite_file(int fd, off_t offset, size_t old_bytes, const fileio_piece_t* pieces, size_t num_pieces, size_t trim, char* path, fileio_syncer_t* sync) {
+    iostat_scope_t scope(IOSTAT_PHASE_WRITE);
+    size_t num_bytes = 0;
+    for (size_t i = 0; i < num_pieces; ++i) {
+        num_bytes += pieces[i].len;
+    }
 
-    // dup fd2 to be the original file desciptor
-    if (fd2 != fd) {
-        dup2(fd2, fd);
-        close(fd2);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if ((off_t) trim > st.st_size - offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::string tmp;
+    int fd2 = open_temp(path, tmp);
+    if (fd2 == -1) {
+        return -1;
+    }
+    assert(fd != fd2);
+
+    // Keep the permissions and, where allowed, the owner
+    fchmod(fd2, st.st_mode & 07777);
+    fchown(fd2, st.st_uid, st.st_gid);
+
+    off_t end = iostat_lseek(fd, 0, SEEK_END);
+    end -= trim;
+    off_t tail = offset + (off_t) old_bytes;
+    if (tail > end) {
+        tail = end;
+    }
+
+    // Prefix, new bytes, then everything after the old bytes.
+    // Zero pieces are left as holes.
+    int ret = copy_range(fd, 0, fd2, 0, offset);
+    off_t pos = offset;
+    for (size_t i = 0; ret == 0 && i < num_pieces; ++i) {
+        const fileio_piece_t* p = &pieces[i];
+        if (p->buf != nullptr) {
+            if (p->len > 0 && iostat_pwrite(fd2, p->buf, p->len, pos) != (ssize_t) p->len) {
+                ret = -1;
+            }
+            iostat_local()->bytes_changed += p->len;
+        } else if (p->src >= 0) {
+            ret = copy_range(fd, p->src, fd2, pos, p->len);
+        }
+        pos += p->len;
+    }
+    if (ret == 0) {
+        ret = copy_range(fd, tail, fd2, offset + num_bytes, end - tail);
+    }
+    if (ret == 0 && ftruncate(fd2, offset + num_bytes + (end - tail)) != 0) {
+        ret = -1;
+    }
+
+    // The new contents must be on disk before they replace the old
+    if (ret == 0) {
+        ret = fileio_sync(sync, fd2);
+    }
+    if (ret == 0) {
+        ret = wait_writeback(sync, fd2);
+    }
+    if (ret == 0 && tmp.empty()) {
+        ret = link_temp(fd2, path, tmp);
+    }
+    if (ret == 0 && iostat_rename(tmp.c_str(), path) != 0) {
+        ret = -1;
     }
 
-    // Set pointer to current or end
-    off_t end = lseek(fd, 0, SEEK_END);
-    if (end > curr) {
-        lseek(fd, curr, SEEK_SET);
+    if (ret != 0) {
+        int err = errno;
+        close(fd2);
+        if (!tmp.empty()) {
+            unlink(tmp.c_str());
+        }
+        iostat_lseek(fd, offset, SEEK_SET);
+        errno = err;
+        return -1;
+    }
+    if (sync && sync->mode == FILEIO_SYNC_FILE) {
+        sync_dir(path);
     }
+
+    // The temporary file is now path; make fd refer to it
+    dup2(fd2, fd);
+    close(fd2);
+    iostat_lseek(fd, offset + num_bytes, SEEK_SET);
+    iostat_local()->rewrites++;
+    return 0;
 }
 
 /****************************************************************
  * remove_bytes: 
+ *   removes num_bytes bytes from fd and places the resulting file
+ * at location path. 
+ ****************************************************************/
+int remove_bytes(int fd, size_t num_bytes, char* path, fileio_syncer_t* sync) {
+    return rewrite_file(fd, iostat_lseek(fd, 0, SEEK_CUR), num_bytes, nullptr, 0, 0, path, sync);
+}
+
+/****************************************************************
+ * remove_bytes_at: 
  *   removes num_bytes bytes from fd at offset and places 
  * the resulting file at location path. 
  ****************************************************************/
-void remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path) {
-    lseek(fd, offset, SEEK_SET);
-    remove_bytes(fd, num_bytes, path);
+int remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path, fileio_syncer_t* sync) {
+    return rewrite_file(fd, offset, num_bytes, nullptr, 0, 0, path, sync);
 }
 
 /****************************************************************
@@ -110,49 +426,240 @@ void remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path) {
  * at the current position and places the resulting file at 
  * location path. 
  ****************************************************************/
-void add_bytes(int fd, size_t num_bytes, uint8_t* buf, char* path) {
+int add_bytes(int fd, size_t num_bytes, uint8_t* buf, char* path, fileio_syncer_t* sync) {
+    fileio_piece_t piece = {buf, -1, num_bytes};
+    return rewrite_file(fd, iostat_lseek(fd, 0, SEEK_CUR), 0, &piece, 1, 0, path, sync);
+}
+
+/****************************************************************
+ * add_bytes_at: 
+ *   adds num_bytes bytes from buf to the file file descriptor fd 
+ * at offset and places the resulting file at location path. 
+ ****************************************************************/
+int add_bytes_at(int fd, size_t num_bytes, uint8_t* buf, off_t offset, char* path, fileio_syncer_t* sync) {
+    fileio_piece_t piece = {buf, -1, num_bytes};
+    return rewrite_file(fd, offset, 0, &piece, 1, 0, path, sync);
+}
+
+/****************************************************************
+ * replace_bytes_at: 
+ *   replaces old_bytes bytes at offset in fd with the num_bytes 
+ * bytes from buf in a single pass over the file and places the 
+ * resulting file at location path. 
+ ****************************************************************/
+int replace_bytes_at(int fd, size_t old_bytes, uint8_t* buf, size_t num_bytes, off_t offset, char* path, fileio_syncer_t* sync) {
+    fileio_piece_t piece = {buf, -1, num_bytes};
+    return rewrite_file(fd, offset, old_bytes, &piece, 1, 0, path, sync);
+}
+
+/****************************************************************
+ * replace_pieces_at: 
+ *   replaces old_bytes bytes at offset in fd with num_pieces 
+ * pieces and places the resulting file at location path. 
+ ****************************************************************/
+int replace_pieces_at(int fd, size_t old_bytes, const fileio_piece_t* pieces, size_t num_pieces, off_t offset, char* path, fileio_syncer_t* sync) {
+    return rewrite_file(fd, offset, old_bytes, pieces, num_pieces, 0, path, sync);
+}
 
-    // Open a temporary file
-    int fd2 = open("tmp", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+/****************************************************************
+ * replace_pieces_trim_at: 
+ *   replace_pieces_at that also leaves the last trim bytes of fd 
+ * out of the new file, in the same pass. 
+ ****************************************************************/
+int replace_pieces_trim_at(int fd, size_t old_bytes, const fileio_piece_t* pieces, size_t num_pieces, off_t offset, size_t trim, char* path, fileio_syncer_t* sync) {
+    return rewrite_file(fd, offset, old_bytes, pieces, num_pieces, trim, path, sync);
+}
+
+/****************************************************************
+ * copy_to_file: 
+ *   writes the num_bytes bytes at offset in fd to a new file at 
+ * path with mode 0644, through a temporary file renamed into 
+ * place. Returns 0 on success and -1 on error. 
+ ****************************************************************/
+int copy_to_file(int fd, off_t offset, size_t num_bytes, char* path, fileio_syncer_t* sync) {
+    iostat_scope_t scope(IOSTAT_PHASE_WRITE);
+    std::string tmp;
+    int fd2 = open_temp(path, tmp);
     if (fd2 == -1) {
-        printf("error\n");
-        return;
+        return -1;
     }
-    assert(fd != fd2);
+    fchmod(fd2, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-    // Get the current position
-    off_t curr = lseek(fd, 0, SEEK_CUR);
-    lseek(fd, 0, SEEK_SET);
+    int ret = copy_range(fd, offset, fd2, 0, num_bytes);
+    if (ret == 0) {
+        ret = fileio_sync(sync, fd2);
+    }
+    if (ret == 0) {
+        ret = wait_writeback(sync, fd2);
+    }
+    if (ret == 0 && tmp.empty()) {
+        ret = link_temp(fd2, path, tmp);
+    }
+    if (ret == 0 && iostat_rename(tmp.c_str(), path) != 0) {
+        ret = -1;
+    }
+    if (ret != 0 && !tmp.empty()) {
+        unlink(tmp.c_str());
+    }
+    if (ret == 0 && sync && sync->mode == FILEIO_SYNC_FILE) {
+        sync_dir(path);
+    }
+    close(fd2);
+    return ret;
+}
 
-    copy_prefix(fd, fd2, curr);
+/****************************************************************
+ * move_range: 
+ *   internal helper for write_pieces_at. Copies len bytes at src 
+ * in fd to dst through buf of buf_sz bytes, starting from the 
+ * end that keeps overlapping source bytes intact until read. 
+ * Returns 0 on success and -1 on error. 
+ ****************************************************************/
+static int move_range(int fd, off_t src, off_t dst, size_t len, uint8_t* buf, size_t buf_sz) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done < buf_sz ? len - done : buf_sz;
+        // Towards the start go front to back, towards the end back to front
+        off_t at = src > dst ? (off_t) done : (off_t) (len - done - n);
+        if (iostat_pread(fd, buf, n, src + at) != (ssize_t) n || iostat_pwrite(fd, buf, n, dst + at) != (ssize_t) n) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
 
-    // TODO: batch this? 
-    write(fd2, buf, num_bytes);
-    size_t bytes_read;
+/****************************************************************
+ * write_pieces_at: 
+ *   writes num_pieces pieces one after another at offset in fd, 
+ * in place. Returns the number of bytes written, or -1 on error. 
+ ****************************************************************/
+ssize_t write_pieces_at(int fd, const fileio_piece_t* pieces, size_t num_pieces, off_t offset) {
+    std::vector<off_t> dst(num_pieces);
+    size_t buf_sz = 0;
+    off_t pos = offset;
+    for (size_t i = 0; i < num_pieces; ++i) {
+        dst[i] = pos;
+        pos += pieces[i].len;
+        if (pieces[i].buf == nullptr && pieces[i].src != dst[i] && pieces[i].len > buf_sz) {
+            buf_sz = pieces[i].len;
+        }
+    }
 
-    while ((bytes_read = read(fd, block_buf, BLOCK_SIZE))) {
-        write(fd2, block_buf, bytes_read);
+    uint8_t* buf = nullptr;
+    if (buf_sz > COPY_BUF_SIZE) {
+        buf_sz = COPY_BUF_SIZE;
+    }
+    if (buf_sz > 0 && (buf = (uint8_t*) malloc(buf_sz)) == nullptr) {
+        return -1;
     }
 
-    close(fd); 
-    close(fd2);
+    // Pieces keep their order, so moving those bound for lower 
+    // offsets front to back and then those bound for higher ones 
+    // back to front never overwrites a byte still to be read. 
+    ssize_t written = 0;
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < num_pieces; ++i) {
+        const fileio_piece_t* p = &pieces[i];
+        if (p->buf == nullptr && p->src > dst[i]) {
+            ret = move_range(fd, p->src, dst[i], p->len, buf, buf_sz);
+            iostat_local()->bytes_copied += p->len;
+            written += p->len;
+        }
+    }
+    for (size_t i = num_pieces; ret == 0 && i-- > 0;) {
+        const fileio_piece_t* p = &pieces[i];
+        if (p->buf == nullptr && p->src >= 0 && p->src < dst[i]) {
+            ret = move_range(fd, p->src, dst[i], p->len, buf, buf_sz);
+            iostat_local()->bytes_copied += p->len;
+            written += p->len;
+        }
+    }
 
-    rename("tmp", path);
-    fd2 = open(path, O_RDWR, S_IRUSR | S_IWUSR);
+    // New bytes and zeros last, once nothing is left to read
+    if (buf != nullptr) {
+        memset(buf, 0, buf_sz);
+    }
+    for (size_t i = 0; ret == 0 && i < num_pieces; ++i) {
+        const fileio_piece_t* p = &pieces[i];
+        if (p->buf != nullptr) {
+            // Runs of new bytes go out in one gathered write
+            struct iovec iov[PIECE_IOV_MAX];
+            size_t n = 0;
+            size_t len = 0;
+            for (; i + n < num_pieces && n < PIECE_IOV_MAX && pieces[i + n].buf != nullptr; ++n) {
+                iov[n].iov_base = (void*) pieces[i + n].buf;
+                iov[n].iov_len = pieces[i + n].len;
+                len += pieces[i + n].len;
+            }
+            if (len > 0 && iostat_pwritev(fd, iov, n, dst[i]) != (ssize_t) len) {
+                ret = -1;
+            }
+            iostat_local()->bytes_changed += len;
+            written += len;
+            i += n - 1;
+        } else if (p->src == -1) {
+            for (size_t done = 0; ret == 0 && done < p->len; done += buf_sz) {
+                size_t n = p->len - done < buf_sz ? p->len - done : buf_sz;
+                if (iostat_pwrite(fd, buf, n, dst[i] + done) != (ssize_t) n) {
+                    ret = -1;
+                }
+            }
+            iostat_local()->bytes_changed += p->len;
+            written += p->len;
+        }
+    }
+    free(buf);
+    return ret == 0 ? written : -1;
+}
 
-    if (fd2 != fd) {
-        dup2(fd2, fd);
-        close(fd2);
+/****************************************************************
+ * file_block_size: 
+ *   returns the filesystem block size of fd. 
+ ****************************************************************/
+size_t file_block_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+        return 4096;
     }
-    lseek(fd, curr + num_bytes, SEEK_SET);
+    return st.st_blksize;
 }
 
 /****************************************************************
- * add_bytes_at: 
- *   adds num_bytes bytes from buf to the file file descriptor fd 
- * at offset and places the resulting file at location path. 
+ * insert_range: 
+ *   inserts num_bytes zero bytes, rounded up to whole filesystem
+ * blocks, at offset in fd without rewriting the rest of the file. 
+ * offset must be block-aligned and inside the file. Returns the 
+ * number of bytes inserted, or 0 if the filesystem cannot insert. 
  ****************************************************************/
-void add_bytes_at(int fd, size_t num_bytes, uint8_t* buf, off_t offset, char* path) {
-    lseek(fd, offset, SEEK_SET);
-    add_bytes(fd, num_bytes, buf, path);
-}
\ No newline at end of file
+size_t insert_range(int fd, off_t offset, size_t num_bytes) {
+    size_t blk = file_block_size(fd);
+    size_t len = (num_bytes + blk - 1) / blk * blk;
+    if (len == 0 || offset % blk != 0) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_INSERT_RANGE, offset, len) != 0) {
+        return 0;
+    }
+    return len;
+}
+
+/****************************************************************
+ * collapse_range: 
+ *   removes the whole filesystem blocks within the num_bytes 
+ * bytes at offset in fd without rewriting the rest of the file. 
+ * The range must end before the end of the file. Returns the 
+ * number of bytes removed, or 0 if nothing could be removed. 
+ ****************************************************************/
+size_t collapse_range(int fd, off_t offset, size_t num_bytes) {
+    size_t blk = file_block_size(fd);
+    off_t start = (offset + blk - 1) / blk * blk;
+    off_t end = (offset + num_bytes) / blk * blk;
+    if (end <= start) {
+        return 0;
+    }
+    if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, start, end - start) != 0) {
+        return 0;
+    }
+    return end - start;
+}
@@ -4,27 +4,92 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h> 
+#include <sys/types.h>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+typedef enum {
+    FILEIO_SYNC_NONE,       // leave writeback to the kernel
+    FILEIO_SYNC_FILE,       // fdatasync every file, fsync the directory on rename
+    FILEIO_SYNC_BATCH,      // start writeback per file, wait once in fileio_sync_flush
+} fileio_sync_t;
+
+/****************************************************************
+ * fileio_piece_t: 
+ *   a run of bytes to write: len bytes from buf or, when buf is 
+ * null, len bytes copied from offset src of the file being 
+ * written, or zeros when src is -1. Copying from the file lets 
+ * large unchanged data move without passing through memory. 
+ ****************************************************************/
+typedef struct fileio_piece_t {
+    const uint8_t* buf;
+    off_t src;
+    size_t len;
+} fileio_piece_t;
+
+/****************************************************************
+ * fileio_syncer_t: 
+ *   how the rewrites and fileio_sync make writes durable and, for 
+ * FILEIO_SYNC_BATCH, one descriptor per filesystem written since 
+ * the last flush. A syncer may be shared by any number of 
+ * threads; functions given a null syncer leave writeback to the 
+ * kernel. 
+ ****************************************************************/
+typedef struct fileio_syncer_t {
+    fileio_sync_t mode;
+    std::mutex lock;
+    std::vector<std::pair<dev_t, int>> pending;
+} fileio_syncer_t;
+
+/****************************************************************
+ * fileio_syncer_init: 
+ *   sets up sync for mode with nothing pending. 
+ ****************************************************************/
+void fileio_syncer_init(fileio_syncer_t* sync, fileio_sync_t mode);
 
 /****************************************************************
- * print_pointers: 
- *   prints the current and end positions of file with file 
- * descriptor fd. 
+ * fileio_sync: 
+ *   makes the data written to fd durable as sync asks: not at 
+ * all, with fdatasync, or for FILEIO_SYNC_BATCH by starting 
+ * writeback now and leaving the wait to fileio_sync_flush. 
+ * Returns 0 on success and -1 on error. 
+ ****************************************************************/
+int fileio_sync(fileio_syncer_t* sync, int fd);
+
+/****************************************************************
+ * fileio_sync_flush: 
+ *   for FILEIO_SYNC_BATCH, waits until everything sync saw since 
+ * the last flush is durable with one syncfs per filesystem. 
+ * Returns 0 on success and -1 if any filesystem failed. 
+ ****************************************************************/
+int fileio_sync_flush(fileio_syncer_t* sync);
+
+/****************************************************************
+ * The rewrites below copy fd to a temporary file next to path 
+ * (O_TMPFILE where available) with the same mode and owner and 
+ * rename it over path, so a crash leaves either the old or the 
+ * new file and concurrent rewrites of different files are safe. 
+ * fd then refers to the new file. The new file's data is on disk 
+ * before it replaces the old one: FILEIO_SYNC_FILE syncs it, and 
+ * FILEIO_SYNC_BATCH waits for its writeback and leaves the cache 
+ * flush to fileio_sync_flush. They return 0 on success and -1 on 
+ * error with errno set, leaving the original untouched. 
  ****************************************************************/
-void print_pointers(int fd);
 
 /****************************************************************
  * remove_bytes: 
  *   removes num_bytes bytes from fd and places the resulting file
  * at location path. 
  ****************************************************************/
-void remove_bytes(int fd, size_t num_bytes, char* path);
+int remove_bytes(int fd, size_t num_bytes, char* path, fileio_syncer_t* sync);
 
 /****************************************************************
  * remove_bytes_at: 
  *   removes num_bytes bytes from fd at offset and places 
  * the resulting file at location path. 
  ****************************************************************/
-void remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path);
+int remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path, fileio_syncer_t* sync);
 
 /****************************************************************
  * add_bytes: 
@@ -32,7 +97,7 @@ void remove_bytes_at(int fd, size_t num_bytes, off_t offset, char* path);
  * at the current position and places the resulting file at 
  * location path. 
  ****************************************************************/
-void add_bytes(int fd, size_t num_bytes, uint8_t* buf, char* path); 
+int add_bytes(int fd, size_t num_bytes, uint8_t* buf, char* path, fileio_syncer_t* sync);
 
 
 /****************************************************************
@@ -40,6 +105,73 @@ void add_bytes(int fd, size_t num_bytes, uint8_t* buf, char* path);
  *   adds num_bytes bytes from buf to the file file descriptor fd 
  * at offset and places the resulting file at location path. 
  ****************************************************************/
-void add_bytes_at(int fd, size_t num_bytes, uint8_t* buf, off_t offset, char* path);
+int add_bytes_at(int fd, size_t num_bytes, uint8_t* buf, off_t offset, char* path, fileio_syncer_t* sync);
+
+/****************************************************************
+ * replace_bytes_at: 
+ *   replaces old_bytes bytes at offset in fd with the num_bytes 
+ * bytes from buf in a single pass over the file and places the 
+ * resulting file at location path. 
+ ****************************************************************/
+int replace_bytes_at(int fd, size_t old_bytes, uint8_t* buf, size_t num_bytes, off_t offset, char* path, fileio_syncer_t* sync);
+
+/****************************************************************
+ * replace_pieces_at: 
+ *   replace_bytes_at with the new bytes given as num_pieces 
+ * pieces. Pieces copied from fd refer to offsets in the original 
+ * and are copied in the kernel. 
+ ****************************************************************/
+int replace_pieces_at(int fd, size_t old_bytes, const fileio_piece_t* pieces, size_t num_pieces, off_t offset, char* path, fileio_syncer_t* sync);
+
+/****************************************************************
+ * replace_pieces_trim_at: 
+ *   replace_pieces_at that also leaves the last trim bytes of fd 
+ * out of the new file, in the same pass. 
+ ****************************************************************/
+int replace_pieces_trim_at(int fd, size_t old_bytes, const fileio_piece_t* pieces, size_t num_pieces, off_t offset, size_t trim, char* path, fileio_syncer_t* sync);
+
+/****************************************************************
+ * copy_to_file: 
+ *   writes the num_bytes bytes at offset in fd to a new file at 
+ * path (replacing any file there) with mode 0644, copied in the 
+ * kernel through a temporary file renamed into place and made 
+ * durable as sync asks. Returns 0 on success and -1 on error. 
+ ****************************************************************/
+int copy_to_file(int fd, off_t offset, size_t num_bytes, char* path, fileio_syncer_t* sync);
+
+/****************************************************************
+ * write_pieces_at: 
+ *   writes num_pieces pieces one after another at offset in fd, 
+ * in place. Pieces copied from fd may overlap where other pieces 
+ * go; they are moved in an order that reads every byte before it 
+ * is overwritten, through a buffer of bounded size, and those 
+ * already in place are skipped. Returns the number of bytes 
+ * written, or -1 on error. 
+ ****************************************************************/
+ssize_t write_pieces_at(int fd, const fileio_piece_t* pieces, size_t num_pieces, off_t offset);
+
+/****************************************************************
+ * file_block_size: 
+ *   returns the filesystem block size of fd. 
+ ****************************************************************/
+size_t file_block_size(int fd);
+
+/****************************************************************
+ * insert_range: 
+ *   inserts num_bytes zero bytes, rounded up to whole filesystem
+ * blocks, at offset in fd without rewriting the rest of the file. 
+ * offset must be block-aligned and inside the file. Returns the 
+ * number of bytes inserted, or 0 if the filesystem cannot insert. 
+ ****************************************************************/
+size_t insert_range(int fd, off_t offset, size_t num_bytes);
+
+/****************************************************************
+ * collapse_range: 
+ *   removes the whole filesystem blocks within the num_bytes 
+ * bytes at offset in fd without rewriting the rest of the file. 
+ * The range must end before the end of the file. Returns the 
+ * number of bytes removed, or 0 if nothing could be removed. 
+ ****************************************************************/
+size_t collapse_range(int fd, off_t offset, size_t num_bytes);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,604 @@
+#include "id3.hh"
+#include "id3frames.hh"
+#include "iostat.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+// Flips endianess of 32-bit integer
+uint32_t flip_endianness(uint32_t x) {
+    uint32_t ret = 0;
+    ret |= (x & 0xFF) << 24;
+    ret |= (x & 0xFF00) << 8;
+    ret |= (x & 0xFF000000) >> 24;
+    ret |= (x & 0xFF0000) >> 8;
+    return ret;
+}
+
+/**********************************************
+ *  synchsafe:
+ *    decodes the 4-byte synchsafe integer at p.
+ **********************************************/
+static uint32_t synchsafe(const uint8_t* p) {
+    return ((p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) | ((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/**********************************************
+ *  id3_2_frames_readable:
+ *    returns whether frames of tags with major
+ *  version major can be walked: ID3v2.3 and
+ *  ID3v2.4, but not the 6-byte frame headers
+ *  of ID3v2.2.
+ **********************************************/
+int id3_2_frames_readable(uint8_t major) {
+    return major == 3 || major == 4;
+}
+
+/**********************************************
+ *  id3_2_frame_size:
+ *    decodes the size in the frame header at p
+ *  of a tag with major version major: plain
+ *  big-endian in ID3v2.3, synchsafe in
+ *  ID3v2.4.
+ **********************************************/
+uint32_t id3_2_frame_size(const uint8_t* p, uint8_t major) {
+    if (major == 4) {
+        return synchsafe(p + 4);
+    }
+    return (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+}
+
+/**********************************************
+ *  put_id3_2_frame_size:
+ *    encodes sz into the frame header at p as
+ *  id3_2_frame_size reads it.
+ **********************************************/
+void put_id3_2_frame_size(uint8_t* p, uint32_t sz, uint8_t major) {
+    if (major == 4) {
+        p[4] = (sz >> 21) & 0x7f;
+        p[5] = (sz >> 14) & 0x7f;
+        p[6] = (sz >> 7) & 0x7f;
+        p[7] = sz & 0x7f;
+        return;
+    }
+    p[4] = sz >> 24;
+    p[5] = sz >> 16;
+    p[6] = sz >> 8;
+    p[7] = sz;
+}
+
+/**********************************************
+ *  id3_2_frames_offset:
+ *    returns the offset in the body of the
+ *  first frame of the tag with the header at
+ *  data and a sz byte body, past the extended
+ *  header if it has one (at most sz).
+ **********************************************/
+uint32_t id3_2_frames_offset(const uint8_t* data, uint32_t sz) {
+    if ((data[5] & ID3_2_FLAG_EXTENDED) == 0) {
+        return 0;
+    }
+    if (sz < 4) {
+        return sz;
+    }
+    // The ID3v2.3 size leaves out its own 4 bytes; the ID3v2.4 size does not
+    const uint8_t* ext = data + 10;
+    uint64_t len = data[3] == 4 ? synchsafe(ext) : 4 + (uint64_t) ((ext[0] << 24) | (ext[1] << 16) | (ext[2] << 8) | ext[3]);
+    return len < sz ? (uint32_t) len : sz;
+}
+
+/**********************************************
+ *  id3_2_frame_iter_init:
+ *    starts it at the first frame of the sz
+ *  byte tag body in buf, whose frame headers
+ *  are those of ID3v2 major version major.
+ **********************************************/
+void id3_2_frame_iter_init(id3_2_frame_iter_t* it, const uint8_t* buf, uint32_t sz, uint8_t major) {
+    it->buf = buf;
+    it->sz = sz;
+    it->off = 0;
+    it->major = major;
+}
+
+/**********************************************
+ *  id3_2_frame_iter_tag:
+ *    starts it at the first frame of tag, past
+ *  any extended header. Tags that are not
+ *  ID3v2, or whose frames are not readable,
+ *  have no frames.
+ **********************************************/
+void id3_2_frame_iter_tag(id3_2_frame_iter_t* it, const id3_tag_t* tag) {
+    if (tag->version != ID3_V2 || !id3_2_frames_readable(tag->data[3])) {
+        id3_2_frame_iter_init(it, tag->body, 0, 0);
+        return;
+    }
+    id3_2_frame_iter_init(it, tag->body, tag->tag_sz, tag->data[3]);
+    it->off = id3_2_frames_offset(tag->data, tag->tag_sz);
+}
+
+/**********************************************
+ *  id3_2_frame_next:
+ *    fills view with the next frame and returns
+ *  1, or returns 0 at the padding, the end of
+ *  the tag or a frame that overruns it. it->off
+ *  is then the offset the walk stopped at.
+ **********************************************/
+int id3_2_frame_next(id3_2_frame_iter_t* it, id3_2_frame_view_t* view) {
+    if (it->off + 10 > it->sz || it->buf[it->off] == 0) {
+        return 0;
+    }
+    const uint8_t* p = it->buf + it->off;
+    uint32_t sz = id3_2_frame_size(p, it->major);
+    if (sz > it->sz - it->off - 10) {
+        return 0;
+    }
+    memcpy(view->id, p, 4);
+    view->size = sz;
+    view->flags[0] = p[8];
+    view->flags[1] = p[9];
+    view->body = p + 10;
+    it->off += 10 + sz;
+    return 1;
+}
+
+/**********************************************
+ *  id3_2_tag_size:
+ *    decodes the synchsafe tag size from the
+ *  10-byte ID3v2 header in header.
+ **********************************************/
+uint32_t id3_2_tag_size(const uint8_t* header) {
+    return synchsafe(header + 6);
+}
+
+/**********************************************
+ *  put_id3_2_tag_size:
+ *    encodes tag_sz as the synchsafe size in
+ *  the 10-byte ID3v2 header in header.
+ **********************************************/
+void put_id3_2_tag_size(uint8_t* header, uint32_t tag_sz) {
+    header[6] = (tag_sz >> 21) & 0x7f;
+    header[7] = (tag_sz >> 14) & 0x7f;
+    header[8] = (tag_sz >> 7) & 0x7f;
+    header[9] = tag_sz & 0x7f;
+}
+
+/**********************************************
+ *  id3_2_frames_size:
+ *    walks the frames in buf, whose headers are
+ *  those of ID3v2 major version major, and
+ *  returns the number of bytes they occupy,
+ *  i.e. the offset at which the padding
+ *  begins. A malformed frame counts as using
+ *  the rest of the buffer.
+ **********************************************/
+uint32_t id3_2_frames_size(const uint8_t* buf, uint32_t sz, uint8_t major) {
+    id3_2_frame_iter_t it;
+    id3_2_frame_view_t view;
+    id3_2_frame_iter_init(&it, buf, sz, major);
+    while (id3_2_frame_next(&it, &view)) {
+    }
+
+    // A frame that overruns the tag leaves no room for padding
+    if (it.off + 10 <= sz && buf[it.off] != 0) {
+        return sz;
+    }
+    return it.off;
+}
+
+/**********************************************
+ *  id3_read_tag:
+ *    loads the tag of fd into tag. The first
+ *  ID3_PREFETCH_SIZE bytes are read at once and
+ *  hold most ID3v2 tags; larger tags take one
+ *  more read. Without an ID3v2 tag the last
+ *  128 bytes are read for an ID3v1 tag.
+ *  Returns 0 on success and -1 on a read
+ *  error. Release with id3_free_tag.
+ **********************************************/
+int id3_read_tag(int fd, id3_tag_t* tag) {
+    iostat_scope_t scope(IOSTAT_PHASE_PARSE);
+    memset(tag, 0, sizeof(*tag));
+
+    uint8_t* buf = (uint8_t*) malloc(ID3_PREFETCH_SIZE);
+    if (buf == nullptr) {
+        return -1;
+    }
+    ssize_t got = iostat_pread(fd, buf, ID3_PREFETCH_SIZE, 0);
+    if (got < 0) {
+        free(buf);
+        return -1;
+    }
+
+    if (got >= 10 && memcmp(buf, "ID3", 3) == 0) {
+        tag->version = ID3_V2;
+        tag->tag_sz = id3_2_tag_size(buf);
+        size_t total = 10 + (size_t) tag->tag_sz;
+
+        // Map large tags so frames are only read when touched
+        if (total > ID3_MAP_THRESHOLD) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && (size_t) st.st_size >= total) {
+                void* map = mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map != MAP_FAILED) {
+                    madvise(map, total, MADV_RANDOM);
+                    free(buf);
+                    tag->data = (uint8_t*) map;
+                    tag->body = tag->data + 10;
+                    tag->map_sz = total;
+                    return 0;
+                }
+            }
+        }
+
+        // Fetch the rest of a tag larger than the prefetch
+        if (total > (size_t) got) {
+            uint8_t* grown = (uint8_t*) realloc(buf, total);
+            if (grown == nullptr) {
+                free(buf);
+                return -1;
+            }
+            buf = grown;
+            if (iostat_pread(fd, buf + got, total - got, got) != (ssize_t) (total - got)) {
+                free(buf);
+                return -1;
+            }
+        }
+        tag->data = buf;
+        tag->body = buf + 10;
+        return 0;
+    }
+
+    // Short files already hold their last 128 bytes
+    off_t end = got;
+    const uint8_t* v1 = got >= 128 ? buf + got - 128 : buf;
+    uint8_t last[128];
+    if (got == ID3_PREFETCH_SIZE) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            free(buf);
+            return -1;
+        }
+        end = st.st_size;
+        if (end > got) {
+            if (iostat_pread(fd, last, 128, end - 128) != 128) {
+                free(buf);
+                return -1;
+            }
+            v1 = last;
+        }
+    }
+    if (end >= 128) {
+        id3_1_load(tag, v1, end - 128);
+    }
+    free(buf);
+    return 0;
+}
+
+/**********************************************
+ *  id3_1_load:
+ *    fills tag from the 128-byte block read at
+ *  offset in the file if it is an ID3v1 tag.
+ *  Returns 1 if it is and 0 otherwise.
+ **********************************************/
+int id3_1_load(id3_tag_t* tag, const uint8_t* block, off_t offset) {
+    if (memcmp(block, "TAG", 3) != 0) {
+        return 0;
+    }
+    tag->version = ID3_V1;
+    tag->v1_offset = offset;
+    memcpy(&tag->v1, block + 3, sizeof(tag->v1));
+    return 1;
+}
+
+/**********************************************
+ *  id3_free_tag:
+ *    releases the buffer held by tag.
+ **********************************************/
+void id3_free_tag(id3_tag_t* tag) {
+    if (tag->map_sz) {
+        munmap(tag->data, tag->map_sz);
+    } else {
+        free(tag->data);
+    }
+    tag->map_sz = 0;
+    tag->data = nullptr;
+    tag->body = nullptr;
+}
+
+/**********************************************
+ *  id3_2_frame_range:
+ *    fills range for the frame view of tag.
+ **********************************************/
+void id3_2_frame_range(const id3_tag_t* tag, const id3_2_frame_view_t* view, id3_2_frame_range_t* range) {
+    memcpy(range->id, view->id, 4);
+    range->size = view->size;
+    range->offset = view->body - tag->data;
+}
+
+/**********************************************
+ *  id3_2_frame_stream:
+ *    reads the body of range from fd in chunks
+ *  and hands each to fn.
+ **********************************************/
+int id3_2_frame_stream(int fd, const id3_2_frame_range_t* range, id3_stream_fn_t fn, void* ctx) {
+    size_t chunk = range->size < ID3_STREAM_CHUNK ? range->size : ID3_STREAM_CHUNK;
+    uint8_t* buf = (uint8_t*) malloc(chunk ? chunk : 1);
+    if (buf == nullptr) {
+        return -1;
+    }
+    posix_fadvise(fd, range->offset, range->size, POSIX_FADV_SEQUENTIAL);
+
+    int ret = 0;
+    off_t off = range->offset;
+    size_t left = range->size;
+    while (left > 0 && ret == 0) {
+        ssize_t n = iostat_pread(fd, buf, left < chunk ? left : chunk, off);
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        ret = fn(buf, n, ctx);
+        off += n;
+        left -= n;
+    }
+    free(buf);
+    return ret;
+}
+
+/**********************************************
+ *  skim_reserve:
+ *    grows the buffer of sk to hold n more
+ *  bytes. Returns 0 on success.
+ **********************************************/
+static int skim_reserve(id3_2_skim_t* sk, size_t n) {
+    if (sk->got + n <= sk->cap) {
+        return 0;
+    }
+    uint8_t* grown = (uint8_t*) realloc(sk->buf, sk->got + n);
+    if (grown == nullptr) {
+        return -1;
+    }
+    sk->buf = grown;
+    sk->cap = sk->got + n;
+    return 0;
+}
+
+/**********************************************
+ *  id3_2_skim_init:
+ *    starts sk on the first got bytes of a
+ *  file in buf.
+ **********************************************/
+void id3_2_skim_init(id3_2_skim_t* sk, uint8_t* buf, size_t cap, size_t got) {
+    sk->buf = buf;
+    sk->cap = cap;
+    sk->kept = 10;
+    sk->got = got;
+    sk->pos = got;
+    sk->total = 10 + (size_t) id3_2_tag_size(buf);
+    sk->major = buf[3];
+
+    // The extended header is kept with the header; tags whose frames
+    // cannot be walked, or whose extended header was not read, keep
+    // no frames
+    size_t ext = id3_2_frames_offset(buf, sk->total - 10);
+    if (!id3_2_frames_readable(sk->major) || 10 + ext > got) {
+        sk->total = 10;
+        return;
+    }
+    sk->kept += ext;
+}
+
+/**********************************************
+ *  id3_2_skim_next:
+ *    keeps the whole frames read so far and
+ *  drops lazy ones, then asks for the next
+ *  header or the rest of a kept frame.
+ **********************************************/
+int id3_2_skim_next(id3_2_skim_t* sk, size_t* off, size_t* len) {
+    for (;;) {
+        size_t avail = sk->got - sk->kept;
+        size_t start = sk->pos - avail;
+        if (start >= sk->total) {
+            return 0;
+        }
+        if (avail < 10) {
+            if ((avail > 0 && sk->buf[sk->kept] == 0) || sk->pos >= sk->total) {
+                return 0;
+            }
+            size_t n = sk->total - sk->pos;
+            *len = n < ID3_PREFETCH_SIZE ? n : ID3_PREFETCH_SIZE;
+            *off = sk->pos;
+            return skim_reserve(sk, *len) == 0 ? 1 : -1;
+        }
+
+        // Stop at the padding or a frame that overruns the tag
+        const uint8_t* p = sk->buf + sk->kept;
+        uint32_t sz = id3_2_frame_size(p, sk->major);
+        if (p[0] == 0 || sz > sk->total - start - 10) {
+            return 0;
+        }
+        size_t frame = 10 + (size_t) sz;
+
+        if (id3_frame_is_lazy(id3_fourcc((const char*) p), sz)) {
+            if (avail >= frame) {
+                memmove(sk->buf + sk->kept, p + frame, avail - frame);
+                sk->got -= frame;
+            } else {
+                sk->got = sk->kept;
+                sk->pos = start + frame;
+            }
+            continue;
+        }
+        if (avail >= frame) {
+            sk->kept += frame;
+            continue;
+        }
+
+        // Read the rest of the frame and the next header with it
+        size_t n = sk->total - sk->pos;
+        size_t want = frame - avail + ID3_PREFETCH_SIZE;
+        *len = n < want ? n : want;
+        *off = sk->pos;
+        return skim_reserve(sk, *len) == 0 ? 1 : -1;
+    }
+}
+
+/**********************************************
+ *  id3_2_skim_fill:
+ *    records n bytes read into sk->buf +
+ *  sk->got.
+ **********************************************/
+void id3_2_skim_fill(id3_2_skim_t* sk, size_t n) {
+    sk->got += n;
+    sk->pos += n;
+}
+
+/**********************************************
+ *  put_v1_field:
+ *    decodes a fixed-width ID3v1 field of at
+ *  most n ISO-8859-1 bytes as a text frame.
+ **********************************************/
+static void put_v1_field(const char* field, size_t n, std::string& out) {
+    uint8_t body[31];
+    body[0] = 0;
+    memcpy(body + 1, field, n);
+    uint32_t len = strnlen(field, n);
+    id3_2_text_utf8(body, len + 1, out);
+}
+
+// ID3v1 genres 0-79, then the Winamp extensions
+static const char* genre_names[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop",
+    "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap",
+    "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska", "Death Metal", "Pranks",
+    "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance",
+    "Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+    "Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+    "Native American", "Cabaret", "New Wave", "Psychedelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+    "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock",
+    "Folk", "Folk-Rock", "National Folk", "Swing", "Fast Fusion", "Bebop", "Latin", "Revival",
+    "Celtic", "Bluegrass", "Avantgarde", "Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
+    "Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
+    "Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam",
+    "Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul", "Freestyle",
+    "Duet", "Punk Rock", "Drum Solo", "A Cappella", "Euro-House", "Dance Hall", "Goa", "Drum & Bass",
+    "Club-House", "Hardcore", "Terror", "Indie", "BritPop", "Afro-Punk", "Polsk Punk", "Beat",
+    "Christian Gangsta Rap", "Heavy Metal", "Black Metal", "Crossover", "Contemporary Christian", "Christian Rock", "Merengue", "Salsa",
+    "Thrash Metal", "Anime", "JPop", "Synthpop",
+};
+
+/**********************************************
+ *  id3_1_genre_name:
+ *    returns the name of ID3v1 genre number
+ *  genre, including the Winamp extensions, or
+ *  nullptr if it has none.
+ **********************************************/
+const char* id3_1_genre_name(uint8_t genre) {
+    if (genre >= sizeof(genre_names) / sizeof(genre_names[0])) {
+        return nullptr;
+    }
+    return genre_names[genre];
+}
+
+/**********************************************
+ *  id3_version_name:
+ *    returns the display name of a tag with
+ *  id3_version_t version and, for ID3v2, the
+ *  header's major version byte minor. Returns
+ *  nullptr when there is no tag.
+ **********************************************/
+const char* id3_version_name(uint8_t version, uint8_t minor) {
+    if (version == ID3_V1) {
+        return "ID3v1";
+    }
+    if (version == ID3_V2) {
+        return minor == 4 ? "ID3v2.4" : minor == 2 ? "ID3v2.2" : "ID3v2.3";
+    }
+    return nullptr;
+}
+
+/**********************************************
+ *  id3_decode_frames:
+ *    appends the text frames of tag to frames
+ *  as UTF-8, keeping the first frame of each
+ *  ID. ID3v1 fields are reported under the
+ *  matching ID3v2 frame IDs, the genre by its
+ *  name. Returns 0, or -1 for an ID3v2 tag
+ *  whose frames cannot be walked (see
+ *  id3_2_frames_readable).
+ **********************************************/
+int id3_decode_frames(const id3_tag_t* tag, std::vector<id3_frame_text_t>& frames) {
+    iostat_scope_t scope(IOSTAT_PHASE_FRAMES);
+    if (tag->version == ID3_V2 && !id3_2_frames_readable(tag->data[3])) {
+        return -1;
+    }
+    if (tag->version == ID3_V2) {
+        id3_2_frame_iter_t it;
+        id3_2_frame_view_t view;
+        id3_2_frame_iter_tag(&it, tag);
+
+        // Known IDs are deduplicated by table position, others by search
+        uint8_t seen[ID3_MAX_KNOWN_FRAMES];
+        memset(seen, 0, sizeof(seen));
+        size_t base = frames.size();
+
+        while (id3_2_frame_next(&it, &view)) {
+            // Text frames only; the first of each ID wins
+            const id3_frame_info_t* info = id3_frame_info(id3_fourcc(view.id));
+            if (info != nullptr) {
+                if (info->kind != ID3_FRAME_TEXT || seen[info - id3_frames]) {
+                    continue;
+                }
+                seen[info - id3_frames] = 1;
+            } else {
+                if (view.id[0] != 'T') {
+                    continue;
+                }
+                size_t i = base;
+                while (i < frames.size() && memcmp(frames[i].first.data(), view.id, 4) != 0) {
+                    ++i;
+                }
+                if (i < frames.size()) {
+                    continue;
+                }
+            }
+            frames.push_back(std::make_pair(std::string(view.id, 4), std::string()));
+            id3_frame_decoder_t decode = info != nullptr ? info->decode : id3_2_text_utf8;
+            decode(view.body, view.size, frames.back().second);
+        }
+    } else if (tag->version == ID3_V1) {
+        const id3_1_t* v1 = &tag->v1;
+        size_t base = frames.size();
+        frames.resize(base + 6);
+        frames[base + 0].first = "TIT2";
+        put_v1_field(v1->title, 30, frames[base + 0].second);
+        frames[base + 1].first = "TPE1";
+        put_v1_field(v1->artist, 30, frames[base + 1].second);
+        frames[base + 2].first = "TALB";
+        put_v1_field(v1->album, 30, frames[base + 2].second);
+        frames[base + 3].first = "TYER";
+        put_v1_field(v1->year, 4, frames[base + 3].second);
+
+        // ID3v1.1 keeps the track in the last comment byte
+        frames[base + 4].first = "COMM";
+        if (v1->comment[28] == 0 && v1->comment[29] != 0) {
+            put_v1_field(v1->comment, 28, frames[base + 4].second);
+            frames.push_back(std::make_pair(std::string("TRCK"), std::to_string((uint8_t) v1->comment[29])));
+        } else {
+            put_v1_field(v1->comment, 30, frames[base + 4].second);
+        }
+        // Genre names as migrate writes them; 255 means no genre
+        frames[base + 5].first = "TCON";
+        uint8_t genre = (uint8_t) v1->genre[0];
+        if (genre != 255) {
+            const char* name = id3_1_genre_name(genre);
+            frames[base + 5].second = name != nullptr ? name : "(" + std::to_string(genre) + ")";
+        }
+    }
+    return 0;
+}
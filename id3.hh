@@ -0,0 +1,361 @@
+#ifndef ID3_H
+#define ID3_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Bytes read from the start of a file before the tag size is known
+#define ID3_PREFETCH_SIZE 4096
+
+// Tags larger than this are memory-mapped rather than read
+#define ID3_MAP_THRESHOLD (64 * 1024)
+
+// Bytes id3_2_frame_stream reads at a time
+#define ID3_STREAM_CHUNK (64 * 1024)
+
+// ID3v2 header flag: an extended header follows the header
+#define ID3_2_FLAG_EXTENDED 0x40
+
+typedef enum {
+    ID3_NONE,
+    ID3_V1,
+    ID3_V2,
+} id3_version_t;
+
+/**********************************************
+ *  id3v1 is the following format: 
+ *  "TAG" - 3 bytes
+ *  TITLE - 30 bytes
+ *  ARTIST - 30 bytes
+ *  ALBUM - 30 bytes
+ *  YEAR - 4 bytes
+ *  COMMENT/TRACK - 30 bytes 
+ *  GENRE - 1 byte
+ * https://id3.org/ID3v1
+ **********************************************/
+typedef struct id3_1_t {
+    char title[30];
+    char artist[30];
+    char album[30];
+    char year[4];
+    char comment[30];
+    char genre[1];
+} id3_1_t;
+
+/**********************************************
+ *  id3v2 frames have the following format: 
+ *  ID - 4 bytes
+ *  SIZE - 4 bytes (big-endian)
+ *  FLAGS - 2 bytes
+ *  https://id3.org/id3v2.3.0
+ **********************************************/
+typedef struct id3_2_frame_header_t {
+    char id[4];
+    uint32_t size;
+    uint32_t flags;
+} id3_2_frame_t;
+
+/**********************************************
+ *  id3_tag_t:
+ *    the raw tag of a file as loaded by
+ *  id3_read_tag. For ID3v2 data holds the
+ *  10-byte header followed by the tag_sz
+ *  byte tag body, either read into memory or
+ *  mapped read-only for large tags.
+ **********************************************/
+typedef struct id3_tag_t {
+    uint8_t version;        // an id3_version_t
+    uint32_t tag_sz;        // ID3v2 size from the header, incl. padding
+    uint8_t* data;          // ID3v2 header and body
+    uint8_t* body;          // data + 10
+    size_t map_sz;          // length of the mapping if data is mmap'd
+    off_t v1_offset;        // offset of the ID3v1 "TAG" block
+    id3_1_t v1;
+} id3_tag_t;
+
+/**********************************************
+ *  id3_2_frame_view_t:
+ *    a frame inside a tag buffer. body points
+ *  into the buffer, so a view is only valid
+ *  while the buffer is.
+ **********************************************/
+typedef struct id3_2_frame_view_t {
+    char id[4];
+    uint32_t size;
+    uint8_t flags[2];
+    const uint8_t* body;
+} id3_2_frame_view_t;
+
+/**********************************************
+ *  id3_2_frame_iter_t:
+ *    walks the frames of a tag body without
+ *  copying or allocating.
+ **********************************************/
+typedef struct id3_2_frame_iter_t {
+    const uint8_t* buf;
+    uint32_t sz;
+    uint32_t off;
+    uint8_t major;          // ID3v2 major version of the frame headers
+} id3_2_frame_iter_t;
+
+// Flips endianess of 32-bit integer
+uint32_t flip_endianness(uint32_t x);
+
+/**********************************************
+ *  id3_2_frames_readable:
+ *    returns whether frames of tags with major
+ *  version major can be walked: ID3v2.3 and
+ *  ID3v2.4, but not the 6-byte frame headers
+ *  of ID3v2.2.
+ **********************************************/
+int id3_2_frames_readable(uint8_t major);
+
+/**********************************************
+ *  id3_2_frame_size:
+ *    decodes the size in the frame header at p
+ *  of a tag with major version major: plain
+ *  big-endian in ID3v2.3, synchsafe in
+ *  ID3v2.4.
+ **********************************************/
+uint32_t id3_2_frame_size(const uint8_t* p, uint8_t major);
+
+/**********************************************
+ *  put_id3_2_frame_size:
+ *    encodes sz into the frame header at p as
+ *  id3_2_frame_size reads it.
+ **********************************************/
+void put_id3_2_frame_size(uint8_t* p, uint32_t sz, uint8_t major);
+
+/**********************************************
+ *  id3_2_frames_offset:
+ *    returns the offset in the body of the
+ *  first frame of the tag with the header at
+ *  data and a sz byte body, past the extended
+ *  header if it has one (at most sz).
+ **********************************************/
+uint32_t id3_2_frames_offset(const uint8_t* data, uint32_t sz);
+
+/**********************************************
+ *  id3_2_frame_iter_init:
+ *    starts it at the first frame of the sz
+ *  byte tag body in buf, whose frame headers
+ *  are those of ID3v2 major version major.
+ **********************************************/
+void id3_2_frame_iter_init(id3_2_frame_iter_t* it, const uint8_t* buf, uint32_t sz, uint8_t major);
+
+/**********************************************
+ *  id3_2_frame_iter_tag:
+ *    starts it at the first frame of tag, past
+ *  any extended header. Tags that are not
+ *  ID3v2, or whose frames are not readable,
+ *  have no frames.
+ **********************************************/
+void id3_2_frame_iter_tag(id3_2_frame_iter_t* it, const id3_tag_t* tag);
+
+/**********************************************
+ *  id3_2_frame_next:
+ *    fills view with the next frame and returns
+ *  1, or returns 0 at the padding, the end of
+ *  the tag or a frame that overruns it. it->off
+ *  is then the offset the walk stopped at.
+ **********************************************/
+int id3_2_frame_next(id3_2_frame_iter_t* it, id3_2_frame_view_t* view);
+
+/**********************************************
+ *  id3_2_tag_size:
+ *    decodes the synchsafe tag size from the
+ *  10-byte ID3v2 header in header.
+ **********************************************/
+uint32_t id3_2_tag_size(const uint8_t* header);
+
+/**********************************************
+ *  put_id3_2_tag_size:
+ *    encodes tag_sz as the synchsafe size in
+ *  the 10-byte ID3v2 header in header.
+ **********************************************/
+void put_id3_2_tag_size(uint8_t* header, uint32_t tag_sz);
+
+/**********************************************
+ *  id3_2_frames_size:
+ *    walks the frames in buf, whose headers are
+ *  those of ID3v2 major version major, and
+ *  returns the number of bytes they occupy,
+ *  i.e. the offset at which the padding
+ *  begins. A malformed frame counts as using
+ *  the rest of the buffer.
+ **********************************************/
+uint32_t id3_2_frames_size(const uint8_t* buf, uint32_t sz, uint8_t major);
+
+/**********************************************
+ *  id3_read_tag:
+ *    loads the tag of fd into tag. The first
+ *  ID3_PREFETCH_SIZE bytes are read at once and
+ *  hold most ID3v2 tags; larger tags take one
+ *  more read, or are mapped once they pass
+ *  ID3_MAP_THRESHOLD so that frames nobody
+ *  looks at are never read. Without an ID3v2 tag the last
+ *  128 bytes are read for an ID3v1 tag.
+ *  Returns 0 on success and -1 on a read
+ *  error. Release with id3_free_tag.
+ **********************************************/
+int id3_read_tag(int fd, id3_tag_t* tag);
+
+/**********************************************
+ *  id3_1_load:
+ *    fills tag from the 128-byte block read at
+ *  offset in the file if it is an ID3v1 tag.
+ *  Returns 1 if it is and 0 otherwise.
+ **********************************************/
+int id3_1_load(id3_tag_t* tag, const uint8_t* block, off_t offset);
+
+/**********************************************
+ *  id3_free_tag:
+ *    releases the buffer or mapping held by
+ *  tag.
+ **********************************************/
+void id3_free_tag(id3_tag_t* tag);
+
+/**********************************************
+ *  id3_2_frame_range_t:
+ *    where a frame body lies in its file, so
+ *  that large frames can be streamed or hashed
+ *  without being held in memory.
+ **********************************************/
+typedef struct id3_2_frame_range_t {
+    char id[4];
+    uint32_t size;
+    off_t offset;           // file offset of the body
+} id3_2_frame_range_t;
+
+/**********************************************
+ *  id3_stream_fn_t:
+ *    receives the next n bytes of a streamed
+ *  frame. Returns 0 to go on; anything else
+ *  stops the stream.
+ **********************************************/
+typedef int (*id3_stream_fn_t)(const uint8_t* buf, size_t n, void* ctx);
+
+/**********************************************
+ *  id3_2_frame_range:
+ *    fills range for the frame view of tag,
+ *  which id3_read_tag loaded.
+ **********************************************/
+void id3_2_frame_range(const id3_tag_t* tag, const id3_2_frame_view_t* view, id3_2_frame_range_t* range);
+
+/**********************************************
+ *  id3_2_frame_stream:
+ *    reads the body of range from fd in chunks
+ *  of ID3_STREAM_CHUNK bytes and hands each to
+ *  fn. Returns 0 once every byte was passed,
+ *  -1 on a read error, or what fn returned if
+ *  it stopped the stream.
+ **********************************************/
+int id3_2_frame_stream(int fd, const id3_2_frame_range_t* range, id3_stream_fn_t fn, void* ctx);
+
+/**********************************************
+ *  id3_2_skim_t:
+ *    loads an ID3v2 tag while skipping lazy
+ *  frames (see id3_frame_is_lazy) by offset,
+ *  for callers that make their own reads, such
+ *  as on an io_uring. buf holds the header and
+ *  the frames kept so far, then bytes not yet
+ *  parsed. Once loaded, the first kept bytes
+ *  of buf are the header and the kept frames,
+ *  a tag for reading but not for editing.
+ **********************************************/
+typedef struct id3_2_skim_t {
+    uint8_t* buf;
+    size_t cap;             // allocated size of buf
+    size_t kept;            // header, extended header and whole frames kept
+    size_t got;             // bytes in buf
+    size_t pos;             // file offset of buf + got
+    size_t total;           // header and body of the tag
+    uint8_t major;          // ID3v2 major version
+} id3_2_skim_t;
+
+/**********************************************
+ *  id3_2_skim_init:
+ *    starts sk on the malloc'd buffer buf of
+ *  cap bytes holding the first got bytes of a
+ *  file that starts with an ID3v2 header. sk
+ *  takes over buf.
+ **********************************************/
+void id3_2_skim_init(id3_2_skim_t* sk, uint8_t* buf, size_t cap, size_t got);
+
+/**********************************************
+ *  id3_2_skim_next:
+ *    parses what has been read. Returns 1 with
+ *  the read to make next in *off and *len (the
+ *  bytes go to sk->buf + sk->got, which has
+ *  room, and are then passed to
+ *  id3_2_skim_fill), 0 once the tag is loaded
+ *  and -1 if memory ran out.
+ **********************************************/
+int id3_2_skim_next(id3_2_skim_t* sk, size_t* off, size_t* len);
+
+/**********************************************
+ *  id3_2_skim_fill:
+ *    records that n bytes were read into
+ *  sk->buf + sk->got.
+ **********************************************/
+void id3_2_skim_fill(id3_2_skim_t* sk, size_t n);
+
+/**********************************************
+ *  id3_frame_text_t:
+ *    a decoded text frame: the frame ID and its
+ *  text as UTF-8.
+ **********************************************/
+typedef std::pair<std::string, std::string> id3_frame_text_t;
+
+/**********************************************
+ *  id3_1_genre_name:
+ *    returns the name of ID3v1 genre number
+ *  genre, including the Winamp extensions, or
+ *  nullptr if it has none.
+ **********************************************/
+const char* id3_1_genre_name(uint8_t genre);
+
+/**********************************************
+ *  id3_version_name:
+ *    returns the display name of a tag with
+ *  id3_version_t version and, for ID3v2, the
+ *  header's major version byte minor. Returns
+ *  nullptr when there is no tag.
+ **********************************************/
+const char* id3_version_name(uint8_t version, uint8_t minor);
+
+/**********************************************
+ *  id3_decode_frames:
+ *    appends the text frames of tag to frames
+ *  as UTF-8, keeping the first frame of each
+ *  ID. ID3v1 fields are reported under the
+ *  matching ID3v2 frame IDs, the genre by its
+ *  name. Returns 0, or -1 for an ID3v2 tag
+ *  whose frames cannot be walked (see
+ *  id3_2_frames_readable).
+ **********************************************/
+int id3_decode_frames(const id3_tag_t* tag, std::vector<id3_frame_text_t>& frames);
+
+/**********************************************
+ *  id3_2_text_utf8:
+ *    decodes the body of a text frame (the
+ *  encoding byte followed by text) and appends
+ *  it to out as UTF-8. Trailing terminators
+ *  are dropped and inner ones become '/'.
+ **********************************************/
+void id3_2_text_utf8(const uint8_t* body, uint32_t sz, std::string& out);
+
+/**********************************************
+ *  id3_2_string_utf8:
+ *    decodes sz bytes of text in the ID3v2
+ *  text encoding encoding and appends them to
+ *  out as UTF-8, as id3_2_text_utf8 does.
+ *  Malformed UTF-8 becomes U+FFFD.
+ **********************************************/
+void id3_2_string_utf8(uint8_t encoding, const uint8_t* text, uint32_t sz, std::string& out);
+
+#endif
@@ -0,0 +1,287 @@
+#include "id3frames.hh"
+#include "id3.hh"
+
+// Slots in the hash index; a power of two well above the table size
+#define FRAME_INDEX_BITS 8
+#define FRAME_INDEX_SIZE (1 << FRAME_INDEX_BITS)
+#define FRAME_INDEX_EMPTY 0xff
+
+/**********************************************
+ *  skip_string:
+ *    returns the end of the terminated string
+ *  in encoding encoding that starts at p, i.e.
+ *  the first byte after its terminator, or end
+ *  if it is not terminated.
+ **********************************************/
+static const uint8_t* skip_string(uint8_t encoding, const uint8_t* p, const uint8_t* end) {
+    if (encoding == 1 || encoding == 2) {
+        for (; p + 1 < end; p += 2) {
+            if (p[0] == 0 && p[1] == 0) {
+                return p + 2;
+            }
+        }
+        return end;
+    }
+    for (; p < end; ++p) {
+        if (*p == 0) {
+            return p + 1;
+        }
+    }
+    return end;
+}
+
+/**********************************************
+ *  url_utf8:
+ *    decodes the body of a URL frame, which is
+ *  ISO-8859-1 with no encoding byte.
+ **********************************************/
+static void url_utf8(const uint8_t* body, uint32_t sz, std::string& out) {
+    id3_2_string_utf8(0, body, sz, out);
+}
+
+/**********************************************
+ *  user_text_utf8:
+ *    decodes the value of a TXXX frame: the
+ *  encoding byte, a description and the value.
+ **********************************************/
+static void user_text_utf8(const uint8_t* body, uint32_t sz, std::string& out) {
+    if (sz <= 1) {
+        return;
+    }
+    const uint8_t* end = body + sz;
+    const uint8_t* value = skip_string(body[0], body + 1, end);
+    id3_2_string_utf8(body[0], value, end - value, out);
+}
+
+/**********************************************
+ *  user_url_utf8:
+ *    decodes the URL of a WXXX frame, which
+ *  follows the description in ISO-8859-1.
+ **********************************************/
+static void user_url_utf8(const uint8_t* body, uint32_t sz, std::string& out) {
+    if (sz <= 1) {
+        return;
+    }
+    const uint8_t* end = body + sz;
+    const uint8_t* value = skip_string(body[0], body + 1, end);
+    id3_2_string_utf8(0, value, end - value, out);
+}
+
+/**********************************************
+ *  comment_utf8:
+ *    decodes the text of a COMM or USLT frame:
+ *  the encoding byte, a 3-byte language, a
+ *  description and the text.
+ **********************************************/
+static void comment_utf8(const uint8_t* body, uint32_t sz, std::string& out) {
+    if (sz <= 4) {
+        return;
+    }
+    const uint8_t* end = body + sz;
+    const uint8_t* text = skip_string(body[0], body + 4, end);
+    id3_2_string_utf8(body[0], text, end - text, out);
+}
+
+#define TEXT(id, name, trait) {id3_fourcc(id), name, trait, ID3_FRAME_TEXT, id3_2_text_utf8}
+#define URL(id, name) {id3_fourcc(id), name, ID3_TRAIT_NONE, ID3_FRAME_URL, url_utf8}
+#define BINARY(id, name) {id3_fourcc(id), name, ID3_TRAIT_NONE, ID3_FRAME_BINARY, nullptr}
+
+constexpr id3_frame_info_t id3_frames[] = {
+    // Text frames
+    TEXT("TALB", "Album", ID3_TRAIT_ALBUM),
+    TEXT("TBPM", "BPM", ID3_TRAIT_NONE),
+    TEXT("TCMP", "Compilation", ID3_TRAIT_NONE),
+    TEXT("TCOM", "Composer", ID3_TRAIT_COMPOSER),
+    TEXT("TCON", "Genre", ID3_TRAIT_NONE),
+    TEXT("TCOP", "Copyright", ID3_TRAIT_NONE),
+    TEXT("TDAT", "Date", ID3_TRAIT_NONE),
+    TEXT("TDEN", "Encoding time", ID3_TRAIT_NONE),
+    TEXT("TDLY", "Playlist delay", ID3_TRAIT_NONE),
+    TEXT("TDOR", "Original release time", ID3_TRAIT_NONE),
+    TEXT("TDRC", "Recording time", ID3_TRAIT_YEAR),
+    TEXT("TDRL", "Release time", ID3_TRAIT_NONE),
+    TEXT("TDTG", "Tagging time", ID3_TRAIT_NONE),
+    TEXT("TENC", "Encoded by", ID3_TRAIT_NONE),
+    TEXT("TEXT", "Lyricist", ID3_TRAIT_NONE),
+    TEXT("TFLT", "File type", ID3_TRAIT_NONE),
+    TEXT("TIME", "Time", ID3_TRAIT_NONE),
+    TEXT("TIPL", "Involved people", ID3_TRAIT_NONE),
+    TEXT("TIT1", "Grouping", ID3_TRAIT_NONE),
+    TEXT("TIT2", "Title", ID3_TRAIT_TITLE),
+    TEXT("TIT3", "Subtitle", ID3_TRAIT_NONE),
+    TEXT("TKEY", "Initial key", ID3_TRAIT_NONE),
+    TEXT("TLAN", "Language", ID3_TRAIT_NONE),
+    TEXT("TLEN", "Length", ID3_TRAIT_NONE),
+    TEXT("TMCL", "Musician credits", ID3_TRAIT_NONE),
+    TEXT("TMED", "Media type", ID3_TRAIT_NONE),
+    TEXT("TMOO", "Mood", ID3_TRAIT_NONE),
+    TEXT("TOAL", "Original album", ID3_TRAIT_NONE),
+    TEXT("TOFN", "Original filename", ID3_TRAIT_NONE),
+    TEXT("TOLY", "Original lyricist", ID3_TRAIT_NONE),
+    TEXT("TOPE", "Original artist", ID3_TRAIT_NONE),
+    TEXT("TORY", "Original release year", ID3_TRAIT_NONE),
+    TEXT("TOWN", "File owner", ID3_TRAIT_NONE),
+    TEXT("TPE1", "Artist", ID3_TRAIT_ARTIST),
+    TEXT("TPE2", "Band", ID3_TRAIT_NONE),
+    TEXT("TPE3", "Conductor", ID3_TRAIT_NONE),
+    TEXT("TPE4", "Remixed by", ID3_TRAIT_NONE),
+    TEXT("TPOS", "Disc", ID3_TRAIT_NONE),
+    TEXT("TPRO", "Produced notice", ID3_TRAIT_NONE),
+    TEXT("TPUB", "Publisher", ID3_TRAIT_NONE),
+    TEXT("TRCK", "Track", ID3_TRAIT_TRACK),
+    TEXT("TRDA", "Recording dates", ID3_TRAIT_NONE),
+    TEXT("TRSN", "Radio station", ID3_TRAIT_NONE),
+    TEXT("TRSO", "Radio station owner", ID3_TRAIT_NONE),
+    TEXT("TSIZ", "Size", ID3_TRAIT_NONE),
+    TEXT("TSO2", "Album artist sort order", ID3_TRAIT_NONE),
+    TEXT("TSOA", "Album sort order", ID3_TRAIT_NONE),
+    TEXT("TSOC", "Composer sort order", ID3_TRAIT_NONE),
+    TEXT("TSOP", "Performer sort order", ID3_TRAIT_NONE),
+    TEXT("TSOT", "Title sort order", ID3_TRAIT_NONE),
+    TEXT("TSRC", "ISRC", ID3_TRAIT_NONE),
+    TEXT("TSSE", "Encoder settings", ID3_TRAIT_NONE),
+    TEXT("TSST", "Set subtitle", ID3_TRAIT_NONE),
+    TEXT("TYER", "Year", ID3_TRAIT_YEAR),
+    TEXT("IPLS", "Involved people", ID3_TRAIT_NONE),
+    {id3_fourcc("TXXX"), "User text", ID3_TRAIT_NONE, ID3_FRAME_USER_TEXT, user_text_utf8},
+
+    // URL frames
+    URL("WCOM", "Commercial URL"),
+    URL("WCOP", "Copyright URL"),
+    URL("WOAF", "Audio file URL"),
+    URL("WOAR", "Artist URL"),
+    URL("WOAS", "Audio source URL"),
+    URL("WORS", "Radio station URL"),
+    URL("WPAY", "Payment URL"),
+    URL("WPUB", "Publisher URL"),
+    {id3_fourcc("WXXX"), "User URL", ID3_TRAIT_NONE, ID3_FRAME_USER_URL, user_url_utf8},
+
+    // Comments, lyrics and pictures
+    {id3_fourcc("COMM"), "Comment", ID3_TRAIT_NONE, ID3_FRAME_COMMENT, comment_utf8},
+    {id3_fourcc("USLT"), "Lyrics", ID3_TRAIT_NONE, ID3_FRAME_COMMENT, comment_utf8},
+    {id3_fourcc("APIC"), "Picture", ID3_TRAIT_NONE, ID3_FRAME_PICTURE, nullptr},
+
+    // Everything else
+    BINARY("AENC", "Audio encryption"),
+    BINARY("ASPI", "Seek point index"),
+    BINARY("CHAP", "Chapter"),
+    BINARY("COMR", "Commercial"),
+    BINARY("CTOC", "Table of contents"),
+    BINARY("ENCR", "Encryption method"),
+    BINARY("EQU2", "Equalisation"),
+    BINARY("EQUA", "Equalisation"),
+    BINARY("ETCO", "Event timing codes"),
+    BINARY("GEOB", "Encapsulated object"),
+    BINARY("GRID", "Group identification"),
+    BINARY("LINK", "Linked information"),
+    BINARY("MCDI", "Music CD identifier"),
+    BINARY("MLLT", "MPEG location lookup table"),
+    BINARY("OWNE", "Ownership"),
+    BINARY("PCNT", "Play counter"),
+    BINARY("POPM", "Popularimeter"),
+    BINARY("POSS", "Position synchronisation"),
+    BINARY("PRIV", "Private"),
+    BINARY("RBUF", "Recommended buffer size"),
+    BINARY("RVA2", "Relative volume adjustment"),
+    BINARY("RVAD", "Relative volume adjustment"),
+    BINARY("RVRB", "Reverb"),
+    BINARY("SEEK", "Seek"),
+    BINARY("SIGN", "Signature"),
+    BINARY("SYLT", "Synchronised lyrics"),
+    BINARY("SYTC", "Synchronised tempo codes"),
+    BINARY("UFID", "Unique file identifier"),
+    BINARY("USER", "Terms of use"),
+};
+
+const size_t num_id3_frames = sizeof(id3_frames) / sizeof(id3_frames[0]);
+
+#undef TEXT
+#undef URL
+#undef BINARY
+
+/**********************************************
+ *  frame_hash:
+ *    the home slot of a FourCC in the index.
+ **********************************************/
+static constexpr uint32_t frame_hash(uint32_t id) {
+    return (id * 0x9e3779b1u) >> (32 - FRAME_INDEX_BITS);
+}
+
+/**********************************************
+ *  frame_index_t:
+ *    open-addressed hash of id3_frames: each
+ *  slot holds a table position or
+ *  FRAME_INDEX_EMPTY. max_probe is the longest
+ *  run any ID is placed away from its home.
+ **********************************************/
+typedef struct frame_index_t {
+    uint8_t slot[FRAME_INDEX_SIZE];
+    uint32_t max_probe;
+} frame_index_t;
+
+/**********************************************
+ *  build_frame_index:
+ *    places every frame of id3_frames in the
+ *  index with linear probing. Runs at compile
+ *  time.
+ **********************************************/
+static constexpr frame_index_t build_frame_index() {
+    frame_index_t index = {};
+    for (size_t i = 0; i < FRAME_INDEX_SIZE; ++i) {
+        index.slot[i] = FRAME_INDEX_EMPTY;
+    }
+    for (size_t i = 0; i < sizeof(id3_frames) / sizeof(id3_frames[0]); ++i) {
+        uint32_t h = frame_hash(id3_frames[i].id);
+        uint32_t probe = 0;
+        while (index.slot[(h + probe) % FRAME_INDEX_SIZE] != FRAME_INDEX_EMPTY) {
+            ++probe;
+        }
+        index.slot[(h + probe) % FRAME_INDEX_SIZE] = i;
+        if (probe > index.max_probe) {
+            index.max_probe = probe;
+        }
+    }
+    return index;
+}
+
+static constexpr frame_index_t frame_index = build_frame_index();
+
+static_assert(sizeof(id3_frames) / sizeof(id3_frames[0]) <= ID3_MAX_KNOWN_FRAMES, "frame table outgrew ID3_MAX_KNOWN_FRAMES");
+static_assert(frame_index.max_probe <= 4, "frame hash clusters; pick another multiplier");
+
+/**********************************************
+ *  id3_frame_info:
+ *    returns the table entry for the frame ID
+ *  id (an id3_fourcc), or nullptr if it is not
+ *  a known frame.
+ **********************************************/
+const id3_frame_info_t* id3_frame_info(uint32_t id) {
+    uint32_t h = frame_hash(id);
+    for (uint32_t probe = 0; probe <= frame_index.max_probe; ++probe) {
+        uint8_t i = frame_index.slot[(h + probe) % FRAME_INDEX_SIZE];
+        if (i == FRAME_INDEX_EMPTY) {
+            return nullptr;
+        }
+        if (id3_frames[i].id == id) {
+            return &id3_frames[i];
+        }
+    }
+    return nullptr;
+}
+
+/**********************************************
+ *  id3_frame_is_lazy:
+ *    returns 1 if a frame with ID id and size
+ *  body bytes is left in the file rather than
+ *  read.
+ **********************************************/
+int id3_frame_is_lazy(uint32_t id, uint32_t size) {
+    if (size < ID3_LAZY_FRAME_SIZE) {
+        return 0;
+    }
+    const id3_frame_info_t* info = id3_frame_info(id);
+    if (info == nullptr) {
+        return (id >> 24) != 'T';
+    }
+    return info->kind == ID3_FRAME_PICTURE || info->kind == ID3_FRAME_BINARY;
+}
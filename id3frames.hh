@@ -0,0 +1,96 @@
+#ifndef ID3_FRAMES_H
+#define ID3_FRAMES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/**********************************************
+ *  id3_fourcc:
+ *    packs a 4-character frame ID into a
+ *  big-endian 32-bit integer, so that "TIT2"
+ *  compares as one word. Usable in constant
+ *  expressions and on frame headers alike.
+ **********************************************/
+constexpr uint32_t id3_fourcc(const char* id) {
+    return ((uint32_t) (uint8_t) id[0] << 24) | ((uint32_t) (uint8_t) id[1] << 16) |
+           ((uint32_t) (uint8_t) id[2] << 8) | (uint32_t) (uint8_t) id[3];
+}
+
+typedef enum {
+    ID3_FRAME_TEXT,         // T*** except TXXX
+    ID3_FRAME_USER_TEXT,    // TXXX
+    ID3_FRAME_URL,          // W*** except WXXX
+    ID3_FRAME_USER_URL,     // WXXX
+    ID3_FRAME_COMMENT,      // COMM, USLT
+    ID3_FRAME_PICTURE,      // APIC
+    ID3_FRAME_BINARY,       // everything else
+} id3_frame_kind_t;
+
+/**********************************************
+ *  id3_trait_t:
+ *    the fields a frame fills in, for callers
+ *  that track which of them a tag has.
+ **********************************************/
+typedef enum {
+    ID3_TRAIT_NONE,
+    ID3_TRAIT_TITLE,
+    ID3_TRAIT_ARTIST,
+    ID3_TRAIT_ALBUM,
+    ID3_TRAIT_YEAR,
+    ID3_TRAIT_TRACK,
+    ID3_TRAIT_COMPOSER,
+    NUM_ID3_TRAITS,
+} id3_trait_t;
+
+/**********************************************
+ *  id3_frame_decoder_t:
+ *    appends the readable text of a frame body
+ *  of sz bytes to out as UTF-8.
+ **********************************************/
+typedef void (*id3_frame_decoder_t)(const uint8_t* body, uint32_t sz, std::string& out);
+
+/**********************************************
+ *  id3_frame_info_t:
+ *    what is known about one frame ID. decode
+ *  is nullptr for frames without text.
+ **********************************************/
+typedef struct id3_frame_info_t {
+    uint32_t id;            // id3_fourcc of the frame ID
+    const char* name;       // display name
+    uint8_t trait;          // an id3_trait_t
+    uint8_t kind;           // an id3_frame_kind_t
+    id3_frame_decoder_t decode;
+} id3_frame_info_t;
+
+// Binary frames at least this large are skipped by offset, not read
+#define ID3_LAZY_FRAME_SIZE (16 * 1024)
+
+// Upper bound on the size of id3_frames, for per-frame scratch arrays
+#define ID3_MAX_KNOWN_FRAMES 128
+
+// Every ID3v2.3 and ID3v2.4 frame, plus common iTunes extensions
+extern const id3_frame_info_t id3_frames[];
+extern const size_t num_id3_frames;
+
+/**********************************************
+ *  id3_frame_info:
+ *    returns the table entry for the frame ID
+ *  id (an id3_fourcc), or nullptr if it is not
+ *  a known frame. One hash probe in the common
+ *  case; the hash index is built at compile
+ *  time.
+ **********************************************/
+const id3_frame_info_t* id3_frame_info(uint32_t id);
+
+/**********************************************
+ *  id3_frame_is_lazy:
+ *    returns 1 if a frame with ID id (an
+ *  id3_fourcc) and size body bytes is left in
+ *  the file rather than read: pictures, binary
+ *  frames and unknown frames that are not text,
+ *  of at least ID3_LAZY_FRAME_SIZE bytes.
+ **********************************************/
+int id3_frame_is_lazy(uint32_t id, uint32_t size);
+
+#endif
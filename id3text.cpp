@@ -0,0 +1,328 @@
+#include "id3.hh"
+
+// Build with -DID3_TEXT_SCALAR to leave out the SIMD kernels
+#if !defined(ID3_TEXT_SCALAR) && defined(__x86_64__)
+#define ID3_TEXT_SIMD
+#include <immintrin.h>
+#endif
+
+// Bytes the scalar decoder handles before retrying the SIMD kernels
+#define TEXT_SCALAR_STEP 32
+
+/**********************************************
+ *  text_kernels_t:
+ *    fast paths for runs of plain ASCII text.
+ *  Each appends the longest prefix of whole
+ *  vectors of p that are ASCII without NULs to
+ *  out and returns the number of bytes it
+ *  consumed, which may be 0.
+ **********************************************/
+typedef struct text_kernels_t {
+    size_t (*ascii)(const uint8_t* p, size_t n, std::string& out);
+    size_t (*utf16)(const uint8_t* p, size_t n, int big_endian, std::string& out);
+} text_kernels_t;
+
+static size_t scalar_ascii(const uint8_t*, size_t, std::string&) {
+    return 0;
+}
+
+static size_t scalar_utf16(const uint8_t*, size_t, int, std::string&) {
+    return 0;
+}
+
+static const text_kernels_t scalar_kernels = {scalar_ascii, scalar_utf16};
+
+#ifdef ID3_TEXT_SIMD
+
+/**********************************************
+ *  sse2_ascii:
+ *    copies 16-byte blocks of ASCII, which is
+ *  the same in ISO-8859-1 and UTF-8.
+ **********************************************/
+static size_t sse2_ascii(const uint8_t* p, size_t n, std::string& out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        if (_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) {
+            break;
+        }
+    }
+    out.append((const char*) p, i);
+    return i;
+}
+
+/**********************************************
+ *  sse2_utf16:
+ *    narrows blocks of 8 UTF-16 code units
+ *  below 0x80 to bytes.
+ **********************************************/
+static size_t sse2_utf16(const uint8_t* p, size_t n, int big_endian, std::string& out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high_bits = _mm_set1_epi16((short) 0xff80);
+    uint8_t narrow[16];
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        if (big_endian) {
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        }
+        __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, high_bits), zero);
+        __m128i nul = _mm_cmpeq_epi16(v, zero);
+        if (_mm_movemask_epi8(_mm_andnot_si128(nul, ascii)) != 0xffff) {
+            break;
+        }
+        _mm_storeu_si128((__m128i*) narrow, _mm_packus_epi16(v, v));
+        out.append((const char*) narrow, 8);
+    }
+    return i;
+}
+
+static const text_kernels_t sse2_kernels = {sse2_ascii, sse2_utf16};
+
+/**********************************************
+ *  avx2_ascii:
+ *    sse2_ascii on 32-byte blocks.
+ **********************************************/
+__attribute__((target("avx2")))
+static size_t avx2_ascii(const uint8_t* p, size_t n, std::string& out) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+        if (_mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) {
+            break;
+        }
+    }
+    out.append((const char*) p, i);
+    return i + sse2_ascii(p + i, n - i, out);
+}
+
+/**********************************************
+ *  avx2_utf16:
+ *    sse2_utf16 on blocks of 16 code units.
+ **********************************************/
+__attribute__((target("avx2")))
+static size_t avx2_utf16(const uint8_t* p, size_t n, int big_endian, std::string& out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i high_bits = _mm256_set1_epi16((short) 0xff80);
+    uint8_t narrow[32];
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (p + i));
+        if (big_endian) {
+            v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        }
+        __m256i ascii = _mm256_cmpeq_epi16(_mm256_and_si256(v, high_bits), zero);
+        __m256i nul = _mm256_cmpeq_epi16(v, zero);
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_andnot_si256(nul, ascii)) != 0xffffffff) {
+            break;
+        }
+        // packus works per 128-bit lane; gather the two low quarters
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+        _mm256_storeu_si256((__m256i*) narrow, packed);
+        out.append((const char*) narrow, 16);
+    }
+    return i + sse2_utf16(p + i, n - i, big_endian, out);
+}
+
+static const text_kernels_t avx2_kernels = {avx2_ascii, avx2_utf16};
+
+#endif
+
+/**********************************************
+ *  select_kernels:
+ *    picks the widest kernels the CPU runs.
+ **********************************************/
+static const text_kernels_t* select_kernels() {
+#ifdef ID3_TEXT_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    return &sse2_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+static const text_kernels_t* kernels = select_kernels();
+
+/**********************************************
+ *  put_utf8:
+ *    appends code point cp to out as UTF-8.
+ **********************************************/
+static void put_utf8(uint32_t cp, std::string& out) {
+    if (cp < 0x80) {
+        out += (char) cp;
+    } else if (cp < 0x800) {
+        out += (char) (0xc0 | (cp >> 6));
+        out += (char) (0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char) (0xe0 | (cp >> 12));
+        out += (char) (0x80 | ((cp >> 6) & 0x3f));
+        out += (char) (0x80 | (cp & 0x3f));
+    } else {
+        out += (char) (0xf0 | (cp >> 18));
+        out += (char) (0x80 | ((cp >> 12) & 0x3f));
+        out += (char) (0x80 | ((cp >> 6) & 0x3f));
+        out += (char) (0x80 | (cp & 0x3f));
+    }
+}
+
+/**********************************************
+ *  next_utf8:
+ *    decodes the UTF-8 sequence at the start
+ *  of the n > 0 bytes at p into cp and returns
+ *  its length. A byte that does not start a
+ *  well-formed sequence (overlong, surrogate,
+ *  past U+10FFFF, or cut short) decodes as
+ *  U+FFFD with length 1.
+ **********************************************/
+static size_t next_utf8(const uint8_t* p, size_t n, uint32_t* cp) {
+    uint8_t c = p[0];
+    size_t len;
+    uint32_t min;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if (c >= 0xc2 && c < 0xe0) {
+        len = 2;
+        min = 0x80;
+        *cp = c & 0x1f;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        len = 3;
+        min = 0x800;
+        *cp = c & 0x0f;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        len = 4;
+        min = 0x10000;
+        *cp = c & 0x07;
+    } else {
+        *cp = 0xfffd;
+        return 1;
+    }
+    if (len > n) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *cp = 0xfffd;
+            return 1;
+        }
+        *cp = (*cp << 6) | (p[i] & 0x3f);
+    }
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp < 0xe000)) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    return len;
+}
+
+/**********************************************
+ *  id3_2_text_utf8:
+ *    decodes the body of a text frame (the
+ *  encoding byte followed by text) and appends
+ *  it to out as UTF-8. Trailing terminators
+ *  are dropped and inner ones become '/'.
+ **********************************************/
+void id3_2_text_utf8(const uint8_t* body, uint32_t sz, std::string& out) {
+    if (sz <= 1) {
+        return;
+    }
+    id3_2_string_utf8(body[0], body + 1, sz - 1, out);
+}
+
+/**********************************************
+ *  id3_2_string_utf8:
+ *    decodes sz bytes of text in the ID3v2
+ *  text encoding encoding and appends them to
+ *  out as UTF-8, as id3_2_text_utf8 does.
+ *  Malformed UTF-8 becomes U+FFFD. Runs of
+ *  ASCII go through the SIMD kernels;
+ *  everything else, including BOMs,
+ *  surrogates and multibyte UTF-8, through
+ *  the scalar loops.
+ **********************************************/
+void id3_2_string_utf8(uint8_t encoding, const uint8_t* text, uint32_t sz, std::string& out) {
+    const uint8_t* p = text;
+    const uint8_t* end = text + sz;
+
+    // Drop the terminators
+    if (encoding == 1 || encoding == 2) {
+        end = p + ((end - p) & ~1);
+        while (end - p >= 2 && end[-1] == 0 && end[-2] == 0) {
+            end -= 2;
+        }
+    } else {
+        while (end > p && end[-1] == 0) {
+            --end;
+        }
+    }
+    out.reserve(out.size() + (end - p));
+
+    if (encoding == 1 || encoding == 2) {
+        // UTF-16 with BOM (1) or big-endian without (2)
+        int big_endian = encoding == 2;
+        uint32_t high = 0;
+        while (p + 1 < end) {
+            size_t done = kernels->utf16(p, end - p, big_endian, out);
+            if (done) {
+                p += done;
+                high = 0;
+                continue;
+            }
+            const uint8_t* stop = end - p > TEXT_SCALAR_STEP ? p + TEXT_SCALAR_STEP : end;
+            while (p + 1 < stop) {
+                uint32_t unit = big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+                p += 2;
+                if (unit == 0xfeff || unit == 0xfffe) {
+                    // A BOM may start each string; 0xfffe means we guessed wrong
+                    if (unit == 0xfffe) {
+                        big_endian = !big_endian;
+                    }
+                    continue;
+                }
+                if (unit >= 0xd800 && unit < 0xdc00) {
+                    high = unit;
+                    continue;
+                }
+                if (unit >= 0xdc00 && unit < 0xe000) {
+                    if (high) {
+                        put_utf8(0x10000 + ((high - 0xd800) << 10) + (unit - 0xdc00), out);
+                    }
+                    high = 0;
+                    continue;
+                }
+                high = 0;
+                put_utf8(unit ? unit : '/', out);
+            }
+        }
+    } else if (encoding == 3) {
+        // UTF-8
+        while (p < end) {
+            p += kernels->ascii(p, end - p, out);
+            const uint8_t* stop = end - p > TEXT_SCALAR_STEP ? p + TEXT_SCALAR_STEP : end;
+            while (p < stop) {
+                uint32_t cp;
+                size_t len = next_utf8(p, end - p, &cp);
+                if (cp == 0 || cp == 0xfffd) {
+                    put_utf8(cp ? cp : '/', out);
+                } else {
+                    out.append((const char*) p, len);
+                }
+                p += len;
+            }
+        }
+    } else {
+        // ISO-8859-1
+        while (p < end) {
+            p += kernels->ascii(p, end - p, out);
+            const uint8_t* stop = end - p > TEXT_SCALAR_STEP ? p + TEXT_SCALAR_STEP : end;
+            for (; p < stop; ++p) {
+                put_utf8(*p ? *p : '/', out);
+            }
+        }
+    }
+}
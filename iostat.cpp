@@ -0,0 +1,275 @@
+#include "iostat.hh"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+/**********************************************
+ *  iostat_thread_t:
+ *    the counters of one thread, the phase it
+ *  is in since phase_start and the sink it
+ *  reports to.
+ **********************************************/
+typedef struct iostat_thread_t {
+    iostat_t stat;
+    uint8_t phase;          // an iostat_phase_t
+    int64_t phase_start;
+    iostat_sink_t* sink;
+} iostat_thread_t;
+
+static thread_local iostat_thread_t local;
+
+static const char* call_names[NUM_IOSTAT_CALLS] = {
+    "open", "read", "write", "seek", "rename", "copy", "sync",
+};
+
+static const char* phase_names[NUM_IOSTAT_PHASES] = {
+    "", "open", "parse", "frames", "audio", "write", "sync",
+};
+
+/**********************************************
+ *  iostat_local:
+ *    returns the counters of the calling
+ *  thread.
+ **********************************************/
+iostat_t* iostat_local() {
+    return &local.stat;
+}
+
+/**********************************************
+ *  iostat_now:
+ *    returns a monotonic time in nanoseconds.
+ **********************************************/
+int64_t iostat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**********************************************
+ *  iostat_enter:
+ *    charges the time since the last switch
+ *  to the current phase and makes phase the
+ *  current one. Returns the phase it replaced.
+ **********************************************/
+uint8_t iostat_enter(uint8_t phase) {
+    int64_t now = iostat_now();
+    uint8_t prev = local.phase;
+    if (prev != IOSTAT_PHASE_NONE) {
+        local.stat.phase_ns[prev] += now - local.phase_start;
+    }
+    local.phase = phase;
+    local.phase_start = now;
+    return prev;
+}
+
+/**********************************************
+ *  iostat_leave:
+ *    stops timing the current phase and
+ *  resumes prev.
+ **********************************************/
+void iostat_leave(uint8_t prev) {
+    iostat_enter(prev);
+}
+
+/**********************************************
+ *  iostat_sink_init:
+ *    empties sink.
+ **********************************************/
+void iostat_sink_init(iostat_sink_t* sink) {
+    memset(&sink->total, 0, sizeof(sink->total));
+    sink->latency_ns.clear();
+}
+
+/**********************************************
+ *  iostat_attach:
+ *    makes the calling thread report to sink.
+ **********************************************/
+void iostat_attach(iostat_sink_t* sink) {
+    local.sink = sink;
+}
+
+/**********************************************
+ *  iostat_attached:
+ *    returns the sink of the calling thread.
+ **********************************************/
+iostat_sink_t* iostat_attached() {
+    return local.sink;
+}
+
+/**********************************************
+ *  iostat_flush:
+ *    adds the counters of the calling thread
+ *  and latency_ns to its sink, then clears
+ *  the counters.
+ **********************************************/
+void iostat_flush(const uint64_t* latency_ns, size_t num_files) {
+    iostat_sink_t* sink = local.sink;
+    if (sink == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(sink->lock);
+    iostat_t* total = &sink->total;
+    const iostat_t* s = &local.stat;
+    for (int i = 0; i < NUM_IOSTAT_CALLS; ++i) {
+        total->calls[i] += s->calls[i];
+    }
+    for (int i = 0; i < NUM_IOSTAT_PHASES; ++i) {
+        total->phase_ns[i] += s->phase_ns[i];
+    }
+    total->bytes_read += s->bytes_read;
+    total->bytes_written += s->bytes_written;
+    total->bytes_changed += s->bytes_changed;
+    total->bytes_copied += s->bytes_copied;
+    total->rewrites += s->rewrites;
+    sink->latency_ns.insert(sink->latency_ns.end(), latency_ns, latency_ns + num_files);
+    memset(&local.stat, 0, sizeof(local.stat));
+}
+
+/**********************************************
+ *  percentile:
+ *    returns the nearest-rank q-th quantile of
+ *  the sorted values v, or 0 if v is empty.
+ **********************************************/
+static uint64_t percentile(const std::vector<uint64_t>& v, double q) {
+    if (v.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t) (q * v.size() + 0.999999);
+    return v[rank ? rank - 1 : 0];
+}
+
+/**********************************************
+ *  iostat_report:
+ *    prints the totals of sink and the spread
+ *  of its file latencies to out. Write
+ *  amplification is bytes written per byte
+ *  changed.
+ **********************************************/
+void iostat_report(iostat_sink_t* sink, int json, FILE* out) {
+    std::lock_guard<std::mutex> guard(sink->lock);
+    const iostat_t* s = &sink->total;
+    std::vector<uint64_t> lat = sink->latency_ns;
+    std::sort(lat.begin(), lat.end());
+
+    double p50 = percentile(lat, 0.50) / 1e6;
+    double p99 = percentile(lat, 0.99) / 1e6;
+    double max = lat.empty() ? 0 : lat.back() / 1e6;
+    double amp = s->bytes_changed ? (double) s->bytes_written / s->bytes_changed : 0;
+
+    if (json) {
+        fprintf(out, "{\"files\":%zu,\"calls\":{", lat.size());
+        for (int i = 0; i < NUM_IOSTAT_CALLS; ++i) {
+            fprintf(out, "%s\"%s\":%llu", i ? "," : "", call_names[i], (unsigned long long) s->calls[i]);
+        }
+        fprintf(out, "},\"bytes_read\":%llu,\"bytes_written\":%llu,\"bytes_changed\":%llu,"
+                "\"bytes_copied\":%llu,\"rewrites\":%llu,\"write_amplification\":%.2f,\"phase_ms\":{",
+                (unsigned long long) s->bytes_read, (unsigned long long) s->bytes_written,
+                (unsigned long long) s->bytes_changed, (unsigned long long) s->bytes_copied,
+                (unsigned long long) s->rewrites, amp);
+        for (int i = IOSTAT_PHASE_OPEN; i < NUM_IOSTAT_PHASES; ++i) {
+            fprintf(out, "%s\"%s\":%.3f", i > IOSTAT_PHASE_OPEN ? "," : "", phase_names[i], s->phase_ns[i] / 1e6);
+        }
+        fprintf(out, "},\"latency_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n", p50, p99, max);
+        return;
+    }
+
+    fprintf(out, "files:   %zu\ncalls:  ", lat.size());
+    for (int i = 0; i < NUM_IOSTAT_CALLS; ++i) {
+        fprintf(out, " %s %llu", call_names[i], (unsigned long long) s->calls[i]);
+    }
+    fprintf(out, "\nbytes:   read %llu, written %llu (changed %llu, copied %llu)\n",
+            (unsigned long long) s->bytes_read, (unsigned long long) s->bytes_written,
+            (unsigned long long) s->bytes_changed, (unsigned long long) s->bytes_copied);
+    fprintf(out, "writes:  %llu rewrites, write amplification %.2fx\nphases: ",
+            (unsigned long long) s->rewrites, amp);
+    for (int i = IOSTAT_PHASE_OPEN; i < NUM_IOSTAT_PHASES; ++i) {
+        fprintf(out, " %s %.1fms", phase_names[i], s->phase_ns[i] / 1e6);
+    }
+    fprintf(out, "\nlatency: p50 %.3fms, p99 %.3fms, max %.3fms\n", p50, p99, max);
+}
+
+/**********************************************
+ *  iostat_open:
+ *    open(2), timed as the open phase.
+ **********************************************/
+int iostat_open(const char* path, int flags, mode_t mode) {
+    iostat_scope_t scope(IOSTAT_PHASE_OPEN);
+    ++local.stat.calls[IOSTAT_OPEN];
+    return open(path, flags, mode);
+}
+
+/**********************************************
+ *  iostat_read:
+ *    read(2).
+ **********************************************/
+ssize_t iostat_read(int fd, void* buf, size_t n) {
+    ssize_t got = read(fd, buf, n);
+    iostat_count(IOSTAT_READ, got > 0 ? got : 0);
+    return got;
+}
+
+/**********************************************
+ *  iostat_pread:
+ *    pread(2).
+ **********************************************/
+ssize_t iostat_pread(int fd, void* buf, size_t n, off_t offset) {
+    ssize_t got = pread(fd, buf, n, offset);
+    iostat_count(IOSTAT_READ, got > 0 ? got : 0);
+    return got;
+}
+
+/**********************************************
+ *  iostat_pwrite:
+ *    pwrite(2).
+ **********************************************/
+ssize_t iostat_pwrite(int fd, const void* buf, size_t n, off_t offset) {
+    ssize_t put = pwrite(fd, buf, n, offset);
+    iostat_count(IOSTAT_WRITE, put > 0 ? put : 0);
+    return put;
+}
+
+/**********************************************
+ *  iostat_pwritev:
+ *    pwritev(2).
+ **********************************************/
+ssize_t iostat_pwritev(int fd, const struct iovec* iov, int n, off_t offset) {
+    ssize_t put = pwritev(fd, iov, n, offset);
+    iostat_count(IOSTAT_WRITE, put > 0 ? put : 0);
+    return put;
+}
+
+/**********************************************
+ *  iostat_lseek:
+ *    lseek(2).
+ **********************************************/
+off_t iostat_lseek(int fd, off_t offset, int whence) {
+    ++local.stat.calls[IOSTAT_SEEK];
+    return lseek(fd, offset, whence);
+}
+
+/**********************************************
+ *  iostat_rename:
+ *    rename(2).
+ **********************************************/
+int iostat_rename(const char* from, const char* to) {
+    ++local.stat.calls[IOSTAT_RENAME];
+    return rename(from, to);
+}
+
+/**********************************************
+ *  iostat_count:
+ *    counts one call of kind. Reads add bytes
+ *  to the bytes read; writes and copies to
+ *  the bytes written.
+ **********************************************/
+void iostat_count(uint8_t kind, uint64_t bytes) {
+    ++local.stat.calls[kind];
+    if (kind == IOSTAT_READ) {
+        local.stat.bytes_read += bytes;
+    } else if (kind == IOSTAT_WRITE || kind == IOSTAT_COPY) {
+        local.stat.bytes_written += bytes;
+    }
+}
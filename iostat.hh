@@ -0,0 +1,173 @@
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <mutex>
+#include <vector>
+
+/**********************************************
+ *  I/O on audio files goes through the
+ *  iostat_* wrappers, which count calls and
+ *  bytes in counters private to the calling
+ *  thread, so they cost no locking. Work is
+ *  timed by phase: a phase entered inside
+ *  another pauses the outer one, so phase
+ *  times add up to the time spent. A thread
+ *  attached to a sink merges its counters
+ *  into it on iostat_flush; batch_run attaches
+ *  its workers to the sink of the thread that
+ *  called it.
+ **********************************************/
+
+typedef enum {
+    IOSTAT_OPEN,
+    IOSTAT_READ,
+    IOSTAT_WRITE,
+    IOSTAT_SEEK,
+    IOSTAT_RENAME,
+    IOSTAT_COPY,            // clone, copy_file_range or sendfile
+    IOSTAT_SYNC,            // fdatasync, fsync or syncfs
+    NUM_IOSTAT_CALLS,
+} iostat_call_t;
+
+typedef enum {
+    IOSTAT_PHASE_NONE,
+    IOSTAT_PHASE_OPEN,      // opening files
+    IOSTAT_PHASE_PARSE,     // reading the tag header and body
+    IOSTAT_PHASE_FRAMES,    // walking and decoding frames
+    IOSTAT_PHASE_AUDIO,     // scanning or hashing the audio
+    IOSTAT_PHASE_WRITE,     // writing edits in place or rewriting files
+    IOSTAT_PHASE_SYNC,      // waiting for writes to be durable
+    NUM_IOSTAT_PHASES,
+} iostat_phase_t;
+
+/**********************************************
+ *  iostat_t:
+ *    counters of one thread, or a sum of them.
+ *  bytes_written is split into bytes_changed,
+ *  the new bytes an edit asked for (frames,
+ *  headers and padding), and bytes_copied,
+ *  the unchanged bytes carried over by a
+ *  rewrite or moved within a file.
+ **********************************************/
+typedef struct iostat_t {
+    uint64_t calls[NUM_IOSTAT_CALLS];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_changed;
+    uint64_t bytes_copied;
+    uint64_t rewrites;      // files written anew through a temporary copy
+    uint64_t phase_ns[NUM_IOSTAT_PHASES];
+} iostat_t;
+
+/**********************************************
+ *  iostat_sink_t:
+ *    where attached threads merge their
+ *  counters, with the latency of every file
+ *  they finished.
+ **********************************************/
+typedef struct iostat_sink_t {
+    std::mutex lock;
+    iostat_t total;
+    std::vector<uint64_t> latency_ns;
+} iostat_sink_t;
+
+/**********************************************
+ *  iostat_local:
+ *    returns the counters of the calling
+ *  thread.
+ **********************************************/
+iostat_t* iostat_local();
+
+/**********************************************
+ *  iostat_now:
+ *    returns a monotonic time in nanoseconds.
+ **********************************************/
+int64_t iostat_now();
+
+/**********************************************
+ *  iostat_enter:
+ *    starts timing phase on the calling
+ *  thread and returns the phase it pauses,
+ *  for iostat_leave.
+ **********************************************/
+uint8_t iostat_enter(uint8_t phase);
+
+/**********************************************
+ *  iostat_leave:
+ *    stops timing the current phase and
+ *  resumes prev.
+ **********************************************/
+void iostat_leave(uint8_t prev);
+
+/**********************************************
+ *  iostat_scope_t:
+ *    times a phase for the rest of a block.
+ **********************************************/
+typedef struct iostat_scope_t {
+    uint8_t prev;
+    explicit iostat_scope_t(uint8_t phase) : prev(iostat_enter(phase)) {}
+    ~iostat_scope_t() { iostat_leave(prev); }
+} iostat_scope_t;
+
+/**********************************************
+ *  iostat_sink_init:
+ *    empties sink.
+ **********************************************/
+void iostat_sink_init(iostat_sink_t* sink);
+
+/**********************************************
+ *  iostat_attach:
+ *    makes the calling thread report to sink,
+ *  or to nothing when sink is null.
+ **********************************************/
+void iostat_attach(iostat_sink_t* sink);
+
+/**********************************************
+ *  iostat_attached:
+ *    returns the sink of the calling thread.
+ **********************************************/
+iostat_sink_t* iostat_attached();
+
+/**********************************************
+ *  iostat_flush:
+ *    merges the counters of the calling thread
+ *  and the num_files latencies in latency_ns
+ *  into its sink and clears them. Does nothing
+ *  without a sink.
+ **********************************************/
+void iostat_flush(const uint64_t* latency_ns, size_t num_files);
+
+/**********************************************
+ *  iostat_report:
+ *    prints the totals of sink, with the p50,
+ *  p99 and maximum latency per file, to out as
+ *  text or, with json, as one JSON object.
+ **********************************************/
+void iostat_report(iostat_sink_t* sink, int json, FILE* out);
+
+/**********************************************
+ *  Counting wrappers around the system calls
+ *  of the same names.
+ **********************************************/
+int iostat_open(const char* path, int flags, mode_t mode = 0);
+ssize_t iostat_read(int fd, void* buf, size_t n);
+ssize_t iostat_pread(int fd, void* buf, size_t n, off_t offset);
+ssize_t iostat_pwrite(int fd, const void* buf, size_t n, off_t offset);
+ssize_t iostat_pwritev(int fd, const struct iovec* iov, int n, off_t offset);
+off_t iostat_lseek(int fd, off_t offset, int whence);
+int iostat_rename(const char* from, const char* to);
+
+/**********************************************
+ *  iostat_count:
+ *    counts one call of kind that moved bytes
+ *  bytes without a wrapper, such as a kernel
+ *  copy or a sync.
+ **********************************************/
+void iostat_count(uint8_t kind, uint64_t bytes);
+
+#endif
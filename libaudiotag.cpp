@@ -0,0 +1,202 @@
+#include "libaudiotag.hh"
+#include "iostat.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char* audiotag_errs[NUM_BATCH_ERRS] = {
+    "ok",
+    "could not open file",
+    "could not read tag",
+    "could not write tag",
+    "not a supported file",
+};
+
+/**********************************************
+ *  audiotag_strerror:
+ *    returns a description of batch_err_t err.
+ **********************************************/
+const char* audiotag_strerror(int err) {
+    if (err < 0 || err >= NUM_BATCH_ERRS) {
+        return "unknown error";
+    }
+    return audiotag_errs[err];
+}
+
+/**********************************************
+ *  audiotag_opts_init:
+ *    sets opts to the default padding and no
+ *  sync.
+ **********************************************/
+void audiotag_opts_init(audiotag_opts_t* opts) {
+    id3_2_padding_init(&opts->padding);
+    opts->sync = nullptr;
+}
+
+/**********************************************
+ *  audiotag_open:
+ *    opens path into at. Returns a
+ *  batch_err_t.
+ **********************************************/
+int audiotag_open(audiotag_t* at, const char* path, int writable, const audiotag_opts_t* opts) {
+    at->fd = iostat_open(path, writable ? O_RDWR : O_RDONLY);
+    if (at->fd < 0) {
+        return BATCH_ERR_OPEN;
+    }
+    at->path = strdup(path);
+    if (at->path == nullptr) {
+        close(at->fd);
+        return BATCH_ERR_OPEN;
+    }
+    at->writable = writable != 0;
+    at->loaded = 0;
+    at->editing = 0;
+    at->refused = 0;
+    if (opts != nullptr) {
+        at->opts = *opts;
+    } else {
+        audiotag_opts_init(&at->opts);
+    }
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  audiotag_read:
+ *    loads the tag of at unless it is loaded.
+ *  While a transaction is open the tag it was
+ *  started on is returned. Returns a
+ *  batch_err_t.
+ **********************************************/
+int audiotag_read(audiotag_t* at, const id3_tag_t** tag) {
+    if (at->editing) {
+        *tag = &at->tx.raw;
+        return BATCH_OK;
+    }
+    if (!at->loaded) {
+        if (id3_read_tag(at->fd, &at->tag) != 0) {
+            return BATCH_ERR_READ;
+        }
+        at->loaded = 1;
+    }
+    *tag = &at->tag;
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  audiotag_frames:
+ *    appends the decoded frames of the tag of
+ *  at to frames. Returns a batch_err_t,
+ *  BATCH_ERR_FORMAT for tags whose frames
+ *  cannot be read.
+ **********************************************/
+int audiotag_frames(audiotag_t* at, std::vector<id3_frame_text_t>& frames) {
+    const id3_tag_t* tag;
+    int err = audiotag_read(at, &tag);
+    if (err != BATCH_OK) {
+        return err;
+    }
+    return id3_decode_frames(tag, frames) == 0 ? BATCH_OK : BATCH_ERR_FORMAT;
+}
+
+/**********************************************
+ *  audiotag_audio:
+ *    fills info for the audio of at. Returns
+ *  a batch_err_t.
+ **********************************************/
+int audiotag_audio(audiotag_t* at, mpeg_info_t* info) {
+    const id3_tag_t* tag;
+    int err = audiotag_read(at, &tag);
+    if (err != BATCH_OK) {
+        return err;
+    }
+    return mpeg_scan(at->fd, tag, info) == 0 ? BATCH_OK : BATCH_ERR_FORMAT;
+}
+
+/**********************************************
+ *  audiotag_edit:
+ *    opens the edit transaction of at, taking
+ *  over its tag, or returns the open one.
+ *  Returns null if at is read-only or its tag
+ *  could not be read, or could not be written
+ *  back (at->refused is then set; see
+ *  id3_2_edit_begin_loaded).
+ **********************************************/
+id3_2_edit_t* audiotag_edit(audiotag_t* at) {
+    if (at->editing) {
+        return &at->tx;
+    }
+    const id3_tag_t* tag;
+    if (!at->writable || audiotag_read(at, &tag) != BATCH_OK) {
+        return nullptr;
+    }
+    at->loaded = 0;
+    if (id3_2_edit_begin_loaded(&at->tx, at->fd, at->path, &at->tag) != 0) {
+        at->refused = 1;
+        return nullptr;
+    }
+    at->tx.padding = at->opts.padding;
+    at->tx.sync = at->opts.sync;
+    at->editing = 1;
+    return &at->tx;
+}
+
+/**********************************************
+ *  audiotag_set:
+ *    sets or removes frame id in the
+ *  transaction of at. Returns a batch_err_t.
+ **********************************************/
+int audiotag_set(audiotag_t* at, const char* id, const char* text) {
+    id3_2_rule_t rule;
+    memcpy(rule.id, id, 4);
+    rule.text = (char*) text;
+    return audiotag_apply(at, &rule, 1);
+}
+
+/**********************************************
+ *  audiotag_apply:
+ *    applies num_rules rules to the
+ *  transaction of at. Returns a batch_err_t.
+ **********************************************/
+int audiotag_apply(audiotag_t* at, const id3_2_rule_t* rules, size_t num_rules) {
+    id3_2_edit_t* tx = audiotag_edit(at);
+    if (tx == nullptr) {
+        return !at->writable ? BATCH_ERR_WRITE : at->refused ? BATCH_ERR_FORMAT : BATCH_ERR_READ;
+    }
+    id3_2_edit_apply(tx, rules, num_rules);
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  audiotag_commit:
+ *    writes and closes the transaction of at.
+ *  Returns a batch_err_t.
+ **********************************************/
+int audiotag_commit(audiotag_t* at) {
+    if (!at->editing) {
+        return BATCH_OK;
+    }
+    int ret = id3_2_edit_commit(&at->tx) == 0 ? BATCH_OK : BATCH_ERR_WRITE;
+    id3_2_edit_end(&at->tx);
+    at->editing = 0;
+    return ret;
+}
+
+/**********************************************
+ *  audiotag_close:
+ *    drops any open transaction and releases
+ *  at.
+ **********************************************/
+void audiotag_close(audiotag_t* at) {
+    if (at->editing) {
+        id3_2_edit_end(&at->tx);
+        at->editing = 0;
+    }
+    if (at->loaded) {
+        id3_free_tag(&at->tag);
+        at->loaded = 0;
+    }
+    close(at->fd);
+    free(at->path);
+    at->path = nullptr;
+}
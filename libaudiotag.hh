@@ -0,0 +1,164 @@
+#ifndef LIBAUDIOTAG_H
+#define LIBAUDIOTAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "id3.hh"
+#include "mpeg.hh"
+#include "fileio.hh"
+#include "tagedit.hh"
+
+/**********************************************
+ *  libaudiotag:
+ *    open a file, read its tag and audio info,
+ *  edit the tag and commit it. The library
+ *  keeps no global state and prints nothing:
+ *  everything lives in the audiotag_t and the
+ *  audiotag_opts_t the caller owns, errors are
+ *  returned as batch_err_t codes, and distinct
+ *  audiotag_t may be used from any number of
+ *  threads at once. One audiotag_t must not be
+ *  used by two threads at a time.
+ **********************************************/
+
+/**********************************************
+ *  batch_err_t:
+ *    per-file results of the audiotag_* calls
+ *  and of the batch workers built on them.
+ *  0 means the file succeeded.
+ **********************************************/
+typedef enum {
+    BATCH_OK = 0,
+    BATCH_ERR_OPEN,
+    BATCH_ERR_READ,
+    BATCH_ERR_WRITE,
+    BATCH_ERR_FORMAT,
+    NUM_BATCH_ERRS,
+} batch_err_t;
+
+/**********************************************
+ *  audiotag_opts_t:
+ *    how commits write: the padding policy of
+ *  tags written at a new size and the syncer
+ *  that makes them durable (null leaves
+ *  writeback to the kernel). The syncer may be
+ *  shared between handles and threads.
+ **********************************************/
+typedef struct audiotag_opts_t {
+    id3_2_padding_t padding;
+    fileio_syncer_t* sync;
+} audiotag_opts_t;
+
+/**********************************************
+ *  audiotag_t:
+ *    an open audio file. tag holds its tag
+ *  once read; tx is its edit transaction while
+ *  one is open, and after a commit
+ *  tx.outcome and tx.shrunk tell how the tag
+ *  was written.
+ **********************************************/
+typedef struct audiotag_t {
+    int fd;
+    char* path;             // owned copy
+    uint8_t writable;
+    uint8_t loaded;         // tag holds the current tag of the file
+    uint8_t editing;        // tx is open
+    uint8_t refused;        // the tag is in a form edits cannot write back
+    audiotag_opts_t opts;
+    id3_tag_t tag;
+    id3_2_edit_t tx;
+} audiotag_t;
+
+/**********************************************
+ *  audiotag_strerror:
+ *    returns a description of batch_err_t err.
+ **********************************************/
+const char* audiotag_strerror(int err);
+
+/**********************************************
+ *  audiotag_opts_init:
+ *    sets opts to the default padding and no
+ *  sync.
+ **********************************************/
+void audiotag_opts_init(audiotag_opts_t* opts);
+
+/**********************************************
+ *  audiotag_open:
+ *    opens path, for writing if writable, into
+ *  at with a copy of opts (null for the
+ *  defaults). Nothing is read yet. Returns a
+ *  batch_err_t; at needs audiotag_close only
+ *  on BATCH_OK.
+ **********************************************/
+int audiotag_open(audiotag_t* at, const char* path, int writable, const audiotag_opts_t* opts);
+
+/**********************************************
+ *  audiotag_read:
+ *    loads the tag of at unless it is loaded
+ *  and points tag at it. It stays valid until
+ *  the next edit or close. Returns a
+ *  batch_err_t.
+ **********************************************/
+int audiotag_read(audiotag_t* at, const id3_tag_t** tag);
+
+/**********************************************
+ *  audiotag_frames:
+ *    appends the decoded frames of the tag of
+ *  at to frames. Returns a batch_err_t,
+ *  BATCH_ERR_FORMAT for tags whose frames
+ *  cannot be read.
+ **********************************************/
+int audiotag_frames(audiotag_t* at, std::vector<id3_frame_text_t>& frames);
+
+/**********************************************
+ *  audiotag_audio:
+ *    fills info for the audio of at. Returns
+ *  a batch_err_t, BATCH_ERR_FORMAT if no MPEG
+ *  audio was found.
+ **********************************************/
+int audiotag_audio(audiotag_t* at, mpeg_info_t* info);
+
+/**********************************************
+ *  audiotag_edit:
+ *    opens the edit transaction of at on its
+ *  tag, or returns the open one, for the
+ *  id3_2_edit_* calls. Returns null if at is
+ *  read-only or its tag could not be read, or
+ *  could not be written back (at->refused is
+ *  then set; see id3_2_edit_begin_loaded).
+ **********************************************/
+id3_2_edit_t* audiotag_edit(audiotag_t* at);
+
+/**********************************************
+ *  audiotag_set:
+ *    sets frame id to text in the transaction
+ *  of at, or removes every id frame when text
+ *  is null. Returns a batch_err_t.
+ **********************************************/
+int audiotag_set(audiotag_t* at, const char* id, const char* text);
+
+/**********************************************
+ *  audiotag_apply:
+ *    applies num_rules rules to the
+ *  transaction of at. Returns a batch_err_t.
+ **********************************************/
+int audiotag_apply(audiotag_t* at, const id3_2_rule_t* rules, size_t num_rules);
+
+/**********************************************
+ *  audiotag_commit:
+ *    writes the transaction of at to the file
+ *  at most once and closes it. Does nothing
+ *  without an open transaction. Returns a
+ *  batch_err_t.
+ **********************************************/
+int audiotag_commit(audiotag_t* at);
+
+/**********************************************
+ *  audiotag_close:
+ *    drops any open transaction without
+ *  writing it and releases at.
+ **********************************************/
+void audiotag_close(audiotag_t* at);
+
+#endif
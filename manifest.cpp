@@ -0,0 +1,892 @@
+#include "manifest.hh"
+#include "batch.hh"
+#include "fileio.hh"
+#include "id3.hh"
+#include "iostat.hh"
+#include "libaudiotag.hh"
+#include "tagedit.hh"
+#include "xxh64.hh"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+// Nesting of ignored JSON values a manifest line may hold
+#define MANIFEST_JSON_DEPTH 32
+
+/**********************************************
+ *  manifest_journal_t:
+ *    the journal being appended to. Lines of
+ *  finished files gather in pending until a
+ *  group is complete.
+ **********************************************/
+typedef struct manifest_journal_t {
+    int fd;
+    fileio_syncer_t* sync;
+    std::mutex lock;
+    std::string pending;
+    size_t num_pending;
+    int failed;             // a write or sync of the journal failed
+} manifest_journal_t;
+
+/**********************************************
+ *  manifest_ctx_t:
+ *    state shared by the manifest workers.
+ *  todo and keys are indexed by position in
+ *  the file list handed to batch_run.
+ **********************************************/
+typedef struct manifest_ctx_t {
+    const std::vector<manifest_entry_t>* entries;
+    std::vector<size_t> todo;
+    std::vector<uint64_t> keys;
+    audiotag_opts_t opts;
+    manifest_journal_t journal;
+    std::atomic<size_t> in_place;
+    std::atomic<size_t> grown;
+    std::atomic<size_t> rewritten;
+    std::atomic<size_t> unchanged;
+    std::atomic<size_t> v1_synced;
+} manifest_ctx_t;
+
+/**********************************************
+ *  read_all:
+ *    reads the whole file at path ("-" for
+ *  stdin) into out. Returns 0 on success and
+ *  -1 on error.
+ **********************************************/
+static int read_all(const char* path, std::string& out) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/**********************************************
+ *  is_frame_id:
+ *    returns whether the n bytes at s are an
+ *  ID3v2.3 frame ID.
+ **********************************************/
+static int is_frame_id(const char* s, size_t n) {
+    if (n != 4) {
+        return 0;
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        if (!((s[i] >= 'A' && s[i] <= 'Z') || (s[i] >= '0' && s[i] <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**********************************************
+ *  add_entry:
+ *    adds entry to entries, or its edits to
+ *  the entry already there for its path.
+ **********************************************/
+static void add_entry(std::vector<manifest_entry_t>& entries, std::unordered_map<std::string, size_t>& index, manifest_entry_t& entry) {
+    auto it = index.find(entry.path);
+    if (it == index.end()) {
+        index.emplace(entry.path, entries.size());
+        entries.push_back(std::move(entry));
+        return;
+    }
+    std::vector<manifest_edit_t>& edits = entries[it->second].edits;
+    for (size_t i = 0; i < entry.edits.size(); ++i) {
+        edits.push_back(std::move(entry.edits[i]));
+    }
+}
+
+/**********************************************
+ *  skip_ws:
+ *    advances p over blanks within a line.
+ **********************************************/
+static void skip_ws(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        ++p;
+    }
+}
+
+/**********************************************
+ *  put_utf8:
+ *    appends code point c to out as UTF-8.
+ **********************************************/
+static void put_utf8(uint32_t c, std::string& out) {
+    if (c < 0x80) {
+        out += (char) c;
+    } else if (c < 0x800) {
+        out += (char) (0xc0 | (c >> 6));
+        out += (char) (0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += (char) (0xe0 | (c >> 12));
+        out += (char) (0x80 | ((c >> 6) & 0x3f));
+        out += (char) (0x80 | (c & 0x3f));
+    } else {
+        out += (char) (0xf0 | (c >> 18));
+        out += (char) (0x80 | ((c >> 12) & 0x3f));
+        out += (char) (0x80 | ((c >> 6) & 0x3f));
+        out += (char) (0x80 | (c & 0x3f));
+    }
+}
+
+/**********************************************
+ *  hex4:
+ *    parses the four hex digits at p into v.
+ *  Returns 0 on success and -1 if there are
+ *  not four.
+ **********************************************/
+static int hex4(const char* p, const char* end, uint32_t* v) {
+    if (end - p < 4) {
+        return -1;
+    }
+    *v = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        uint32_t d;
+        if (c >= '0' && c <= '9') {
+            d = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            d = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            d = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        *v = *v << 4 | d;
+    }
+    return 0;
+}
+
+/**********************************************
+ *  json_string:
+ *    parses the JSON string at p into out as
+ *  UTF-8. Returns 0 on success and -1 on a
+ *  syntax error.
+ **********************************************/
+static int json_string(const char*& p, const char* end, std::string& out) {
+    out.clear();
+    if (p == end || *p != '"') {
+        return -1;
+    }
+    ++p;
+    while (p < end && *p != '"') {
+        if (*p != '\\') {
+            out += *p++;
+            continue;
+        }
+        if (++p == end) {
+            return -1;
+        }
+        char c = *p++;
+        switch (c) {
+            case '"': case '\\': case '/': out += c; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (hex4(p, end, &cp) != 0) {
+                    return -1;
+                }
+                p += 4;
+                // A high surrogate pairs with the low one after it
+                uint32_t lo;
+                if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                    hex4(p + 2, end, &lo) == 0 && lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+                put_utf8(cp, out);
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    if (p == end) {
+        return -1;
+    }
+    ++p;
+    return 0;
+}
+
+/**********************************************
+ *  json_skip:
+ *    advances p over the JSON value there.
+ *  Returns 0 on success and -1 on a syntax
+ *  error.
+ **********************************************/
+static int json_skip(const char*& p, const char* end, int depth) {
+    std::string scratch;
+    skip_ws(p, end);
+    if (p == end || depth > MANIFEST_JSON_DEPTH) {
+        return -1;
+    }
+    if (*p == '"') {
+        return json_string(p, end, scratch);
+    }
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        ++p;
+        skip_ws(p, end);
+        if (p < end && *p == close) {
+            ++p;
+            return 0;
+        }
+        while (true) {
+            if (close == '}') {
+                skip_ws(p, end);
+                if (json_string(p, end, scratch) != 0) {
+                    return -1;
+                }
+                skip_ws(p, end);
+                if (p == end || *p++ != ':') {
+                    return -1;
+                }
+            }
+            if (json_skip(p, end, depth + 1) != 0) {
+                return -1;
+            }
+            skip_ws(p, end);
+            if (p == end) {
+                return -1;
+            }
+            if (*p == close) {
+                ++p;
+                return 0;
+            }
+            if (*p++ != ',') {
+                return -1;
+            }
+        }
+    }
+
+    // Numbers, true, false and null
+    const char* start = p;
+    while (p < end && (isalnum((unsigned char) *p) || *p == '-' || *p == '+' || *p == '.')) {
+        ++p;
+    }
+    return p > start ? 0 : -1;
+}
+
+/**********************************************
+ *  json_frames:
+ *    parses the "frames" object at p into the
+ *  edits of entry. Returns 0 on success and -1
+ *  on a syntax error.
+ **********************************************/
+static int json_frames(const char*& p, const char* end, manifest_entry_t* entry) {
+    if (p == end || *p++ != '{') {
+        return -1;
+    }
+    skip_ws(p, end);
+    if (p < end && *p == '}') {
+        ++p;
+        return 0;
+    }
+    std::string id;
+    while (true) {
+        skip_ws(p, end);
+        if (json_string(p, end, id) != 0 || !is_frame_id(id.data(), id.size())) {
+            return -1;
+        }
+        skip_ws(p, end);
+        if (p == end || *p++ != ':') {
+            return -1;
+        }
+        skip_ws(p, end);
+
+        manifest_edit_t edit;
+        memcpy(edit.id, id.data(), 4);
+        if (end - p >= 4 && memcmp(p, "null", 4) == 0) {
+            edit.remove = 1;
+            p += 4;
+        } else if (json_string(p, end, edit.text) == 0) {
+            edit.remove = 0;
+        } else {
+            return -1;
+        }
+        entry->edits.push_back(std::move(edit));
+
+        skip_ws(p, end);
+        if (p == end) {
+            return -1;
+        }
+        if (*p == '}') {
+            ++p;
+            return 0;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+/**********************************************
+ *  json_entry:
+ *    parses one JSONL manifest line into
+ *  entry. Returns 0 on success and -1 on a
+ *  syntax error or a missing path.
+ **********************************************/
+static int json_entry(const char* p, const char* end, manifest_entry_t* entry) {
+    skip_ws(p, end);
+    if (p == end || *p++ != '{') {
+        return -1;
+    }
+    std::string key;
+    skip_ws(p, end);
+    while (p < end && *p != '}') {
+        if (json_string(p, end, key) != 0) {
+            return -1;
+        }
+        skip_ws(p, end);
+        if (p == end || *p++ != ':') {
+            return -1;
+        }
+        skip_ws(p, end);
+        int ret;
+        if (key == "path") {
+            ret = json_string(p, end, entry->path);
+        } else if (key == "frames") {
+            ret = json_frames(p, end, entry);
+        } else {
+            ret = json_skip(p, end, 0);
+        }
+        if (ret != 0) {
+            return -1;
+        }
+        skip_ws(p, end);
+        if (p < end && *p == ',') {
+            ++p;
+            skip_ws(p, end);
+        } else if (p == end || *p != '}') {
+            return -1;
+        }
+    }
+    if (p == end) {
+        return -1;
+    }
+    ++p;
+    skip_ws(p, end);
+    return p == end && !entry->path.empty() ? 0 : -1;
+}
+
+/**********************************************
+ *  csv_record:
+ *    parses the CSV record at p into fields,
+ *  counting the lines it ends in *line.
+ *  Quoted fields may hold commas, doubled
+ *  quotes and line breaks. Returns 1 for a
+ *  record, 0 at the end and -1 on a syntax
+ *  error.
+ **********************************************/
+static int csv_record(const char*& p, const char* end, std::vector<std::string>& fields, size_t* line) {
+    fields.clear();
+    if (p == end) {
+        return 0;
+    }
+    std::string field;
+    while (true) {
+        field.clear();
+        if (p < end && *p == '"') {
+            ++p;
+            while (true) {
+                if (p == end) {
+                    return -1;
+                }
+                if (*p == '"') {
+                    if (p + 1 < end && p[1] == '"') {
+                        field += '"';
+                        p += 2;
+                        continue;
+                    }
+                    ++p;
+                    break;
+                }
+                if (*p == '\n') {
+                    ++*line;
+                }
+                field += *p++;
+            }
+        } else {
+            while (p < end && *p != ',' && *p != '\n') {
+                field += *p++;
+            }
+            if (!field.empty() && field.back() == '\r') {
+                field.pop_back();
+            }
+        }
+        fields.push_back(field);
+
+        if (p == end) {
+            return 1;
+        }
+        if (*p == ',') {
+            ++p;
+            continue;
+        }
+        if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+            ++p;
+        }
+        if (*p == '\n') {
+            ++p;
+            ++*line;
+            return 1;
+        }
+        return -1;
+    }
+}
+
+/**********************************************
+ *  load_csv:
+ *    adds the rows of the CSV manifest in data
+ *  to entries. Returns 0 on success and -1 on
+ *  a syntax error, with its line in *line.
+ **********************************************/
+static int load_csv(const std::string& data, std::vector<manifest_entry_t>& entries, std::unordered_map<std::string, size_t>& index, size_t* line) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    std::vector<std::string> header;
+    std::vector<std::string> fields;
+    size_t ln = 1;
+    *line = 1;
+    if (csv_record(p, end, header, &ln) != 1) {
+        return -1;
+    }
+
+    // The path column and every frame ID column; the rest are ignored
+    size_t path_col = header.size();
+    std::vector<size_t> frame_cols;
+    for (size_t i = 0; i < header.size(); ++i) {
+        if (header[i] == "path") {
+            path_col = i;
+        } else if (is_frame_id(header[i].data(), header[i].size())) {
+            frame_cols.push_back(i);
+        }
+    }
+    if (path_col == header.size()) {
+        return -1;
+    }
+
+    int ret;
+    while (*line = ln, (ret = csv_record(p, end, fields, &ln)) == 1) {
+        if (fields.size() == 1 && fields[0].empty()) {
+            continue;
+        }
+        if (fields.size() > header.size() || path_col >= fields.size() || fields[path_col].empty()) {
+            return -1;
+        }
+        manifest_entry_t entry;
+        entry.path = fields[path_col];
+        for (size_t i = 0; i < frame_cols.size(); ++i) {
+            size_t c = frame_cols[i];
+            if (c < fields.size() && !fields[c].empty()) {
+                manifest_edit_t edit;
+                memcpy(edit.id, header[c].data(), 4);
+                edit.remove = 0;
+                edit.text = fields[c];
+                entry.edits.push_back(std::move(edit));
+            }
+        }
+        add_entry(entries, index, entry);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+/**********************************************
+ *  load_jsonl:
+ *    adds the lines of the JSONL manifest in
+ *  data to entries. Returns 0 on success and
+ *  -1 on a syntax error, with its line in
+ *  *line.
+ **********************************************/
+static int load_jsonl(const std::string& data, std::vector<manifest_entry_t>& entries, std::unordered_map<std::string, size_t>& index, size_t* line) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    for (*line = 1; p < end; ++*line) {
+        const char* nl = (const char*) memchr(p, '\n', end - p);
+        const char* eol = nl ? nl : end;
+        const char* q = p;
+        skip_ws(q, eol);
+        if (q < eol) {
+            manifest_entry_t entry;
+            if (json_entry(q, eol, &entry) != 0) {
+                return -1;
+            }
+            add_entry(entries, index, entry);
+        }
+        p = nl ? nl + 1 : end;
+    }
+    return 0;
+}
+
+/**********************************************
+ *  manifest_load:
+ *    reads the manifest at path, in the format
+ *  its first character tells, into entries.
+ **********************************************/
+int manifest_load(const char* path, std::vector<manifest_entry_t>& entries, size_t* line) {
+    std::string data;
+    *line = 0;
+    if (read_all(path, data) != 0) {
+        return -1;
+    }
+    size_t first = data.find_first_not_of(" \t\r\n");
+    std::unordered_map<std::string, size_t> index;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        index.emplace(entries[i].path, i);
+    }
+    int ret = first != std::string::npos && data[first] == '{' ?
+        load_jsonl(data, entries, index, line) : load_csv(data, entries, index, line);
+
+    // Rows with every cell empty have nothing to do
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].edits.empty()) {
+            if (kept != i) {
+                entries[kept] = std::move(entries[i]);
+            }
+            ++kept;
+        }
+    }
+    entries.resize(kept);
+    return ret;
+}
+
+/**********************************************
+ *  manifest_key:
+ *    hashes the path of entry and each edit:
+ *  frame ID, remove flag and text.
+ **********************************************/
+uint64_t manifest_key(const manifest_entry_t* entry) {
+    xxh64_t ctx;
+    xxh64_init(&ctx, 0);
+    xxh64_update(&ctx, (const uint8_t*) entry->path.c_str(), entry->path.size() + 1);
+    for (size_t i = 0; i < entry->edits.size(); ++i) {
+        const manifest_edit_t* e = &entry->edits[i];
+        xxh64_update(&ctx, (const uint8_t*) e->id, 4);
+        xxh64_update(&ctx, &e->remove, 1);
+        xxh64_update(&ctx, (const uint8_t*) e->text.c_str(), e->text.size() + 1);
+    }
+    return xxh64_final(&ctx);
+}
+
+/**********************************************
+ *  journal_load:
+ *    adds the key of every complete line of
+ *  the journal fd to done. A line torn by a
+ *  crash is ended before anything is appended
+ *  after it. Returns 0 on success and -1 on a
+ *  read error.
+ **********************************************/
+static int journal_load(manifest_journal_t* j, std::unordered_set<uint64_t>& done) {
+    std::string data;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(j->fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    if (n < 0) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    size_t nl;
+    while ((nl = data.find('\n', pos)) != std::string::npos) {
+        if (nl - pos > XXH64_HEX_SIZE && data[pos + XXH64_HEX_SIZE] == ' ' &&
+            strspn(data.c_str() + pos, "0123456789abcdef") == XXH64_HEX_SIZE) {
+            done.insert(strtoull(data.c_str() + pos, nullptr, 16));
+        }
+        pos = nl + 1;
+    }
+    if (pos < data.size()) {
+        j->pending += '\n';
+    }
+    return 0;
+}
+
+/**********************************************
+ *  journal_commit:
+ *    writes out the pending lines of j, with
+ *  j->lock held. Under FILEIO_SYNC_BATCH the
+ *  edits they record are flushed first, and
+ *  under any sync the journal is synced after.
+ **********************************************/
+static void journal_commit(manifest_journal_t* j) {
+    if (j->pending.empty()) {
+        return;
+    }
+    fileio_syncer_t* sync = j->sync;
+    if (sync && sync->mode == FILEIO_SYNC_BATCH && fileio_sync_flush(sync) != 0) {
+        j->failed = 1;
+        return;
+    }
+    const char* p = j->pending.data();
+    size_t left = j->pending.size();
+    while (left > 0) {
+        ssize_t n = write(j->fd, p, left);
+        if (n <= 0) {
+            j->failed = 1;
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+    if (sync && sync->mode != FILEIO_SYNC_NONE && fdatasync(j->fd) != 0) {
+        j->failed = 1;
+    }
+    j->pending.clear();
+    j->num_pending = 0;
+}
+
+/**********************************************
+ *  journal_append:
+ *    records that the entry with key was
+ *  applied to path as outcome, committing the
+ *  group once it is full.
+ **********************************************/
+static void journal_append(manifest_journal_t* j, uint64_t key, const char* outcome, const char* path) {
+    char hex[XXH64_HEX_SIZE + 1];
+    xxh64_hex(key, hex);
+    std::lock_guard<std::mutex> guard(j->lock);
+    j->pending += hex;
+    j->pending += ' ';
+    j->pending += outcome;
+    j->pending += ' ';
+    j->pending += path;
+    j->pending += '\n';
+    if (++j->num_pending >= MANIFEST_JOURNAL_GROUP) {
+        journal_commit(j);
+    }
+}
+
+/**********************************************
+ *  sync_v1:
+ *    applies the rules that have an ID3v1
+ *  field (title, artist, album, year and the
+ *  ID3v1.1 track) to the ID3v1 block of at,
+ *  loaded in tag, and writes the block back
+ *  if it changed. Returns 1 if it did, 0 if
+ *  not and -1 on a write error.
+ **********************************************/
+static int sync_v1(audiotag_t* at, const id3_tag_t* tag, const std::vector<id3_2_rule_t>& rules) {
+    id3_1_t v1 = tag->v1;
+    for (size_t i = 0; i < rules.size(); ++i) {
+        const char* text = rules[i].text;
+        char* field;
+        size_t n;
+        if (memcmp(rules[i].id, "TIT2", 4) == 0) {
+            field = v1.title;
+            n = sizeof(v1.title);
+        } else if (memcmp(rules[i].id, "TPE1", 4) == 0) {
+            field = v1.artist;
+            n = sizeof(v1.artist);
+        } else if (memcmp(rules[i].id, "TALB", 4) == 0) {
+            field = v1.album;
+            n = sizeof(v1.album);
+        } else if (memcmp(rules[i].id, "TYER", 4) == 0) {
+            field = v1.year;
+            n = sizeof(v1.year);
+        } else if (memcmp(rules[i].id, "TRCK", 4) == 0) {
+            // ID3v1.1: a zero byte, then the track in the last byte of the comment
+            int track = text ? atoi(text) : 0;
+            v1.comment[28] = 0;
+            v1.comment[29] = track > 0 && track < 256 ? track : 0;
+            continue;
+        } else {
+            continue;
+        }
+        id3_1_field(text ? text : "", field, n);
+    }
+    if (memcmp(&v1, &tag->v1, sizeof(v1)) == 0) {
+        return 0;
+    }
+    iostat_scope_t scope(IOSTAT_PHASE_WRITE);
+    if (iostat_pwrite(at->fd, &v1, sizeof(v1), tag->v1_offset + 3) != (ssize_t) sizeof(v1)) {
+        return -1;
+    }
+    iostat_local()->bytes_changed += sizeof(v1);
+    return 1;
+}
+
+/**********************************************
+ *  find_v1:
+ *    loads the ID3v1 block of at into v1 if it
+ *  has one, reading the end of the file when
+ *  tag, its loaded tag, is ID3v2. Returns 1 if
+ *  it has one, 0 if not and -1 on a read
+ *  error.
+ **********************************************/
+static int find_v1(audiotag_t* at, const id3_tag_t* tag, id3_tag_t* v1) {
+    memset(v1, 0, sizeof(*v1));
+    if (tag->version == ID3_V1) {
+        v1->v1 = tag->v1;
+        v1->v1_offset = tag->v1_offset;
+        return 1;
+    }
+    if (tag->version != ID3_V2) {
+        return 0;
+    }
+    struct stat st;
+    uint8_t block[128];
+    if (fstat(at->fd, &st) != 0 || (st.st_size >= 128 && iostat_pread(at->fd, block, 128, st.st_size - 128) != 128)) {
+        return -1;
+    }
+    return st.st_size >= 128 ? id3_1_load(v1, block, st.st_size - 128) : 0;
+}
+
+/**********************************************
+ *  manifest_worker:
+ *    batch_fn_t applying the entry of path in
+ *  one commit and journaling it.
+ **********************************************/
+static int manifest_worker(const char* path, size_t idx, unsigned worker, void* ctx) {
+    manifest_ctx_t* mc = (manifest_ctx_t*) ctx;
+    const manifest_entry_t* entry = &(*mc->entries)[mc->todo[idx]];
+    std::vector<id3_2_rule_t> rules(entry->edits.size());
+    for (size_t i = 0; i < rules.size(); ++i) {
+        memcpy(rules[i].id, entry->edits[i].id, 4);
+        rules[i].text = entry->edits[i].remove ? nullptr : (char*) entry->edits[i].text.c_str();
+    }
+
+    audiotag_t at;
+    int ret = audiotag_open(&at, path, 1, &mc->opts);
+    if (ret != BATCH_OK) {
+        return ret;
+    }
+
+    // The ID3v1 block moves if the commit creates an ID3v2 tag, so it goes first
+    const id3_tag_t* tag;
+    id3_tag_t v1;
+    ret = audiotag_read(&at, &tag);
+    int has_v1 = ret == BATCH_OK ? find_v1(&at, tag, &v1) : 0;
+    if (has_v1 < 0) {
+        ret = BATCH_ERR_READ;
+    } else if (has_v1) {
+        // The commit syncs only what it writes, and may write nothing, so
+        // the block is made durable here before the journal records it
+        int synced = sync_v1(&at, &v1, rules);
+        if (synced < 0 || (synced > 0 && fileio_sync(at.opts.sync, at.fd) != 0)) {
+            ret = BATCH_ERR_WRITE;
+        }
+        mc->v1_synced.fetch_add(synced > 0);
+    }
+    if (ret == BATCH_OK) {
+        ret = audiotag_apply(&at, rules.data(), rules.size());
+    }
+    if (ret == BATCH_OK) {
+        ret = audiotag_commit(&at);
+    }
+    if (ret == BATCH_OK) {
+        const char* outcome = "unchanged";
+        switch (at.tx.outcome) {
+            case ID3_2_EDIT_IN_PLACE:
+                mc->in_place.fetch_add(1);
+                outcome = "in-place";
+                break;
+            case ID3_2_EDIT_GROWN:
+                mc->grown.fetch_add(1);
+                outcome = "grown";
+                break;
+            case ID3_2_EDIT_REWRITTEN:
+                mc->rewritten.fetch_add(1);
+                outcome = "rewritten";
+                break;
+            default:
+                mc->unchanged.fetch_add(1);
+                break;
+        }
+        journal_append(&mc->journal, mc->keys[idx], outcome, path);
+    }
+    audiotag_close(&at);
+    return ret;
+}
+
+/**********************************************
+ *  manifest_run:
+ *    skips the entries already journaled and
+ *  runs the rest through batch_run.
+ **********************************************/
+long manifest_run(const std::vector<manifest_entry_t>& entries, const char* journal, unsigned num_workers, const audiotag_opts_t* opts, manifest_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->entries = entries.size();
+
+    manifest_ctx_t mc;
+    mc.entries = &entries;
+    if (opts != nullptr) {
+        mc.opts = *opts;
+    } else {
+        audiotag_opts_init(&mc.opts);
+    }
+    mc.in_place = 0;
+    mc.grown = 0;
+    mc.rewritten = 0;
+    mc.unchanged = 0;
+    mc.v1_synced = 0;
+    mc.journal.sync = mc.opts.sync;
+    mc.journal.num_pending = 0;
+    mc.journal.failed = 0;
+    mc.journal.fd = open(journal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (mc.journal.fd < 0) {
+        return -1;
+    }
+
+    std::unordered_set<uint64_t> done;
+    if (journal_load(&mc.journal, done) != 0) {
+        close(mc.journal.fd);
+        return -1;
+    }
+    std::vector<std::string> files;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        uint64_t key = manifest_key(&entries[i]);
+        if (done.count(key)) {
+            ++stats->journaled;
+            continue;
+        }
+        mc.todo.push_back(i);
+        mc.keys.push_back(key);
+        files.push_back(entries[i].path);
+    }
+
+    size_t failed = files.empty() ? 0 : batch_run(files, num_workers, manifest_worker, &mc);
+    {
+        std::lock_guard<std::mutex> guard(mc.journal.lock);
+        journal_commit(&mc.journal);
+    }
+    close(mc.journal.fd);
+
+    stats->in_place = mc.in_place.load();
+    stats->grown = mc.grown.load();
+    stats->rewritten = mc.rewritten.load();
+    stats->unchanged = mc.unchanged.load();
+    stats->v1_synced = mc.v1_synced.load();
+    stats->failed = failed;
+    return mc.journal.failed ? -1 : (long) failed;
+}
+
+/**********************************************
+ *  manifest_report:
+ *    prints stats to out.
+ **********************************************/
+void manifest_report(const manifest_stats_t* stats, FILE* out) {
+    fprintf(out, "%zu files in the manifest, %zu already done per the journal, %zu failed\n",
+            stats->entries, stats->journaled, stats->failed);
+    fprintf(out, "%zu edited in place, %zu grown by inserting blocks, %zu rewritten, %zu unchanged, %zu ID3v1 blocks updated\n",
+            stats->in_place, stats->grown, stats->rewritten, stats->unchanged, stats->v1_synced);
+}
@@ -0,0 +1,119 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "libaudiotag.hh"
+
+// Journal lines are written out, and made durable, this many at a time
+#define MANIFEST_JOURNAL_GROUP 256
+
+/**********************************************
+ *  A manifest lists edits per file, in either
+ *  of the --dump formats, so a dump can be
+ *  corrected and fed back:
+ *    JSONL  one object per line with "path"
+ *           and "frames", an object mapping
+ *           frame IDs to the new text, or to
+ *           null to remove the frame
+ *    CSV    a header row naming a "path"
+ *           column, then one row per file;
+ *           columns named by a frame ID set
+ *           it, and empty cells leave it be
+ *  Other keys and columns are ignored. The
+ *  format is told by the first character.
+ *
+ *  The journal is append-only, one line per
+ *  finished file:
+ *    KEY OUTCOME PATH
+ *  where KEY is the XXH64 in hex of the path
+ *  and its edits and OUTCOME is how the edit
+ *  was served. A run skips every entry whose
+ *  key is in the journal, so an interrupted
+ *  run picks up where it stopped, and an
+ *  entry whose edits changed runs again.
+ **********************************************/
+
+/**********************************************
+ *  manifest_edit_t:
+ *    one edit: sets frame id to text, or
+ *  removes it.
+ **********************************************/
+typedef struct manifest_edit_t {
+    char id[4];
+    uint8_t remove;
+    std::string text;
+} manifest_edit_t;
+
+/**********************************************
+ *  manifest_entry_t:
+ *    the edits of one file, in manifest
+ *  order.
+ **********************************************/
+typedef struct manifest_entry_t {
+    std::string path;
+    std::vector<manifest_edit_t> edits;
+} manifest_entry_t;
+
+/**********************************************
+ *  manifest_stats_t:
+ *    what a manifest_run did.
+ **********************************************/
+typedef struct manifest_stats_t {
+    size_t entries;         // files in the manifest
+    size_t journaled;       // skipped as already done
+    size_t in_place;        // frames fit in the existing tag
+    size_t grown;           // blocks were inserted in front of the audio
+    size_t rewritten;       // the whole file was rewritten
+    size_t unchanged;       // the tag already held the edits
+    size_t v1_synced;       // ID3v1 blocks updated alongside
+    size_t failed;
+} manifest_stats_t;
+
+/**********************************************
+ *  manifest_load:
+ *    appends the entries of the manifest at
+ *  path ("-" for stdin) to entries. Entries
+ *  for the same path are merged, later edits
+ *  winning, and entries without edits are
+ *  dropped. Returns 0 on success and -1 on a
+ *  read or syntax error, with the line in
+ *  *line (0 if the file could not be read).
+ **********************************************/
+int manifest_load(const char* path, std::vector<manifest_entry_t>& entries, size_t* line);
+
+/**********************************************
+ *  manifest_key:
+ *    returns the journal key of entry.
+ **********************************************/
+uint64_t manifest_key(const manifest_entry_t* entry);
+
+/**********************************************
+ *  manifest_run:
+ *    applies every entry not yet in the
+ *  journal at journal across num_workers
+ *  threads (0 for one per core), each with a
+ *  single commit written as opts asks (null
+ *  for the defaults). Files without an ID3v2
+ *  tag get one, and the fields of an ID3v1
+ *  block are updated in place to match.
+ *  Finished files are appended to the journal
+ *  MANIFEST_JOURNAL_GROUP at a time, each
+ *  group only once the edits it records are
+ *  as durable as opts->sync makes them.
+ *  Fills stats and returns the number of
+ *  files that failed, or -1 if the journal
+ *  could not be read or written.
+ **********************************************/
+long manifest_run(const std::vector<manifest_entry_t>& entries, const char* journal, unsigned num_workers, const audiotag_opts_t* opts, manifest_stats_t* stats);
+
+/**********************************************
+ *  manifest_report:
+ *    prints stats to out.
+ **********************************************/
+void manifest_report(const manifest_stats_t* stats, FILE* out);
+
+#endif
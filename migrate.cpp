@@ -0,0 +1,185 @@
+#include "migrate.hh"
+#include "batch.hh"
+#include "id3.hh"
+#include "libaudiotag.hh"
+#include "tagedit.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+/**********************************************
+ *  migrate_ctx_t:
+ *    the shared state of a migrate_run.
+ **********************************************/
+typedef struct migrate_ctx_t {
+    const audiotag_opts_t* opts;
+    uint8_t drop_v1;
+    std::atomic<size_t> migrated;
+    std::atomic<size_t> frames;
+    std::atomic<size_t> dropped;
+    std::atomic<size_t> skipped;
+} migrate_ctx_t;
+
+/**********************************************
+ *  field_body:
+ *    returns a malloc'd ISO-8859-1 text frame
+ *  body holding prefix_sz bytes of prefix and
+ *  then the n-byte ID3v1 field, which ends at
+ *  its first NUL and loses trailing spaces.
+ *  Returns null if the field is empty.
+ **********************************************/
+static uint8_t* field_body(const char* prefix, size_t prefix_sz, const char* field, size_t n, uint32_t* sz) {
+    size_t len = strnlen(field, n);
+    while (len > 0 && field[len - 1] == ' ') {
+        --len;
+    }
+    if (len == 0) {
+        return nullptr;
+    }
+    uint8_t* body = (uint8_t*) malloc(1 + prefix_sz + len);
+    if (body == nullptr) {
+        return nullptr;
+    }
+    body[0] = 0;
+    memcpy(body + 1, prefix, prefix_sz);
+    memcpy(body + 1 + prefix_sz, field, len);
+    *sz = 1 + prefix_sz + len;
+    return body;
+}
+
+/**********************************************
+ *  add_field:
+ *    adds frame id holding the n-byte ID3v1
+ *  field after prefix_sz bytes of prefix to
+ *  tx, unless the field is empty. Returns the
+ *  number of frames added.
+ **********************************************/
+static int add_field(id3_2_edit_t* tx, const char* id, const char* prefix, size_t prefix_sz, const char* field, size_t n) {
+    uint32_t sz;
+    uint8_t* body = field_body(prefix, prefix_sz, field, n, &sz);
+    if (body == nullptr) {
+        return 0;
+    }
+    id3_2_edit_add_body(tx, id, body, sz);
+    return 1;
+}
+
+/**********************************************
+ *  add_v1_frames:
+ *    adds the frames v1 maps to to tx.
+ *  Returns the number of frames added.
+ **********************************************/
+static int add_v1_frames(id3_2_edit_t* tx, const id3_1_t* v1) {
+    int added = 0;
+    added += add_field(tx, "TIT2", nullptr, 0, v1->title, sizeof(v1->title));
+    added += add_field(tx, "TPE1", nullptr, 0, v1->artist, sizeof(v1->artist));
+    added += add_field(tx, "TALB", nullptr, 0, v1->album, sizeof(v1->album));
+    added += add_field(tx, "TYER", nullptr, 0, v1->year, sizeof(v1->year));
+
+    // ID3v1.1 keeps the track in the last comment byte. The
+    // comment gets the language "eng" and no description.
+    size_t comment_sz = sizeof(v1->comment);
+    char text[8];
+    if (v1->comment[28] == 0 && v1->comment[29] != 0) {
+        comment_sz = 28;
+        int n = snprintf(text, sizeof(text), "%u", (uint8_t) v1->comment[29]);
+        added += add_field(tx, "TRCK", nullptr, 0, text, n);
+    }
+    added += add_field(tx, "COMM", "eng", 4, v1->comment, comment_sz);
+
+    // Names read everywhere; "(n)" is the ID3v2.3 reference for the rest
+    uint8_t genre = (uint8_t) v1->genre[0];
+    if (genre != 255) {
+        const char* name = id3_1_genre_name(genre);
+        if (name == nullptr) {
+            snprintf(text, sizeof(text), "(%u)", genre);
+            name = text;
+        }
+        added += add_field(tx, "TCON", nullptr, 0, name, strlen(name));
+    }
+    return added;
+}
+
+/**********************************************
+ *  migrate_file:
+ *    batch_fn_t that gives the ID3v1-only file
+ *  path the ID3v2.3 tag its ID3v1 block maps
+ *  to, dropping the block if asked, in one
+ *  commit. Other files are skipped.
+ **********************************************/
+static int migrate_file(const char* path, size_t idx, unsigned worker, void* ctx) {
+    migrate_ctx_t* mc = (migrate_ctx_t*) ctx;
+    audiotag_t at;
+    int ret = audiotag_open(&at, path, 1, mc->opts);
+    if (ret != BATCH_OK) {
+        return ret;
+    }
+    const id3_tag_t* tag;
+    ret = audiotag_read(&at, &tag);
+    if (ret != BATCH_OK || tag->version != ID3_V1) {
+        if (ret == BATCH_OK) {
+            mc->skipped.fetch_add(1);
+        }
+        audiotag_close(&at);
+        return ret;
+    }
+
+    // The transaction takes over the loaded tag, so copy the block first
+    id3_1_t v1 = tag->v1;
+    id3_2_edit_t* tx = audiotag_edit(&at);
+    if (tx == nullptr) {
+        audiotag_close(&at);
+        return BATCH_ERR_READ;
+    }
+    int added = add_v1_frames(tx, &v1);
+
+    // The block is the last 128 bytes, so the commit's write can leave it out
+    if (mc->drop_v1) {
+        tx->trim = 128;
+    }
+    ret = audiotag_commit(&at);
+    if (ret == BATCH_OK) {
+        mc->migrated.fetch_add(1);
+        mc->frames.fetch_add(added);
+        mc->dropped.fetch_add(mc->drop_v1);
+    }
+    audiotag_close(&at);
+    return ret;
+}
+
+/**********************************************
+ *  migrate_run:
+ *    migrates every ID3v1-only file of files
+ *  across num_workers threads (0 for one per
+ *  core), each in a single write as opts asks
+ *  (null for the defaults). With drop_v1 the
+ *  ID3v1 block is left out of the new file.
+ *  Fills stats and returns the number of files
+ *  that failed.
+ **********************************************/
+size_t migrate_run(const std::vector<std::string>& files, unsigned num_workers, int drop_v1, const audiotag_opts_t* opts, migrate_stats_t* stats) {
+    migrate_ctx_t mc;
+    mc.opts = opts;
+    mc.drop_v1 = drop_v1 != 0;
+    mc.migrated = 0;
+    mc.frames = 0;
+    mc.dropped = 0;
+    mc.skipped = 0;
+
+    size_t failed = batch_run(files, num_workers, migrate_file, &mc);
+    stats->migrated = mc.migrated.load();
+    stats->frames = mc.frames.load();
+    stats->dropped = mc.dropped.load();
+    stats->skipped = mc.skipped.load();
+    stats->failed = failed;
+    return failed;
+}
+
+/**********************************************
+ *  migrate_report:
+ *    prints stats to out.
+ **********************************************/
+void migrate_report(const migrate_stats_t* stats, FILE* out) {
+    fprintf(out, "%zu migrated with %zu frames, %zu ID3v1 blocks dropped, %zu skipped, %zu failed\n",
+            stats->migrated, stats->frames, stats->dropped, stats->skipped, stats->failed);
+}
@@ -0,0 +1,55 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "libaudiotag.hh"
+
+/**********************************************
+ *  Migration turns an ID3v1-only file into an
+ *  ID3v2.3 one. The fields of the 128-byte
+ *  block map to frames:
+ *    title   TIT2     artist  TPE1
+ *    album   TALB     year    TYER
+ *    comment COMM     track   TRCK (ID3v1.1)
+ *    genre   TCON, by name, or as "(n)" for
+ *            numbers without one
+ *  Empty fields and genre 255 add no frame.
+ *  The padded tag is built in memory and the
+ *  file written once, with or without the
+ *  trailing ID3v1 block.
+ **********************************************/
+
+/**********************************************
+ *  migrate_stats_t:
+ *    what a migrate_run did.
+ **********************************************/
+typedef struct migrate_stats_t {
+    size_t migrated;        // files given an ID3v2 tag
+    size_t frames;          // frames written across them
+    size_t dropped;         // ID3v1 blocks removed
+    size_t skipped;         // files with an ID3v2 tag or no tag
+    size_t failed;
+} migrate_stats_t;
+
+/**********************************************
+ *  migrate_run:
+ *    migrates every ID3v1-only file of files
+ *  across num_workers threads (0 for one per
+ *  core), each in a single write as opts asks
+ *  (null for the defaults). With drop_v1 the
+ *  ID3v1 block is left out of the new file.
+ *  Fills stats and returns the number of files
+ *  that failed.
+ **********************************************/
+size_t migrate_run(const std::vector<std::string>& files, unsigned num_workers, int drop_v1, const audiotag_opts_t* opts, migrate_stats_t* stats);
+
+/**********************************************
+ *  migrate_report:
+ *    prints stats to out.
+ **********************************************/
+void migrate_report(const migrate_stats_t* stats, FILE* out);
+
+#endif
@@ -0,0 +1,555 @@
+#include "mpeg.hh"
+#include "xxh64.hh"
+#include "iostat.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Build with -DMPEG_SCALAR to leave out the SIMD sync search
+#if !defined(MPEG_SCALAR) && defined(__x86_64__)
+#define MPEG_SIMD
+#include <immintrin.h>
+#endif
+
+// Sample rates by version bits (11, 10, 00) and rate index
+static const uint32_t sample_rates[3][3] = {
+    {44100, 48000, 32000},
+    {22050, 24000, 16000},
+    {11025, 12000, 8000},
+};
+
+// Bitrates in kbit/s by [MPEG-1 or not][layer - 1][bitrate index]
+static const uint16_t bitrates[2][3][15] = {
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+    },
+    {
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    },
+};
+
+/**********************************************
+ *  mpeg_header_t:
+ *    a decoded 4-byte frame header.
+ **********************************************/
+typedef struct mpeg_header_t {
+    uint8_t version;        // an mpeg_version_t
+    uint8_t layer;
+    uint8_t channels;
+    uint32_t sample_rate;
+    uint32_t bitrate;       // bits per second
+    uint32_t length;        // bytes, header included
+    uint32_t samples;       // per channel
+} mpeg_header_t;
+
+/**********************************************
+ *  parse_header:
+ *    decodes the frame header at p into h.
+ *  Returns 1 if it is a valid header and 0
+ *  otherwise. Free-format frames, which carry
+ *  no bitrate, are not supported.
+ **********************************************/
+static int parse_header(const uint8_t* p, mpeg_header_t* h) {
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) {
+        return 0;
+    }
+    unsigned version_bits = (p[1] >> 3) & 3;
+    unsigned layer_bits = (p[1] >> 1) & 3;
+    unsigned rate_idx = p[2] >> 4;
+    unsigned sr_idx = (p[2] >> 2) & 3;
+    if (version_bits == 1 || layer_bits == 0 || rate_idx == 0 || rate_idx == 15 || sr_idx == 3 ||
+        (p[3] & 3) == 2) {
+        return 0;
+    }
+
+    h->version = version_bits == 3 ? MPEG_V1 : version_bits == 2 ? MPEG_V2 : MPEG_V25;
+    h->layer = 4 - layer_bits;
+    h->channels = (p[3] >> 6) == 3 ? 1 : 2;
+    h->sample_rate = sample_rates[h->version - 1][sr_idx];
+    h->bitrate = bitrates[h->version != MPEG_V1][h->layer - 1][rate_idx] * 1000;
+
+    unsigned pad = (p[2] >> 1) & 1;
+    if (h->layer == 1) {
+        h->samples = 384;
+        h->length = (12 * h->bitrate / h->sample_rate + pad) * 4;
+    } else if (h->layer == 2 || h->version == MPEG_V1) {
+        h->samples = 1152;
+        h->length = 144 * h->bitrate / h->sample_rate + pad;
+    } else {
+        h->samples = 576;
+        h->length = 72 * h->bitrate / h->sample_rate + pad;
+    }
+    return 1;
+}
+
+/**********************************************
+ *  same_stream:
+ *    returns 1 if frame headers a and b can
+ *  belong to the same stream.
+ **********************************************/
+static int same_stream(const mpeg_header_t* a, const mpeg_header_t* b) {
+    return a->version == b->version && a->layer == b->layer && a->sample_rate == b->sample_rate;
+}
+
+/**********************************************
+ *  find_sync:
+ *    returns the index of the first frame sync
+ *  (11 set bits) in the n bytes of p, or n if
+ *  there is none.
+ **********************************************/
+static size_t find_sync(const uint8_t* p, size_t n) {
+    size_t i = 0;
+#ifdef MPEG_SIMD
+    // Look for 0xff bytes 16 at a time and check the byte after each
+    const __m128i ff = _mm_set1_epi8((char) 0xff);
+    for (; i + 17 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+        while (mask) {
+            unsigned b = __builtin_ctz(mask);
+            if ((p[i + b + 1] & 0xe0) == 0xe0) {
+                return i + b;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + 1 < n; ++i) {
+        if (p[i] == 0xff && (p[i + 1] & 0xe0) == 0xe0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+/**********************************************
+ *  be32:
+ *    reads a big-endian 32-bit integer.
+ **********************************************/
+static uint32_t be32(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/**********************************************
+ *  side_info_size:
+ *    returns the bytes of Layer III side
+ *  information after the header of h, where
+ *  a Xing header sits.
+ **********************************************/
+static size_t side_info_size(const mpeg_header_t* h) {
+    if (h->version == MPEG_V1) {
+        return h->channels == 1 ? 17 : 32;
+    }
+    return h->channels == 1 ? 9 : 17;
+}
+
+/**********************************************
+ *  set_stream:
+ *    copies the stream fields of h to info.
+ **********************************************/
+static void set_stream(const mpeg_header_t* h, mpeg_info_t* info) {
+    info->version = h->version;
+    info->layer = h->layer;
+    info->channels = h->channels;
+    info->sample_rate = h->sample_rate;
+}
+
+/**********************************************
+ *  set_length:
+ *    fills the frame count, duration and
+ *  average bitrate of info from its frames of
+ *  spf samples taking bytes.
+ **********************************************/
+static void set_length(mpeg_info_t* info, uint64_t frames, uint32_t spf, uint64_t bytes) {
+    uint64_t samples = frames * spf;
+    info->frames = frames;
+    info->bitrate = samples ? bytes * 8 * info->sample_rate / samples : 0;
+    uint64_t trim = (uint64_t) info->delay + info->padding;
+    if (samples > trim) {
+        samples -= trim;
+    }
+    info->duration_ms = samples * 1000 / info->sample_rate;
+}
+
+/**********************************************
+ *  first_frame:
+ *    returns the index in the n bytes of buf
+ *  of the first frame header that the next
+ *  header confirms, and stores it in h, or
+ *  returns n if there is none. buf starts at
+ *  file offset offset; a frame reaching end
+ *  or past buf is taken unconfirmed.
+ **********************************************/
+static size_t first_frame(const uint8_t* buf, size_t n, off_t offset, off_t end, mpeg_header_t* h) {
+    size_t i = 0;
+    while (i + 4 <= n) {
+        i += find_sync(buf + i, n - i);
+        if (i + 4 > n) {
+            break;
+        }
+        if (parse_header(buf + i, h)) {
+            size_t next = i + h->length;
+            mpeg_header_t h2;
+            if (offset + (off_t) next >= end || next + 4 > n ||
+                (parse_header(buf + next, &h2) && same_stream(h, &h2))) {
+                return i;
+            }
+        }
+        ++i;
+    }
+    return n;
+}
+
+/**********************************************
+ *  read_xing:
+ *    reads the Xing/Info header of the frame
+ *  h at p, and the LAME tag after it, into
+ *  info. n bytes of p are readable. Returns 1
+ *  if it holds a frame count and 0 otherwise.
+ **********************************************/
+static int read_xing(const uint8_t* p, size_t n, const mpeg_header_t* h, off_t end, mpeg_info_t* info) {
+    size_t x = 4 + side_info_size(h);
+    if (h->layer != 3 || x + 8 > n || x + 8 > h->length) {
+        return 0;
+    }
+    int vbr = memcmp(p + x, "Xing", 4) == 0;
+    if (!vbr && memcmp(p + x, "Info", 4) != 0) {
+        return 0;
+    }
+    uint32_t flags = be32(p + x + 4);
+    size_t pos = x + 8;
+    uint32_t frames = 0;
+    uint64_t bytes = end - info->offset;
+    if (flags & 1) {
+        if (pos + 4 > n) {
+            return 0;
+        }
+        frames = be32(p + pos);
+        pos += 4;
+    }
+    if (flags & 2) {
+        if (pos + 4 > n) {
+            return 0;
+        }
+        // Counts the header frame too, which the offset leaves out
+        uint32_t b = be32(p + pos);
+        if (b > h->length) {
+            bytes = b - h->length;
+        }
+        pos += 4;
+    }
+    if (!(flags & 1) || frames == 0) {
+        return 0;
+    }
+    pos += (flags & 4 ? 100 : 0) + (flags & 8 ? 4 : 0);
+
+    // LAME tag: encoder, ..., then 12-bit delay and padding at 21
+    if (pos + 24 <= n && (memcmp(p + pos, "LAME", 4) == 0 || memcmp(p + pos, "Lavc", 4) == 0 ||
+                          memcmp(p + pos, "Lavf", 4) == 0)) {
+        info->delay = (p[pos + 21] << 4) | (p[pos + 22] >> 4);
+        info->padding = ((p[pos + 22] & 0xf) << 8) | p[pos + 23];
+    }
+    info->source = MPEG_XING;
+    info->vbr = vbr;
+    set_length(info, frames, h->samples, bytes);
+    return 1;
+}
+
+/**********************************************
+ *  read_vbri:
+ *    reads the VBRI header of the frame h at
+ *  p into info. n bytes of p are readable.
+ *  Returns 1 if there is one and 0 otherwise.
+ **********************************************/
+static int read_vbri(const uint8_t* p, size_t n, const mpeg_header_t* h, mpeg_info_t* info) {
+    size_t x = 4 + 32;
+    if (x + 18 > n || memcmp(p + x, "VBRI", 4) != 0) {
+        return 0;
+    }
+    uint32_t bytes = be32(p + x + 10);
+    uint32_t frames = be32(p + x + 14);
+    if (frames == 0) {
+        return 0;
+    }
+    info->source = MPEG_VBRI;
+    info->vbr = 1;
+    set_length(info, frames, h->samples, bytes > h->length ? bytes - h->length : bytes);
+    return 1;
+}
+
+/**********************************************
+ *  mpeg_audio_offset:
+ *    returns where the audio of a file with
+ *  the loaded tag starts: right after its
+ *  ID3v2 tag, or 0 without one.
+ **********************************************/
+off_t mpeg_audio_offset(const id3_tag_t* tag) {
+    if (tag->version != ID3_V2 || tag->data == nullptr) {
+        return 0;
+    }
+    // ID3v2.4 tags may end in a 10-byte footer
+    int footer = tag->data[3] == 4 && (tag->data[5] & 0x10);
+    return 10 + (off_t) tag->tag_sz + (footer ? 10 : 0);
+}
+
+/**********************************************
+ *  mpeg_audio_end:
+ *    returns where the audio of a file of size
+ *  bytes ends: before the ID3v1 block if last,
+ *  its final 128 bytes, hold one.
+ **********************************************/
+off_t mpeg_audio_end(off_t size, const uint8_t* last) {
+    if (size >= 128 && last && memcmp(last, "TAG", 3) == 0) {
+        return size - 128;
+    }
+    return size;
+}
+
+/**********************************************
+ *  mpeg_probe:
+ *    finds the first frame in buf and reads
+ *  its VBR header into info. Returns 0 when
+ *  info is complete, 1 when mpeg_walk has to
+ *  finish it and -1 if there is no frame.
+ **********************************************/
+int mpeg_probe(const uint8_t* buf, size_t n, off_t offset, off_t end, mpeg_info_t* info) {
+    memset(info, 0, sizeof(*info));
+    if (end - offset < (off_t) n) {
+        n = end > offset ? end - offset : 0;
+    }
+    mpeg_header_t h;
+    size_t i = first_frame(buf, n, offset, end, &h);
+    if (i >= n) {
+        return -1;
+    }
+    info->offset = offset + i;
+    info->end = end;
+    set_stream(&h, info);
+
+    const uint8_t* p = buf + i;
+    if (read_xing(p, n - i, &h, end, info) || read_vbri(p, n - i, &h, info)) {
+        return 0;
+    }
+
+    // No usable VBR header: a header frame carries no audio and is skipped
+    size_t x = 4 + side_info_size(&h);
+    if (h.layer == 3 && x + 4 <= n - i &&
+        (memcmp(p + x, "Xing", 4) == 0 || memcmp(p + x, "Info", 4) == 0)) {
+        info->offset += h.length;
+        i += h.length;
+        if (i + 4 > n || !parse_header(buf + i, &h)) {
+            info->source = MPEG_WALK;
+            return 1;
+        }
+    }
+
+    // Constant bitrate if the first frames agree
+    uint32_t bitrate = h.bitrate;
+    size_t j = i;
+    for (unsigned k = 0; k < MPEG_CBR_FRAMES && j + 4 <= n; ++k) {
+        mpeg_header_t hk;
+        if (!parse_header(buf + j, &hk) || !same_stream(&h, &hk) || hk.bitrate != bitrate) {
+            info->source = MPEG_WALK;
+            return 1;
+        }
+        j += hk.length;
+    }
+    info->source = MPEG_CBR;
+    uint64_t bytes = end - info->offset;
+    info->bitrate = bitrate;
+    uint64_t per_frame = (uint64_t) bitrate * h.samples;
+    info->frames = (bytes * 8 * h.sample_rate + per_frame / 2) / per_frame;
+    info->duration_ms = bytes * 8 * 1000 / bitrate;
+    return 0;
+}
+
+/**********************************************
+ *  mpeg_walk:
+ *    counts every frame of fd from the first
+ *  one mpeg_probe found up to info->end and
+ *  completes info. Returns 0 on success and
+ *  -1 on a read error.
+ **********************************************/
+int mpeg_walk(int fd, mpeg_info_t* info) {
+    uint8_t* buf = (uint8_t*) malloc(MPEG_WALK_CHUNK);
+    if (buf == nullptr) {
+        return -1;
+    }
+    posix_fadvise(fd, info->offset, info->end - info->offset, POSIX_FADV_SEQUENTIAL);
+
+    mpeg_header_t first;
+    memset(&first, 0, sizeof(first));
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    off_t base = 0;
+    size_t n = 0;
+    off_t pos = info->offset;
+    int ret = 0;
+    while (pos + 4 <= info->end) {
+        if (pos < base || pos + 4 > base + (off_t) n) {
+            size_t want = info->end - pos < MPEG_WALK_CHUNK ? info->end - pos : MPEG_WALK_CHUNK;
+            ssize_t got = iostat_pread(fd, buf, want, pos);
+            if (got < 4) {
+                ret = got < 0 ? -1 : 0;
+                break;
+            }
+            base = pos;
+            n = got;
+        }
+
+        const uint8_t* p = buf + (pos - base);
+        mpeg_header_t h;
+        if (parse_header(p, &h) && (frames == 0 || same_stream(&first, &h))) {
+            if (frames == 0) {
+                first = h;
+            } else if (h.bitrate != first.bitrate) {
+                info->vbr = 1;
+            }
+            ++frames;
+            bytes += h.length;
+            pos += h.length;
+            continue;
+        }
+
+        // Lost sync: skip to the next candidate, keeping a trailing 0xff for the next chunk
+        size_t rest = base + n - pos - 1;
+        size_t k = find_sync(p + 1, rest);
+        pos += k < rest ? 1 + k : rest > 0 ? rest : 1;
+    }
+    free(buf);
+
+    if (ret == 0 && frames > 0) {
+        info->source = MPEG_WALK;
+        set_length(info, frames, first.samples, bytes);
+    }
+    return ret;
+}
+
+/**********************************************
+ *  find_end:
+ *    stores where the audio of fd, whose tag
+ *  is loaded in tag, ends in end. Returns 0
+ *  on success and -1 if fd cannot be stat'd.
+ **********************************************/
+static int find_end(int fd, const id3_tag_t* tag, off_t* end) {
+    if (tag->version == ID3_V1) {
+        *end = tag->v1_offset;
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    *end = st.st_size;
+    uint8_t last[128];
+    if (*end >= 128 && iostat_pread(fd, last, 128, *end - 128) == 128) {
+        *end = mpeg_audio_end(*end, last);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  mpeg_scan:
+ *    fills info for the audio of fd, whose
+ *  tag is loaded in tag. Returns 0 on success
+ *  and -1 if no MPEG audio was found.
+ **********************************************/
+int mpeg_scan(int fd, const id3_tag_t* tag, mpeg_info_t* info) {
+    iostat_scope_t scope(IOSTAT_PHASE_AUDIO);
+    memset(info, 0, sizeof(*info));
+    off_t end;
+    if (find_end(fd, tag, &end) != 0) {
+        return -1;
+    }
+
+    off_t offset = mpeg_audio_offset(tag);
+    if (offset >= end) {
+        return -1;
+    }
+    uint8_t* buf = (uint8_t*) malloc(MPEG_PROBE_SIZE);
+    if (buf == nullptr) {
+        return -1;
+    }
+    size_t want = end - offset < MPEG_PROBE_SIZE ? end - offset : MPEG_PROBE_SIZE;
+    ssize_t got = iostat_pread(fd, buf, want, offset);
+    int ret = got > 0 ? mpeg_probe(buf, got, offset, end, info) : -1;
+    free(buf);
+
+    if (ret == 1) {
+        ret = mpeg_walk(fd, info);
+    }
+    if (ret != 0 || info->frames == 0) {
+        memset(info, 0, sizeof(*info));
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************
+ *  mpeg_hash_payload:
+ *    hashes the bytes of fd between its tags
+ *  and stores the XXH64 in hash and the count
+ *  in bytes. Returns 0 on success and -1 on a
+ *  read error.
+ **********************************************/
+int mpeg_hash_payload(int fd, const id3_tag_t* tag, uint64_t* hash, uint64_t* bytes) {
+    iostat_scope_t scope(IOSTAT_PHASE_AUDIO);
+    off_t end;
+    if (find_end(fd, tag, &end) != 0) {
+        return -1;
+    }
+    off_t offset = mpeg_audio_offset(tag);
+    xxh64_t ctx;
+    xxh64_init(&ctx, 0);
+    *bytes = offset < end ? end - offset : 0;
+    if (*bytes == 0) {
+        *hash = xxh64_final(&ctx);
+        return 0;
+    }
+
+    uint8_t* buf = (uint8_t*) malloc(MPEG_HASH_CHUNK);
+    if (buf == nullptr) {
+        return -1;
+    }
+    posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+    int ret = 0;
+    for (off_t pos = offset; pos < end;) {
+        size_t want = end - pos < MPEG_HASH_CHUNK ? end - pos : MPEG_HASH_CHUNK;
+        ssize_t got = iostat_pread(fd, buf, want, pos);
+        if (got <= 0) {
+            ret = -1;
+            break;
+        }
+        xxh64_update(&ctx, buf, got);
+        // A scan of a whole collection should not push out the page cache
+        posix_fadvise(fd, pos, got, POSIX_FADV_DONTNEED);
+        pos += got;
+    }
+    free(buf);
+    *hash = xxh64_final(&ctx);
+    return ret;
+}
+
+/**********************************************
+ *  mpeg_version_name:
+ *    returns "1", "2" or "2.5" for version.
+ **********************************************/
+const char* mpeg_version_name(uint8_t version) {
+    static const char* names[] = {"", "1", "2", "2.5"};
+    return version <= MPEG_V25 ? names[version] : "";
+}
+
+/**********************************************
+ *  mpeg_source_name:
+ *    returns a short name for source.
+ **********************************************/
+const char* mpeg_source_name(uint8_t source) {
+    static const char* names[] = {"none", "xing", "vbri", "cbr", "walk"};
+    return source <= MPEG_WALK ? names[source] : "none";
+}
@@ -0,0 +1,136 @@
+#ifndef MPEG_H
+#define MPEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "id3.hh"
+
+// Bytes read at the start of the audio to find the first frame and its VBR header
+#define MPEG_PROBE_SIZE (16 * 1024)
+
+// Frames that must share a bitrate before a stream without a VBR header is taken as CBR
+#define MPEG_CBR_FRAMES 8
+
+// Bytes read at a time when every frame has to be counted
+#define MPEG_WALK_CHUNK (1024 * 1024)
+
+// Bytes read at a time when hashing the audio payload
+#define MPEG_HASH_CHUNK (1024 * 1024)
+
+typedef enum {
+    MPEG_NONE,              // no MPEG audio found
+    MPEG_XING,              // Xing (VBR) or Info (CBR) header, as LAME writes
+    MPEG_VBRI,              // Fraunhofer VBRI header
+    MPEG_CBR,               // constant bitrate, estimated from the audio size
+    MPEG_WALK,              // every frame counted
+} mpeg_source_t;
+
+typedef enum {
+    MPEG_V1 = 1,
+    MPEG_V2,
+    MPEG_V25,
+} mpeg_version_t;
+
+/**********************************************
+ *  mpeg_info_t:
+ *    what mpeg_scan learned about the audio
+ *  of a file. Plain fixed-size fields so it
+ *  can be stored in the catalog as is.
+ **********************************************/
+typedef struct mpeg_info_t {
+    uint8_t source;         // an mpeg_source_t; the rest is 0 for MPEG_NONE
+    uint8_t version;        // an mpeg_version_t
+    uint8_t layer;          // 1, 2 or 3
+    uint8_t channels;
+    uint8_t vbr;            // the bitrate varies between frames
+    uint8_t reserved[3];
+    uint32_t sample_rate;   // Hz
+    uint32_t bitrate;       // average, in bits per second
+    uint32_t frames;        // audio frames, not counting a VBR header frame
+    uint32_t duration_ms;   // without encoder delay and padding
+    uint16_t delay;         // encoder delay in samples, from a LAME tag
+    uint16_t padding;       // end padding in samples, from a LAME tag
+    uint32_t reserved2;
+    int64_t offset;         // first audio frame
+    int64_t end;            // end of the audio
+} mpeg_info_t;
+
+/**********************************************
+ *  mpeg_audio_offset:
+ *    returns where the audio of a file with
+ *  the loaded tag starts: right after its
+ *  ID3v2 tag, or 0 without one.
+ **********************************************/
+off_t mpeg_audio_offset(const id3_tag_t* tag);
+
+/**********************************************
+ *  mpeg_audio_end:
+ *    returns where the audio of a file of size
+ *  bytes ends: before the ID3v1 block if last,
+ *  its final 128 bytes, hold one.
+ **********************************************/
+off_t mpeg_audio_end(off_t size, const uint8_t* last);
+
+/**********************************************
+ *  mpeg_probe:
+ *    finds the first frame in the n bytes of
+ *  buf read at file offset offset and reads
+ *  its Xing/Info, LAME or VBRI header. end is
+ *  where the audio stops. Returns 0 when info
+ *  is complete, 1 when the stream has no VBR
+ *  header and its bitrate varies, so only
+ *  mpeg_walk can tell its length, and -1 if
+ *  buf holds no MPEG frame.
+ **********************************************/
+int mpeg_probe(const uint8_t* buf, size_t n, off_t offset, off_t end, mpeg_info_t* info);
+
+/**********************************************
+ *  mpeg_walk:
+ *    counts every frame of fd from the first
+ *  one mpeg_probe found up to info->end,
+ *  reading MPEG_WALK_CHUNK bytes at a time,
+ *  and completes info. Returns 0 on success
+ *  and -1 on a read error.
+ **********************************************/
+int mpeg_walk(int fd, mpeg_info_t* info);
+
+/**********************************************
+ *  mpeg_scan:
+ *    fills info for the audio of fd, whose
+ *  tag is loaded in tag. Files with a VBR
+ *  header or a constant bitrate take two
+ *  small reads; others are walked. Returns 0
+ *  on success and -1 if no MPEG audio was
+ *  found (info->source is MPEG_NONE).
+ **********************************************/
+int mpeg_scan(int fd, const id3_tag_t* tag, mpeg_info_t* info);
+
+/**********************************************
+ *  mpeg_hash_payload:
+ *    hashes the audio payload of fd, whose tag
+ *  is loaded in tag: every byte between the
+ *  end of the ID3v2 tag, padding included, and
+ *  the ID3v1 block, so files that differ only
+ *  in their tags hash the same. Streams the
+ *  payload MPEG_HASH_CHUNK bytes at a time
+ *  and drops it from the page cache behind
+ *  it. Stores the XXH64 of the payload in hash
+ *  and its length in bytes. Returns 0 on
+ *  success and -1 on a read error.
+ **********************************************/
+int mpeg_hash_payload(int fd, const id3_tag_t* tag, uint64_t* hash, uint64_t* bytes);
+
+/**********************************************
+ *  mpeg_version_name:
+ *    returns "1", "2" or "2.5" for version.
+ **********************************************/
+const char* mpeg_version_name(uint8_t version);
+
+/**********************************************
+ *  mpeg_source_name:
+ *    returns a short name for source.
+ **********************************************/
+const char* mpeg_source_name(uint8_t source);
+
+#endif
@@ -0,0 +1,140 @@
+#include "sha256.hh"
+#include <string.h>
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/**********************************************
+ *  compress:
+ *    folds the 64-byte block p into the state
+ *  of ctx.
+ **********************************************/
+static void compress(sha256_t* ctx, const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t) p[4 * i] << 24) | ((uint32_t) p[4 * i + 1] << 16) |
+               ((uint32_t) p[4 * i + 2] << 8) | (uint32_t) p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+    uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + round_constants[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->h[5] += f;
+    ctx->h[6] += g;
+    ctx->h[7] += h;
+}
+
+/**********************************************
+ *  sha256_init:
+ *    starts an empty hash in ctx.
+ **********************************************/
+void sha256_init(sha256_t* ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->h, initial, sizeof(initial));
+    ctx->fill = 0;
+    ctx->len = 0;
+}
+
+/**********************************************
+ *  sha256_update:
+ *    hashes the n bytes at data. Whole blocks
+ *  are compressed straight from data.
+ **********************************************/
+void sha256_update(sha256_t* ctx, const uint8_t* data, size_t n) {
+    ctx->len += n;
+    if (ctx->fill) {
+        size_t take = 64 - ctx->fill < n ? 64 - ctx->fill : n;
+        memcpy(ctx->block + ctx->fill, data, take);
+        ctx->fill += take;
+        data += take;
+        n -= take;
+        if (ctx->fill < 64) {
+            return;
+        }
+        compress(ctx, ctx->block);
+        ctx->fill = 0;
+    }
+    for (; n >= 64; data += 64, n -= 64) {
+        compress(ctx, data);
+    }
+    memcpy(ctx->block, data, n);
+    ctx->fill = n;
+}
+
+/**********************************************
+ *  sha256_final:
+ *    pads the message with its bit length and
+ *  stores the digest in digest.
+ **********************************************/
+void sha256_final(sha256_t* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->len * 8;
+    ctx->block[ctx->fill++] = 0x80;
+    if (ctx->fill > 56) {
+        memset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+        compress(ctx, ctx->block);
+        ctx->fill = 0;
+    }
+    memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+    for (int i = 0; i < 8; ++i) {
+        ctx->block[56 + i] = bits >> (56 - 8 * i);
+    }
+    compress(ctx, ctx->block);
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = ctx->h[i] >> 24;
+        digest[4 * i + 1] = ctx->h[i] >> 16;
+        digest[4 * i + 2] = ctx->h[i] >> 8;
+        digest[4 * i + 3] = ctx->h[i];
+    }
+}
+
+/**********************************************
+ *  sha256_hex:
+ *    writes digest as lowercase hex.
+ **********************************************/
+void sha256_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA256_HEX_SIZE] = 0;
+}
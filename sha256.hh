@@ -0,0 +1,51 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+// Length of a digest as lowercase hex, without the NUL
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE)
+
+/**********************************************
+ *  sha256_t:
+ *    a SHA-256 hash being computed over data
+ *  fed in pieces of any size.
+ **********************************************/
+typedef struct sha256_t {
+    uint32_t h[8];
+    uint8_t block[64];
+    size_t fill;            // bytes of block in use
+    uint64_t len;           // bytes hashed so far
+} sha256_t;
+
+/**********************************************
+ *  sha256_init:
+ *    starts an empty hash in ctx.
+ **********************************************/
+void sha256_init(sha256_t* ctx);
+
+/**********************************************
+ *  sha256_update:
+ *    hashes the n bytes at data.
+ **********************************************/
+void sha256_update(sha256_t* ctx, const uint8_t* data, size_t n);
+
+/**********************************************
+ *  sha256_final:
+ *    finishes the hash and stores the digest
+ *  in digest. ctx must be initialised again
+ *  before reuse.
+ **********************************************/
+void sha256_final(sha256_t* ctx, uint8_t* digest);
+
+/**********************************************
+ *  sha256_hex:
+ *    writes digest as SHA256_HEX_SIZE hex
+ *  digits and a NUL to hex.
+ **********************************************/
+void sha256_hex(const uint8_t* digest, char* hex);
+
+#endif
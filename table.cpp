@@ -0,0 +1,555 @@
+#include "table.hh"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <algorithm>
+
+/**********************************************
+ *  table_field_t:
+ *    a trait name usable in queries and the
+ *  frame ID it stands for.
+ **********************************************/
+typedef struct table_field_t {
+    const char* name;
+    uint8_t trait;
+    const char* id;
+} table_field_t;
+
+static const table_field_t fields[] = {
+    {"title", ID3_TRAIT_TITLE, "TIT2"},
+    {"artist", ID3_TRAIT_ARTIST, "TPE1"},
+    {"album", ID3_TRAIT_ALBUM, "TALB"},
+    {"year", ID3_TRAIT_YEAR, "TYER"},
+    {"track", ID3_TRAIT_TRACK, "TRCK"},
+    {"composer", ID3_TRAIT_COMPOSER, "TCOM"},
+};
+
+#define NUM_FIELDS (sizeof(fields) / sizeof(fields[0]))
+
+/**********************************************
+ *  column_for:
+ *    returns the column of frame id in t,
+ *  adding an empty one if it has none.
+ **********************************************/
+static table_column_t* column_for(table_t* t, uint32_t id) {
+    auto it = t->column_of.find(id);
+    if (it != t->column_of.end()) {
+        return &t->columns[it->second];
+    }
+    t->column_of[id] = t->columns.size();
+    t->columns.emplace_back();
+    table_column_t* col = &t->columns.back();
+    col->id = id;
+    col->codes.assign(t->num_words * 64, 0);
+    col->dict.push_back(std::string());
+    col->present.assign(t->num_words, 0);
+    return col;
+}
+
+/**********************************************
+ *  find_column:
+ *    returns the column of frame id in t, or
+ *  nullptr if no row has the frame.
+ **********************************************/
+static const table_column_t* find_column(const table_t* t, uint32_t id) {
+    auto it = t->column_of.find(id);
+    return it == t->column_of.end() ? nullptr : &t->columns[it->second];
+}
+
+/**********************************************
+ *  set_code:
+ *    gives row i of col the code of text,
+ *  adding text to the dictionary if needed.
+ **********************************************/
+static void set_code(table_column_t* col, size_t i, const std::string& text) {
+    auto code = col->lookup.emplace(text, col->dict.size());
+    if (code.second) {
+        col->dict.push_back(text);
+    }
+    col->codes[i] = code.first->second;
+    col->present[i >> 6] |= 1ull << (i & 63);
+}
+
+/**********************************************
+ *  table_build:
+ *    fills t with the frames of every entry
+ *  of cat. A row without TYER gets the year
+ *  of its TDRC in the TYER column.
+ **********************************************/
+void table_build(const catalog_t* cat, table_t* t) {
+    t->cat = cat;
+    t->num_rows = cat->header->num_entries;
+    t->num_words = (t->num_rows + 63) / 64;
+    t->columns.clear();
+    t->column_of.clear();
+    for (size_t k = 0; k < NUM_ID3_TRAITS; ++k) {
+        t->traits[k].assign(t->num_words, 0);
+    }
+
+    const uint32_t tyer = id3_fourcc("TYER");
+    const uint32_t tdrc = id3_fourcc("TDRC");
+    std::string text;
+    std::string recorded;
+    for (size_t i = 0; i < t->num_rows; ++i) {
+        const catalog_entry_t* e = &cat->entries[i];
+        const char* p = cat->strings + e->frames_off;
+        const char* end = p + e->frames_len;
+        uint64_t bit = 1ull << (i & 63);
+        recorded.clear();
+        while (p + 8 <= end) {
+            uint32_t n;
+            memcpy(&n, p + 4, 4);
+            uint32_t id = id3_fourcc(p);
+            text.assign(p + 8, n);
+            p += 8 + n;
+            if (n == 0) {
+                continue;
+            }
+
+            // The first frame with an ID holds the value, as in the dumps
+            table_column_t* col = column_for(t, id);
+            if (col->codes[i] != 0) {
+                continue;
+            }
+            set_code(col, i, text);
+            if (id == tdrc) {
+                recorded = text;
+            }
+
+            const id3_frame_info_t* info = id3_frame_info(id);
+            if (info != nullptr && info->trait != ID3_TRAIT_NONE) {
+                t->traits[info->trait][i >> 6] |= bit;
+            }
+        }
+
+        // ID3v2.4 has no TYER; its year starts the TDRC timestamp
+        if (recorded.size() >= 4) {
+            table_column_t* col = column_for(t, tyer);
+            if (col->codes[i] == 0) {
+                set_code(col, i, recorded.substr(0, 4));
+            }
+        }
+    }
+}
+
+/**********************************************
+ *  tokenize:
+ *    splits text at whitespace into tokens,
+ *  keeping double-quoted runs together without
+ *  the quotes. Returns -1 on an unterminated
+ *  quote.
+ **********************************************/
+static int tokenize(const char* text, std::vector<std::string>& tokens) {
+    const char* p = text;
+    while (*p) {
+        while (isspace((unsigned char) *p)) {
+            ++p;
+        }
+        if (!*p) {
+            break;
+        }
+        std::string tok;
+        while (*p && !isspace((unsigned char) *p)) {
+            if (*p != '"') {
+                tok += *p++;
+                continue;
+            }
+            const char* close = strchr(p + 1, '"');
+            if (close == nullptr) {
+                return -1;
+            }
+            tok.append(p + 1, close - p - 1);
+            p = close + 1;
+        }
+        tokens.push_back(tok);
+    }
+    return 0;
+}
+
+/**********************************************
+ *  parse_field:
+ *    reads a frame ID or trait name into id
+ *  and trait. Returns 0 on success and -1 if s
+ *  is neither.
+ **********************************************/
+static int parse_field(const std::string& s, uint32_t* id, uint8_t* trait) {
+    if (s.size() == 4) {
+        size_t k = 0;
+        while (k < 4 && (isupper((unsigned char) s[k]) || isdigit((unsigned char) s[k]))) {
+            ++k;
+        }
+        if (k == 4) {
+            *id = id3_fourcc(s.c_str());
+            *trait = ID3_TRAIT_NONE;
+            return 0;
+        }
+    }
+    for (size_t k = 0; k < NUM_FIELDS; ++k) {
+        if (strcasecmp(s.c_str(), fields[k].name) == 0) {
+            *id = id3_fourcc(fields[k].id);
+            *trait = fields[k].trait;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**********************************************
+ *  parse_cond:
+ *    reads the condition starting at token i
+ *  into cond and advances i past it. Returns
+ *  0 on success and -1 on a syntax error.
+ **********************************************/
+static int parse_cond(const std::vector<std::string>& tokens, size_t* i, table_cond_t* cond) {
+    if (*i >= tokens.size()) {
+        return -1;
+    }
+    const std::string& tok = tokens[(*i)++];
+    if (tok == "has" || tok == "missing") {
+        cond->op = tok == "has" ? TABLE_HAS : TABLE_MISSING;
+        return *i < tokens.size() ? parse_field(tokens[(*i)++], &cond->id, &cond->trait) : -1;
+    }
+    size_t eq = tok.find('=');
+    if (eq == std::string::npos || eq == 0) {
+        return -1;
+    }
+    size_t name_end = eq;
+    cond->op = TABLE_EQ;
+    if (tok[eq - 1] == '!') {
+        cond->op = TABLE_NE;
+        --name_end;
+    }
+    cond->value = tok.substr(eq + 1);
+    if (parse_field(tok.substr(0, name_end), &cond->id, &cond->trait) != 0) {
+        return -1;
+    }
+
+    // Values are compared against the frame the name stands for
+    cond->trait = ID3_TRAIT_NONE;
+    return 0;
+}
+
+/**********************************************
+ *  table_parse_query:
+ *    parses text into q. Returns 0 on success
+ *  and -1 on a syntax error.
+ **********************************************/
+int table_parse_query(const char* text, table_query_t* q) {
+    q->where.clear();
+    q->select.clear();
+    q->count = 0;
+    q->group = 0;
+    q->distinct = 0;
+
+    std::vector<std::string> tokens;
+    if (tokenize(text, tokens) != 0) {
+        return -1;
+    }
+    uint8_t trait;
+    size_t i = 0;
+    while (i < tokens.size()) {
+        const std::string& tok = tokens[i++];
+        if (tok == "where") {
+            table_cond_t cond;
+            if (parse_cond(tokens, &i, &cond) != 0) {
+                return -1;
+            }
+            q->where.push_back(cond);
+            while (i < tokens.size() && tokens[i] == "and") {
+                ++i;
+                if (parse_cond(tokens, &i, &cond) != 0) {
+                    return -1;
+                }
+                q->where.push_back(cond);
+            }
+        } else if (tok == "select" && i < tokens.size()) {
+            std::string list = tokens[i++];
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                if (comma == std::string::npos) {
+                    comma = list.size();
+                }
+                uint32_t id;
+                if (parse_field(list.substr(start, comma - start), &id, &trait) != 0) {
+                    return -1;
+                }
+                q->select.push_back(id);
+                start = comma + 1;
+            }
+        } else if (tok == "count") {
+            q->count = 1;
+        } else if (tok == "group" && i < tokens.size()) {
+            if (parse_field(tokens[i++], &q->group, &trait) != 0) {
+                return -1;
+            }
+            if (i + 1 < tokens.size() && tokens[i] == "distinct") {
+                if (parse_field(tokens[i + 1], &q->distinct, &trait) != 0) {
+                    return -1;
+                }
+                i += 2;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    // One kind of output per query
+    if ((q->count && (q->group || !q->select.empty())) || (q->group && !q->select.empty())) {
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************************
+ *  match_word:
+ *    returns the bitmap of the 64 codes
+ *  starting at codes that equal code. The
+ *  loop has no branches, so the compiler can
+ *  vectorize it.
+ **********************************************/
+static inline uint64_t match_word(const uint32_t* codes, uint32_t code) {
+    uint64_t m = 0;
+    for (unsigned b = 0; b < 64; ++b) {
+        m |= (uint64_t) (codes[b] == code) << b;
+    }
+    return m;
+}
+
+/**********************************************
+ *  table_filter:
+ *    sets rows to the bitmap of the rows of t
+ *  matching every where condition of q.
+ **********************************************/
+void table_filter(const table_t* t, const table_query_t* q, std::vector<uint64_t>& rows) {
+    rows.assign(t->num_words, ~0ull);
+    if (t->num_rows % 64) {
+        rows.back() = (1ull << (t->num_rows % 64)) - 1;
+    }
+
+    for (size_t c = 0; c < q->where.size(); ++c) {
+        const table_cond_t* cond = &q->where[c];
+        const table_column_t* col = find_column(t, cond->id);
+
+        if (cond->op == TABLE_HAS || cond->op == TABLE_MISSING) {
+            const uint64_t* bits = cond->trait != ID3_TRAIT_NONE ? t->traits[cond->trait].data() :
+                                   col != nullptr ? col->present.data() : nullptr;
+            uint64_t flip = cond->op == TABLE_MISSING ? ~0ull : 0;
+            for (size_t w = 0; w < t->num_words; ++w) {
+                rows[w] &= (bits ? bits[w] : 0) ^ flip;
+            }
+            continue;
+        }
+
+        // Values are matched by their dictionary code, looked up once
+        uint32_t code = 0;
+        if (col != nullptr) {
+            auto it = col->lookup.find(cond->value);
+            code = it == col->lookup.end() ? 0 : it->second;
+        }
+        if (col == nullptr || (code == 0 && cond->op == TABLE_EQ)) {
+            std::fill(rows.begin(), rows.end(), 0);
+            break;
+        }
+        const uint32_t* codes = col->codes.data();
+        for (size_t w = 0; w < t->num_words; ++w) {
+            if (rows[w] == 0) {
+                continue;
+            }
+            uint64_t m = code ? match_word(codes + w * 64, code) : 0;
+            rows[w] &= cond->op == TABLE_EQ ? m : col->present[w] & ~m;
+        }
+    }
+}
+
+/**********************************************
+ *  id_name:
+ *    returns the frame ID id as a string.
+ **********************************************/
+static std::string id_name(uint32_t id) {
+    char s[4] = {(char) (id >> 24), (char) (id >> 16), (char) (id >> 8), (char) id};
+    return std::string(s, 4);
+}
+
+/**********************************************
+ *  put_value:
+ *    appends the value code of col to out in
+ *  format; missing values are null in JSON
+ *  and empty in CSV.
+ **********************************************/
+static void put_value(const table_column_t* col, uint32_t code, dump_format_t format, std::string& out) {
+    if (col == nullptr || code == 0) {
+        if (format == DUMP_JSON) {
+            out += "null";
+        }
+        return;
+    }
+    const std::string& s = col->dict[code];
+    if (format == DUMP_JSON) {
+        dump_json_string(s.data(), s.size(), out);
+    } else {
+        dump_csv_field(s.data(), s.size(), out);
+    }
+}
+
+/**********************************************
+ *  run_groups:
+ *    writes the groups of the group column of
+ *  q over rows to w, largest first.
+ **********************************************/
+static void run_groups(const table_t* t, const table_query_t* q, const std::vector<uint64_t>& rows,
+                       dump_format_t format, dump_writer_t* w) {
+    const table_column_t* col = find_column(t, q->group);
+    const table_column_t* dcol = q->distinct ? find_column(t, q->distinct) : nullptr;
+    std::vector<size_t> counts(col ? col->dict.size() : 1, 0);
+    std::vector<uint64_t> pairs;
+    for (size_t wd = 0; wd < rows.size(); ++wd) {
+        uint64_t word = rows[wd];
+        while (word) {
+            size_t i = wd * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            uint32_t code = col ? col->codes[i] : 0;
+            counts[code]++;
+            if (dcol != nullptr && dcol->codes[i] != 0) {
+                pairs.push_back((uint64_t) code << 32 | dcol->codes[i]);
+            }
+        }
+    }
+
+    // Distinct values per group from the sorted (group, value) pairs
+    std::vector<size_t> distinct(counts.size(), 0);
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    for (size_t k = 0; k < pairs.size(); ++k) {
+        distinct[pairs[k] >> 32]++;
+    }
+
+    std::vector<uint32_t> order;
+    for (uint32_t code = 0; code < counts.size(); ++code) {
+        if (counts[code] && (!q->distinct || distinct[code] > 1)) {
+            order.push_back(code);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        if (counts[a] != counts[b]) {
+            return counts[a] > counts[b];
+        }
+        return col ? col->dict[a] < col->dict[b] : a < b;
+    });
+
+    std::string name = id_name(q->group);
+    std::string out;
+    if (format == DUMP_CSV) {
+        out = name + ",count" + (q->distinct ? ",distinct\n" : "\n");
+    }
+    for (size_t k = 0; k < order.size(); ++k) {
+        uint32_t code = order[k];
+        if (format == DUMP_JSON) {
+            out += "{\"" + name + "\":";
+            put_value(col, code, format, out);
+            out += ",\"count\":" + std::to_string(counts[code]);
+            if (q->distinct) {
+                out += ",\"distinct\":" + std::to_string(distinct[code]);
+            }
+            out += "}\n";
+        } else {
+            put_value(col, code, format, out);
+            out += "," + std::to_string(counts[code]);
+            if (q->distinct) {
+                out += "," + std::to_string(distinct[code]);
+            }
+            out += "\n";
+        }
+        if (out.size() >= DUMP_FLUSH_SIZE) {
+            dump_writer_append(w, out.data(), out.size());
+            out.clear();
+        }
+    }
+    dump_writer_append(w, out.data(), out.size());
+}
+
+/**********************************************
+ *  run_select:
+ *    writes the path and the select columns of
+ *  every row in rows to w.
+ **********************************************/
+static void run_select(const table_t* t, const table_query_t* q, const std::vector<uint64_t>& rows,
+                       dump_format_t format, dump_writer_t* w) {
+    std::vector<const table_column_t*> cols;
+    std::vector<std::string> names;
+    std::string out;
+    if (format == DUMP_CSV) {
+        out = "path";
+    }
+    for (size_t k = 0; k < q->select.size(); ++k) {
+        cols.push_back(find_column(t, q->select[k]));
+        names.push_back(id_name(q->select[k]));
+        if (format == DUMP_CSV) {
+            out += "," + names.back();
+        }
+    }
+    if (format == DUMP_CSV) {
+        out += "\n";
+    }
+
+    for (size_t wd = 0; wd < rows.size(); ++wd) {
+        uint64_t word = rows[wd];
+        while (word) {
+            size_t i = wd * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            const catalog_entry_t* e = &t->cat->entries[i];
+            const char* path = t->cat->strings + e->path_off;
+            if (format == DUMP_JSON) {
+                out += "{\"path\":";
+                dump_json_string(path, e->path_len, out);
+                for (size_t k = 0; k < cols.size(); ++k) {
+                    out += ",\"" + names[k] + "\":";
+                    put_value(cols[k], cols[k] ? cols[k]->codes[i] : 0, format, out);
+                }
+                out += "}\n";
+            } else {
+                dump_csv_field(path, e->path_len, out);
+                for (size_t k = 0; k < cols.size(); ++k) {
+                    out += ',';
+                    put_value(cols[k], cols[k] ? cols[k]->codes[i] : 0, format, out);
+                }
+                out += "\n";
+            }
+            if (out.size() >= DUMP_FLUSH_SIZE) {
+                dump_writer_append(w, out.data(), out.size());
+                out.clear();
+            }
+        }
+    }
+    dump_writer_append(w, out.data(), out.size());
+}
+
+/**********************************************
+ *  table_run:
+ *    filters t by q and writes the result to
+ *  fd in format. Returns the number of rows
+ *  matched.
+ **********************************************/
+size_t table_run(const table_t* t, const table_query_t* q, dump_format_t format, int fd) {
+    std::vector<uint64_t> rows;
+    table_filter(t, q, rows);
+    size_t matched = 0;
+    for (size_t w = 0; w < rows.size(); ++w) {
+        matched += __builtin_popcountll(rows[w]);
+    }
+
+    dump_writer_t writer;
+    dump_writer_init(&writer, fd);
+    if (q->count) {
+        std::string out = format == DUMP_JSON ? "{\"count\":" + std::to_string(matched) + "}\n" :
+                                                "count\n" + std::to_string(matched) + "\n";
+        dump_writer_append(&writer, out.data(), out.size());
+    } else if (q->group) {
+        run_groups(t, q, rows, format, &writer);
+    } else {
+        run_select(t, q, rows, format, &writer);
+    }
+    dump_writer_flush(&writer);
+    return matched;
+}
@@ -0,0 +1,131 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "catalog.hh"
+#include "dump.hh"
+#include "id3frames.hh"
+
+/**********************************************
+ *  The table holds the frames of a catalog
+ *  column by column: row i is catalog entry
+ *  i. Each frame ID is a column of dictionary
+ *  codes, one uint32_t per row with 0 where
+ *  the file has no such frame or an empty
+ *  one, plus a bitmap of the rows that have
+ *  it. Each trait (see id3_trait_t) has a
+ *  bitmap of the rows with any frame filling
+ *  it in. Bitmaps are 64 rows per word, and
+ *  code arrays are padded to whole words, so
+ *  filters run a word at a time without
+ *  reading a file.
+ **********************************************/
+
+/**********************************************
+ *  table_column_t:
+ *    the values of one frame ID.
+ **********************************************/
+typedef struct table_column_t {
+    uint32_t id;                                    // id3_fourcc of the frame ID
+    std::vector<uint32_t> codes;                    // per row, 0 if missing
+    std::vector<std::string> dict;                  // code -> text; dict[0] is ""
+    std::unordered_map<std::string, uint32_t> lookup;   // text -> code
+    std::vector<uint64_t> present;                  // rows with a code
+} table_column_t;
+
+/**********************************************
+ *  table_t:
+ *    the frames of cat, which must stay open
+ *  while the table is used.
+ **********************************************/
+typedef struct table_t {
+    const catalog_t* cat;
+    size_t num_rows;
+    size_t num_words;                               // bitmap words per column
+    std::vector<table_column_t> columns;
+    std::unordered_map<uint32_t, size_t> column_of; // frame ID -> column
+    std::vector<uint64_t> traits[NUM_ID3_TRAITS];
+} table_t;
+
+typedef enum {
+    TABLE_HAS,              // the frame or trait is present
+    TABLE_MISSING,          // it is not
+    TABLE_EQ,               // the frame has exactly the value
+    TABLE_NE,               // the frame is present with another value
+} table_op_t;
+
+/**********************************************
+ *  table_cond_t:
+ *    one where condition. trait is set for
+ *  has and missing on a trait name, which
+ *  then test the trait bitmap instead of the
+ *  column of id.
+ **********************************************/
+typedef struct table_cond_t {
+    uint8_t op;             // a table_op_t
+    uint8_t trait;          // an id3_trait_t, or ID3_TRAIT_NONE
+    uint32_t id;            // id3_fourcc of the frame ID
+    std::string value;
+} table_cond_t;
+
+/**********************************************
+ *  table_query_t:
+ *    a parsed query: rows matching every
+ *  where condition, then either their count,
+ *  their path and the select columns, or the
+ *  groups of their group column. With
+ *  distinct, only groups whose rows take more
+ *  than one value of that column are kept.
+ **********************************************/
+typedef struct table_query_t {
+    std::vector<table_cond_t> where;
+    std::vector<uint32_t> select;
+    uint8_t count;
+    uint32_t group;         // 0 for no grouping
+    uint32_t distinct;      // 0 for none
+} table_query_t;
+
+/**********************************************
+ *  table_build:
+ *    fills t with the frames of every entry
+ *  of cat. A row without TYER gets the year
+ *  of its TDRC in the TYER column.
+ **********************************************/
+void table_build(const catalog_t* cat, table_t* t);
+
+/**********************************************
+ *  table_parse_query:
+ *    parses text into q. The clauses are
+ *      where COND [and COND]...
+ *      select ID[,ID]...
+ *      count
+ *      group ID [distinct ID]
+ *  and COND is has X, missing X, X=value or
+ *  X!=value, where X is a frame ID or one of
+ *  title, artist, album, year, track and
+ *  composer. Values may be double-quoted.
+ *  Returns 0 on success and -1 on a syntax
+ *  error.
+ **********************************************/
+int table_parse_query(const char* text, table_query_t* q);
+
+/**********************************************
+ *  table_filter:
+ *    sets rows to the bitmap of the rows of t
+ *  matching every where condition of q.
+ **********************************************/
+void table_filter(const table_t* t, const table_query_t* q, std::vector<uint64_t>& rows);
+
+/**********************************************
+ *  table_run:
+ *    filters t by q and writes the result to
+ *  fd in format. Returns the number of rows
+ *  matched.
+ **********************************************/
+size_t table_run(const table_t* t, const table_query_t* q, dump_format_t format, int fd);
+
+#endif
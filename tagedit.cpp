@@ -0,0 +1,587 @@
+#include "tagedit.hh"
+#include "id3.hh"
+#include "fileio.hh"
+#include "iostat.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**********************************************
+ *  utf8_next:
+ *    decodes the UTF-8 sequence at *p and
+ *  advances *p past it. Returns the code
+ *  point, or -1 if the bytes are not UTF-8.
+ **********************************************/
+static int32_t utf8_next(const uint8_t** p, const uint8_t* end) {
+    const uint8_t* s = *p;
+    uint32_t c = *s++;
+    int more = c < 0x80 ? 0 : (c & 0xe0) == 0xc0 ? 1 : (c & 0xf0) == 0xe0 ? 2 : (c & 0xf8) == 0xf0 ? 3 : -1;
+    if (more < 0 || end - s < more) {
+        return -1;
+    }
+    c &= more ? 0x3f >> more : 0x7f;
+    for (int i = 0; i < more; ++i, ++s) {
+        if ((*s & 0xc0) != 0x80) {
+            return -1;
+        }
+        c = c << 6 | (*s & 0x3f);
+    }
+    // Overlong forms, surrogates and code points past U+10FFFF
+    static const uint32_t least[4] = {0, 0x80, 0x800, 0x10000};
+    if (c < least[more] || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+        return -1;
+    }
+    *p = s;
+    return c;
+}
+
+/**********************************************
+ *  make_text_body:
+ *    allocates an ID3v2 text frame body for
+ *  text and stores its size in sz. ASCII, and
+ *  bytes that are not UTF-8, are stored as is
+ *  with ISO-8859-1 encoding; other UTF-8 text
+ *  as ISO-8859-1 where every character has a
+ *  form there, and as UTF-16 with a BOM if
+ *  not, as ID3v2.3 has no UTF-8.
+ **********************************************/
+static uint8_t* make_text_body(const char* text, uint32_t* sz) {
+    size_t n = strlen(text);
+    const uint8_t* end = (const uint8_t*) text + n;
+    size_t units = 0;
+    int32_t max = 0;
+    for (const uint8_t* p = (const uint8_t*) text; p < end && max >= 0;) {
+        int32_t c = utf8_next(&p, end);
+        max = c > max || c < 0 ? c : max;
+        units += c > 0xffff ? 2 : 1;
+    }
+
+    if (max < 0x80) {
+        uint8_t* body = (uint8_t*) malloc(n + 1);
+        if (body == nullptr) {
+            return nullptr;
+        }
+        body[0] = 0;
+        memcpy(body + 1, text, n);
+        *sz = n + 1;
+        return body;
+    }
+
+    size_t len = max <= 0xff ? 1 + units : 3 + 2 * units;
+    uint8_t* body = (uint8_t*) malloc(len);
+    if (body == nullptr) {
+        return nullptr;
+    }
+    uint8_t* out = body;
+    if (max <= 0xff) {
+        *out++ = 0;
+    } else {
+        *out++ = 1;
+        *out++ = 0xff;
+        *out++ = 0xfe;
+    }
+    for (const uint8_t* p = (const uint8_t*) text; p < end;) {
+        uint32_t c = utf8_next(&p, end);
+        if (max <= 0xff) {
+            *out++ = c;
+            continue;
+        }
+        if (c > 0xffff) {
+            uint32_t hi = 0xd800 + ((c - 0x10000) >> 10);
+            *out++ = hi & 0xff;
+            *out++ = hi >> 8;
+            c = 0xdc00 + ((c - 0x10000) & 0x3ff);
+        }
+        *out++ = c & 0xff;
+        *out++ = c >> 8;
+    }
+    *sz = len;
+    return body;
+}
+
+/**********************************************
+ *  id3_1_field:
+ *    writes text into the n-byte ID3v1 field,
+ *  zero-padded, converting UTF-8 to ISO-8859-1.
+ **********************************************/
+void id3_1_field(const char* text, char* field, size_t n) {
+    memset(field, 0, n);
+    size_t len = strlen(text);
+    const uint8_t* end = (const uint8_t*) text + len;
+    size_t k = 0;
+    for (const uint8_t* p = (const uint8_t*) text; p < end && k < n;) {
+        int32_t c = utf8_next(&p, end);
+        if (c < 0) {
+            // Not UTF-8: the bytes are taken as they are
+            memcpy(field, text, len < n ? len : n);
+            return;
+        }
+        field[k++] = c <= 0xff ? c : '?';
+    }
+}
+
+/**********************************************
+ *  release_frame:
+ *    frees the body of f if the frame owns it.
+ **********************************************/
+static void release_frame(id3_2_edit_frame_t* f) {
+    if (f->owned) {
+        free(f->body);
+    }
+    f->body = nullptr;
+    f->owned = 0;
+}
+
+/**********************************************
+ *  id3_2_padding_init:
+ *    sets policy to the default.
+ **********************************************/
+void id3_2_padding_init(id3_2_padding_t* policy) {
+    policy->min = ID3_2_MIN_PADDING;
+    policy->headroom_pct = ID3_2_HEADROOM_PCT;
+    policy->max = ID3_2_MAX_PADDING;
+    policy->align = 0;
+}
+
+/**********************************************
+ *  id3_2_edit_begin:
+ *    loads the ID3v2 tag of fd (if any) into
+ *  tx. Returns 0 on success and -1 if the tag
+ *  could not be read or cannot be edited.
+ **********************************************/
+int id3_2_edit_begin(id3_2_edit_t* tx, int fd, char* path) {
+    id3_tag_t tag;
+    if (id3_read_tag(fd, &tag) != 0) {
+        return -1;
+    }
+    return id3_2_edit_begin_loaded(tx, fd, path, &tag);
+}
+
+/**********************************************
+ *  id3_2_edit_begin_loaded:
+ *    starts tx on the tag already loaded from
+ *  fd by id3_read_tag. tx takes over the tag
+ *  buffer, which is left empty. Only ID3v2.3
+ *  and ID3v2.4 tags without unsynchronisation,
+ *  extended header or footer whose frames
+ *  parse up to zero padding or the end of the
+ *  tag can be edited; for others tx is left
+ *  empty, so no commit drops frames it could
+ *  not read.
+ *  Returns 0 on success and -1 if the tag
+ *  cannot be edited.
+ **********************************************/
+int id3_2_edit_begin_loaded(id3_2_edit_t* tx, int fd, char* path, id3_tag_t* tag) {
+    tx->fd = fd;
+    tx->path = path;
+    tx->has_tag = 0;
+    tx->dirty = 0;
+    tx->outcome = ID3_2_EDIT_NONE;
+    tx->shrunk = 0;
+    tx->trim = 0;
+    id3_2_padding_init(&tx->padding);
+    tx->sync = nullptr;
+    tx->tag_sz = 0;
+    tx->used = 0;
+    tx->tag = nullptr;
+    tx->frames.clear();
+
+    tx->raw = *tag;
+    tag->data = nullptr;
+    tag->body = nullptr;
+    tag->map_sz = 0;
+    if (tx->raw.version != ID3_V2) {
+        id3_free_tag(&tx->raw);
+        return 0;
+    }
+    if (!id3_2_frames_readable(tx->raw.data[3]) || (tx->raw.data[5] & ID3_2_FLAGS_UNEDITABLE) != 0) {
+        id3_free_tag(&tx->raw);
+        return -1;
+    }
+    tx->has_tag = 1;
+    tx->tag_sz = tx->raw.tag_sz;
+    tx->tag = tx->raw.body;
+
+    // Index the frames; their bodies stay in the tag copy
+    iostat_scope_t scope(IOSTAT_PHASE_FRAMES);
+    id3_2_frame_iter_t it;
+    id3_2_frame_view_t view;
+    id3_2_frame_iter_init(&it, tx->tag, tx->tag_sz, tx->raw.data[3]);
+    while (id3_2_frame_next(&it, &view)) {
+        id3_2_edit_frame_t f;
+        memcpy(f.id, view.id, 4);
+        memcpy(f.flags, view.flags, 2);
+        f.size = view.size;
+        f.body = (uint8_t*) view.body;
+        f.owned = 0;
+        tx->frames.push_back(f);
+    }
+    tx->used = it.off;
+
+    // Whatever the walk stopped at must be padding
+    for (uint32_t off = it.off; off < tx->tag_sz; ++off) {
+        if (tx->tag[off] != 0) {
+            id3_2_edit_end(tx);
+            tx->has_tag = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**********************************************
+ *  id3_2_edit_find:
+ *    returns the index of the first frame with
+ *  ID id, or -1 if there is none.
+ **********************************************/
+int id3_2_edit_find(id3_2_edit_t* tx, const char* id) {
+    for (size_t i = 0; i < tx->frames.size(); ++i) {
+        if (memcmp(tx->frames[i].id, id, 4) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**********************************************
+ *  id3_2_edit_remove:
+ *    removes frame idx from the tag.
+ **********************************************/
+void id3_2_edit_remove(id3_2_edit_t* tx, size_t idx) {
+    release_frame(&tx->frames[idx]);
+    tx->frames.erase(tx->frames.begin() + idx);
+    tx->dirty = 1;
+}
+
+/**********************************************
+ *  id3_2_edit_replace:
+ *    replaces the body of frame idx with the
+ *  text frame body for text. Clears the flags.
+ **********************************************/
+void id3_2_edit_replace(id3_2_edit_t* tx, size_t idx, const char* text) {
+    uint32_t sz;
+    uint8_t* body = make_text_body(text, &sz);
+    if (body == nullptr) {
+        return;
+    }
+    id3_2_edit_set_body(tx, idx, body, sz);
+}
+
+/**********************************************
+ *  id3_2_edit_set_body:
+ *    replaces the body of frame idx with body,
+ *  which the frame takes over. A body equal to
+ *  the current one is freed instead, so edits
+ *  that change nothing write nothing.
+ **********************************************/
+void id3_2_edit_set_body(id3_2_edit_t* tx, size_t idx, uint8_t* body, uint32_t sz) {
+    id3_2_edit_frame_t* f = &tx->frames[idx];
+    if (f->size == sz && f->flags[0] == 0 && f->flags[1] == 0 && (sz == 0 || memcmp(f->body, body, sz) == 0)) {
+        free(body);
+        return;
+    }
+    release_frame(f);
+    f->body = body;
+    f->size = sz;
+    f->owned = 1;
+    memset(f->flags, 0, 2);
+    tx->dirty = 1;
+}
+
+/**********************************************
+ *  id3_2_edit_add_body:
+ *    appends a frame id with body, which the
+ *  frame takes over, to the tag.
+ **********************************************/
+void id3_2_edit_add_body(id3_2_edit_t* tx, const char* id, uint8_t* body, uint32_t sz) {
+    id3_2_edit_frame_t f;
+    memcpy(f.id, id, 4);
+    memset(f.flags, 0, 2);
+    f.size = sz;
+    f.body = body;
+    f.owned = 1;
+    tx->frames.push_back(f);
+    tx->dirty = 1;
+}
+
+/**********************************************
+ *  add_id3_2_frame:
+ *    appends an ID3 frame id with field text
+ *  as text to the tag.
+ **********************************************/
+void add_id3_2_frame(id3_2_edit_t* tx, const char* id, const char* text) {
+    uint32_t sz;
+    uint8_t* body = make_text_body(text, &sz);
+    if (body == nullptr) {
+        return;
+    }
+    id3_2_edit_add_body(tx, id, body, sz);
+}
+
+/**********************************************
+ *  id3_2_edit_apply:
+ *    applies num_rules scripted rules to tx.
+ *  Set rules replace the first matching frame
+ *  or add one if missing.
+ **********************************************/
+void id3_2_edit_apply(id3_2_edit_t* tx, const id3_2_rule_t* rules, size_t num_rules) {
+    for (size_t i = 0; i < num_rules; ++i) {
+        int idx = id3_2_edit_find(tx, rules[i].id);
+        if (rules[i].text == nullptr) {
+            while (idx != -1) {
+                id3_2_edit_remove(tx, idx);
+                idx = id3_2_edit_find(tx, rules[i].id);
+            }
+        } else if (idx == -1) {
+            add_id3_2_frame(tx, rules[i].id, rules[i].text);
+        } else {
+            id3_2_edit_replace(tx, idx, rules[i].text);
+        }
+    }
+}
+
+/**********************************************
+ *  push_piece:
+ *    appends piece to pieces, merging it into
+ *  the last one when the two are contiguous.
+ **********************************************/
+static void push_piece(std::vector<fileio_piece_t>& pieces, fileio_piece_t piece) {
+    if (!pieces.empty()) {
+        fileio_piece_t* last = &pieces.back();
+        if ((piece.buf != nullptr && last->buf + last->len == piece.buf) ||
+            (piece.buf == nullptr && last->buf == nullptr && piece.src >= 0 &&
+             last->src + (off_t) last->len == piece.src)) {
+            last->len += piece.len;
+            return;
+        }
+    }
+    pieces.push_back(piece);
+}
+
+/**********************************************
+ *  frame_pieces:
+ *    appends the frames of tx to pieces as
+ *  they are to be written after the header.
+ *  Changed frames come from memory, with their
+ *  headers built in hdrs (10 bytes per frame).
+ *  Unchanged frames of a mapped tag are copied
+ *  from the file, so large artwork never
+ *  passes through memory; so are those already
+ *  in place when same_file, which are then
+ *  skipped. Blocks inserted since begin all
+ *  lie past the frames, so none has moved.
+ **********************************************/
+static void frame_pieces(id3_2_edit_t* tx, int same_file, uint8_t* hdrs,
+                         std::vector<fileio_piece_t>& pieces) {
+    uint8_t major = tx->has_tag ? tx->raw.data[3] : 3;
+    off_t dst = 10;
+    for (size_t i = 0; i < tx->frames.size(); ++i) {
+        id3_2_edit_frame_t* f = &tx->frames[i];
+        size_t len = 10 + (size_t) f->size;
+
+        if (f->owned) {
+            uint8_t* hdr = hdrs + 10 * i;
+            memcpy(hdr, f->id, 4);
+            put_id3_2_frame_size(hdr, f->size, major);
+            memcpy(hdr + 8, f->flags, 2);
+            push_piece(pieces, {hdr, -1, 10});
+            push_piece(pieces, {f->body, -1, f->size});
+            dst += len;
+            continue;
+        }
+
+        // Unchanged frames still have their header in front of the body
+        off_t src = f->body - 10 - tx->raw.data;
+        int in_place = same_file && src == dst;
+        if (!tx->raw.map_sz && !in_place) {
+            push_piece(pieces, {f->body - 10, -1, len});
+        } else {
+            push_piece(pieces, {nullptr, src, len});
+        }
+        dst += len;
+    }
+}
+
+/**********************************************
+ *  padded_tag_size:
+ *    returns the tag size (excluding the
+ *  header) that holds used bytes of frames
+ *  in fd with padding as policy asks.
+ **********************************************/
+static uint32_t padded_tag_size(int fd, size_t used, const id3_2_padding_t* policy) {
+    uint64_t pad = (uint64_t) used * policy->headroom_pct / 100;
+    if (pad < policy->min) {
+        pad = policy->min;
+    }
+    if (pad > policy->max && policy->max >= policy->min) {
+        pad = policy->max;
+    }
+    uint64_t align = policy->align ? policy->align : file_block_size(fd);
+    uint64_t end = (10 + used + pad + align - 1) / align * align;
+    return end - 10;
+}
+
+/**********************************************
+ *  shrink_padding:
+ *    gives excess padding after used bytes of
+ *  frames back to the filesystem by collapsing
+ *  whole blocks out of the tag. The header is
+ *  updated first so a crash leaves at worst
+ *  zeros between the tag and the audio. Where
+ *  blocks cannot be collapsed the padding is
+ *  kept; only a rewrite forced anyway drops
+ *  it. Returns 0 on success and -1 if the
+ *  header could not be put back.
+ **********************************************/
+static int shrink_padding(id3_2_edit_t* tx, size_t used) {
+    size_t keep = 10 + padded_tag_size(tx->fd, used, &tx->padding);
+    size_t tag_end = 10 + (size_t) tx->tag_sz;
+    size_t blk = file_block_size(tx->fd);
+    size_t start = (keep + blk - 1) / blk * blk;
+    size_t end = tag_end / blk * blk;
+    if (end <= start) {
+        return 0;
+    }
+
+    uint8_t header[10];
+    if (iostat_pread(tx->fd, header, 10, 0) != 10) {
+        return 0;
+    }
+    put_id3_2_tag_size(header, tx->tag_sz - (end - start));
+    if (iostat_pwrite(tx->fd, header + 6, 4, 6) != 4) {
+        return 0;
+    }
+    iostat_local()->bytes_changed += 4;
+    if (collapse_range(tx->fd, start, end - start) == end - start) {
+        tx->shrunk = 1;
+        return 0;
+    }
+
+    // The filesystem cannot collapse: keep the padding rather than write twice
+    put_id3_2_tag_size(header, tx->tag_sz);
+    return iostat_pwrite(tx->fd, header + 6, 4, 6) == 4 ? 0 : -1;
+}
+
+/**********************************************
+ *  trim_end:
+ *    cuts the last tx->trim bytes off the
+ *  file. Returns 0 on success and -1 on error.
+ **********************************************/
+static int trim_end(id3_2_edit_t* tx) {
+    struct stat st;
+    if (fstat(tx->fd, &st) != 0 || st.st_size < (off_t) tx->trim) {
+        return -1;
+    }
+    return ftruncate(tx->fd, st.st_size - tx->trim);
+}
+
+/**********************************************
+ *  id3_2_edit_commit:
+ *    serializes the edited tag and writes it
+ *  to the file at most once. If the frames fit
+ *  in the existing tag only the changed bytes
+ *  are rewritten in place. Otherwise the tag
+ *  grows by whole blocks inserted into its
+ *  padding where the filesystem allows it, so
+ *  a crash before the frames are written
+ *  leaves at worst zeros between the tag and
+ *  the audio; a tag whose padding does not
+ *  reach a block boundary, or a filesystem
+ *  that cannot insert, gets the file rewritten
+ *  once. Unchanged frames of large tags are
+ *  copied within the file, so memory use does
+ *  not grow with the artwork a tag carries.
+ *  The last tx->trim bytes of the file are cut
+ *  off by the same write. Records how in
+ *  tx->outcome. Returns 0 on success.
+ **********************************************/
+int id3_2_edit_commit(id3_2_edit_t* tx) {
+    if (!tx->dirty && !tx->trim) {
+        return 0;
+    }
+    iostat_scope_t scope(IOSTAT_PHASE_WRITE);
+
+    size_t used = 0;
+    for (size_t i = 0; i < tx->frames.size(); ++i) {
+        used += 10 + tx->frames[i].size;
+    }
+
+    std::vector<fileio_piece_t> pieces;
+    std::vector<uint8_t> hdrs(10 * tx->frames.size());
+    size_t tag_end = 10 + (size_t) tx->tag_sz;
+
+    if (tx->has_tag && used <= tx->tag_sz) {
+        // Fits in the padding: only touch bytes that moved or changed
+        frame_pieces(tx, 1, hdrs.data(), pieces);
+        if (used < tx->used) {
+            pieces.push_back({nullptr, -1, tx->used - used});
+        }
+        ssize_t ret = write_pieces_at(tx->fd, pieces.data(), pieces.size(), 10);
+        if (ret >= 0 && tx->trim) {
+            ret = trim_end(tx) == 0 ? 1 : -1;
+        }
+        if (ret >= 0) {
+            tx->outcome = ID3_2_EDIT_IN_PLACE;
+        }
+
+        if (ret >= 0 && tx->tag_sz - used > tx->padding.max && shrink_padding(tx, used) != 0) {
+            ret = -1;
+        }
+        if (ret > 0 || tx->shrunk) {
+            ret = fileio_sync(tx->sync, tx->fd);
+        }
+        return ret < 0 ? -1 : 0;
+    }
+
+    // A tag keeps its version and flags; new tags are ID3v2.3
+    uint8_t header[10] = {'I', 'D', '3', 3, 0, 0};
+    if (tx->has_tag) {
+        memcpy(header + 3, tx->raw.data + 3, 3);
+        // Insert whole blocks into the padding after the last frame,
+        // so a crash before the frames are written cannot leave zeros
+        // inside one, then write the frames over the old ones
+        size_t blk = file_block_size(tx->fd);
+        size_t grow = 10 + padded_tag_size(tx->fd, used, &tx->padding) - tag_end;
+        grow = (grow + blk - 1) / blk * blk;
+        off_t ins = tag_end / blk * blk;
+        size_t stale = 10 + (size_t) tx->used;
+        if ((off_t) stale <= ins && insert_range(tx->fd, ins, grow) == grow) {
+            put_id3_2_tag_size(header, tx->tag_sz + grow);
+            pieces.push_back({header, -1, 10});
+            frame_pieces(tx, 1, hdrs.data(), pieces);
+            if (write_pieces_at(tx->fd, pieces.data(), pieces.size(), 0) < 0 || (tx->trim && trim_end(tx) != 0)) {
+                return -1;
+            }
+            tx->outcome = ID3_2_EDIT_GROWN;
+            return fileio_sync(tx->sync, tx->fd);
+        }
+    }
+
+    // Rewrite the file once with a larger tag, leaving out the trimmed end
+    uint32_t new_tag_sz = padded_tag_size(tx->fd, used, &tx->padding);
+    put_id3_2_tag_size(header, new_tag_sz);
+    pieces.push_back({header, -1, 10});
+    frame_pieces(tx, 0, hdrs.data(), pieces);
+    pieces.push_back({nullptr, -1, new_tag_sz - used});
+    size_t old_sz = tx->has_tag ? tag_end : 0;
+    if (replace_pieces_trim_at(tx->fd, old_sz, pieces.data(), pieces.size(), 0, tx->trim, tx->path, tx->sync) != 0) {
+        return -1;
+    }
+    tx->outcome = ID3_2_EDIT_REWRITTEN;
+    return 0;
+}
+
+/**********************************************
+ *  id3_2_edit_end:
+ *    releases the memory held by tx without
+ *  writing anything.
+ **********************************************/
+void id3_2_edit_end(id3_2_edit_t* tx) {
+    for (size_t i = 0; i < tx->frames.size(); ++i) {
+        release_frame(&tx->frames[i]);
+    }
+    tx->frames.clear();
+    id3_free_tag(&tx->raw);
+    tx->tag = nullptr;
+}
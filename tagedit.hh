@@ -0,0 +1,221 @@
+#ifndef TAGEDIT_H
+#define TAGEDIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "id3.hh"
+#include "fileio.hh"
+
+// Header flags of tags edits cannot write back: unsynchronisation,
+// an extended header and a footer
+#define ID3_2_FLAGS_UNEDITABLE 0xd0
+
+// Default padding policy; see id3_2_padding_t
+#define ID3_2_MIN_PADDING 1024
+#define ID3_2_HEADROOM_PCT 10
+#define ID3_2_MAX_PADDING (64 * 1024)
+
+/**********************************************
+ *  id3_2_padding_t:
+ *    how much room is left after the frames
+ *  whenever a tag is written at a new size,
+ *  on creation, growth or a forced rewrite,
+ *  so that later edits fit in place. The tag
+ *  gets the larger of min bytes and
+ *  headroom_pct percent of its frames, at most
+ *  max, and then ends on a multiple of align
+ *  (0 for the filesystem block size). Edits
+ *  that leave more than max bytes of padding
+ *  give the excess back.
+ **********************************************/
+typedef struct id3_2_padding_t {
+    uint32_t min;
+    uint32_t headroom_pct;
+    uint32_t max;
+    uint32_t align;
+} id3_2_padding_t;
+
+typedef enum {
+    ID3_2_EDIT_NONE,        // nothing was written
+    ID3_2_EDIT_IN_PLACE,    // frames fit in the existing tag
+    ID3_2_EDIT_GROWN,       // blocks were inserted in front of the audio
+    ID3_2_EDIT_REWRITTEN,   // the whole file was rewritten
+} id3_2_edit_outcome_t;
+
+/**********************************************
+ *  id3_2_edit_frame_t:
+ *    one frame of a tag being edited. body
+ *  points into the transaction's copy of the
+ *  tag unless the frame was added or replaced,
+ *  in which case the frame owns it.
+ **********************************************/
+typedef struct id3_2_edit_frame_t {
+    char id[4];
+    uint8_t flags[2];
+    uint32_t size;
+    uint8_t* body;
+    uint8_t owned;
+} id3_2_edit_frame_t;
+
+/**********************************************
+ *  id3_2_edit_t:
+ *    an edit transaction over the ID3v2 tag of
+ *  an open file. Inserts, removes and replaces
+ *  are recorded against an in-memory copy of
+ *  the tag and nothing touches the file until
+ *  id3_2_edit_commit. padding and sync start
+ *  as the defaults and no sync, and trim as 0;
+ *  all may be set before the commit. A transaction shares no
+ *  state with any other.
+ **********************************************/
+typedef struct id3_2_edit_t {
+    int fd;
+    char* path;
+    uint8_t has_tag;        // file already starts with an ID3v2 tag
+    uint8_t dirty;          // frames changed since begin
+    uint8_t outcome;        // an id3_2_edit_outcome_t, set by the commit
+    uint8_t shrunk;         // the commit gave excess padding back
+    uint32_t trim;          // bytes the commit cuts from the end of the file
+    id3_2_padding_t padding;
+    fileio_syncer_t* sync;
+    uint32_t tag_sz;        // size from the ID3 header, incl. padding
+    uint32_t used;          // bytes of tag holding frames at begin
+    uint8_t* tag;           // copy of the tag body, raw.body
+    id3_tag_t raw;
+    std::vector<id3_2_edit_frame_t> frames;
+} id3_2_edit_t;
+
+/**********************************************
+ *  id3_2_rule_t:
+ *    a scripted edit: sets frame id to text, or
+ *  removes every id frame when text is null.
+ **********************************************/
+typedef struct id3_2_rule_t {
+    char id[4];
+    char* text;
+} id3_2_rule_t;
+
+/**********************************************
+ *  id3_2_padding_init:
+ *    sets policy to the default:
+ *  ID3_2_MIN_PADDING, ID3_2_HEADROOM_PCT,
+ *  ID3_2_MAX_PADDING and the filesystem block
+ *  size.
+ **********************************************/
+void id3_2_padding_init(id3_2_padding_t* policy);
+
+/**********************************************
+ *  id3_2_edit_begin:
+ *    loads the ID3v2 tag of fd (if any) into
+ *  tx. Returns 0 on success and -1 if the tag
+ *  could not be read or cannot be edited.
+ **********************************************/
+int id3_2_edit_begin(id3_2_edit_t* tx, int fd, char* path);
+
+/**********************************************
+ *  id3_2_edit_begin_loaded:
+ *    starts tx on the tag already loaded from
+ *  fd by id3_read_tag. tx takes over the tag
+ *  buffer, which is left empty. Only ID3v2.3
+ *  and ID3v2.4 tags without unsynchronisation,
+ *  extended header or footer whose frames
+ *  parse up to zero padding or the end of the
+ *  tag can be edited; for others tx is left
+ *  empty.
+ *  Returns 0 on success and -1 if the tag
+ *  cannot be edited.
+ **********************************************/
+int id3_2_edit_begin_loaded(id3_2_edit_t* tx, int fd, char* path, id3_tag_t* tag);
+
+/**********************************************
+ *  id3_2_edit_find:
+ *    returns the index of the first frame with
+ *  ID id, or -1 if there is none.
+ **********************************************/
+int id3_2_edit_find(id3_2_edit_t* tx, const char* id);
+
+/**********************************************
+ *  id3_2_edit_remove:
+ *    removes frame idx from the tag.
+ **********************************************/
+void id3_2_edit_remove(id3_2_edit_t* tx, size_t idx);
+
+/**********************************************
+ *  id3_2_edit_replace:
+ *    replaces the body of frame idx with the
+ *  text frame body for text. Clears the flags.
+ **********************************************/
+void id3_2_edit_replace(id3_2_edit_t* tx, size_t idx, const char* text);
+
+/**********************************************
+ *  id3_2_edit_set_body:
+ *    replaces the body of frame idx with the
+ *  sz bytes of the malloc'd body, which the
+ *  frame takes over. Clears the flags. If
+ *  the frame already holds the same bytes and
+ *  no flags, body is freed and tx stays clean.
+ **********************************************/
+void id3_2_edit_set_body(id3_2_edit_t* tx, size_t idx, uint8_t* body, uint32_t sz);
+
+/**********************************************
+ *  id3_1_field:
+ *    writes the UTF-8 text into the n-byte
+ *  ID3v1 field as ISO-8859-1, zero-padded and
+ *  cut at n bytes. Characters without an
+ *  ISO-8859-1 form become '?'.
+ **********************************************/
+void id3_1_field(const char* text, char* field, size_t n);
+
+/**********************************************
+ *  id3_2_edit_add_body:
+ *    appends a frame id with body, which the
+ *  frame takes over, to the tag.
+ **********************************************/
+void id3_2_edit_add_body(id3_2_edit_t* tx, const char* id, uint8_t* body, uint32_t sz);
+
+/**********************************************
+ *  add_id3_2_frame:
+ *    appends an ID3 frame id with field text
+ *  as text to the tag.
+ **********************************************/
+void add_id3_2_frame(id3_2_edit_t* tx, const char* id, const char* text);
+
+/**********************************************
+ *  id3_2_edit_apply:
+ *    applies num_rules scripted rules to tx.
+ *  Set rules replace the first matching frame
+ *  or add one if missing.
+ **********************************************/
+void id3_2_edit_apply(id3_2_edit_t* tx, const id3_2_rule_t* rules, size_t num_rules);
+
+/**********************************************
+ *  id3_2_edit_commit:
+ *    serializes the edited tag and writes it
+ *  to the file at most once. If the frames fit
+ *  in the existing tag only the changed bytes
+ *  are rewritten in place. Otherwise the tag
+ *  grows by whole blocks inserted into its
+ *  padding where the filesystem allows it, so
+ *  a crash before the frames are written
+ *  leaves at worst zeros between the tag and
+ *  the audio; a tag whose padding does not
+ *  reach a block boundary, or a filesystem
+ *  that cannot insert, gets the file rewritten
+ *  once. Unchanged frames of large tags are
+ *  copied within the file, so memory use does
+ *  not grow with the artwork a tag carries.
+ *  The last tx->trim bytes of the file are cut
+ *  off by the same write. Records how in
+ *  tx->outcome. Returns 0 on success.
+ **********************************************/
+int id3_2_edit_commit(id3_2_edit_t* tx);
+
+/**********************************************
+ *  id3_2_edit_end:
+ *    releases the memory held by tx without
+ *  writing anything.
+ **********************************************/
+void id3_2_edit_end(id3_2_edit_t* tx);
+
+#endif
@@ -0,0 +1,836 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fileio.hh"
+#include "id3.hh"
+#include "tagedit.hh"
+#include "batch.hh"
+#include "libaudiotag.hh"
+#include "mpeg.hh"
+#include "manifest.hh"
+#include "table.hh"
+
+// id3text.cpp built with -DID3_TEXT_SCALAR, renamed by the Makefile
+void id3_2_string_utf8_scalar(uint8_t encoding, const uint8_t* text, uint32_t sz, std::string& out);
+
+/**********************************************
+ *  edit_case_t:
+ *    a generated file and one edit to commit
+ *  to it, with the outcome expected.
+ **********************************************/
+typedef struct edit_case_t {
+    const char* name;
+    uint8_t major;          // 3 or 4, 0 for a file without a tag
+    size_t padding;         // bytes of tag padding
+    uint8_t aligned;        // pad the tag to end on a block boundary
+    size_t apic_sz;         // bytes of cover art, 0 for none
+    uint8_t remove_first;   // remove the first frame
+    const char* set_id;     // frame to set, or added if missing
+    size_t set_sz;          // bytes of text it is set to
+    uint32_t max_padding;   // 0 for the default policy
+    uint8_t outcome;        // an id3_2_edit_outcome_t
+    uint8_t shrunk;
+} edit_case_t;
+
+static const edit_case_t edit_cases[] = {
+    {"in place", 3, 2048, 0, 0, 0, "TIT2", 50, 0, ID3_2_EDIT_IN_PLACE, 0},
+    {"in place, frames moved", 3, 2048, 0, 100000, 1, "TPE1", 300, 0, ID3_2_EDIT_IN_PLACE, 0},
+    {"grown", 3, 100, 1, 100000, 0, "TIT2", 8000, 0, ID3_2_EDIT_GROWN, 0},
+    {"rewritten", 3, 100, 0, 100000, 0, "TIT2", 8000, 0, ID3_2_EDIT_REWRITTEN, 0},
+    {"shrunk", 3, 200000, 0, 0, 0, "TIT2", 10, 1000, ID3_2_EDIT_IN_PLACE, 1},
+    {"new tag", 0, 0, 0, 0, 0, "TIT2", 20, 0, ID3_2_EDIT_REWRITTEN, 0},
+    {"v2.4 in place", 4, 2048, 0, 0, 0, "TPE1", 300, 0, ID3_2_EDIT_IN_PLACE, 0},
+    {"v2.4 grown", 4, 100, 1, 100000, 0, "TIT2", 8000, 0, ID3_2_EDIT_GROWN, 0},
+    {"v2.4 rewritten", 4, 100, 0, 0, 1, "TALB", 5000, 0, ID3_2_EDIT_REWRITTEN, 0},
+};
+#define NUM_EDIT_CASES (sizeof(edit_cases) / sizeof(edit_cases[0]))
+
+static int num_tests = 0;
+static int failures = 0;
+
+/**********************************************
+ *  check:
+ *    counts and reports a failed expectation
+ *  what of test name. Returns ok.
+ **********************************************/
+static int check(int ok, const char* name, const char* what) {
+    if (!ok) {
+        std::cerr << "FAIL " << name << ": " << what << "\n";
+        ++failures;
+    }
+    return ok;
+}
+
+/**********************************************
+ *  read_file:
+ *    reads the whole of path into out.
+ *  Returns 0 on success.
+ **********************************************/
+static int read_file(const char* path, std::string& out) {
+    out.clear();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+/**********************************************
+ *  write_file:
+ *    replaces path with data. Returns 0 on
+ *  success.
+ **********************************************/
+static int write_file(const char* path, const std::string& data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t ret = write(fd, data.data(), data.size());
+    close(fd);
+    return ret == (ssize_t) data.size() ? 0 : -1;
+}
+
+/**********************************************
+ *  put_frame:
+ *    appends a frame with the header layout of
+ *  major to out.
+ **********************************************/
+static void put_frame(std::string& out, const id3_frame_text_t& frame, uint8_t major) {
+    uint8_t header[10];
+    memcpy(header, frame.first.data(), 4);
+    put_id3_2_frame_size(header, frame.second.size(), major);
+    header[8] = 0;
+    header[9] = 0;
+    out.append((const char*) header, 10);
+    out += frame.second;
+}
+
+/**********************************************
+ *  parse_file:
+ *    splits data into the major version, the
+ *  frames and the audio after the tag, walking
+ *  the frames independently of the parser
+ *  under test. Returns 0 on success and -1 if
+ *  data has no well-formed ID3v2 tag.
+ **********************************************/
+static int parse_file(const std::string& data, uint8_t* major, std::vector<id3_frame_text_t>& frames, std::string& audio) {
+    frames.clear();
+    const uint8_t* p = (const uint8_t*) data.data();
+    if (data.size() < 10 || memcmp(p, "ID3", 3) != 0) {
+        return -1;
+    }
+    *major = p[3];
+    size_t end = 10 + (size_t) id3_2_tag_size(p);
+    if (end > data.size()) {
+        return -1;
+    }
+    size_t off = 10;
+    while (off + 10 <= end && p[off] != 0) {
+        size_t sz = id3_2_frame_size(p + off, *major);
+        if (sz > end - off - 10) {
+            return -1;
+        }
+        frames.push_back(std::make_pair(data.substr(off, 4), data.substr(off + 10, sz)));
+        off += 10 + sz;
+    }
+    for (; off < end; ++off) {
+        if (p[off] != 0) {
+            return -1;
+        }
+    }
+    audio = data.substr(end);
+    return 0;
+}
+
+/**********************************************
+ *  make_audio:
+ *    returns n bytes of MPEG frames whose
+ *  contents depend on seed.
+ **********************************************/
+static std::string make_audio(size_t n, unsigned seed) {
+    static const uint8_t sync[4] = {0xff, 0xfb, 0x90, 0x64};
+    std::string audio;
+    while (audio.size() < n) {
+        audio.append((const char*) sync, 4);
+        for (size_t i = 4; i < 417; ++i) {
+            audio += (char) (i * 31 + seed);
+        }
+    }
+    audio.resize(n);
+    return audio;
+}
+
+/**********************************************
+ *  text_body:
+ *    returns an ISO-8859-1 text frame body of
+ *  n bytes of text.
+ **********************************************/
+static std::string text_body(size_t n, char c) {
+    std::string body(1, '\0');
+    body.append(n, c);
+    return body;
+}
+
+/**********************************************
+ *  fs_support:
+ *    finds whether the filesystem of dir can
+ *  insert and collapse blocks, so the grown
+ *  case knows when to expect the rewrite
+ *  fallback and the shrunk case when to expect
+ *  the padding kept.
+ **********************************************/
+static void fs_support(const char* dir, int* can_insert, int* can_collapse) {
+    std::string path = std::string(dir) + "/probe";
+    *can_insert = 0;
+    *can_collapse = 0;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return;
+    }
+    size_t blk = file_block_size(fd);
+    std::string data(4 * blk, 'p');
+    if (write(fd, data.data(), data.size()) == (ssize_t) data.size()) {
+        *can_insert = insert_range(fd, blk, blk) == blk;
+        *can_collapse = collapse_range(fd, blk, blk) == blk;
+    }
+    close(fd);
+    unlink(path.c_str());
+}
+
+/**********************************************
+ *  test_write_pieces:
+ *    checks write_pieces_at against a copy
+ *  made in memory, with pieces that move
+ *  bytes over themselves in both directions,
+ *  pieces already in place and zeros.
+ **********************************************/
+static void test_write_pieces(const char* dir) {
+    std::string path = std::string(dir) + "/pieces.bin";
+    std::string orig = make_audio(300000, 7);
+    static const uint8_t news[] = {'n', 'e', 'w'};
+
+    struct {
+        const char* name;
+        off_t offset;
+        fileio_piece_t pieces[4];
+        size_t num_pieces;
+    } cases[] = {
+        {"pieces moved back", 100, {{news, -1, 3}, {nullptr, 1000, 200000}, {nullptr, -1, 50}}, 3},
+        {"pieces moved forward", 7, {{nullptr, 0, 250000}, {news, -1, 3}}, 2},
+        {"pieces in place", 500, {{nullptr, 500, 400}, {news, -1, 3}, {nullptr, 5000, 70000}, {nullptr, -1, 9}}, 4},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        ++num_tests;
+        if (!check(write_file(path.c_str(), orig) == 0, cases[c].name, "could not write the file")) {
+            continue;
+        }
+        std::string expect = orig;
+        off_t pos = cases[c].offset;
+        for (size_t i = 0; i < cases[c].num_pieces; ++i) {
+            const fileio_piece_t* p = &cases[c].pieces[i];
+            std::string bytes = p->buf ? std::string((const char*) p->buf, p->len)
+                              : p->src >= 0 ? orig.substr(p->src, p->len) : std::string(p->len, '\0');
+            expect.replace(pos, bytes.size(), bytes);
+            pos += p->len;
+        }
+
+        int fd = open(path.c_str(), O_RDWR);
+        ssize_t ret = write_pieces_at(fd, cases[c].pieces, cases[c].num_pieces, cases[c].offset);
+        close(fd);
+        std::string got;
+        check(ret >= 0, cases[c].name, "write_pieces_at failed");
+        check(read_file(path.c_str(), got) == 0 && got == expect, cases[c].name, "file differs from the copy");
+    }
+    unlink(path.c_str());
+}
+
+/**********************************************
+ *  run_edit_case:
+ *    generates the file of ec, commits its
+ *  edit and checks the outcome, the frames
+ *  against the expected list and the audio
+ *  byte for byte.
+ **********************************************/
+static void run_edit_case(const char* dir, const edit_case_t* ec, int can_insert, int can_collapse) {
+    std::string path = std::string(dir) + "/edit.mp3";
+    std::string audio = make_audio(200000, ec->major + ec->padding);
+    ++num_tests;
+
+    std::vector<id3_frame_text_t> frames;
+    if (ec->major) {
+        frames.push_back(std::make_pair(std::string("TIT2"), text_body(200, 'T')));
+        if (ec->apic_sz) {
+            std::string body("\0image/jpeg\0\3\0", 14);
+            body.append(ec->apic_sz, '\xa5');
+            frames.push_back(std::make_pair(std::string("APIC"), body));
+        }
+        frames.push_back(std::make_pair(std::string("TPE1"), text_body(6, 'A')));
+    }
+
+    std::string data;
+    if (ec->major) {
+        std::string body;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            put_frame(body, frames[i], ec->major);
+        }
+        size_t padding = ec->padding;
+        if (ec->aligned) {
+            int fd = open(dir, O_RDONLY | O_DIRECTORY);
+            size_t blk = file_block_size(fd);
+            close(fd);
+            padding += blk - (10 + body.size() + padding) % blk;
+        }
+        body.append(padding, '\0');
+        uint8_t header[10] = {'I', 'D', '3', ec->major, 0, 0};
+        put_id3_2_tag_size(header, body.size());
+        data.append((const char*) header, 10);
+        data += body;
+    }
+    data += audio;
+    if (!check(write_file(path.c_str(), data) == 0, ec->name, "could not write the file")) {
+        return;
+    }
+
+    // The same edit on the expected frames
+    std::string body = text_body(ec->set_sz, 'e');
+    if (ec->remove_first) {
+        frames.erase(frames.begin());
+    }
+    size_t i = 0;
+    while (i < frames.size() && frames[i].first != ec->set_id) {
+        ++i;
+    }
+    if (i < frames.size()) {
+        frames[i].second = body;
+    } else {
+        frames.push_back(std::make_pair(std::string(ec->set_id), body));
+    }
+
+    int fd = open(path.c_str(), O_RDWR);
+    id3_2_edit_t tx;
+    if (!check(id3_2_edit_begin(&tx, fd, (char*) path.c_str()) == 0, ec->name, "could not begin the edit")) {
+        close(fd);
+        return;
+    }
+    if (ec->max_padding) {
+        tx.padding.max = ec->max_padding;
+    }
+    if (ec->remove_first) {
+        id3_2_edit_remove(&tx, 0);
+    }
+    uint8_t* copy = (uint8_t*) malloc(body.size());
+    memcpy(copy, body.data(), body.size());
+    int idx = id3_2_edit_find(&tx, ec->set_id);
+    if (idx >= 0) {
+        id3_2_edit_set_body(&tx, idx, copy, body.size());
+    } else {
+        id3_2_edit_add_body(&tx, ec->set_id, copy, body.size());
+    }
+    int ret = id3_2_edit_commit(&tx);
+    uint8_t outcome = tx.outcome;
+    uint8_t shrunk = tx.shrunk;
+    id3_2_edit_end(&tx);
+    close(fd);
+
+    // Filesystems that cannot insert fall back to a rewrite, and
+    // those that cannot collapse keep the padding
+    uint8_t expect = ec->outcome;
+    if (expect == ID3_2_EDIT_GROWN && !can_insert) {
+        expect = ID3_2_EDIT_REWRITTEN;
+    }
+    uint8_t expect_shrunk = ec->shrunk && can_collapse;
+    check(ret == 0, ec->name, "commit failed");
+    check(outcome == expect, ec->name, "unexpected outcome");
+    check(shrunk == expect_shrunk, ec->name, "unexpected shrink");
+
+    std::string got;
+    std::string got_audio;
+    std::vector<id3_frame_text_t> got_frames;
+    uint8_t major = 0;
+    if (!check(read_file(path.c_str(), got) == 0 && parse_file(got, &major, got_frames, got_audio) == 0,
+               ec->name, "no well-formed tag after the commit")) {
+        return;
+    }
+    check(major == (ec->major ? ec->major : 3), ec->name, "tag version changed");
+    check(got_frames == frames, ec->name, "frames differ");
+    check(got_audio == audio, ec->name, "audio differs");
+    if (ec->shrunk) {
+        check(expect_shrunk ? got.size() < data.size() : got.size() == data.size(), ec->name, "unexpected file size");
+    }
+}
+
+/**********************************************
+ *  test_malformed:
+ *    checks that a tag whose frame runs past
+ *  its end is refused and left untouched.
+ **********************************************/
+static void test_malformed(const char* dir) {
+    const char* name = "malformed frame";
+    ++num_tests;
+    std::string path = std::string(dir) + "/bad.mp3";
+    std::string body;
+    put_frame(body, std::make_pair(std::string("TIT2"), text_body(20, 'T')), 3);
+    body += "XXXX\xff\xff\xff\xff";
+    body.append(2, '\0');
+    body += "junk";
+    body.append(256, '\0');
+    uint8_t header[10] = {'I', 'D', '3', 3, 0, 0};
+    put_id3_2_tag_size(header, body.size());
+    std::string data = std::string((const char*) header, 10) + body + make_audio(50000, 1);
+    if (!check(write_file(path.c_str(), data) == 0, name, "could not write the file")) {
+        return;
+    }
+
+    audiotag_t at;
+    if (check(audiotag_open(&at, path.c_str(), 1, nullptr) == BATCH_OK, name, "could not open")) {
+        int err = audiotag_set(&at, "TIT2", "edited");
+        if (err == BATCH_OK) {
+            err = audiotag_commit(&at);
+        }
+        audiotag_close(&at);
+        check(err != BATCH_OK, name, "edit was not refused");
+    }
+    std::string got;
+    check(read_file(path.c_str(), got) == 0 && got == data, name, "file changed");
+    unlink(path.c_str());
+}
+
+/**********************************************
+ *  append_chunk:
+ *    id3_stream_fn_t that appends each chunk
+ *  to the std::string at ctx.
+ **********************************************/
+static int append_chunk(const uint8_t* buf, size_t n, void* ctx) {
+    ((std::string*) ctx)->append((const char*) buf, n);
+    return 0;
+}
+
+/**********************************************
+ *  stop_chunk:
+ *    id3_stream_fn_t that stops the stream at
+ *  the first chunk.
+ **********************************************/
+static int stop_chunk(const uint8_t*, size_t, void*) {
+    return 7;
+}
+
+/**********************************************
+ *  test_lazy_frames:
+ *    (user-015) checks that the range of a
+ *  large picture streams back its body, that
+ *  a stream stops when asked, and that the
+ *  skim parser keeps the text frames around
+ *  lazy ones.
+ **********************************************/
+static void test_lazy_frames(const char* dir) {
+    const char* name = "lazy frames";
+    ++num_tests;
+    std::string path = std::string(dir) + "/lazy.mp3";
+    std::string apic("\0image/png\0\3\0", 13);
+    for (size_t i = 0; i < 150000; ++i) {
+        apic += (char) (i * 7 + i / 251);
+    }
+    std::vector<id3_frame_text_t> frames;
+    frames.push_back(std::make_pair(std::string("TIT2"), text_body(30, 'T')));
+    frames.push_back(std::make_pair(std::string("APIC"), apic));
+    frames.push_back(std::make_pair(std::string("PRIV"), std::string(20000, 'p')));
+    frames.push_back(std::make_pair(std::string("TPE1"), text_body(5000, 'A')));
+
+    std::string body;
+    off_t apic_offset = 0;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (frames[i].first == "APIC") {
+            apic_offset = 10 + body.size() + 10;
+        }
+        put_frame(body, frames[i], 3);
+    }
+    body.append(512, '\0');
+    uint8_t header[10] = {'I', 'D', '3', 3, 0, 0};
+    put_id3_2_tag_size(header, body.size());
+    std::string data = std::string((const char*) header, 10) + body + make_audio(20000, 3);
+    if (!check(write_file(path.c_str(), data) == 0, name, "could not write the file")) {
+        return;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    id3_tag_t tag;
+    if (check(fd >= 0 && id3_read_tag(fd, &tag) == 0, name, "could not read the tag")) {
+        id3_2_frame_iter_t it;
+        id3_2_frame_view_t view;
+        id3_2_frame_iter_tag(&it, &tag);
+        int found = 0;
+        while (id3_2_frame_next(&it, &view)) {
+            if (memcmp(view.id, "APIC", 4) != 0) {
+                continue;
+            }
+            found = 1;
+            id3_2_frame_range_t range;
+            id3_2_frame_range(&tag, &view, &range);
+            check(range.offset == apic_offset && range.size == apic.size(), name, "wrong picture range");
+            std::string got;
+            check(id3_2_frame_stream(fd, &range, append_chunk, &got) == 0 && got == apic, name,
+                  "streamed picture differs");
+            check(id3_2_frame_stream(fd, &range, stop_chunk, nullptr) == 7, name, "stream did not stop");
+        }
+        check(found, name, "picture not found");
+        id3_free_tag(&tag);
+    }
+
+    // Drive the skim parser with plain preads, as the io_uring scanner does
+    id3_2_skim_t sk;
+    uint8_t* buf = (uint8_t*) malloc(ID3_PREFETCH_SIZE);
+    ssize_t got = pread(fd, buf, ID3_PREFETCH_SIZE, 0);
+    if (check(got == ID3_PREFETCH_SIZE, name, "could not read the header")) {
+        id3_2_skim_init(&sk, buf, ID3_PREFETCH_SIZE, got);
+        size_t off;
+        size_t len;
+        int ret;
+        while ((ret = id3_2_skim_next(&sk, &off, &len)) == 1) {
+            got = pread(fd, sk.buf + sk.got, len, off);
+            if (got <= 0) {
+                break;
+            }
+            id3_2_skim_fill(&sk, got);
+        }
+        check(ret == 0, name, "skim did not finish");
+
+        std::vector<id3_frame_text_t> kept;
+        id3_2_frame_iter_t it;
+        id3_2_frame_view_t view;
+        id3_2_frame_iter_init(&it, sk.buf + 10, sk.kept - 10, 3);
+        while (id3_2_frame_next(&it, &view)) {
+            kept.push_back(std::make_pair(std::string(view.id, 4), std::string((const char*) view.body, view.size)));
+        }
+        check(kept.size() == 2 && kept[0] == frames[0] && kept[1] == frames[3], name,
+              "skim kept the wrong frames");
+        buf = sk.buf;
+    }
+    free(buf);
+    close(fd);
+    unlink(path.c_str());
+}
+
+/**********************************************
+ *  mpeg_stream:
+ *    returns n MPEG-1 Layer III frames at
+ *  128 kbit/s, 44.1 kHz stereo (417 bytes
+ *  each), with vbr copied into the first
+ *  after its side information.
+ **********************************************/
+static std::string mpeg_stream(size_t n, const std::string& vbr) {
+    static const uint8_t sync[4] = {0xff, 0xfb, 0x90, 0x00};
+    std::string frame((const char*) sync, 4);
+    frame.append(413, '\0');
+    std::string out;
+    for (size_t i = 0; i < n; ++i) {
+        out += frame;
+    }
+    out.replace(36, vbr.size(), vbr);
+    return out;
+}
+
+/**********************************************
+ *  be32_bytes:
+ *    returns x as 4 big-endian bytes.
+ **********************************************/
+static std::string be32_bytes(uint32_t x) {
+    char b[4] = {(char) (x >> 24), (char) (x >> 16), (char) (x >> 8), (char) x};
+    return std::string(b, 4);
+}
+
+/**********************************************
+ *  test_mpeg_probe:
+ *    (user-017) checks mpeg_probe on a Xing
+ *  header with a LAME tag, a VBRI header, a
+ *  constant bitrate stream and no audio.
+ **********************************************/
+static void test_mpeg_probe() {
+    const off_t base = 1000;
+    mpeg_info_t info;
+
+    // Xing with frame and byte counts, then LAME with 576 delay and 1000 padding
+    std::string xing = "Xing" + be32_bytes(3) + be32_bytes(1000) + be32_bytes(1001 * 417);
+    xing += std::string("LAME3.100", 9) + std::string(12, '\0');
+    xing += std::string("\x24\x03\xe8", 3);
+    std::string buf = mpeg_stream(12, xing);
+    ++num_tests;
+    int ret = mpeg_probe((const uint8_t*) buf.data(), buf.size(), base, base + 1001 * 417, &info);
+    check(ret == 0 && info.source == MPEG_XING && info.vbr, "mpeg xing", "wrong source");
+    check(info.offset == base && info.frames == 1000, "mpeg xing", "wrong offset or frames");
+    check(info.delay == 576 && info.padding == 1000, "mpeg xing", "wrong LAME delay or padding");
+    check(info.duration_ms == (1000 * 1152 - 1576) * 1000 / 44100, "mpeg xing", "wrong duration");
+
+    std::string vbri = "VBRI" + std::string(6, '\0') + be32_bytes(501 * 417) + be32_bytes(500);
+    buf = mpeg_stream(12, vbri);
+    ++num_tests;
+    ret = mpeg_probe((const uint8_t*) buf.data(), buf.size(), base, base + 501 * 417, &info);
+    check(ret == 0 && info.source == MPEG_VBRI && info.vbr, "mpeg vbri", "wrong source");
+    check(info.frames == 500 && info.duration_ms == 500 * 1152 * 1000 / 44100, "mpeg vbri", "wrong length");
+
+    buf = mpeg_stream(20, std::string());
+    ++num_tests;
+    ret = mpeg_probe((const uint8_t*) buf.data(), buf.size(), base, base + buf.size(), &info);
+    check(ret == 0 && info.source == MPEG_CBR && !info.vbr, "mpeg cbr", "wrong source");
+    check(info.bitrate == 128000 && info.frames == 20, "mpeg cbr", "wrong bitrate or frames");
+    check(info.duration_ms == 20 * 417 * 8 * 1000 / 128000, "mpeg cbr", "wrong duration");
+
+    buf.assign(4096, '\0');
+    ++num_tests;
+    ret = mpeg_probe((const uint8_t*) buf.data(), buf.size(), base, base + buf.size(), &info);
+    check(ret == -1 && info.source == MPEG_NONE, "mpeg none", "found audio in zeros");
+}
+
+/**********************************************
+ *  same_edit:
+ *    returns whether e sets id to text, or
+ *  removes it when text is null.
+ **********************************************/
+static int same_edit(const manifest_edit_t* e, const char* id, const char* text) {
+    if (memcmp(e->id, id, 4) != 0) {
+        return 0;
+    }
+    return text == nullptr ? e->remove : !e->remove && e->text == text;
+}
+
+/**********************************************
+ *  test_manifest_load:
+ *    (user-024) checks that JSONL and CSV
+ *  manifests load with escapes, quoting,
+ *  ignored keys and columns, merged paths and
+ *  dropped empty entries, and that a syntax
+ *  error reports its line.
+ **********************************************/
+static void test_manifest_load(const char* dir) {
+    std::string path = std::string(dir) + "/manifest";
+    std::vector<manifest_entry_t> entries;
+    size_t line;
+
+    const char* jsonl =
+        "{\"path\":\"a.mp3\",\"frames\":{\"TIT2\":\"One\",\"TPE1\":null},\"other\":[1,{\"x\":\"}\"}]}\n"
+        "{\"path\":\"b.mp3\",\"frames\":{}}\n"
+        "\n"
+        "{\"frames\":{\"TIT2\":\"Caf\\u00e9 \\\"Two\\\"\"},\"path\":\"a.mp3\"}\n";
+    ++num_tests;
+    if (check(write_file(path.c_str(), jsonl) == 0, "manifest jsonl", "could not write the file")) {
+        int ret = manifest_load(path.c_str(), entries, &line);
+        check(ret == 0 && entries.size() == 1 && entries[0].path == "a.mp3", "manifest jsonl", "wrong entries");
+        check(entries.size() == 1 && entries[0].edits.size() == 3 &&
+              same_edit(&entries[0].edits[0], "TIT2", "One") &&
+              same_edit(&entries[0].edits[1], "TPE1", nullptr) &&
+              same_edit(&entries[0].edits[2], "TIT2", "Caf\xc3\xa9 \"Two\""), "manifest jsonl", "wrong edits");
+    }
+
+    const char* bad = "{\"path\":\"a.mp3\",\"frames\":{\"TIT2\":\"One\"}}\n{\"path\":\"b.mp3\",\"frames\":{\"TIT2\":}}\n";
+    ++num_tests;
+    if (check(write_file(path.c_str(), bad) == 0, "manifest error", "could not write the file")) {
+        entries.clear();
+        check(manifest_load(path.c_str(), entries, &line) == -1 && line == 2, "manifest error",
+              "syntax error not reported on its line");
+    }
+
+    const char* csv =
+        "path,TIT2,comment,TALB\n"
+        "a.mp3,\"One, two\",x,\n"
+        "b.mp3,,y,\n"
+        "\"c \"\"q\"\".mp3\",Three,,Album\n";
+    ++num_tests;
+    if (check(write_file(path.c_str(), csv) == 0, "manifest csv", "could not write the file")) {
+        entries.clear();
+        int ret = manifest_load(path.c_str(), entries, &line);
+        check(ret == 0 && entries.size() == 2, "manifest csv", "wrong entries");
+        check(entries.size() == 2 && entries[0].path == "a.mp3" && entries[0].edits.size() == 1 &&
+              same_edit(&entries[0].edits[0], "TIT2", "One, two"), "manifest csv", "wrong first row");
+        check(entries.size() == 2 && entries[1].path == "c \"q\".mp3" && entries[1].edits.size() == 2 &&
+              same_edit(&entries[1].edits[0], "TIT2", "Three") &&
+              same_edit(&entries[1].edits[1], "TALB", "Album"), "manifest csv", "wrong last row");
+    }
+    unlink(path.c_str());
+}
+
+/**********************************************
+ *  same_cond:
+ *    returns whether cond is op on the frame
+ *  id or trait with value, which is not
+ *  compared when null.
+ **********************************************/
+static int same_cond(const table_cond_t* cond, uint8_t op, uint8_t trait, const char* id, const char* value) {
+    return cond->op == op && cond->trait == trait && cond->id == id3_fourcc(id) &&
+           (value == nullptr || cond->value == value);
+}
+
+/**********************************************
+ *  test_table_query:
+ *    (user-022) checks table_parse_query on
+ *  where, select, count and group clauses
+ *  with trait names and quoted values, and
+ *  that malformed queries are refused.
+ **********************************************/
+static void test_table_query() {
+    const char* name = "table query";
+    ++num_tests;
+    table_query_t q;
+    int ret = table_parse_query("where year=2004 and has composer and TPE1!=\"A B\" select title,TPE1", &q);
+    check(ret == 0 && q.where.size() == 3 && q.select.size() == 2 && !q.count && !q.group, name,
+          "wrong clauses");
+    if (ret == 0 && q.where.size() == 3 && q.select.size() == 2) {
+        check(same_cond(&q.where[0], TABLE_EQ, ID3_TRAIT_NONE, "TYER", "2004"), name, "wrong year condition");
+        check(same_cond(&q.where[1], TABLE_HAS, ID3_TRAIT_COMPOSER, "TCOM", nullptr), name, "wrong has condition");
+        check(same_cond(&q.where[2], TABLE_NE, ID3_TRAIT_NONE, "TPE1", "A B"), name, "wrong quoted condition");
+        check(q.select[0] == id3_fourcc("TIT2") && q.select[1] == id3_fourcc("TPE1"), name, "wrong select");
+    }
+
+    ret = table_parse_query("where missing title count", &q);
+    check(ret == 0 && q.count && q.where.size() == 1 &&
+          same_cond(&q.where[0], TABLE_MISSING, ID3_TRAIT_TITLE, "TIT2", nullptr), name, "wrong count query");
+    ret = table_parse_query("group TALB distinct year", &q);
+    check(ret == 0 && q.group == id3_fourcc("TALB") && q.distinct == id3_fourcc("TYER"), name,
+          "wrong group query");
+
+    static const char* bad[] = {
+        "count select TIT2", "group TPE1 count", "where TIT2=\"open", "where nosuch=1",
+        "where has", "where =x", "select TIT2,", "frobnicate",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        check(table_parse_query(bad[i], &q) == -1, name, bad[i]);
+    }
+}
+
+/**********************************************
+ *  text_sample:
+ *    returns n random pieces of text in
+ *  encoding, mostly ASCII so the SIMD kernels
+ *  get runs to copy, with high code points,
+ *  NULs and malformed sequences mixed in.
+ **********************************************/
+static std::string text_sample(uint8_t encoding, size_t n, unsigned* seed) {
+    static const char* utf8_pieces[] = {
+        "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x8e\xb5", "\xff", "\xc3", "\xed\xa0\x80", "\xe0\x80\x80", "\xf4\x90\x80\x80",
+    };
+    static const uint16_t utf16_units[] = {0xe9, 0x20ac, 0xd83c, 0xdfb5, 0xd800, 0xfeff, 0x7f, 0x80};
+    std::string out;
+    if (encoding == 1) {
+        out += (*seed & 1) ? "\xfe\xff" : "\xff\xfe";
+    }
+    int big_endian = encoding == 2 || (encoding == 1 && (*seed & 1));
+    for (size_t i = 0; i < n; ++i) {
+        *seed = *seed * 1103515245 + 12345;
+        unsigned r = (*seed >> 16) & 0x7fff;
+        uint16_t unit = r % 16 ? 'a' + r % 26 : r % 64 == 0 ? 0 : 0xffff;
+        if (encoding == 1 || encoding == 2) {
+            if (unit == 0xffff) {
+                unit = utf16_units[(r >> 6) % 8];
+            }
+            out += (char) (big_endian ? unit >> 8 : unit);
+            out += (char) (big_endian ? unit : unit >> 8);
+        } else if (encoding == 3 && unit == 0xffff) {
+            out += utf8_pieces[(r >> 6) % 8];
+        } else {
+            out += (char) (unit == 0xffff ? 0x80 + (r >> 6) % 128 : unit);
+        }
+    }
+    return out;
+}
+
+/**********************************************
+ *  test_text_kernels:
+ *    (user-012) checks that the SIMD text
+ *  decoder gives the same UTF-8 as the scalar
+ *  build on random text in every encoding,
+ *  and that malformed UTF-8 becomes U+FFFD.
+ **********************************************/
+static void test_text_kernels() {
+    const char* name = "text kernels";
+    ++num_tests;
+    unsigned seed = 1;
+    std::string simd;
+    std::string scalar;
+    for (uint8_t encoding = 0; encoding < 4; ++encoding) {
+        for (size_t n = 0; n < 400; n += 1 + n / 8) {
+            for (int k = 0; k < 8; ++k) {
+                std::string text = text_sample(encoding, n, &seed);
+                simd.clear();
+                scalar.clear();
+                id3_2_string_utf8(encoding, (const uint8_t*) text.data(), text.size(), simd);
+                id3_2_string_utf8_scalar(encoding, (const uint8_t*) text.data(), text.size(), scalar);
+                if (!check(simd == scalar, name, "SIMD and scalar output differ")) {
+                    return;
+                }
+            }
+        }
+    }
+
+    static const struct {
+        const char* in;
+        const char* out;
+    } utf8_cases[] = {
+        {"A\xc3\xa9\xe2\x82\xac", "A\xc3\xa9\xe2\x82\xac"},
+        {"A\xff" "B", "A\xef\xbf\xbd" "B"},
+        {"\xc0\xaf", "\xef\xbf\xbd\xef\xbf\xbd"},
+        {"\xed\xa0\x80", "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd"},
+        {"\xf4\x90\x80\x80", "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd"},
+        {"ab\xe2\x82", "ab\xef\xbf\xbd\xef\xbf\xbd"},
+    };
+    for (size_t i = 0; i < sizeof(utf8_cases) / sizeof(utf8_cases[0]); ++i) {
+        simd.clear();
+        id3_2_string_utf8(3, (const uint8_t*) utf8_cases[i].in, strlen(utf8_cases[i].in), simd);
+        check(simd == utf8_cases[i].out, name, "malformed UTF-8 not replaced");
+    }
+}
+
+/**********************************************
+ *  usage:
+ *    prints the command line usage and
+ *  returns the exit code for bad arguments.
+ **********************************************/
+static int usage() {
+    std::cerr << "Usage: ./audiotest [-d dir]\n";
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = "test_corpus";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            default: return usage();
+        }
+    }
+    if (optind != argc) {
+        return usage();
+    }
+    mkdir(dir, S_IRWXU);
+
+    int can_insert;
+    int can_collapse;
+    fs_support(dir, &can_insert, &can_collapse);
+
+    test_write_pieces(dir);
+    for (size_t i = 0; i < NUM_EDIT_CASES; ++i) {
+        run_edit_case(dir, &edit_cases[i], can_insert, can_collapse);
+    }
+    std::string path = std::string(dir) + "/edit.mp3";
+    unlink(path.c_str());
+    test_malformed(dir);
+    test_lazy_frames(dir);
+    test_mpeg_probe();
+    test_manifest_load(dir);
+    test_table_query();
+    test_text_kernels();
+    rmdir(dir);
+
+    std::cerr << num_tests << " tests, " << failures << " failures\n";
+    return failures ? 1 : 0;
+}
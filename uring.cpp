@@ -0,0 +1,581 @@
+#include "uring.hh"
+#include "batch.hh"
+#include "iostat.hh"
+#include "mpeg.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <chrono>
+
+typedef enum {
+    STAGE_OPEN,             // openat
+    STAGE_HEAD,             // read of the first ID3_PREFETCH_SIZE bytes
+    STAGE_BODY,             // read of the rest of an ID3v2 tag
+    STAGE_SKIM,             // read of part of a large tag, skipping lazy frames
+    STAGE_STATX,            // file size, to find the ID3v1 block
+    STAGE_LAST,             // read of the last 128 bytes
+    STAGE_PROBE,            // read of the first MPEG_PROBE_SIZE bytes of audio
+    STAGE_CLOSE,            // close
+} uring_stage_t;
+
+/**********************************************
+ *  uring_t:
+ *    a minimal io_uring: the mapped submission
+ *  and completion rings and the SQE array.
+ **********************************************/
+typedef struct uring_t {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_sz;
+    void* cq_map;
+    size_t cq_map_sz;
+    size_t sqes_sz;
+    unsigned to_submit;     // SQEs queued but not yet submitted
+} uring_t;
+
+/**********************************************
+ *  uring_slot_t:
+ *    one file in flight. Each slot has at most
+ *  one operation on the ring, identified by
+ *  its index in user_data.
+ **********************************************/
+typedef struct uring_slot_t {
+    size_t idx;             // position in files
+    int64_t started;        // iostat_now() when the open was queued
+    uint8_t busy;           // a file is in flight
+    int fd;
+    uint8_t stage;          // a uring_stage_t
+    uint8_t* buf;           // ID3_PREFETCH_SIZE, grown to the ID3v2 tag
+    size_t got;             // bytes of buf read
+    size_t have;            // bytes of buf that are the start of the file
+    size_t total;           // header and body of an ID3v2 tag
+    id3_2_skim_t skim;      // STAGE_SKIM: buf is skim.buf
+    off_t end;              // file size once known
+    uint8_t sized;          // end is known
+    uint8_t last[128];
+    struct statx stx;
+    uint8_t* probe;         // MPEG_PROBE_SIZE, unless buf already holds the audio
+    mpeg_info_t audio;
+} uring_slot_t;
+
+/**********************************************
+ *  uring_teardown:
+ *    unmaps the rings of r and closes it.
+ **********************************************/
+static void uring_teardown(uring_t* r) {
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_sz);
+    }
+    munmap(r->sq_map, r->sq_map_sz);
+    close(r->fd);
+}
+
+/**********************************************
+ *  uring_setup:
+ *    creates a ring of entries SQEs in r.
+ *  Returns 0 on success and -1 if io_uring is
+ *  unavailable.
+ **********************************************/
+static int uring_setup(uring_t* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_map_sz > r->sq_map_sz) {
+        r->sq_map_sz = r->cq_map_sz;
+    }
+    r->sq_map = mmap(nullptr, r->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_map = r->sq_map;
+    if (!single) {
+        r->cq_map = mmap(nullptr, r->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_map_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*) mmap(nullptr, r->sqes_sz, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_map_sz);
+        }
+        munmap(r->sq_map, r->sq_map_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    uint8_t* sq = (uint8_t*) r->sq_map;
+    uint8_t* cq = (uint8_t*) r->cq_map;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+/**********************************************
+ *  uring_supports:
+ *    returns 1 if the kernel behind r runs
+ *  every operation the scanner queues.
+ **********************************************/
+static int uring_supports(uring_t* r) {
+    static const uint8_t needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_STATX, IORING_OP_CLOSE};
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, sz);
+    if (probe == nullptr) {
+        return 0;
+    }
+    int ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed); ++i) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+/**********************************************
+ *  uring_push:
+ *    queues an operation for slot and returns
+ *  its zeroed SQE to fill in. It is submitted
+ *  by the next uring_submit.
+ **********************************************/
+static struct io_uring_sqe* uring_push(uring_t* r, uint8_t opcode, size_t slot) {
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = slot;
+    r->sq_array[i] = i;
+    // The kernel only reads the SQE during io_uring_enter
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->to_submit;
+    return sqe;
+}
+
+/**********************************************
+ *  uring_submit:
+ *    submits the queued operations and waits
+ *  for at least one completion. Returns 0 on
+ *  success and -1 on an error.
+ **********************************************/
+static int uring_submit(uring_t* r) {
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret >= 0) {
+            r->to_submit -= ret;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/**********************************************
+ *  queue_read:
+ *    queues a read of n bytes at offset off
+ *  of the slot's file into dst.
+ **********************************************/
+static void queue_read(uring_t* r, size_t i, uring_slot_t* s, uint8_t stage, void* dst, size_t n, off_t off) {
+    struct io_uring_sqe* sqe = uring_push(r, IORING_OP_READ, i);
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t) dst;
+    sqe->len = n;
+    sqe->off = off;
+    s->stage = stage;
+}
+
+/**********************************************
+ *  queue_statx:
+ *    queues a statx of the slot's file for its
+ *  size.
+ **********************************************/
+static void queue_statx(uring_t* r, size_t i, uring_slot_t* s) {
+    struct io_uring_sqe* sqe = uring_push(r, IORING_OP_STATX, i);
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t) "";
+    sqe->len = STATX_SIZE;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->off = (uint64_t) &s->stx;
+    s->stage = STAGE_STATX;
+}
+
+/**********************************************
+ *  tail_of:
+ *    returns the last 128 bytes of the slot's
+ *  file, or nullptr if it is shorter.
+ **********************************************/
+static const uint8_t* tail_of(const uring_slot_t* s) {
+    if (s->end < 128) {
+        return nullptr;
+    }
+    return s->end <= (off_t) s->have ? s->buf + s->end - 128 : s->last;
+}
+
+/**********************************************
+ *  queue_close:
+ *    releases the slot's buffer and queues the
+ *  close of its file.
+ **********************************************/
+static void queue_close(uring_t* r, size_t i, uring_slot_t* s) {
+    free(s->buf);
+    s->buf = nullptr;
+    free(s->probe);
+    s->probe = nullptr;
+    struct io_uring_sqe* sqe = uring_push(r, IORING_OP_CLOSE, i);
+    sqe->fd = s->fd;
+    s->stage = STAGE_CLOSE;
+}
+
+/**********************************************
+ *  uring_scan:
+ *    loads the tag of every file through one
+ *  io_uring with up to URING_QUEUE_DEPTH files
+ *  in flight and hands each to fn. Returns the
+ *  number of files that failed, or -1 if
+ *  io_uring is unavailable.
+ **********************************************/
+long uring_scan(const std::vector<std::string>& files, uring_tag_fn_t fn, void* ctx) {
+    uring_t ring;
+    if (uring_setup(&ring, URING_QUEUE_DEPTH) != 0) {
+        return -1;
+    }
+    if (!uring_supports(&ring)) {
+        uring_teardown(&ring);
+        return -1;
+    }
+
+    std::vector<uring_slot_t> slots(URING_QUEUE_DEPTH);
+    std::vector<size_t> idle;
+    for (size_t i = URING_QUEUE_DEPTH; i-- > 0;) {
+        idle.push_back(i);
+    }
+
+    size_t next = 0;
+    size_t failed = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    // The ring does the I/O, so completions are counted here
+    iostat_t* stat = iostat_local();
+    iostat_sink_t* sink = iostat_attached();
+    std::vector<uint64_t> latency;
+
+    // Hands a loaded tag to fn or reports err, then closes the file
+    auto finish = [&](size_t i, uring_slot_t* s, int err) {
+        const char* path = files[s->idx].c_str();
+        if (err == BATCH_OK) {
+            id3_tag_t tag;
+            memset(&tag, 0, sizeof(tag));
+            if (s->total) {
+                tag.version = ID3_V2;
+                tag.tag_sz = s->total - 10;
+                tag.data = s->buf;
+                tag.body = s->buf + 10;
+            } else if (s->end >= 128) {
+                id3_1_load(&tag, tail_of(s), s->end - 128);
+            }
+            err = fn(path, s->idx, BATCH_OK, &tag, &s->audio, ctx);
+        } else {
+            fn(path, s->idx, err, nullptr, nullptr, ctx);
+        }
+        if (err != BATCH_OK) {
+            fprintf(stderr, "%s: %s\n", path, audiotag_strerror(err));
+            ++failed;
+        }
+        queue_close(&ring, i, s);
+    };
+
+    // Completes the audio info from n probed bytes at offset, then finishes
+    auto probed = [&](size_t i, uring_slot_t* s, const uint8_t* p, size_t n, off_t offset, off_t end) {
+        int ret = mpeg_probe(p, n, offset, end, &s->audio);
+        if (ret == 1) {
+            // Headerless VBR: only counting every frame tells the length
+            ret = mpeg_walk(s->fd, &s->audio);
+        }
+        if (ret != 0 || s->audio.frames == 0) {
+            memset(&s->audio, 0, sizeof(s->audio));
+        }
+        finish(i, s, BATCH_OK);
+    };
+
+    // Probes the first frames of audio once the file size and tail are known
+    auto probe = [&](size_t i, uring_slot_t* s) {
+        off_t offset = 0;
+        if (s->total) {
+            id3_tag_t tag;
+            memset(&tag, 0, sizeof(tag));
+            tag.version = ID3_V2;
+            tag.data = s->buf;
+            tag.tag_sz = id3_2_tag_size(s->buf);
+            offset = mpeg_audio_offset(&tag);
+        }
+        off_t end = mpeg_audio_end(s->end, tail_of(s));
+        if (offset >= end) {
+            finish(i, s, BATCH_OK);
+            return;
+        }
+        size_t n = end - offset < MPEG_PROBE_SIZE ? end - offset : MPEG_PROBE_SIZE;
+        if (offset + (off_t) n <= (off_t) s->have) {
+            probed(i, s, s->buf + offset, n, offset, end);
+            return;
+        }
+        s->probe = (uint8_t*) malloc(MPEG_PROBE_SIZE);
+        if (s->probe == nullptr) {
+            finish(i, s, BATCH_OK);
+            return;
+        }
+        s->audio.offset = offset;
+        s->audio.end = end;
+        queue_read(&ring, i, s, STAGE_PROBE, s->probe, n, offset);
+    };
+
+    // Reads the last 128 bytes for an ID3v1 block unless buf holds them
+    auto read_tail = [&](size_t i, uring_slot_t* s) {
+        if (s->end >= 128 && s->end > (off_t) s->have) {
+            queue_read(&ring, i, s, STAGE_LAST, s->last, 128, s->end - 128);
+        } else {
+            probe(i, s);
+        }
+    };
+
+    // Moves on from a loaded tag to the audio, finding the file size first
+    auto loaded = [&](size_t i, uring_slot_t* s) {
+        if (s->sized) {
+            read_tail(i, s);
+        } else {
+            queue_statx(&ring, i, s);
+        }
+    };
+
+    // Queues the next read of a large tag, or moves on once it is loaded
+    auto skim = [&](size_t i, uring_slot_t* s) {
+        size_t off, len;
+        int ret = id3_2_skim_next(&s->skim, &off, &len);
+        s->buf = s->skim.buf;
+        if (ret == 1) {
+            queue_read(&ring, i, s, STAGE_SKIM, s->buf + s->skim.got, len, off);
+        } else if (ret == 0) {
+            s->total = s->skim.kept;
+            loaded(i, s);
+        } else {
+            finish(i, s, BATCH_ERR_READ);
+        }
+    };
+
+    while (next < files.size() || idle.size() < slots.size()) {
+        // Start files in every idle slot
+        while (next < files.size() && !idle.empty()) {
+            size_t i = idle.back();
+            idle.pop_back();
+            uring_slot_t* s = &slots[i];
+            s->idx = next++;
+            s->started = sink ? iostat_now() : 0;
+            s->busy = 1;
+            s->fd = -1;
+            s->buf = nullptr;
+            s->got = 0;
+            s->have = 0;
+            s->total = 0;
+            s->end = 0;
+            s->sized = 0;
+            s->probe = nullptr;
+            memset(&s->audio, 0, sizeof(s->audio));
+            s->stage = STAGE_OPEN;
+            struct io_uring_sqe* sqe = uring_push(&ring, IORING_OP_OPENAT, i);
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t) files[s->idx].c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        if (uring_submit(&ring) != 0) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t i = cqe->user_data;
+            int res = cqe->res;
+            uring_slot_t* s = &slots[i];
+
+            if (s->stage == STAGE_OPEN) {
+                stat->calls[IOSTAT_OPEN]++;
+            } else if (s->stage != STAGE_STATX && s->stage != STAGE_CLOSE) {
+                stat->calls[IOSTAT_READ]++;
+                stat->bytes_read += res > 0 ? res : 0;
+            }
+
+            switch (s->stage) {
+                case STAGE_OPEN:
+                    if (res < 0) {
+                        fn(files[s->idx].c_str(), s->idx, BATCH_ERR_OPEN, nullptr, nullptr, ctx);
+                        fprintf(stderr, "%s: %s\n", files[s->idx].c_str(), audiotag_strerror(BATCH_ERR_OPEN));
+                        ++failed;
+                        if (sink) {
+                            latency.push_back(iostat_now() - s->started);
+                        }
+                        s->busy = 0;
+                        idle.push_back(i);
+                        break;
+                    }
+                    s->fd = res;
+                    s->buf = (uint8_t*) malloc(ID3_PREFETCH_SIZE);
+                    if (s->buf == nullptr) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    queue_read(&ring, i, s, STAGE_HEAD, s->buf, ID3_PREFETCH_SIZE, 0);
+                    break;
+
+                case STAGE_HEAD:
+                    if (res < 0) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    s->got = res;
+                    s->have = res;
+                    s->end = res;
+                    // A short read means the whole file is in buf
+                    s->sized = s->got < ID3_PREFETCH_SIZE;
+                    if (s->got >= 10 && memcmp(s->buf, "ID3", 3) == 0) {
+                        s->total = 10 + (size_t) id3_2_tag_size(s->buf);
+                        if (s->total <= s->got) {
+                            loaded(i, s);
+                            break;
+                        }
+                        if (s->total > ID3_MAP_THRESHOLD) {
+                            // Large tags: skip artwork and the like by offset
+                            s->have = 0;
+                            id3_2_skim_init(&s->skim, s->buf, ID3_PREFETCH_SIZE, s->got);
+                            skim(i, s);
+                            break;
+                        }
+                        uint8_t* grown = (uint8_t*) realloc(s->buf, s->total);
+                        if (grown == nullptr) {
+                            finish(i, s, BATCH_ERR_READ);
+                            break;
+                        }
+                        s->buf = grown;
+                        queue_read(&ring, i, s, STAGE_BODY, s->buf + s->got, s->total - s->got, s->got);
+                    } else {
+                        // No ID3v2 tag: look for the ID3v1 block at the end
+                        loaded(i, s);
+                    }
+                    break;
+
+                case STAGE_BODY:
+                    if (res != (int) (s->total - s->got)) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    s->have = s->total;
+                    loaded(i, s);
+                    break;
+
+                case STAGE_SKIM:
+                    if (res <= 0) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    id3_2_skim_fill(&s->skim, res);
+                    skim(i, s);
+                    break;
+
+                case STAGE_STATX:
+                    if (res < 0) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    s->end = s->stx.stx_size;
+                    s->sized = 1;
+                    read_tail(i, s);
+                    break;
+
+                case STAGE_LAST:
+                    if (res != 128) {
+                        finish(i, s, BATCH_ERR_READ);
+                        break;
+                    }
+                    probe(i, s);
+                    break;
+
+                case STAGE_PROBE:
+                    if (res <= 0) {
+                        finish(i, s, BATCH_OK);
+                        break;
+                    }
+                    probed(i, s, s->probe, res, s->audio.offset, s->audio.end);
+                    break;
+
+                case STAGE_CLOSE:
+                    if (sink) {
+                        latency.push_back(iostat_now() - s->started);
+                    }
+                    s->busy = 0;
+                    idle.push_back(i);
+                    break;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Only reached with files in flight if the ring failed; a queued
+    // close may or may not have run, so only other open files are closed
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i].busy && slots[i].stage != STAGE_CLOSE) {
+            if (slots[i].fd >= 0) {
+                close(slots[i].fd);
+            }
+            free(slots[i].buf);
+            free(slots[i].probe);
+            ++failed;
+        }
+    }
+    failed += files.size() - next;
+    uring_teardown(&ring);
+    iostat_flush(latency.data(), latency.size());
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%zu files, %zu failed, io_uring with %d in flight, %.2fs (%.1f files/s)\n",
+            files.size(), failed, URING_QUEUE_DEPTH, secs, secs > 0 ? files.size() / secs : 0.0);
+    return failed;
+}
@@ -0,0 +1,46 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "id3.hh"
+#include "mpeg.hh"
+
+// Files the io_uring scanner keeps in flight at once
+#define URING_QUEUE_DEPTH 256
+
+/**********************************************
+ *  uring_tag_fn_t:
+ *    called by uring_scan on the scanning
+ *  thread once the tag and the audio info of
+ *  files[idx] are loaded. err is a batch_err_t;
+ *  tag and audio are only valid when it is
+ *  BATCH_OK and only during the call. Returns
+ *  a batch_err_t.
+ **********************************************/
+typedef int (*uring_tag_fn_t)(const char* path, size_t idx, int err, const id3_tag_t* tag, const mpeg_info_t* audio, void* ctx);
+
+/**********************************************
+ *  uring_scan:
+ *    loads the tag of every file through one
+ *  io_uring with up to URING_QUEUE_DEPTH files
+ *  in flight and hands each to fn. The open,
+ *  the prefetch read, the read of the rest of
+ *  the tag, of the ID3v1 block and of the
+ *  first MPEG frames and the close are all
+ *  queued on the ring, so one thread does no
+ *  blocking syscalls, except to walk the rare
+ *  VBR streams without a Xing or VBRI header
+ *  (see mpeg_walk). Tags larger than
+ *  ID3_MAP_THRESHOLD are skimmed: lazy frames
+ *  such as artwork are skipped by offset and
+ *  left out of the tag fn sees. Failures are
+ *  reported on stderr as batch_run does.
+ *  Returns the number of files that failed, or
+ *  -1 without touching any file if the kernel
+ *  lacks io_uring or the needed operations.
+ **********************************************/
+long uring_scan(const std::vector<std::string>& files, uring_tag_fn_t fn, void* ctx);
+
+#endif
@@ -0,0 +1,594 @@
+#include "watch.hh"
+#include "batch.hh"
+#include "dump.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// Events that can change the files of a watched directory
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+/**********************************************
+ *  watch_entry_t:
+ *    one file of the table: what it was parsed
+ *  from and its record in the --dump format.
+ **********************************************/
+typedef struct watch_entry_t {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+    std::string record;
+} watch_entry_t;
+
+/**********************************************
+ *  watch_ctx_t:
+ *    the state of a watch_run. Only the loop
+ *  thread touches it once the initial scan is
+ *  done.
+ **********************************************/
+typedef struct watch_ctx_t {
+    int ifd;
+    std::vector<std::string> roots;
+    std::unordered_map<int, std::string> dirs;          // watch descriptor -> directory
+    std::map<std::string, watch_entry_t> table;         // sorted for LIST
+    std::unordered_map<std::string, int64_t> pending;   // path -> when to parse it
+    std::mutex lock;                                    // table, during the initial scan
+    size_t events;
+    size_t parsed;
+    size_t unchanged;
+    size_t dropped;
+} watch_ctx_t;
+
+/**********************************************
+ *  watch_client_t:
+ *    a connection to the socket, the part of
+ *  a request read so far and the answers the
+ *  socket has not taken yet.
+ **********************************************/
+typedef struct watch_client_t {
+    int fd;
+    std::string in;
+    std::string out;
+    size_t sent;            // bytes of out already written
+} watch_client_t;
+
+/**********************************************
+ *  now_ms:
+ *    returns a monotonic time in milliseconds.
+ **********************************************/
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**********************************************
+ *  stat_entry:
+ *    fills the identity of the regular file
+ *  path into e. Returns 0 on success and -1
+ *  if path is gone or not a regular file.
+ **********************************************/
+static int stat_entry(const char* path, watch_entry_t* e) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    e->size = st.st_size;
+    return 0;
+}
+
+/**********************************************
+ *  same_file:
+ *    returns whether a and b were parsed from
+ *  the same unchanged file.
+ **********************************************/
+static int same_file(const watch_entry_t* a, const watch_entry_t* b) {
+    return a->dev == b->dev && a->ino == b->ino && a->mtime_ns == b->mtime_ns && a->size == b->size;
+}
+
+/**********************************************
+ *  scan_file:
+ *    batch_fn_t that parses path into the
+ *  table of the watch_ctx_t in ctx.
+ **********************************************/
+static int scan_file(const char* path, size_t idx, unsigned worker, void* ctx) {
+    watch_ctx_t* wc = (watch_ctx_t*) ctx;
+    watch_entry_t e;
+    if (stat_entry(path, &e) != 0) {
+        return BATCH_ERR_OPEN;
+    }
+    int err = dump_file(path, DUMP_JSON, e.record);
+    if (err != BATCH_OK) {
+        return err;
+    }
+    std::lock_guard<std::mutex> guard(wc->lock);
+    wc->table[path] = std::move(e);
+    wc->parsed++;
+    return BATCH_OK;
+}
+
+/**********************************************
+ *  add_tree:
+ *    watches dir and every directory below it
+ *  and appends the mp3 files found to files.
+ **********************************************/
+static void add_tree(watch_ctx_t* wc, const std::string& dir, std::vector<std::string>& files) {
+    std::vector<std::string> dirs(1, dir);
+    while (!dirs.empty()) {
+        std::string cur = dirs.back();
+        dirs.pop_back();
+
+        // Watch before listing so nothing created in between is missed
+        int wd = inotify_add_watch(wc->ifd, cur.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            fprintf(stderr, "%s: could not watch directory: %s\n", cur.c_str(), strerror(errno));
+            continue;
+        }
+        wc->dirs[wd] = cur;
+
+        DIR* d = opendir(cur.c_str());
+        if (d == nullptr) {
+            continue;
+        }
+        struct dirent* ent;
+        while ((ent = readdir(d)) != nullptr) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            std::string child = cur + "/" + ent->d_name;
+            unsigned char type = ent->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (lstat(child.c_str(), &st) == 0) {
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+            if (type == DT_DIR) {
+                dirs.push_back(child);
+            } else if ((type == DT_REG || type == DT_LNK) && batch_is_mp3(ent->d_name)) {
+                files.push_back(child);
+            }
+        }
+        closedir(d);
+    }
+}
+
+/**********************************************
+ *  drop_tree:
+ *    forgets the files and watches below dir,
+ *  which was removed or moved away.
+ **********************************************/
+static void drop_tree(watch_ctx_t* wc, const std::string& dir) {
+    std::string prefix = dir + "/";
+    auto it = wc->table.lower_bound(prefix);
+    while (it != wc->table.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        it = wc->table.erase(it);
+        wc->dropped++;
+    }
+    for (auto d = wc->dirs.begin(); d != wc->dirs.end();) {
+        if (d->second == dir || d->second.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(wc->ifd, d->first);
+            d = wc->dirs.erase(d);
+        } else {
+            ++d;
+        }
+    }
+}
+
+/**********************************************
+ *  schedule:
+ *    parses path once WATCH_DEBOUNCE_MS pass
+ *  without another event on it.
+ **********************************************/
+static void schedule(watch_ctx_t* wc, const std::string& path) {
+    wc->pending[path] = now_ms() + WATCH_DEBOUNCE_MS;
+}
+
+/**********************************************
+ *  rescan:
+ *    after the kernel dropped events, walks
+ *  the roots again and checks every file
+ *  found and every file in the table.
+ **********************************************/
+static void rescan(watch_ctx_t* wc) {
+    std::vector<std::string> files;
+    for (size_t i = 0; i < wc->roots.size(); ++i) {
+        add_tree(wc, wc->roots[i], files);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        schedule(wc, files[i]);
+    }
+    for (auto& e : wc->table) {
+        schedule(wc, e.first);
+    }
+}
+
+/**********************************************
+ *  refresh:
+ *    brings the table entry of path up to
+ *  date: drops it if the file is gone, keeps
+ *  it if the file did not change and parses
+ *  the file again otherwise.
+ **********************************************/
+static void refresh(watch_ctx_t* wc, const std::string& path) {
+    watch_entry_t e;
+    auto it = wc->table.find(path);
+    if (stat_entry(path.c_str(), &e) != 0) {
+        if (it != wc->table.end()) {
+            wc->table.erase(it);
+            wc->dropped++;
+        }
+        return;
+    }
+    if (it != wc->table.end() && same_file(&it->second, &e)) {
+        wc->unchanged++;
+        return;
+    }
+    int err = dump_file(path.c_str(), DUMP_JSON, e.record);
+    if (err != BATCH_OK) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), audiotag_strerror(err));
+        if (it != wc->table.end()) {
+            wc->table.erase(it);
+            wc->dropped++;
+        }
+        return;
+    }
+    wc->table[path] = std::move(e);
+    wc->parsed++;
+}
+
+/**********************************************
+ *  handle_events:
+ *    schedules the files named by the n bytes
+ *  of inotify events in buf and follows
+ *  directories as they come and go.
+ **********************************************/
+static void handle_events(watch_ctx_t* wc, const char* buf, size_t n) {
+    size_t off = 0;
+    while (off + sizeof(struct inotify_event) <= n) {
+        const struct inotify_event* ev = (const struct inotify_event*) (buf + off);
+        off += sizeof(struct inotify_event) + ev->len;
+        wc->events++;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            rescan(wc);
+            continue;
+        }
+        auto d = wc->dirs.find(ev->wd);
+        if (d == wc->dirs.end()) {
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            wc->dirs.erase(d);
+            continue;
+        }
+        if (ev->len == 0) {
+            continue;
+        }
+        std::string path = d->second + "/" + ev->name;
+
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                std::vector<std::string> files;
+                add_tree(wc, path, files);
+                for (size_t i = 0; i < files.size(); ++i) {
+                    schedule(wc, files[i]);
+                }
+            } else if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                drop_tree(wc, path);
+            }
+            continue;
+        }
+
+        // Temporary copies have hidden names that do not end in .mp3
+        if (batch_is_mp3(ev->name)) {
+            schedule(wc, path);
+        }
+    }
+}
+
+/**********************************************
+ *  flush_client:
+ *    writes as much of the answers queued for
+ *  c as its socket takes without blocking.
+ *  Returns 0 on success and -1 if the client
+ *  is gone.
+ **********************************************/
+static int flush_client(watch_client_t* c) {
+    while (c->sent < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->sent, c->out.size() - c->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        c->sent += n;
+    }
+    c->out.clear();
+    c->sent = 0;
+    return 0;
+}
+
+/**********************************************
+ *  serve:
+ *    appends the answer to request line to
+ *  out, ending with an empty line.
+ **********************************************/
+static void serve(watch_ctx_t* wc, size_t num_clients, const std::string& line, std::string& out) {
+    if (line.compare(0, 4, "GET ") == 0) {
+        std::string path = line.substr(4);
+        auto it = wc->table.find(path);
+        if (it == wc->table.end()) {
+            char* abs = realpath(path.c_str(), nullptr);
+            if (abs != nullptr) {
+                it = wc->table.find(abs);
+                free(abs);
+            }
+        }
+        if (it != wc->table.end()) {
+            out += it->second.record;
+        }
+    } else if (line == "LIST" || line.compare(0, 5, "LIST ") == 0) {
+        std::string prefix = line.size() > 5 ? line.substr(5) : std::string();
+        for (auto it = wc->table.lower_bound(prefix); it != wc->table.end(); ++it) {
+            if (it->first.compare(0, prefix.size(), prefix) != 0) {
+                break;
+            }
+            out += it->second.record;
+        }
+    } else if (line == "STATS") {
+        char buf[256];
+        snprintf(buf, sizeof(buf),
+                 "{\"files\":%zu,\"directories\":%zu,\"pending\":%zu,\"events\":%zu,"
+                 "\"parsed\":%zu,\"unchanged\":%zu,\"dropped\":%zu,\"clients\":%zu}\n",
+                 wc->table.size(), wc->dirs.size(), wc->pending.size(), wc->events,
+                 wc->parsed, wc->unchanged, wc->dropped, num_clients);
+        out += buf;
+    } else {
+        out += "{\"error\":\"unknown request\"}\n";
+    }
+    out += "\n";
+}
+
+/**********************************************
+ *  read_client:
+ *    reads what c sent and queues the answer
+ *  to every complete request. Returns -1 once
+ *  the connection should be closed.
+ **********************************************/
+static int read_client(watch_ctx_t* wc, size_t num_clients, watch_client_t* c) {
+    char buf[4096];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    c->in.append(buf, n);
+
+    size_t start = 0;
+    size_t nl;
+    while ((nl = c->in.find('\n', start)) != std::string::npos) {
+        size_t end = nl;
+        if (end > start && c->in[end - 1] == '\r') {
+            --end;
+        }
+        serve(wc, num_clients, c->in.substr(start, end - start), c->out);
+        start = nl + 1;
+    }
+    c->in.erase(0, start);
+    if (c->in.size() > WATCH_MAX_REQUEST || c->out.size() - c->sent > WATCH_MAX_BACKLOG) {
+        return -1;
+    }
+    return flush_client(c);
+}
+
+/**********************************************
+ *  open_socket:
+ *    listens on a Unix socket at path,
+ *  replacing a stale socket left there.
+ *  Returns the descriptor or -1.
+ **********************************************/
+static int open_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**********************************************
+ *  watch_run:
+ *    keeps the tags below roots in memory and
+ *  serves them on socket_path.
+ **********************************************/
+int watch_run(const std::vector<std::string>& roots, const char* socket_path, unsigned num_workers) {
+    watch_ctx_t wc;
+    wc.events = 0;
+    wc.parsed = 0;
+    wc.unchanged = 0;
+    wc.dropped = 0;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        char* abs = realpath(roots[i].c_str(), nullptr);
+        struct stat st;
+        if (abs == nullptr || stat(abs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s: not a directory\n", roots[i].c_str());
+            free(abs);
+            return -1;
+        }
+        wc.roots.push_back(abs);
+        free(abs);
+    }
+
+    // Shutdown signals are read from a descriptor like everything else
+    sigset_t mask;
+    sigset_t old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    wc.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int lfd = open_socket(socket_path);
+    if (sfd < 0 || wc.ifd < 0 || lfd < 0) {
+        fprintf(stderr, "%s: could not set up the watch: %s\n", socket_path, strerror(errno));
+        if (lfd >= 0) {
+            close(lfd);
+            unlink(socket_path);
+        }
+        if (wc.ifd >= 0) {
+            close(wc.ifd);
+        }
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        return -1;
+    }
+
+    // Watches go in before the scan; events meanwhile are checked after it
+    std::vector<std::string> files;
+    for (size_t i = 0; i < wc.roots.size(); ++i) {
+        add_tree(&wc, wc.roots[i], files);
+    }
+    batch_run(files, num_workers, scan_file, &wc);
+    fprintf(stderr, "watching %zu directories, %zu files, on %s\n", wc.dirs.size(), wc.table.size(), socket_path);
+
+    std::vector<uint64_t> events(WATCH_EVENT_BUF / sizeof(uint64_t));
+    std::vector<watch_client_t> clients;
+    std::vector<struct pollfd> pfds;
+    int running = 1;
+    while (running) {
+        int timeout = -1;
+        if (!wc.pending.empty()) {
+            int64_t now = now_ms();
+            int64_t next = INT64_MAX;
+            for (auto& p : wc.pending) {
+                next = p.second < next ? p.second : next;
+            }
+            timeout = next > now ? (int) (next - now) : 0;
+        }
+
+        pfds.clear();
+        pfds.push_back({sfd, POLLIN, 0});
+        pfds.push_back({wc.ifd, POLLIN, 0});
+        pfds.push_back({lfd, POLLIN, 0});
+        // A client with answers queued is not read until it takes them
+        for (size_t i = 0; i < clients.size(); ++i) {
+            pfds.push_back({clients[i].fd, (short) (clients[i].out.empty() ? POLLIN : POLLOUT), 0});
+        }
+        if (poll(pfds.data(), pfds.size(), timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "watch: poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+                running = 0;
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            ssize_t n;
+            while ((n = read(wc.ifd, events.data(), WATCH_EVENT_BUF)) > 0) {
+                handle_events(&wc, (const char*) events.data(), n);
+            }
+        }
+
+        // Clients are served before new ones are accepted so pfds stays in step
+        for (size_t i = clients.size(); i-- > 0;) {
+            short revents = pfds[3 + i].revents;
+            if (revents == 0) {
+                continue;
+            }
+            int ret;
+            if (revents & (POLLERR | POLLNVAL)) {
+                ret = -1;
+            } else if (!clients[i].out.empty()) {
+                ret = (revents & POLLOUT) ? flush_client(&clients[i]) : -1;
+            } else {
+                ret = read_client(&wc, clients.size(), &clients[i]);
+            }
+            if (ret != 0) {
+                close(clients[i].fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+        if (pfds[2].revents & POLLIN) {
+            int cfd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (cfd >= 0) {
+                clients.push_back({cfd, std::string(), std::string(), 0});
+            }
+        }
+
+        // Parse the files that have been quiet long enough
+        int64_t now = now_ms();
+        std::vector<std::string> due;
+        for (auto p = wc.pending.begin(); p != wc.pending.end();) {
+            if (p->second <= now) {
+                due.push_back(p->first);
+                p = wc.pending.erase(p);
+            } else {
+                ++p;
+            }
+        }
+        for (size_t i = 0; i < due.size(); ++i) {
+            refresh(&wc, due[i]);
+        }
+    }
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+        close(clients[i].fd);
+    }
+    close(lfd);
+    unlink(socket_path);
+    close(wc.ifd);
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    return 0;
+}
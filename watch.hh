@@ -0,0 +1,55 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Quiet time after the last event on a file before it is parsed again
+#define WATCH_DEBOUNCE_MS 250
+
+// Bytes of inotify events read at a time
+#define WATCH_EVENT_BUF (64 * 1024)
+
+// Requests longer than this close the connection
+#define WATCH_MAX_REQUEST 8192
+
+// Answers a client has not read past this close the connection
+#define WATCH_MAX_BACKLOG (64 * 1024 * 1024)
+
+/**********************************************
+ *  The watch socket takes one request per
+ *  line and answers each with zero or more
+ *  JSON lines, in the --dump format, followed
+ *  by an empty line:
+ *    GET path       the record for path
+ *    LIST [prefix]  every record whose path
+ *                   starts with prefix
+ *    STATS          one object with the table
+ *                   and event counters
+ *  Paths are absolute, as realpath gives them.
+ *  Answers are queued and written as the
+ *  client reads them, so a slow client only
+ *  holds up itself; its next requests are read
+ *  once it has taken the last answers.
+ **********************************************/
+
+/**********************************************
+ *  watch_run:
+ *    parses every mp3 below roots across
+ *  num_workers threads (0 for one per core)
+ *  into an in-memory table, then watches the
+ *  trees with inotify and serves the table on
+ *  the Unix socket at socket_path until
+ *  SIGINT or SIGTERM. Files are parsed again
+ *  once WATCH_DEBOUNCE_MS pass without events
+ *  on them, so a write followed by a rename
+ *  over the file, as the rewrites do, costs
+ *  one parse; files whose inode, mtime and
+ *  size did not change are not reopened.
+ *  Returns 0 on shutdown and -1 if the watch
+ *  or the socket could not be set up.
+ **********************************************/
+int watch_run(const std::vector<std::string>& roots, const char* socket_path, unsigned num_workers);
+
+#endif
@@ -0,0 +1,150 @@
+#include "xxh64.hh"
+#include <string.h>
+
+static const uint64_t P1 = 0x9e3779b185ebca87ULL;
+static const uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t P3 = 0x165667b19e3779f9ULL;
+static const uint64_t P4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t P5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t rotl(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+// Input is read little-endian, as the XXH64 spec requires
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+    acc ^= round64(0, v);
+    return acc * P1 + P4;
+}
+
+/**********************************************
+ *  stripes:
+ *    folds the whole 32-byte stripes of the n
+ *  bytes at p into the lanes of ctx and
+ *  returns the bytes consumed.
+ **********************************************/
+static size_t stripes(xxh64_t* ctx, const uint8_t* p, size_t n) {
+    uint64_t v0 = ctx->v[0], v1 = ctx->v[1], v2 = ctx->v[2], v3 = ctx->v[3];
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        v0 = round64(v0, read64(p + i));
+        v1 = round64(v1, read64(p + i + 8));
+        v2 = round64(v2, read64(p + i + 16));
+        v3 = round64(v3, read64(p + i + 24));
+    }
+    ctx->v[0] = v0;
+    ctx->v[1] = v1;
+    ctx->v[2] = v2;
+    ctx->v[3] = v3;
+    return i;
+}
+
+/**********************************************
+ *  xxh64_init:
+ *    starts an empty hash with seed in ctx.
+ **********************************************/
+void xxh64_init(xxh64_t* ctx, uint64_t seed) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->seed = seed;
+    ctx->v[0] = seed + P1 + P2;
+    ctx->v[1] = seed + P2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - P1;
+}
+
+/**********************************************
+ *  xxh64_update:
+ *    hashes the n bytes at data. Whole stripes
+ *  are read straight from data.
+ **********************************************/
+void xxh64_update(xxh64_t* ctx, const uint8_t* data, size_t n) {
+    ctx->len += n;
+    if (ctx->fill) {
+        size_t take = 32 - ctx->fill < n ? 32 - ctx->fill : n;
+        memcpy(ctx->block + ctx->fill, data, take);
+        ctx->fill += take;
+        data += take;
+        n -= take;
+        if (ctx->fill < 32) {
+            return;
+        }
+        stripes(ctx, ctx->block, 32);
+        ctx->fill = 0;
+    }
+    size_t done = stripes(ctx, data, n);
+    memcpy(ctx->block, data + done, n - done);
+    ctx->fill = n - done;
+}
+
+/**********************************************
+ *  xxh64_final:
+ *    merges the lanes, folds in the bytes left
+ *  over and mixes the result.
+ **********************************************/
+uint64_t xxh64_final(const xxh64_t* ctx) {
+    uint64_t h;
+    if (ctx->len >= 32) {
+        h = rotl(ctx->v[0], 1) + rotl(ctx->v[1], 7) + rotl(ctx->v[2], 12) + rotl(ctx->v[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            h = merge64(h, ctx->v[i]);
+        }
+    } else {
+        h = ctx->seed + P5;
+    }
+    h += ctx->len;
+
+    const uint8_t* p = ctx->block;
+    size_t n = ctx->fill;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (n >= 4) {
+        h ^= (uint64_t) read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n > 0; ++p, --n) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**********************************************
+ *  xxh64_hex:
+ *    writes hash as XXH64_HEX_SIZE hex digits
+ *  and a NUL to hex.
+ **********************************************/
+void xxh64_hex(uint64_t hash, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = XXH64_HEX_SIZE - 1; i >= 0; --i) {
+        hex[i] = digits[hash & 0xf];
+        hash >>= 4;
+    }
+    hex[XXH64_HEX_SIZE] = '\0';
+}
@@ -0,0 +1,52 @@
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Length of a hash as lowercase hex, without the NUL
+#define XXH64_HEX_SIZE 16
+
+/**********************************************
+ *  xxh64_t:
+ *    an XXH64 hash being computed over data
+ *  fed in pieces of any size. XXH64 is not
+ *  cryptographic but runs at memory speed,
+ *  which suits telling identical files apart
+ *  across a large collection.
+ **********************************************/
+typedef struct xxh64_t {
+    uint64_t v[4];          // lane accumulators
+    uint64_t seed;
+    uint8_t block[32];
+    size_t fill;            // bytes of block in use
+    uint64_t len;           // bytes hashed so far
+} xxh64_t;
+
+/**********************************************
+ *  xxh64_init:
+ *    starts an empty hash with seed in ctx.
+ **********************************************/
+void xxh64_init(xxh64_t* ctx, uint64_t seed);
+
+/**********************************************
+ *  xxh64_update:
+ *    hashes the n bytes at data.
+ **********************************************/
+void xxh64_update(xxh64_t* ctx, const uint8_t* data, size_t n);
+
+/**********************************************
+ *  xxh64_final:
+ *    returns the hash of everything fed to
+ *  ctx. ctx is left unchanged.
+ **********************************************/
+uint64_t xxh64_final(const xxh64_t* ctx);
+
+/**********************************************
+ *  xxh64_hex:
+ *    writes hash as XXH64_HEX_SIZE hex digits
+ *  and a NUL to hex.
+ **********************************************/
+void xxh64_hex(uint64_t hash, char* hex);
+
+#endif